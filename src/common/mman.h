@@ -49,3 +49,7 @@
 
 #define MADV_HWPOISON		100		/* poison a page for testing */
 #define MADV_SOFT_OFFLINE	101		/* soft offline page for testing */
+
+/* Flags for mremap. */
+#define MREMAP_MAYMOVE	1
+#define MREMAP_FIXED	2
@@ -47,6 +47,13 @@ uint64_t filetime_to_unix_nsec(const FILETIME *filetime)
 	return nsec % NANOSECONDS_PER_SECOND;
 }
 
+uint64_t performance_counter_to_nsec(const LARGE_INTEGER *counter, const LARGE_INTEGER *freq)
+{
+	uint64_t sec = counter->QuadPart / freq->QuadPart;
+	uint64_t rem = counter->QuadPart % freq->QuadPart;
+	return sec * NANOSECONDS_PER_SECOND + rem * NANOSECONDS_PER_SECOND / freq->QuadPart;
+}
+
 void filetime_to_unix_timeval(const FILETIME *filetime, struct timeval *tv)
 {
 	uint64_t nsec = filetime_to_unix(filetime);
@@ -30,6 +30,8 @@
 
 uint64_t filetime_to_unix_sec(const FILETIME *filetime);
 uint64_t filetime_to_unix_nsec(const FILETIME *filetime);
+/* Convert a QueryPerformanceCounter() value to nanoseconds without floating point math */
+uint64_t performance_counter_to_nsec(const LARGE_INTEGER *counter, const LARGE_INTEGER *freq);
 void filetime_to_unix_timeval(const FILETIME *filetime, struct timeval *tv);
 void filetime_to_unix_timespec(const FILETIME *filetime, struct linux_timespec *tv);
 void unix_timeval_to_filetime(const struct timeval *time, FILETIME *filetime);
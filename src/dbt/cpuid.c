@@ -286,6 +286,12 @@ static struct cpuinfo_feature cpuinfo_features_7_0_ebx[] =
 	{ FEATURE_AVX512CD, "avx512cd" },
 };
 
+/* EAX = 0x0D, Sub-leaf 1, EAX */
+#define FEATURE_XSAVEOPT		BIT(0)	/* XSAVEOPT instruction */
+
+/* EAX = 0x80000007, EDX */
+#define FEATURE_INVARIANT_TSC	BIT(8)	/* TSC runs at a constant rate in all states */
+
 #ifdef __clang__
 static __forceinline void __cpuidex(int info[4], int function_id, int subfunction_id)
 {
@@ -500,3 +506,26 @@ int dbt_get_cpuinfo(char *buf)
 	
 	return buf - buf_original;
 }
+
+bool dbt_host_has_xsaveopt()
+{
+	int cpuinfo[4];
+	__cpuidex(cpuinfo, 0, 0);
+	if (cpuinfo[0] < 0x0D)
+		return false;
+	__cpuidex(cpuinfo, 1, 0);
+	if ((cpuinfo[2] & (FEATURE_XSAVE | FEATURE_OSXSAVE)) != (FEATURE_XSAVE | FEATURE_OSXSAVE))
+		return false;
+	__cpuidex(cpuinfo, 0x0D, 1);
+	return (cpuinfo[0] & FEATURE_XSAVEOPT) != 0;
+}
+
+bool dbt_host_has_invariant_tsc()
+{
+	int cpuinfo[4];
+	__cpuidex(cpuinfo, 0x80000000, 0);
+	if ((uint32_t)cpuinfo[0] < 0x80000007)
+		return false;
+	__cpuidex(cpuinfo, 0x80000007, 0);
+	return (cpuinfo[3] & FEATURE_INVARIANT_TSC) != 0;
+}
@@ -22,6 +22,8 @@
 #include <common/types.h>
 #include <dbt/cpuid.h>
 
+#include <stdbool.h>
+
 struct cpuid_t
 {
 	uint32_t eax;
@@ -33,3 +35,7 @@ struct cpuid_t
 /* Singature used in dbt trampoline */
 EXTERN_C void dbt_cpuid(int eax, int ecx, struct cpuid_t *cpuid);
 int dbt_get_cpuinfo(char *buf);
+/* Whether the host supports XSAVEOPT and the OS has enabled XSAVE */
+bool dbt_host_has_xsaveopt();
+/* Whether the host TSC runs at a constant rate */
+bool dbt_host_has_invariant_tsc();
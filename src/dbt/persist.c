@@ -0,0 +1,291 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <common/errno.h>
+#include <common/fcntl.h>
+#include <common/stat.h>
+#include <dbt/persist.h>
+#include <dbt/x86.h>
+#include <syscall/mm.h>
+#include <syscall/process.h>
+#include <syscall/vfs.h>
+#include <flags.h>
+#include <log.h>
+#include <str.h>
+
+#include <stdint.h>
+#include <string.h>
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+/* Cache file layout: struct dbt_persist_header followed by |count| sorted uint32_t
+ * block offsets relative to the load base of the image. Offsets instead of
+ * addresses make the file independent of where the image is loaded. */
+#define DBT_PERSIST_MAGIC			0x54424446 /* "FDBT" */
+#define DBT_PERSIST_VERSION			1
+#define DBT_PERSIST_MAX_MODULES		32
+#define DBT_PERSIST_MAX_BLOCKS		65536
+#define DBT_PERSIST_POOL_SIZE		(4 * DBT_PERSIST_MAX_BLOCKS) /* Offsets of all registered images */
+#define DBT_PERSIST_TAKEN			0x80000000U /* The block was handed to the translator */
+
+struct dbt_persist_header
+{
+	uint32_t magic;
+	uint32_t version;
+	/* Identity of the image, the cache is discarded if any of these changes */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t mtime_nsec;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct dbt_persist_module
+{
+	struct dbt_persist_header id;
+	size_t base, low, high;
+	/* Recorded offsets in the pool */
+	int first, count;
+};
+
+struct dbt_persist_data
+{
+	int modules_count;
+	struct dbt_persist_module modules[DBT_PERSIST_MAX_MODULES];
+	int pool_used;
+	uint32_t pool[DBT_PERSIST_POOL_SIZE];
+};
+
+static struct dbt_persist_data *persist;
+static SRWLOCK persist_lock;
+
+void dbt_persist_init()
+{
+	if (!cmdline_flags->dbt_cache_dir[0])
+		return;
+	/* The registered images are kept in a region which survives fork() and execve(),
+	 * its address is stored in static area so a forked child finds them */
+	struct dbt_persist_data **data = (struct dbt_persist_data **)mm_static_alloc(sizeof(struct dbt_persist_data *));
+	if (!*data)
+		*data = (struct dbt_persist_data *)mm_mmap(NULL, sizeof(struct dbt_persist_data), PROT_READ | PROT_WRITE, MAP_ANONYMOUS,
+			INTERNAL_MAP_TOPDOWN | INTERNAL_MAP_NORESET | INTERNAL_MAP_VIRTUALALLOC, NULL, 0);
+	persist = *data;
+	InitializeSRWLock(&persist_lock);
+}
+
+static void get_cache_path(struct dbt_persist_module *module, char *path)
+{
+	/* FNV-1a hash of the image identity */
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	const uint8_t *p = (const uint8_t *)&module->id.dev;
+	const uint8_t *end = (const uint8_t *)&module->id.count;
+	for (; p < end; p++)
+		hash = (hash ^ *p) * 0x100000001B3ULL;
+	ksprintf(path, "%s/%016llx.dbt", cmdline_flags->dbt_cache_dir, hash);
+}
+
+static bool same_identity(const struct dbt_persist_header *l, const struct dbt_persist_header *r)
+{
+	return l->dev == r->dev && l->ino == r->ino && l->size == r->size
+		&& l->mtime == r->mtime && l->mtime_nsec == r->mtime_nsec;
+}
+
+/* Read at most max_count block offsets of an image, returns number of offsets read */
+static int read_offsets(struct dbt_persist_module *module, uint32_t *offsets, int max_count)
+{
+	char path[PATH_MAX];
+	get_cache_path(module, path);
+	struct file *f;
+	if (vfs_openat(AT_FDCWD, path, O_RDONLY, 0, 0, &f) < 0)
+		return 0;
+	int count = 0;
+	struct dbt_persist_header header;
+	if (f->op_vtable->pread(f, &header, sizeof(header), 0) == sizeof(header)
+		&& header.magic == DBT_PERSIST_MAGIC && header.version == DBT_PERSIST_VERSION
+		&& same_identity(&header, &module->id) && header.count <= DBT_PERSIST_MAX_BLOCKS)
+	{
+		int read_count = (int)header.count < max_count? (int)header.count: max_count;
+		size_t size = read_count * sizeof(uint32_t);
+		if (f->op_vtable->pread(f, offsets, size, sizeof(header)) == size)
+			count = read_count;
+	}
+	vfs_release(f);
+	return count;
+}
+
+static void write_offsets(struct dbt_persist_module *module, const uint32_t *offsets, int count)
+{
+	/* Write to a temporary file and rename it over the cache file, so other processes
+	 * never see a partially written file */
+	char path[PATH_MAX], temp_path[PATH_MAX];
+	get_cache_path(module, path);
+	ksprintf(temp_path, "%s.%d.tmp", path, process_get_pid());
+	struct file *f;
+	int r = vfs_openat(AT_FDCWD, temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0, 0644, &f);
+	if (r < 0)
+	{
+		log_warning("dbt: Cannot write translation cache file %s, error %d.", temp_path, r);
+		return;
+	}
+	struct dbt_persist_header header = module->id;
+	header.magic = DBT_PERSIST_MAGIC;
+	header.version = DBT_PERSIST_VERSION;
+	header.count = count;
+	header.reserved = 0;
+	size_t size = count * sizeof(uint32_t);
+	bool ok = f->op_vtable->pwrite(f, &header, sizeof(header), 0) == sizeof(header)
+		&& f->op_vtable->pwrite(f, offsets, size, sizeof(header)) == size;
+	vfs_release(f);
+	if (ok && (r = sys_rename(temp_path, path)) == 0)
+		return;
+	log_warning("dbt: Cannot write translation cache file %s, error %d.", path, ok? r: -L_EIO);
+	sys_unlink(temp_path);
+}
+
+void dbt_persist_load_module(struct file *f, size_t base, size_t low, size_t high)
+{
+	if (!persist)
+		return;
+	struct newstat stat;
+	if (!f->op_vtable->stat || f->op_vtable->stat(f, &stat) < 0)
+		return;
+	struct dbt_persist_header id;
+	id.dev = stat.st_dev;
+	id.ino = stat.st_ino;
+	id.size = stat.st_size;
+	id.mtime = stat.st_mtime;
+	id.mtime_nsec = stat.st_mtime_nsec;
+	AcquireSRWLockExclusive(&persist_lock);
+	for (int i = 0; i < persist->modules_count; i++)
+	{
+		struct dbt_persist_module *module = &persist->modules[i];
+		if (base + low >= module->base + module->high || base + high <= module->base + module->low)
+			continue;
+		if (same_identity(&module->id, &id) && module->base == base)
+		{
+			/* Another executable mapping of the same image */
+			if (low < module->low)
+				module->low = low;
+			if (high > module->high)
+				module->high = high;
+			ReleaseSRWLockExclusive(&persist_lock);
+			return;
+		}
+		/* The image is mapped over a registered one, which is forgotten */
+		module->high = module->low;
+	}
+	if (persist->modules_count == DBT_PERSIST_MAX_MODULES)
+	{
+		ReleaseSRWLockExclusive(&persist_lock);
+		return;
+	}
+	struct dbt_persist_module *module = &persist->modules[persist->modules_count++];
+	module->id = id;
+	module->base = base;
+	module->low = low;
+	module->high = high;
+	/* The blocks are translated when their page is first executed, see dbt_persist_take_blocks() */
+	module->first = persist->pool_used;
+	module->count = read_offsets(module, persist->pool + persist->pool_used, DBT_PERSIST_POOL_SIZE - persist->pool_used);
+	persist->pool_used += module->count;
+	ReleaseSRWLockExclusive(&persist_lock);
+	log_info("dbt: %d blocks recorded in translation cache.", module->count);
+}
+
+int dbt_persist_take_blocks(size_t pc, size_t *pcs, int max_count)
+{
+	if (!persist)
+		return 0;
+	int count = 0;
+	size_t page = pc & ~(size_t)(PAGE_SIZE - 1);
+	AcquireSRWLockExclusive(&persist_lock);
+	for (int i = 0; i < persist->modules_count; i++)
+	{
+		struct dbt_persist_module *module = &persist->modules[i];
+		if (pc < module->base + module->low || pc >= module->base + module->high)
+			continue;
+		/* Binary search the first recorded block in the page */
+		uint32_t *offsets = persist->pool + module->first;
+		uint32_t start = (uint32_t)(page - module->base), end = start + PAGE_SIZE;
+		int l = 0, r = module->count;
+		while (l < r)
+		{
+			int mid = (l + r) / 2;
+			if ((offsets[mid] & ~DBT_PERSIST_TAKEN) < start)
+				l = mid + 1;
+			else
+				r = mid;
+		}
+		for (; l < module->count && (offsets[l] & ~DBT_PERSIST_TAKEN) < end && count < max_count; l++)
+		{
+			if (offsets[l] & DBT_PERSIST_TAKEN)
+				continue;
+			offsets[l] |= DBT_PERSIST_TAKEN;
+			if (offsets[l] - DBT_PERSIST_TAKEN >= module->low && offsets[l] - DBT_PERSIST_TAKEN < module->high)
+				pcs[count++] = module->base + offsets[l] - DBT_PERSIST_TAKEN;
+		}
+	}
+	ReleaseSRWLockExclusive(&persist_lock);
+	return count;
+}
+
+void dbt_persist_save()
+{
+	if (!persist || !persist->modules_count)
+		return;
+	/* Forget the registered images first, the dbt lock must not be taken while holding persist_lock */
+	struct dbt_persist_module modules[DBT_PERSIST_MAX_MODULES];
+	AcquireSRWLockExclusive(&persist_lock);
+	int modules_count = persist->modules_count;
+	memcpy(modules, persist->modules, modules_count * sizeof(struct dbt_persist_module));
+	persist->modules_count = 0;
+	persist->pool_used = 0;
+	ReleaseSRWLockExclusive(&persist_lock);
+	/* Old offsets in the first half, merged offsets in the second half */
+	uint32_t *offsets = (uint32_t *)VirtualAlloc(NULL, 2 * DBT_PERSIST_MAX_BLOCKS * sizeof(uint32_t), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	uint32_t *merged = offsets + DBT_PERSIST_MAX_BLOCKS;
+	size_t *pcs = (size_t *)VirtualAlloc(NULL, DBT_PERSIST_MAX_BLOCKS * sizeof(size_t), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	for (int i = 0; i < modules_count; i++)
+	{
+		struct dbt_persist_module *module = &modules[i];
+		if (module->low == module->high)
+			continue;
+		/* The file may have been updated by another process meanwhile */
+		int old_count = read_offsets(module, offsets, DBT_PERSIST_MAX_BLOCKS);
+		int new_count = dbt_get_translated_blocks(module->base + module->low, module->base + module->high, pcs, DBT_PERSIST_MAX_BLOCKS);
+		/* Both lists are sorted, merge them */
+		int count = 0, p = 0, q = 0;
+		while ((p < old_count || q < new_count) && count < DBT_PERSIST_MAX_BLOCKS)
+		{
+			uint32_t offset;
+			if (q == new_count || (p < old_count && offsets[p] <= pcs[q] - module->base))
+				offset = offsets[p++];
+			else
+				offset = (uint32_t)(pcs[q++] - module->base);
+			if (count == 0 || merged[count - 1] != offset)
+				merged[count++] = offset;
+		}
+		if (count > old_count)
+			write_offsets(module, merged, count);
+	}
+	VirtualFree(pcs, 0, MEM_RELEASE);
+	VirtualFree(offsets, 0, MEM_RELEASE);
+}
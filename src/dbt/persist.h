@@ -0,0 +1,47 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <fs/file.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Persistent translation cache
+ * For every loaded ELF image and executable file mapping we remember the offsets of
+ * translated blocks in a file keyed by the identity of the image. When the same image
+ * is loaded again, the recorded blocks of a page are translated when the page is first
+ * executed, by the background translation thread if it is enabled. So most direct
+ * branches are linked at translation time instead of going through dbt_find_direct(),
+ * without translating blocks of pages the program does not run this time.
+ * Enabled by the --dbt-cache command line option.
+ */
+
+void dbt_persist_init();
+
+/* Register an image mapped with [base + low, base + high) executable and read its recorded blocks */
+void dbt_persist_load_module(struct file *f, size_t base, size_t low, size_t high);
+
+/* Get recorded blocks in the page of pc which were not handed out before
+ * Returns number of block addresses stored in pcs */
+int dbt_persist_take_blocks(size_t pc, size_t *pcs, int max_count);
+
+/* Write back block offsets of all registered images and forget them */
+void dbt_persist_save();
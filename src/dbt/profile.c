@@ -0,0 +1,499 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <binfmt/elf.h>
+#include <common/fcntl.h>
+#include <dbt/profile.h>
+#include <dbt/x86.h>
+#include <syscall/mm.h>
+#include <syscall/process.h>
+#include <syscall/vfs.h>
+#include <flags.h>
+#include <log.h>
+#include <str.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#define DBT_PROFILE_INTERVAL		1 /* Sampling interval in milliseconds */
+#define DBT_PROFILE_MAX_SYMBOLS		65536
+#define DBT_PROFILE_NAMES_SIZE		0x100000
+#define DBT_PROFILE_MAX_NAME_LEN	127 /* Longer symbol names are truncated */
+#define DBT_PROFILE_PCS				65536 /* Must be a power of 2 */
+#define DBT_PROFILE_STACKS			16384 /* Must be a power of 2 */
+#define DBT_PROFILE_MAX_PROBES		64
+#define DBT_PROFILE_REPORT_BLOCKS	1000 /* Number of blocks listed in the flat profile */
+
+struct dbt_profile_symbol
+{
+	size_t start, size;
+	uint32_t name; /* Offset in names */
+};
+
+/* Per block statistics, keyed by block pc */
+struct dbt_profile_pc
+{
+	size_t pc;
+	bool used;
+	uint32_t samples;
+	uint64_t executions;
+};
+
+struct dbt_profile_stack
+{
+	uint32_t samples;
+	int depth;
+	size_t frames[DBT_PROFILE_MAX_DEPTH];
+};
+
+struct dbt_profile_data
+{
+	pid_t pid; /* Process the samples belong to */
+	int image; /* Number of images executed by the process so far, execve() keeps the pid */
+	uint32_t samples_count;
+	uint32_t lost_samples_count;
+	int symbols_count;
+	bool symbols_sorted;
+	uint32_t names_size;
+	struct dbt_profile_symbol symbols[DBT_PROFILE_MAX_SYMBOLS];
+	char names[DBT_PROFILE_NAMES_SIZE];
+	struct dbt_profile_pc pcs[DBT_PROFILE_PCS];
+	struct dbt_profile_stack stacks[DBT_PROFILE_STACKS];
+};
+
+static struct dbt_profile_data *profile;
+static SRWLOCK profile_lock;
+static HANDLE sampler_thread;
+
+static void reset_samples()
+{
+	profile->samples_count = 0;
+	profile->lost_samples_count = 0;
+	memset(profile->pcs, 0, sizeof(profile->pcs));
+	memset(profile->stacks, 0, sizeof(profile->stacks));
+}
+
+static DWORD WINAPI sampler_thread_proc(LPVOID parameter)
+{
+	for (;;)
+	{
+		Sleep(DBT_PROFILE_INTERVAL);
+		dbt_sample_threads();
+	}
+	return 0;
+}
+
+void dbt_profile_init()
+{
+	if (!cmdline_flags->dbt_profile_dir[0])
+		return;
+	/* The profile is kept in a region which survives fork() and execve(), its address
+	 * is stored in static area so a forked child finds the symbols of its image */
+	struct dbt_profile_data **data = (struct dbt_profile_data **)mm_static_alloc(sizeof(struct dbt_profile_data *));
+	if (!*data)
+		*data = (struct dbt_profile_data *)mm_mmap(NULL, sizeof(struct dbt_profile_data), PROT_READ | PROT_WRITE, MAP_ANONYMOUS,
+			INTERNAL_MAP_TOPDOWN | INTERNAL_MAP_NORESET | INTERNAL_MAP_VIRTUALALLOC, NULL, 0);
+	profile = *data;
+	InitializeSRWLock(&profile_lock);
+	if (profile->pid != process_get_pid())
+	{
+		/* Samples inherited from the parent are written by the parent */
+		profile->pid = process_get_pid();
+		profile->image = 0;
+		reset_samples();
+	}
+	sampler_thread = CreateThread(NULL, 0, sampler_thread_proc, NULL, 0, NULL);
+	if (!sampler_thread)
+		log_error("dbt: Profiler thread creation failed, error code: %d.", GetLastError());
+}
+
+static void add_symbol(size_t start, size_t size, const char *name)
+{
+	int len = strlen(name);
+	if (len > DBT_PROFILE_MAX_NAME_LEN)
+		len = DBT_PROFILE_MAX_NAME_LEN;
+	if (profile->symbols_count == DBT_PROFILE_MAX_SYMBOLS || profile->names_size + len + 1 > DBT_PROFILE_NAMES_SIZE)
+		return;
+	struct dbt_profile_symbol *symbol = &profile->symbols[profile->symbols_count++];
+	symbol->start = start;
+	symbol->size = size;
+	symbol->name = profile->names_size;
+	memcpy(profile->names + profile->names_size, name, len);
+	profile->names[profile->names_size + len] = 0;
+	profile->names_size += len + 1;
+}
+
+void dbt_profile_load_module(struct file *f, size_t base)
+{
+	if (!profile)
+		return;
+	Elf32_Ehdr eh;
+	if (f->op_vtable->pread(f, &eh, sizeof(eh), 0) != sizeof(eh) || eh.e_shentsize != sizeof(Elf32_Shdr) || eh.e_shnum == 0)
+		return;
+	size_t shsize = eh.e_shnum * sizeof(Elf32_Shdr);
+	Elf32_Shdr *sht = (Elf32_Shdr *)VirtualAlloc(NULL, shsize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (f->op_vtable->pread(f, sht, shsize, eh.e_shoff) != shsize)
+	{
+		VirtualFree(sht, 0, MEM_RELEASE);
+		return;
+	}
+	/* Stripped images only have the dynamic symbol table */
+	Elf32_Shdr *symtab = NULL;
+	for (int i = 0; i < eh.e_shnum; i++)
+	{
+		if (sht[i].sh_type == SHT_SYMTAB)
+		{
+			symtab = &sht[i];
+			break;
+		}
+		if (sht[i].sh_type == SHT_DYNSYM && !symtab)
+			symtab = &sht[i];
+	}
+	AcquireSRWLockExclusive(&profile_lock);
+	int old_count = profile->symbols_count;
+	if (symtab && symtab->sh_link < eh.e_shnum && symtab->sh_entsize == sizeof(Elf32_Sym))
+	{
+		Elf32_Shdr *strtab = &sht[symtab->sh_link];
+		char *strings = (char *)VirtualAlloc(NULL, strtab->sh_size + 1, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (f->op_vtable->pread(f, strings, strtab->sh_size, strtab->sh_offset) == strtab->sh_size)
+		{
+			strings[strtab->sh_size] = 0;
+			Elf32_Sym syms[256];
+			int count = symtab->sh_size / sizeof(Elf32_Sym);
+			for (int i = 0; i < count; i += 256)
+			{
+				int n = count - i < 256? count - i: 256;
+				if (f->op_vtable->pread(f, syms, n * sizeof(Elf32_Sym), symtab->sh_offset + i * sizeof(Elf32_Sym)) != n * sizeof(Elf32_Sym))
+					break;
+				for (int j = 0; j < n; j++)
+					if (ELF32_ST_TYPE(syms[j].st_info) == STT_FUNC && syms[j].st_value && syms[j].st_name < strtab->sh_size)
+						add_symbol(base + syms[j].st_value, syms[j].st_size, strings + syms[j].st_name);
+			}
+		}
+		VirtualFree(strings, 0, MEM_RELEASE);
+	}
+	profile->symbols_sorted = false;
+	ReleaseSRWLockExclusive(&profile_lock);
+	VirtualFree(sht, 0, MEM_RELEASE);
+	log_info("dbt: %d symbols loaded for profiling.", profile->symbols_count - old_count);
+}
+
+/* Find or insert the statistics entry of a block, profile lock must be held */
+static struct dbt_profile_pc *get_pc(size_t pc)
+{
+	uint32_t hash = (pc ^ (pc >> 16)) * 0x9E3779B1U;
+	for (int i = 0; i < DBT_PROFILE_MAX_PROBES; i++)
+	{
+		struct dbt_profile_pc *entry = &profile->pcs[(hash + i) & (DBT_PROFILE_PCS - 1)];
+		if (!entry->used)
+		{
+			entry->used = true;
+			entry->pc = pc;
+			return entry;
+		}
+		if (entry->pc == pc)
+			return entry;
+	}
+	return NULL;
+}
+
+void dbt_profile_add_sample(const size_t *frames, int depth)
+{
+	AcquireSRWLockExclusive(&profile_lock);
+	profile->samples_count++;
+	struct dbt_profile_pc *entry = get_pc(frames[0]);
+	if (entry)
+		entry->samples++;
+	/* FNV-1a hash of the call chain */
+	uint32_t hash = 0x811C9DC5U;
+	for (int i = 0; i < depth; i++)
+		hash = (hash ^ frames[i]) * 0x01000193U;
+	bool found = false;
+	for (int i = 0; i < DBT_PROFILE_MAX_PROBES && !found; i++)
+	{
+		struct dbt_profile_stack *stack = &profile->stacks[(hash + i) & (DBT_PROFILE_STACKS - 1)];
+		if (!stack->samples)
+		{
+			stack->depth = depth;
+			memcpy(stack->frames, frames, depth * sizeof(size_t));
+		}
+		else if (stack->depth != depth || memcmp(stack->frames, frames, depth * sizeof(size_t)))
+			continue;
+		stack->samples++;
+		found = true;
+	}
+	if (!found)
+		profile->lost_samples_count++;
+	ReleaseSRWLockExclusive(&profile_lock);
+}
+
+void dbt_profile_add_executions(size_t pc, uint32_t executions)
+{
+	if (!profile)
+		return;
+	AcquireSRWLockExclusive(&profile_lock);
+	struct dbt_profile_pc *entry = get_pc(pc);
+	if (entry)
+		entry->executions += executions;
+	ReleaseSRWLockExclusive(&profile_lock);
+}
+
+static int cmp_symbol(const void *l, const void *r)
+{
+	const struct dbt_profile_symbol *left = (const struct dbt_profile_symbol *)l;
+	const struct dbt_profile_symbol *right = (const struct dbt_profile_symbol *)r;
+	if (left->start < right->start)
+		return -1;
+	else if (left->start > right->start)
+		return 1;
+	else
+		return 0;
+}
+
+/* Find the symbol containing addr, returns -1 if not found */
+static int find_symbol(size_t addr)
+{
+	if (!profile->symbols_sorted)
+	{
+		qsort(profile->symbols, profile->symbols_count, sizeof(struct dbt_profile_symbol), cmp_symbol);
+		profile->symbols_sorted = true;
+	}
+	int l = 0, r = profile->symbols_count - 1, found = -1;
+	while (l <= r)
+	{
+		int mid = (l + r) / 2;
+		if (profile->symbols[mid].start <= addr)
+		{
+			found = mid;
+			l = mid + 1;
+		}
+		else
+			r = mid - 1;
+	}
+	/* Symbols without size cover everything up to the next symbol */
+	if (found != -1 && profile->symbols[found].size && addr >= profile->symbols[found].start + profile->symbols[found].size)
+		return -1;
+	return found;
+}
+
+/* Buffered output file */
+struct profile_writer
+{
+	struct file *f;
+	loff_t offset;
+	int len;
+	char buf[65536];
+};
+
+static struct profile_writer writer;
+
+static bool writer_open(const char *suffix)
+{
+	char path[PATH_MAX];
+	ksprintf(path, "%s/profile-%d-%d.%s", cmdline_flags->dbt_profile_dir, profile->pid, profile->image, suffix);
+	int r = vfs_openat(AT_FDCWD, path, O_WRONLY | O_CREAT | O_TRUNC, 0, 0644, &writer.f);
+	if (r < 0)
+	{
+		log_warning("dbt: Cannot write profile %s, error %d.", path, r);
+		return false;
+	}
+	writer.offset = 0;
+	writer.len = 0;
+	return true;
+}
+
+static void writer_flush()
+{
+	writer.f->op_vtable->pwrite(writer.f, writer.buf, writer.len, writer.offset);
+	writer.offset += writer.len;
+	writer.len = 0;
+}
+
+/* Make sure there is room for a line, which is no longer than DBT_PROFILE_MAX_DEPTH symbols */
+static char *writer_reserve()
+{
+	if (writer.len > sizeof(writer.buf) - (DBT_PROFILE_MAX_DEPTH + 1) * (DBT_PROFILE_MAX_NAME_LEN + 32))
+		writer_flush();
+	return writer.buf + writer.len;
+}
+
+static void writer_close()
+{
+	writer_flush();
+	vfs_release(writer.f);
+}
+
+/* Name of the function containing addr */
+static int print_function(char *buf, size_t addr)
+{
+	if (!addr)
+		return ksprintf(buf, "[flinux]");
+	int symbol = find_symbol(addr);
+	if (symbol == -1)
+		return ksprintf(buf, "[unknown]");
+	return ksprintf(buf, "%s", profile->names + profile->symbols[symbol].name);
+}
+
+struct profile_entry
+{
+	uint32_t samples;
+	uint64_t executions;
+	int index;
+};
+
+static int cmp_entry(const void *l, const void *r)
+{
+	const struct profile_entry *left = (const struct profile_entry *)l;
+	const struct profile_entry *right = (const struct profile_entry *)r;
+	if (left->samples != right->samples)
+		return left->samples > right->samples? -1: 1;
+	if (left->executions != right->executions)
+		return left->executions > right->executions? -1: 1;
+	return 0;
+}
+
+static int print_percent(char *buf, uint32_t samples)
+{
+	uint32_t permyriad = profile->samples_count? (uint32_t)((uint64_t)samples * 10000 / profile->samples_count): 0;
+	return ksprintf(buf, "%3u.%02u%%", permyriad / 100, permyriad % 100);
+}
+
+static void write_flat_profile()
+{
+	if (!writer_open("txt"))
+		return;
+	/* Aggregate blocks by function, the last two entries are [unknown] and [flinux] */
+	int functions_count = profile->symbols_count + 2;
+	struct profile_entry *functions = (struct profile_entry *)VirtualAlloc(NULL, functions_count * sizeof(struct profile_entry), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	struct profile_entry *blocks = (struct profile_entry *)VirtualAlloc(NULL, DBT_PROFILE_PCS * sizeof(struct profile_entry), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	for (int i = 0; i < functions_count; i++)
+		functions[i].index = i;
+	int blocks_count = 0;
+	for (int i = 0; i < DBT_PROFILE_PCS; i++)
+	{
+		struct dbt_profile_pc *entry = &profile->pcs[i];
+		if (!entry->used)
+			continue;
+		int symbol = entry->pc? find_symbol(entry->pc): functions_count - 1;
+		if (symbol == -1)
+			symbol = functions_count - 2;
+		functions[symbol].samples += entry->samples;
+		functions[symbol].executions += entry->executions;
+		blocks[blocks_count].samples = entry->samples;
+		blocks[blocks_count].executions = entry->executions;
+		blocks[blocks_count].index = i;
+		blocks_count++;
+	}
+	qsort(functions, functions_count, sizeof(struct profile_entry), cmp_entry);
+	qsort(blocks, blocks_count, sizeof(struct profile_entry), cmp_entry);
+
+	char *buf = writer_reserve();
+	/* ksprintf() translates \n to \r\n, line breaks are written as raw bytes */
+	buf += ksprintf(buf, "# %u samples, %d ms interval, %u samples lost", profile->samples_count, DBT_PROFILE_INTERVAL, profile->lost_samples_count);
+	*buf++ = '\n';
+	buf += ksprintf(buf, "# samples  percent  executions  function");
+	*buf++ = '\n';
+	writer.len = buf - writer.buf;
+	for (int i = 0; i < functions_count && (functions[i].samples || functions[i].executions); i++)
+	{
+		buf = writer_reserve();
+		buf += ksprintf(buf, "%9u  ", functions[i].samples);
+		buf += print_percent(buf, functions[i].samples);
+		buf += ksprintf(buf, "  %10llu  ", functions[i].executions);
+		if (functions[i].index == functions_count - 1)
+			buf += ksprintf(buf, "[flinux]");
+		else if (functions[i].index == functions_count - 2)
+			buf += ksprintf(buf, "[unknown]");
+		else
+			buf += ksprintf(buf, "%s", profile->names + profile->symbols[functions[i].index].name);
+		*buf++ = '\n';
+		writer.len = buf - writer.buf;
+	}
+
+	buf = writer_reserve();
+	*buf++ = '\n';
+	buf += ksprintf(buf, "# samples  percent  executions  block");
+	*buf++ = '\n';
+	writer.len = buf - writer.buf;
+	for (int i = 0; i < blocks_count && i < DBT_PROFILE_REPORT_BLOCKS; i++)
+	{
+		size_t pc = profile->pcs[blocks[i].index].pc;
+		buf = writer_reserve();
+		buf += ksprintf(buf, "%9u  ", blocks[i].samples);
+		buf += print_percent(buf, blocks[i].samples);
+		buf += ksprintf(buf, "  %10llu  %p ", blocks[i].executions, pc);
+		int symbol = pc? find_symbol(pc): -1;
+		if (symbol != -1)
+			buf += ksprintf(buf, "%s+0x%x", profile->names + profile->symbols[symbol].name, pc - profile->symbols[symbol].start);
+		else
+			buf += print_function(buf, pc);
+		*buf++ = '\n';
+		writer.len = buf - writer.buf;
+	}
+	VirtualFree(blocks, 0, MEM_RELEASE);
+	VirtualFree(functions, 0, MEM_RELEASE);
+	writer_close();
+}
+
+static void write_folded_stacks()
+{
+	if (!writer_open("folded"))
+		return;
+	for (int i = 0; i < DBT_PROFILE_STACKS; i++)
+	{
+		struct dbt_profile_stack *stack = &profile->stacks[i];
+		if (!stack->samples)
+			continue;
+		/* Outermost frame first, return addresses point after the call instruction */
+		char *buf = writer_reserve();
+		for (int j = stack->depth - 1; j > 0; j--)
+		{
+			buf += print_function(buf, stack->frames[j] - 1);
+			*buf++ = ';';
+		}
+		buf += print_function(buf, stack->frames[0]);
+		buf += ksprintf(buf, " %u", stack->samples);
+		*buf++ = '\n';
+		writer.len = buf - writer.buf;
+	}
+	writer_close();
+}
+
+void dbt_profile_save()
+{
+	if (!profile)
+		return;
+	dbt_collect_block_executions();
+	AcquireSRWLockExclusive(&profile_lock);
+	if (profile->samples_count)
+	{
+		write_flat_profile();
+		write_folded_stacks();
+	}
+	/* The next image has its own symbols */
+	profile->image++;
+	reset_samples();
+	profile->symbols_count = 0;
+	profile->names_size = 0;
+	ReleaseSRWLockExclusive(&profile_lock);
+}
@@ -0,0 +1,50 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <fs/file.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Guest code profiler
+ * Translated blocks count their executions, and a sampling thread periodically
+ * records the block every thread is executing together with the guest call chain
+ * taken from its shadow stack. When the image exits or calls execve(), a flat
+ * profile and a folded stack file (the input format of flamegraph.pl) are written.
+ * Enabled by the --dbt-profile command line option.
+ */
+
+#define DBT_PROFILE_MAX_DEPTH	32 /* Maximum number of frames of a sample */
+
+void dbt_profile_init();
+
+/* Register function symbols of an ELF image loaded at base */
+void dbt_profile_load_module(struct file *f, size_t base);
+
+/* Record a sample, frames[0] is the pc of the executing block or 0 if the thread is
+ * not in translated code, followed by return addresses from innermost to outermost */
+void dbt_profile_add_sample(const size_t *frames, int depth);
+
+/* Account executions of a translated block starting at pc */
+void dbt_profile_add_executions(size_t pc, uint32_t executions);
+
+/* Write out the profile of the current image and start over */
+void dbt_profile_save();
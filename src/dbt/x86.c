@@ -17,45 +17,31 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <dbt/cpuid.h>
+#include <dbt/persist.h>
+#include <dbt/profile.h>
 #include <dbt/x86.h>
+#include <dbt/x86_decoder.h>
+#include <dbt/x86_host.h>
 #include <dbt/x86_inst.h>
+#include <lib/list.h>
 #include <lib/rbtree.h>
 #include <lib/slist.h>
 #include <syscall/mm.h>
 #include <syscall/sig.h>
+#include <syscall/syscall_dispatch.h>
 #include <syscall/tls.h>
 #include <flags.h>
 #include <log.h>
+#include <str.h>
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
-#include <msvcmacro.h>
-#include <ntdll.h>
 #include <immintrin.h>
 
-#ifdef __clang__
-#define __writefsdword my_writefsdword
-static __forceinline void __writefsdword(unsigned long offset, unsigned long value)
-{
-    __asm__ __volatile__(
-        "movl %0, %%fs:%1"
-        :
-        : "r"(value), "m"(*(uint32_t*)offset)
-        );
-}
-#endif
-
-#define GET_MODRM_MOD(c)	(((c) >> 6) & 7)
-#define GET_MODRM_R(c)		(((c) >> 3) & 7)
-#define GET_MODRM_RM(c)		((c) & 7)
-#define GET_MODRM_CODE(c)	GET_MODRM_R(c)
-
-#define GET_SIB_SCALE(s)	((s) >> 6)
-#define GET_SIB_INDEX(s)	(((s) >> 3) & 7)
-#define GET_SIB_BASE(s)		((s) & 7)
-
 #define GET_REX_W(r)		(((r) >> 3) & 1)
 #define GET_REX_R(r)		(((r) >> 2) & 1)
 #define GET_REX_X(r)		(((r) >> 1) & 1)
@@ -75,15 +61,6 @@ static __forceinline void __writefsdword(unsigned long offset, unsigned long val
 #define ESI		6
 #define EDI		7
 
-/* ModR/M flags */
-#define MODRM_PURE_REGISTER	1
-
-struct modrm_rm_t
-{
-	int base, index, scale, flags;
-	int32_t disp;
-};
-
 /* Helpers for constructing modrm_rm_t structure */
 static struct modrm_rm_t __forceinline modrm_rm_reg(int r)
 {
@@ -129,113 +106,6 @@ static struct modrm_rm_t __forceinline modrm_rm_mscale(int base, int index, int
 	return rm;
 }
 
-static int __forceinline modrm_rm_is_r(struct modrm_rm_t rm)
-{
-	return rm.flags & MODRM_PURE_REGISTER;
-}
-
-static int __forceinline modrm_rm_is_m(struct modrm_rm_t rm)
-{
-	return (rm.flags & MODRM_PURE_REGISTER) == 0;
-}
-
-static uint8_t __forceinline parse_byte(uint8_t **code)
-{
-	return *(*code)++;
-}
-
-static uint16_t __forceinline parse_word(uint8_t **code)
-{
-    uint16_t v = *(uint16_t*)*code;
-    *code += 2;
-    return v;
-}
-
-static uint32_t __forceinline parse_dword(uint8_t **code)
-{
-    uint32_t v = *(uint32_t*)*code;
-    *code += 4;
-    return v;
-}
-
-static uint64_t __forceinline parse_qword(uint8_t **code)
-{
-    uint64_t v = *(uint64_t*)*code;
-    *code += 8;
-    return v;
-}
-
-static int32_t __forceinline parse_rel(uint8_t **code, int rel_bytes)
-{
-	if (rel_bytes == 1)
-		return (int8_t)parse_byte(code);
-	else if (rel_bytes == 2)
-		return (int16_t)parse_word(code);
-	else
-		return (int32_t)parse_dword(code);
-}
-
-static uint32_t __forceinline parse_moffset(uint8_t **code, int imm_bytes)
-{
-	if (imm_bytes == 1)
-		return parse_byte(code);
-	else if (imm_bytes == 2)
-		return parse_word(code);
-	else
-		return parse_dword(code);
-}
-
-static void parse_modrm(uint8_t **code, int *r, struct modrm_rm_t *rm)
-{
-	uint8_t modrm = parse_byte(code);
-	*r = GET_MODRM_R(modrm);
-	int mod = GET_MODRM_MOD(modrm);
-	if (mod == 3)
-	{
-		rm->flags = MODRM_PURE_REGISTER;
-		rm->base = GET_MODRM_RM(modrm);
-		rm->index = -1;
-		return;
-	}
-	rm->flags = 0;
-	int sib_bytes = 0;
-	int modrm_rm = GET_MODRM_RM(modrm);
-	if (modrm_rm == 4)
-	{
-		/* ModR/M with SIB byte */
-		sib_bytes = 1;
-		int sib = parse_byte(code);
-		rm->scale = GET_SIB_SCALE(sib);
-		if ((rm->index = GET_SIB_INDEX(sib)) == 4)
-			rm->index = -1;
-		if ((rm->base = GET_SIB_BASE(sib)) == 5 && mod == 0)
-		{
-			rm->base = -1;
-			mod = 2; /* For use later to correctly extract disp32 */
-		}
-	}
-	else
-	{
-		/* ModR/M without SIB byte */
-		rm->index = -1;
-		rm->scale = 0;
-		if (mod == 0 && modrm_rm == 5) /* disp32 */
-		{
-			rm->base = -1;
-			rm->disp = (int32_t)parse_dword(code);
-			return;
-		}
-		rm->base = modrm_rm;
-	}
-	/* Displacement */
-	if (mod == 1) /* disp8 */
-		rm->disp = (int8_t)parse_byte(code);
-	else if (mod == 2) /* disp32 */
-		rm->disp = (int32_t)parse_dword(code);
-	else /* no disp */
-		rm->disp = 0;
-}
-
 static __forceinline void gen_byte(uint8_t **out, uint8_t x)
 {
 	*(*out)++ = x;
@@ -425,8 +295,16 @@ static __forceinline void gen_push_imm32(uint8_t **out, uint32_t imm)
 	gen_dword(out, imm);
 }
 
+/* Background translations are generated in a private buffer, see dbt_stage_block()
+ * Branches leaving the block are recorded so they can be relocated when the block is copied */
+struct dbt_staging;
+static __declspec(thread) struct dbt_staging *dbt_staging;
+static void dbt_stage_branch(uint8_t *rel, size_t dest);
+
 static __forceinline void gen_call(uint8_t **out, void *dest)
 {
+	if (dbt_staging)
+		dbt_stage_branch(*out + 1, (size_t)dest);
 	int32_t rel = (int32_t)((size_t)dest - (((size_t)*out) + 5));
 	gen_byte(out, 0xE8);
 	gen_dword(out, rel);
@@ -434,6 +312,8 @@ static __forceinline void gen_call(uint8_t **out, void *dest)
 
 static __forceinline void gen_jmp(uint8_t **out, void *dest)
 {
+	if (dbt_staging)
+		dbt_stage_branch(*out + 1, (size_t)dest);
 	int32_t rel = (int32_t)((size_t)dest - (((size_t)*out) + 5));
 	gen_byte(out, 0xE9);
 	gen_dword(out, rel);
@@ -447,6 +327,8 @@ static __forceinline void gen_jmp_rm(uint8_t **out, struct modrm_rm_t rm)
 
 static __forceinline void gen_jcc(uint8_t **out, int cond, size_t dest)
 {
+	if (dbt_staging)
+		dbt_stage_branch(*out + 2, dest);
 	int32_t rel = (int32_t)(dest - (((size_t)*out) + 6));
 	gen_byte(out, 0x0F);
 	gen_byte(out, 0x80 + cond);
@@ -459,13 +341,30 @@ static __forceinline void gen_jecxz_rel(uint8_t **out, int8_t rel)
 	gen_byte(out, rel);
 }
 
+/* Pad with nops so that the rel32 field of the following branch instruction is 4-byte aligned
+ * The code cache is shared by all threads, a patchable branch must never straddle a cache line
+ * so it can be atomically updated while other threads may be executing it */
+static __forceinline void gen_patchable_align(uint8_t **out, int opcode_bytes)
+{
+	while (((size_t)*out + opcode_bytes) & 3)
+		gen_byte(out, 0x90);
+}
+
 struct dbt_block
 {
 	struct slist list;
 	struct rb_node tree; /* RB tree organized by source address */
 	struct rb_node cache_tree; /* RB tree organized by translated code cache address */
-	size_t pc;
-	uint8_t *start;
+	size_t pc, end_pc; /* Source code range */
+	uint8_t *start, *end; /* Translated code range */
+	bool invalidated;
+	bool superblock;
+	bool hot; /* Translated into the hot code region */
+	uint32_t superblock_branches; /* Directions of conditional branches in a superblock, 1 = taken */
+	uint32_t executions; /* Execution counter in profiling mode, not synchronized between threads */
+	bool checked; /* The guest code is verified on entry instead of being write protected */
+	uint32_t code_hash; /* Hash of the guest code for checked blocks */
+	uint8_t *space_exhausted_out; /* Where translation gave up for lack of code cache space, NULL if not */
 };
 
 static int tree_cmp(const struct rb_node *left, const struct rb_node *right)
@@ -498,7 +397,19 @@ static int cache_tree_cmp(const struct rb_node *left, const struct rb_node *righ
 #define DBT_BLOCK_MAXSIZE		1024 /* Maximum size of a translated basic block */
 #define DBT_BLOCKS_TABLE_SIZE	0x00800000U
 #define DBT_CACHE_SIZE			0x00800000U
+#define DBT_HOT_CACHE_SIZE		(DBT_CACHE_SIZE / 8) /* Size of the hot code region in a code cache */
 #define MAX_DBT_BLOCKS			(DBT_BLOCKS_TABLE_SIZE / sizeof(struct dbt_block))
+#define DBT_BLOCK_ENTRY_SIZE	5 /* Size of the patchable block entry */
+#define DBT_EVICT_KEEP_DIVISOR	4 /* 1/4 of youngest blocks survive an eviction */
+#define DBT_CODE_CHANGED_MAX_RANGES	16
+#define DBT_BACKGROUND_QUEUE_SIZE	1024 /* Must be a power of 2 */
+#define DBT_BACKGROUND_MAX_INSTRUCTIONS	256 /* Give up pre-scanning a block longer than this */
+#define DBT_STAGING_SIZE		0x2000 /* Size of the staging buffer of background translations */
+#define DBT_STAGING_MAX_RELOCS	1024
+#define DBT_STAGING_MAX_LINKS	256
+#define DBT_PERSIST_BATCH_SIZE	256 /* Maximum recorded blocks translated at a time */
+
+#define DBT_HANDLER_TYPES			(HANDLER_NORMAL + 1)
 
 struct dbt_global_data
 {
@@ -511,15 +422,157 @@ struct dbt_global_data
 	int tls_kernel_esp_offset; /* saved kernel stack pointer */
 	int tls_esp_offset; /* saved user stack pointer */
 	int tls_eip_offset; /* saved instruction pointer */
+	int tls_shadow_stack_offset; /* top of shadow return stack */
+	/* Shared code cache */
+	dbt_host_lock rw_lock;
+	struct dbt_data *retired_caches; /* Flushed caches which may still be in use by other threads */
+	struct dbt_data *free_caches; /* Decommitted caches ready for reuse */
+	/* Code changes reported by dbt_code_changed(), processed on next dbt entry */
+	dbt_host_lock code_changed_lock;
+	volatile bool code_changed_pending;
+	int code_changed_count;
+	size_t code_changed_start[DBT_CODE_CHANGED_MAX_RANGES];
+	size_t code_changed_end[DBT_CODE_CHANGED_MAX_RANGES];
+	/* Save SIMD state with XSAVEOPT instead of FXSAVE */
+	bool xsaveopt;
+	/* The gs base of all threads, 0 if not set yet. As long as all threads share the
+	 * same base it is folded into translated code as a constant. */
+	size_t gs_base;
+	bool gs_base_mixed; /* Threads have different gs bases, never fold */
+	/* Log2 entries of the sieve table of the next code cache, carried over from grown tables */
+	int sieve_bits;
+	/* Threads with a shadow stack, protected by rw_lock */
+	struct list threads;
+	/* Direct branch targets waiting for background translation, protected by rw_lock */
+	dbt_host_event background_event;
+	bool background_signaled;
+	int background_head, background_tail;
+	size_t background_queue[DBT_BACKGROUND_QUEUE_SIZE];
+	/* Statistics */
+	volatile LONG threads_count;
+	int caches_count;
+	int free_caches_count;
+	int translated_blocks_count;
+	int flushes_count;
+	int invalidations_count;
+	int invalidated_blocks_count;
+	int evictions_count;
+	int evicted_blocks_count;
+	int evict_kept_blocks_count;
+	int superblocks_count;
+	int inline_cache_entries_count;
+	int megamorphic_sites_count;
+	int sieve_trims_count;
+	int sieve_grows_count;
+	int sieve_max_chain;
+	volatile LONG return_mispredicts_count;
+	volatile LONG code_write_faults_count;
+	int checked_blocks_count;
+	volatile LONG code_checks_count;
+	volatile LONG code_check_misses_count;
+	volatile LONG direct_lookups_count;
+	volatile LONG indirect_lookups_count;
+	int gs_folded_modrm_count;
+	int gs_folded_moffset_count;
+	int gs_generic_count;
+	int gs_base_changes_count;
+	/* Translation cost, replays are not counted */
+	uint64_t translated_source_bytes;
+	uint64_t translated_code_bytes;
+	uint64_t translate_cycles;
+	int handler_instructions_count[DBT_HANDLER_TYPES];
+	uint64_t handler_code_bytes[DBT_HANDLER_TYPES];
 } static _dbt_global;
 
 static struct dbt_global_data *const dbt_global = &_dbt_global;
 
+/* Fields of a staged block which depend on where it is copied to */
+#define DBT_RELOC_BRANCH		0 /* rel32 of a branch leaving the block */
+#define DBT_RELOC_SELF			1 /* imm32 holding an address inside the block */
+#define DBT_RELOC_BLOCK			2 /* disp32 holding an address inside the block descriptor */
+
+/* Patchable branches of a staged block, their trampolines are created on publish */
+#define DBT_LINK_DIRECT			0 /* dbt_get_direct_trampoline() */
+#define DBT_LINK_BRANCH			1 /* dbt_get_branch_trampoline() */
+#define DBT_LINK_DIRECT_CALL	2 /* dbt_get_direct_call_trampoline() */
+#define DBT_LINK_JMP_INDIRECT	3 /* Inline cache or sieve dispatch of an indirect jmp */
+#define DBT_LINK_CALL_INDIRECT	4 /* Inline cache or sieve dispatch of an indirect call */
+
+struct dbt_staging_reloc
+{
+	uint16_t offset;
+	uint8_t type;
+};
+
+struct dbt_staging_link
+{
+	uint16_t offset; /* Offset of the rel32 field */
+	uint8_t type;
+	size_t target, segment_pc, source_pc;
+};
+
+/* A block translated by the background thread without holding the dbt lock
+ * Code is generated in the buffer as if it were at the buffer address, everything which
+ * needs the code cache or the block tables is deferred to dbt_publish_staged_block(). */
+struct dbt_staging
+{
+	uint8_t buffer[DBT_STAGING_SIZE];
+	struct dbt_data *cache; /* Code cache the block is translated for */
+	struct dbt_block block;
+	uint32_t code_hash; /* Hash of the guest code at translation time */
+	bool overflow; /* Too many relocations, the block is dropped */
+	int relocs_count;
+	struct dbt_staging_reloc relocs[DBT_STAGING_MAX_RELOCS];
+	int links_count;
+	struct dbt_staging_link links[DBT_STAGING_MAX_LINKS];
+	/* Counters, added to the global ones on publish */
+	int gs_folded_modrm_count;
+	int gs_folded_moffset_count;
+	int gs_generic_count;
+	int handler_instructions_count[DBT_HANDLER_TYPES];
+	uint64_t handler_code_bytes[DBT_HANDLER_TYPES];
+	uint64_t translate_cycles;
+};
+
+static __declspec(align(16)) struct dbt_staging dbt_background_staging;
+
+/* Translation counter of the staged block when staging, the global one otherwise */
+#define DBT_TRANSLATE_STAT(name)	(*(dbt_staging? &dbt_staging->name: &dbt_global->name))
+
 /* Do not modify these unless you know what you are doing */
-#define DBT_SIEVE_ENTRIES			65536
-#define SIEVE_HASH(x)				((x) & 0xFFFF)
-#define DBT_RETURN_CACHE_ENTRIES	65536
-#define RETURN_CACHE_HASH(x)		((x) & 0xFFFF)
+/* The sieve is indexed by the low bits of the pc, which is the only hash we can
+ * compute without touching eflags. Its size is between 2^DBT_TABLE_MIN_BITS and
+ * 2^DBT_TABLE_MAX_BITS entries, see gen_table_index() */
+#define SIEVE_HASH(cache, x)		((x) & ((1 << (cache)->sieve_bits) - 1))
+#define DBT_SIEVE_GROW_CHAIN		3 /* Grow the sieve table when a bucket holds this many stubs */
+/* The shadow stack is a ring of (guest return address, translated return address) pairs
+ * The ring is 64KB aligned so the top can wrap around with a 16-bit lea */
+#define DBT_SHADOW_STACK_SIZE		0x10000
+#define DBT_SHADOW_STACK_ENTRIES	(DBT_SHADOW_STACK_SIZE / sizeof(struct dbt_shadow_entry))
+#define DBT_SHADOW_STACK_RESYNC_DEPTH	64 /* Number of entries searched for a mispredicted return */
+#define DBT_SUPERBLOCK_COUNTERS		4096
+#define SUPERBLOCK_COUNTER_HASH(x)	(((x) ^ ((x) >> 12)) & 0x0FFF)
+#define DBT_SUPERBLOCK_THRESHOLD	64 /* Executions of a loop head before a superblock is formed */
+#define DBT_SUPERBLOCK_MAX_SEGMENTS	16 /* Maximum number of branches followed in a superblock */
+#define DBT_SUPERBLOCK_MAX_SPAN		0x1000 /* Maximum source code size of a superblock */
+#define DBT_SIEVE_MAX_CHAIN			8 /* Maximum number of sieve stubs in a bucket */
+#define DBT_INLINE_CACHE_SITES		4096
+#define DBT_INLINE_CACHE_ENTRIES	4 /* Maximum targets of an indirect branch before falling back to the sieve */
+/* Inline cache of an indirect branch site
+ * The site jumps to a dispatch stub which compares the target against a chain
+ * of sieve stubs private to the site, most recently added first.
+ */
+struct dbt_inline_cache
+{
+	size_t pc; /* Address of the indirect branch */
+	uint8_t *head; /* Dispatch stub */
+	uint8_t *last_entry; /* Oldest sieve stub, the end of the chain */
+	uint32_t executions; /* Updated by the dispatch stub without synchronization */
+	uint32_t misses;
+	int entries;
+	bool megamorphic; /* Further targets are looked up in the sieve table */
+};
+
 struct dbt_data
 {
 	struct slist block_hash[DBT_BLOCK_HASH_BUCKETS];
@@ -527,9 +580,14 @@ struct dbt_data
 	struct rb_tree tree;
 	struct rb_tree cache_tree;
 	int blocks_count;
+	int invalidated_blocks_count;
+	size_t max_block_span; /* Maximum source code size of a block */
 	uint8_t *code_cache;
 	uint8_t *internal_trampoline_end;
 	uint8_t *out, *end;
+	/* Hot code region, superblocks are laid out contiguously here instead of being
+	 * interleaved with run-once code and trampolines */
+	uint8_t *hot_start, *hot_out, *hot_end;
 	/* Trampolines */
 	void *run_trampoline;
 	void *restore_fork_trampoline;
@@ -537,41 +595,165 @@ struct dbt_data
 	void *sigreturn_trampoline;
 	/* Sieve */
 	uint8_t **sieve_table;
+	int sieve_bits;
 	uint8_t *sieve_dispatch_trampoline;
 	uint8_t *sieve_indirect_call_dispatch_trampoline;
-	/* Return cache */
-	uint8_t **return_cache;
+	/* Returns missing from the shadow stack */
 	uint8_t *return_fallback_trampoline;
+	/* Execution counters of loop heads */
+	uint32_t *superblock_counters;
+	/* gs base folded into gs relative accesses, 0 if they load the base from TLS */
+	size_t gs_base;
+	/* Inline caches */
+	struct dbt_inline_cache *inline_caches;
+	int inline_caches_count;
+	/* Number of threads which may be executing code in this cache */
+	volatile LONG users;
+	/* Next cache in the retired or free list */
+	struct dbt_data *next;
+};
+
+struct dbt_shadow_entry
+{
+	size_t pc; /* Guest return address */
+	uint8_t *target; /* Translated code following the call */
+};
+
+/* Per thread dbt data, stored in TLS_ENTRY_DBT */
+struct dbt_thread_data
+{
+	/* The code cache this thread is currently executing in */
+	struct dbt_data *cache;
 	/* Information of current signal to be delivered */
+	struct dbt_data *signal_cache;
 	bool signal_pending;
 	bool signal_need_fixup;
+	/* Shadow return stack, the top is stored in TLS_ENTRY_SHADOW_STACK */
+	struct dbt_shadow_entry *shadow_stack;
+	volatile DWORD *shadow_stack_top; /* Address of the TLS slot, for the profiler */
+	HANDLE handle; /* Thread handle for the profiler */
+	struct list_node list;
 };
 
 EXTERN_C void dbt_find_direct_internal();
+EXTERN_C void dbt_find_superblock_internal();
 EXTERN_C void dbt_find_indirect_internal();
 EXTERN_C void dbt_sieve_fallback();
+EXTERN_C void dbt_return_fallback();
+EXTERN_C void dbt_inline_cache_miss_internal();
+EXTERN_C void dbt_check_code_internal();
 
 EXTERN_C void dbt_cpuid_internal();
 EXTERN_C void syscall_handler();
 
-static __declspec(thread, align(16)) char dbt_simd_state[512];
+/* The emulator is compiled without SSE (NoExtensions in flinux.vcxproj, /arch:IA32 or -mno-sse
+ * in CMakeLists.txt), the guest x87/SSE state only needs to be saved around calls which may
+ * enter the Windows kernel. Saves can be nested, only the outermost pair touches the state.
+ * With XSAVEOPT, components the guest has not modified since the last restore are not
+ * written again. */
+#define DBT_XSTATE_X87_SSE			3 /* XSAVE component bitmap of x87 and SSE state */
+#define DBT_SIMD_STATE_SIZE			(512 + 64) /* Legacy area + XSAVE header */
+static __declspec(thread) __declspec(align(64)) char dbt_simd_state[DBT_SIMD_STATE_SIZE];
+static __declspec(thread) int dbt_simd_state_depth;
 
 static void dbt_save_simd_state()
 {
-	_fxsave(dbt_simd_state);
+	if (dbt_simd_state_depth++)
+		return;
+	if (dbt_global->xsaveopt)
+		_xsaveopt(dbt_simd_state, DBT_XSTATE_X87_SSE);
+	else
+		_fxsave(dbt_simd_state);
 }
 
 static void dbt_restore_simd_state()
 {
-	_fxrstor(dbt_simd_state);
+	if (--dbt_simd_state_depth)
+		return;
+	if (dbt_global->xsaveopt)
+		_xrstor(dbt_simd_state, DBT_XSTATE_X87_SSE);
+	else
+		_fxrstor(dbt_simd_state);
 }
 
-static __declspec(thread) struct dbt_data *dbt;
-/* A helper flag which will be set to true in dbt_flush().
- * User can first set this to true, and read it after some operations
- * to determine if dbt code cache is flushed during the operations.
+/* The code cache is shared by all threads in the process
+ * Lookups take dbt_global->rw_lock shared, translation and patching take it exclusively.
+ * Translated code runs without holding the lock, so a block must be completely
+ * generated before it is published through the sieve table or a patched jump.
  */
-static __declspec(thread) bool dbt_flushed;
+static struct dbt_data *dbt;
+static __declspec(thread) struct dbt_thread_data dbt_thread;
+
+/* Acquiring a contended lock enters the Windows kernel which clobbers SIMD state */
+static void dbt_lock_shared()
+{
+	if (!dbt_host_try_lock_shared(&dbt_global->rw_lock))
+	{
+		dbt_save_simd_state();
+		dbt_host_lock_shared(&dbt_global->rw_lock);
+		dbt_restore_simd_state();
+	}
+}
+
+static void dbt_unlock_shared()
+{
+	dbt_host_unlock_shared(&dbt_global->rw_lock);
+}
+
+static void dbt_lock_exclusive()
+{
+	if (!dbt_host_try_lock_exclusive(&dbt_global->rw_lock))
+	{
+		dbt_save_simd_state();
+		dbt_host_lock_exclusive(&dbt_global->rw_lock);
+		dbt_restore_simd_state();
+	}
+}
+
+static void dbt_unlock_exclusive()
+{
+	dbt_host_unlock_exclusive(&dbt_global->rw_lock);
+}
+
+/* Empty the shadow stack of current thread, its translated return addresses point to the old code cache */
+static void dbt_reset_shadow_stack()
+{
+	for (int i = 0; i < DBT_SHADOW_STACK_ENTRIES; i++)
+	{
+		dbt_thread.shadow_stack[i].pc = 0;
+		dbt_thread.shadow_stack[i].target = dbt->return_fallback_trampoline;
+	}
+	dbt_host_write_tls(dbt_global->tls_shadow_stack_offset, (DWORD)dbt_thread.shadow_stack);
+}
+
+/* Attach current thread to the current code cache, dbt lock must be held */
+static void dbt_enter()
+{
+	struct dbt_data *old = dbt_thread.cache;
+	if (old != dbt)
+	{
+		InterlockedIncrement(&dbt->users);
+		dbt_thread.cache = dbt;
+		if (old)
+			InterlockedDecrement(&old->users);
+		dbt_reset_shadow_stack();
+	}
+}
+
+/* Detach current thread from its code cache, dbt lock must be held */
+static void dbt_leave()
+{
+	if (dbt_thread.cache)
+	{
+		InterlockedDecrement(&dbt_thread.cache->users);
+		dbt_thread.cache = NULL;
+	}
+}
+
+static bool dbt_in_cache(struct dbt_data *cache, size_t addr)
+{
+	return addr >= (size_t)cache->code_cache && addr < (size_t)cache->code_cache + DBT_CACHE_SIZE;
+}
 
 /* We use a return trampoline for returning to user code from kernel code
  * The return address is stored in TLS and set up in kernel code
@@ -747,10 +929,10 @@ static void dbt_gen_sigreturn_trampoline()
 
 static void dbt_set_return_addr(size_t original_pc, size_t translated_addr)
 {
-	__writefsdword(dbt_global->tls_eip_offset, original_pc);
-	__writefsdword(dbt_global->tls_return_addr_offset, translated_addr);
-	if (dbt->signal_pending)
-		__writefsdword(dbt_global->tls_return_addr_offset, (DWORD)dbt->signal_trampoline);
+	dbt_host_write_tls(dbt_global->tls_eip_offset, original_pc);
+	dbt_host_write_tls(dbt_global->tls_return_addr_offset, translated_addr);
+	if (dbt_thread.signal_pending)
+		dbt_host_write_tls(dbt_global->tls_return_addr_offset, (DWORD)dbt->signal_trampoline);
 }
 
 static void dbt_gen_sieve_dispatch();
@@ -760,14 +942,23 @@ static void dbt_gen_tables()
 	rb_init(&dbt->tree);
 	rb_init(&dbt->cache_tree);
 	dbt->blocks_count = 0;
+	dbt->invalidated_blocks_count = 0;
+	dbt->max_block_span = 0;
 	dbt->out = dbt->code_cache;
 	dbt->end = dbt->code_cache + DBT_CACHE_SIZE;
 
 	/* Allocate ancillary data structure */
+	dbt->sieve_bits = dbt_global->sieve_bits;
+	dbt->gs_base = dbt_global->gs_base_mixed? 0: dbt_global->gs_base;
 	dbt->sieve_table = (uint8_t**)dbt->out;
-	dbt->out += sizeof(uint8_t*) * DBT_SIEVE_ENTRIES;
-	dbt->return_cache = (uint8_t**)dbt->out;
-	dbt->out += sizeof(uint8_t*) * DBT_RETURN_CACHE_ENTRIES;
+	dbt->out += sizeof(uint8_t*) << dbt->sieve_bits;
+	dbt->superblock_counters = (uint32_t*)dbt->out;
+	dbt->out += sizeof(uint32_t) * DBT_SUPERBLOCK_COUNTERS;
+	for (int i = 0; i < DBT_SUPERBLOCK_COUNTERS; i++)
+		dbt->superblock_counters[i] = DBT_SUPERBLOCK_THRESHOLD;
+	dbt->inline_caches = (struct dbt_inline_cache *)dbt->out;
+	dbt->out += sizeof(struct dbt_inline_cache) * DBT_INLINE_CACHE_SITES;
+	dbt->inline_caches_count = 0;
 
 	/* Trampolines */
 	dbt_gen_run_trampoline();
@@ -776,24 +967,189 @@ static void dbt_gen_tables()
 	dbt_gen_sigreturn_trampoline();
 	dbt->internal_trampoline_end = dbt->out;
 	dbt_gen_sieve_dispatch();
-	for (int i = 0; i < DBT_RETURN_CACHE_ENTRIES; i++)
-		dbt->return_cache[i] = dbt->return_fallback_trampoline;
+
+	/* Hot code region, page aligned so hot code shares no page with cold code */
+	dbt->hot_start = (uint8_t*)ALIGN_TO(dbt->out, PAGE_SIZE);
+	dbt->hot_out = dbt->hot_start;
+	dbt->hot_end = dbt->hot_start + DBT_HOT_CACHE_SIZE;
+	dbt->out = dbt->hot_end;
+}
+
+/* Get an empty code cache, reuse a reclaimed one if possible, dbt lock must be held exclusively */
+static struct dbt_data *dbt_alloc_cache()
+{
+	struct dbt_data *cache = dbt_global->free_caches;
+	if (cache)
+	{
+		dbt_global->free_caches = cache->next;
+		dbt_global->free_caches_count--;
+		if (!dbt_host_commit(cache->blocks, DBT_BLOCKS_TABLE_SIZE, 0))
+			log_error("Committing dbt_blocks failed.");
+		if (!dbt_host_commit(cache->code_cache, DBT_CACHE_SIZE, DBT_HOST_EXECUTE))
+			log_error("Committing dbt_cache failed.");
+	}
+	else
+	{
+		cache = (struct dbt_data*)dbt_host_alloc(sizeof(struct dbt_data), DBT_HOST_TOP_DOWN);
+		if (!(cache->blocks = (struct dbt_block*)dbt_host_alloc(DBT_BLOCKS_TABLE_SIZE, DBT_HOST_TOP_DOWN)))
+			log_error("Allocating dbt_blocks failed.");
+		if (!(cache->code_cache = (uint8_t*)dbt_host_alloc(DBT_CACHE_SIZE, DBT_HOST_EXECUTE | DBT_HOST_TOP_DOWN)))
+			log_error("Allocating dbt_cache failed.");
+		dbt_global->caches_count++;
+	}
+	for (int i = 0; i < DBT_BLOCK_HASH_BUCKETS; i++)
+		slist_init(&cache->block_hash[i]);
+	cache->users = 0;
+	cache->next = NULL;
+	return cache;
+}
+
+/* Hand execution counters of all blocks in a cache to the profiler and reset them */
+static void dbt_collect_cache_executions(struct dbt_data *cache)
+{
+	for (struct rb_node *node = rb_first(&cache->cache_tree); node; node = rb_next(node))
+	{
+		struct dbt_block *block = rb_entry(node, struct dbt_block, cache_tree);
+		if (block->executions)
+		{
+			dbt_profile_add_executions(block->pc, block->executions);
+			block->executions = 0;
+		}
+	}
+}
+
+/* Move retired caches which no thread is using to the free list
+ * The dbt_data structure itself is never freed as dbt_deliver_signal() walks the lists without locking
+ */
+static void dbt_reclaim_caches()
+{
+	struct dbt_data **prev = &dbt_global->retired_caches;
+	while (*prev)
+	{
+		struct dbt_data *cache = *prev;
+		if (cache->users == 0)
+		{
+			*prev = cache->next;
+			if (cmdline_flags->dbt_profile_dir[0])
+				dbt_collect_cache_executions(cache);
+			dbt_host_decommit(cache->blocks, DBT_BLOCKS_TABLE_SIZE);
+			dbt_host_decommit(cache->code_cache, DBT_CACHE_SIZE);
+			cache->next = dbt_global->free_caches;
+			dbt_global->free_caches = cache;
+			dbt_global->free_caches_count++;
+		}
+		else
+			prev = &cache->next;
+	}
+}
+
+/* Find the code cache containing the given address, without taking the dbt lock */
+static struct dbt_data *dbt_find_cache(size_t addr)
+{
+	struct dbt_data *cache = dbt;
+	if (addr >= (size_t)cache->internal_trampoline_end && dbt_in_cache(cache, addr))
+		return cache;
+	for (cache = dbt_global->retired_caches; cache; cache = cache->next)
+		if (addr >= (size_t)cache->internal_trampoline_end && dbt_in_cache(cache, addr))
+			return cache;
+	return NULL;
 }
 
 void dbt_init_thread()
 {
-	dbt = (struct dbt_data*)VirtualAlloc(NULL, sizeof(struct dbt_data), MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE);
-	if (!(dbt->blocks = (struct dbt_block*)VirtualAlloc(NULL, DBT_BLOCKS_TABLE_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE)))
-		log_error("VirtualAlloc() for dbt_blocks failed.");
-	if (!(dbt->code_cache = (uint8_t*)VirtualAlloc(NULL, DBT_CACHE_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_EXECUTE_READWRITE)))
-		log_error("VirtualAlloc() for dbt_cache failed.");
-	dbt_gen_tables();
-	__writefsdword(dbt_global->tls_dbt_offset, (DWORD)dbt);
+	dbt_thread.cache = NULL;
+	dbt_thread.signal_cache = NULL;
+	dbt_thread.signal_pending = false;
+	dbt_thread.signal_need_fixup = false;
+	/* Allocation granularity is 64KB, which is what the shadow stack needs to be aligned to */
+	dbt_thread.shadow_stack = (struct dbt_shadow_entry *)dbt_host_alloc(DBT_SHADOW_STACK_SIZE, 0);
+	dbt_thread.shadow_stack_top = (volatile DWORD *)(dbt_host_tls_base() + dbt_global->tls_shadow_stack_offset);
+	dbt_thread.handle = NULL;
+	if (cmdline_flags->dbt_profile_dir[0])
+		DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &dbt_thread.handle, 0, FALSE, DUPLICATE_SAME_ACCESS);
+	dbt_lock_exclusive();
+	list_add(&dbt_global->threads, &dbt_thread.list);
+	dbt_unlock_exclusive();
+	InterlockedIncrement(&dbt_global->threads_count);
+	dbt_host_write_tls(dbt_global->tls_dbt_offset, (DWORD)&dbt_thread);
+}
+
+void dbt_exit_thread()
+{
+	dbt_lock_exclusive();
+	dbt_leave();
+	list_remove(&dbt_global->threads, &dbt_thread.list);
+	dbt_unlock_exclusive();
+	dbt_host_free(dbt_thread.shadow_stack, DBT_SHADOW_STACK_SIZE);
+	if (dbt_thread.handle)
+		CloseHandle(dbt_thread.handle);
+	InterlockedDecrement(&dbt_global->threads_count);
+}
+
+void dbt_sample_threads()
+{
+	/* Skip the sample instead of delaying a translating thread */
+	if (!dbt_host_try_lock_shared(&dbt_global->rw_lock))
+		return;
+	struct list_node *cur;
+	list_iterate(&dbt_global->threads, cur)
+	{
+		struct dbt_thread_data *thread = list_entry(cur, struct dbt_thread_data, list);
+		if (!thread->handle || !thread->cache)
+			continue;
+		size_t frames[DBT_PROFILE_MAX_DEPTH];
+		int depth = 0;
+		CONTEXT context;
+		context.ContextFlags = CONTEXT_CONTROL;
+		if (SuspendThread(thread->handle) == (DWORD)-1)
+			continue;
+		if (GetThreadContext(thread->handle, &context))
+		{
+			/* The innermost frame is the block being executed, 0 if the thread is not in translated code */
+			frames[depth++] = 0;
+			struct dbt_data *cache = dbt_find_cache(context.Eip);
+			if (cache && context.Eip < (DWORD)cache->end)
+			{
+				struct dbt_block probe;
+				probe.start = (uint8_t *)context.Eip;
+				struct rb_node *node = rb_upper_bound(&cache->cache_tree, &probe.cache_tree, cache_tree_cmp);
+				if (node && context.Eip < (DWORD)rb_entry(node, struct dbt_block, cache_tree)->end)
+					frames[0] = rb_entry(node, struct dbt_block, cache_tree)->pc;
+			}
+			/* Callers are the return addresses on the shadow stack */
+			size_t top = (*thread->shadow_stack_top - (DWORD)thread->shadow_stack) / sizeof(struct dbt_shadow_entry);
+			for (int i = 0; i < DBT_PROFILE_MAX_DEPTH - 1; i++)
+			{
+				size_t pc = thread->shadow_stack[(top - i) % DBT_SHADOW_STACK_ENTRIES].pc;
+				if (!pc)
+					break;
+				frames[depth++] = pc;
+			}
+		}
+		ResumeThread(thread->handle);
+		if (depth)
+			dbt_profile_add_sample(frames, depth);
+	}
+	dbt_host_unlock_shared(&dbt_global->rw_lock);
+}
+
+void dbt_collect_block_executions()
+{
+	dbt_lock_exclusive();
+	dbt_collect_cache_executions(dbt);
+	for (struct dbt_data *cache = dbt_global->retired_caches; cache; cache = cache->next)
+		dbt_collect_cache_executions(cache);
+	dbt_unlock_exclusive();
 }
 
+static void dbt_background_thread();
+
 void dbt_init()
 {
 	log_info("Initializing dbt subsystem...");
+	dbt_host_lock_init(&dbt_global->rw_lock);
+	dbt_host_lock_init(&dbt_global->code_changed_lock);
+	list_init(&dbt_global->threads);
 	/* Initialize TLS offsets */
 	dbt_global->tls_dbt_offset = tls_kernel_entry_to_offset(TLS_ENTRY_DBT);
 	dbt_global->tls_scratch_offset = tls_kernel_entry_to_offset(TLS_ENTRY_SCRATCH);
@@ -802,11 +1158,29 @@ void dbt_init()
 	dbt_global->tls_return_addr_offset = tls_kernel_entry_to_offset(TLS_ENTRY_RETURN_ADDR);
 	dbt_global->tls_kernel_esp_offset = tls_kernel_entry_to_offset(TLS_ENTRY_KERNEL_ESP);
 	dbt_global->tls_esp_offset = tls_kernel_entry_to_offset(TLS_ENTRY_ESP);
+	dbt_global->tls_shadow_stack_offset = tls_kernel_entry_to_offset(TLS_ENTRY_SHADOW_STACK);
 	/* Generate return trampoline */
-	void *buffer = VirtualAlloc(NULL, PAGE_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_EXECUTE_READWRITE);
+	void *buffer = dbt_host_alloc(PAGE_SIZE, DBT_HOST_EXECUTE | DBT_HOST_TOP_DOWN);
 	dbt_gen_return_trampoline(buffer);
+	x86_decoder_init();
+	dbt_global->xsaveopt = dbt_host_has_xsaveopt();
+	/* Initialize shared code cache */
+	dbt_global->sieve_bits = cmdline_flags->dbt_table_bits? cmdline_flags->dbt_table_bits: DBT_TABLE_MIN_BITS;
+	/* A forked child starts with only the forking thread */
+	dbt_global->gs_base = dbt_host_read_tls(dbt_global->tls_gs_addr_offset);
+	dbt = dbt_alloc_cache();
+	dbt_gen_tables();
 	/* Initialize dbt thread local data for main thread */
 	dbt_init_thread();
+	dbt_persist_init();
+	dbt_profile_init();
+	if (cmdline_flags->dbt_background)
+	{
+		dbt_global->background_event = dbt_host_create_event();
+		int error = dbt_host_start_idle_thread(dbt_background_thread);
+		if (error)
+			log_error("dbt: Background translation thread creation failed, error code: %d.", error);
+	}
 	log_info("dbt subsystem initialized.");
 }
 
@@ -815,35 +1189,282 @@ void dbt_shutdown()
 	/* TODO */
 }
 
-static void dbt_flush()
+/* Switch to an empty code cache, dbt lock must be held exclusively
+ * Other threads may still be executing in the current cache, so it is retired
+ * instead of being overwritten. They switch to the new cache on their next dbt entry.
+ */
+static void dbt_retire_cache()
 {
-	for (int i = 0; i < DBT_BLOCK_HASH_BUCKETS; i++)
-		slist_init(&dbt->block_hash[i]);
+	dbt_save_simd_state();
+	/* The calling thread is inside dbt and will return to the new cache */
+	dbt_leave();
+	dbt->next = dbt_global->retired_caches;
+	dbt_global->retired_caches = dbt;
+	dbt_reclaim_caches();
+	dbt = dbt_alloc_cache();
 	dbt_gen_tables();
-	dbt_flushed = true;
+	dbt_restore_simd_state();
+}
+
+/* Discard all translated code, dbt lock must be held exclusively */
+static void dbt_flush()
+{
+	dbt_retire_cache();
+	dbt_global->flushes_count++;
+	dbt_save_simd_state();
 	log_info("dbt code cache flushed.");
+	dbt_restore_simd_state();
 }
 
 void dbt_reset()
 {
+	dbt_lock_exclusive();
+	/* The new image starts without TLS */
+	dbt_host_write_tls(dbt_global->tls_gs_offset, 0);
+	dbt_host_write_tls(dbt_global->tls_gs_addr_offset, 0);
+	dbt_global->gs_base = 0;
+	dbt_global->gs_base_mixed = false;
+	dbt_flush();
+	/* Pending targets belong to the old image */
+	dbt_global->background_head = dbt_global->background_tail;
+	dbt_unlock_exclusive();
+}
+
+/* Check the gs base of current thread against the one folded into translated code
+ * Must be called whenever the gs base of a thread changes, before it executes translated
+ * code again. dbt lock must be held exclusively. Code translated for another base is
+ * flushed, current thread switches to the new cache on return from dbt. */
+static void dbt_check_gs_base()
+{
+	size_t gs_base = dbt_host_read_tls(dbt_global->tls_gs_addr_offset);
+	if (gs_base == 0 || gs_base == dbt_global->gs_base || dbt_global->gs_base_mixed)
+		return;
+	if (dbt_global->gs_base == 0)
+		dbt_global->gs_base = gs_base;
+	else
+	{
+		dbt_global->gs_base_mixed = true;
+		dbt_save_simd_state();
+		log_info("dbt: Threads with different gs bases, gs base folding disabled.");
+		dbt_restore_simd_state();
+	}
+	dbt_global->gs_base_changes_count++;
 	dbt_flush();
 }
 
 void dbt_code_changed(size_t pc, size_t len)
 {
-	struct dbt_block probe;
-	probe.pc = pc;
-	struct rb_node *node = rb_lower_bound(&dbt->tree, &probe.tree, tree_cmp);
-	if (node == NULL) /* Nothing to do */
+	/* This is called with mm lock held, while a translating thread could be waiting
+	 * for the mm lock in a page fault with dbt lock held. To avoid deadlock we only
+	 * record the range here, the next dbt entry will do the actual work. */
+	dbt_host_lock_exclusive(&dbt_global->code_changed_lock);
+	int i = dbt_global->code_changed_count;
+	if (i < DBT_CODE_CHANGED_MAX_RANGES)
+	{
+		dbt_global->code_changed_start[i] = pc;
+		dbt_global->code_changed_end[i] = pc + len;
+		dbt_global->code_changed_count++;
+	}
+	else
+	{
+		/* Too many pending ranges, merge into the last one */
+		i--;
+		if (pc < dbt_global->code_changed_start[i])
+			dbt_global->code_changed_start[i] = pc;
+		if (pc + len > dbt_global->code_changed_end[i])
+			dbt_global->code_changed_end[i] = pc + len;
+	}
+	dbt_global->code_changed_pending = true;
+	dbt_host_unlock_exclusive(&dbt_global->code_changed_lock);
+}
+
+/* Drop translated return addresses into invalidated blocks from shadow stacks of all threads
+ * dbt lock must be held exclusively. Threads in retired caches are left alone, the same as
+ * their code which is not invalidated either. */
+static void dbt_scrub_shadow_stacks()
+{
+	struct list_node *cur;
+	list_iterate(&dbt_global->threads, cur)
+	{
+		struct dbt_thread_data *thread = list_entry(cur, struct dbt_thread_data, list);
+		for (int i = 0; i < DBT_SHADOW_STACK_ENTRIES; i++)
+		{
+			uint8_t *target = thread->shadow_stack[i].target;
+			if (target == dbt->return_fallback_trampoline || !dbt_in_cache(dbt, (size_t)target))
+				continue;
+			struct dbt_block probe;
+			probe.start = target;
+			struct rb_node *node = rb_upper_bound(&dbt->cache_tree, &probe.cache_tree, cache_tree_cmp);
+			if (node && rb_entry(node, struct dbt_block, cache_tree)->invalidated)
+				thread->shadow_stack[i].target = dbt->return_fallback_trampoline;
+		}
+	}
+}
+
+static void dbt_invalidate_block(struct dbt_block *block);
+/* Process code changes reported by dbt_code_changed(), dbt lock must be held exclusively
+ * Only blocks overlapping the changed ranges are invalidated, other blocks are kept
+ * If can_flush is false and the code cache runs out of space, the remaining ranges are left
+ * for the next dbt entry. */
+static void dbt_handle_code_changed(bool can_flush)
+{
+	if (!dbt_global->code_changed_pending)
 		return;
-	struct dbt_block *block = rb_entry(node, struct dbt_block, tree);
-	if (block->pc <= pc + len)
+	size_t start[DBT_CODE_CHANGED_MAX_RANGES], end[DBT_CODE_CHANGED_MAX_RANGES];
+	dbt_host_lock_exclusive(&dbt_global->code_changed_lock);
+	int count = dbt_global->code_changed_count;
+	for (int i = 0; i < count; i++)
+	{
+		start[i] = dbt_global->code_changed_start[i];
+		end[i] = dbt_global->code_changed_end[i];
+	}
+	dbt_global->code_changed_count = 0;
+	dbt_global->code_changed_pending = false;
+	dbt_host_unlock_exclusive(&dbt_global->code_changed_lock);
+
+	int invalidated = 0;
+	for (int i = 0; i < count; i++)
+	{
+		/* A block starting before the range may still extend into it */
+		struct dbt_block probe;
+		probe.pc = start[i] > dbt->max_block_span? start[i] - dbt->max_block_span: 0;
+		struct rb_node *node = rb_lower_bound(&dbt->tree, &probe.tree, tree_cmp);
+		while (node)
+		{
+			struct dbt_block *block = rb_entry(node, struct dbt_block, tree);
+			if (block->pc >= end[i])
+				break;
+			node = rb_next(node);
+			if (block->end_pc <= start[i])
+				continue;
+			if (dbt->end - dbt->out < DBT_BLOCK_MAXSIZE)
+			{
+				if (!can_flush)
+				{
+					for (int j = i; j < count; j++)
+						dbt_code_changed(start[j], end[j] - start[j]);
+					goto done;
+				}
+				/* No space left for redirecting the block entries, flush all code cache */
+				dbt_save_simd_state();
+				log_info("DBT block at [%p, %p) changed. No space left, flushing code cache.", start[i], end[i]);
+				dbt_restore_simd_state();
+				dbt_flush();
+				return;
+			}
+			dbt_invalidate_block(block);
+			invalidated++;
+		}
+	}
+done:
+	if (invalidated)
+	{
+		dbt_scrub_shadow_stacks();
+		dbt_global->invalidations_count++;
+		dbt_global->invalidated_blocks_count += invalidated;
+		if (cmdline_flags->dbt_trace)
+		{
+			dbt_save_simd_state();
+			log_debug("dbt: %d blocks invalidated due to code change.", invalidated);
+			dbt_restore_simd_state();
+		}
+	}
+}
+
+void dbt_code_written(size_t pc, size_t len)
+{
+	InterlockedIncrement(&dbt_global->code_write_faults_count);
+	dbt_code_changed(pc, len);
+	/* Translations of the page can be reached through linked branches without entering dbt,
+	 * so they are invalidated right away. The writing thread may be executing in the code
+	 * cache which must not be flushed under it, a flush is left to its next dbt entry. */
+	dbt_lock_exclusive();
+	dbt_handle_code_changed(false);
+	dbt_unlock_exclusive();
+}
+
+static uint8_t *dbt_sieve_next_bucket(uint8_t *sieve);
+int dbt_get_stats(char *buf)
+{
+	char *original_buf = buf;
+	dbt_lock_shared();
+	int committed_caches = dbt_global->caches_count - dbt_global->free_caches_count;
+	buf += ksprintf(buf, "threads %d\n", dbt_global->threads_count);
+	buf += ksprintf(buf, "translated_blocks %d\n", dbt_global->translated_blocks_count);
+	buf += ksprintf(buf, "cached_blocks %d\n", dbt->blocks_count - dbt->invalidated_blocks_count);
+	buf += ksprintf(buf, "flushes %d\n", dbt_global->flushes_count);
+	buf += ksprintf(buf, "invalidations %d\n", dbt_global->invalidations_count);
+	buf += ksprintf(buf, "invalidated_blocks %d\n", dbt_global->invalidated_blocks_count);
+	buf += ksprintf(buf, "evictions %d\n", dbt_global->evictions_count);
+	buf += ksprintf(buf, "evicted_blocks %d\n", dbt_global->evicted_blocks_count);
+	buf += ksprintf(buf, "evict_kept_blocks %d\n", dbt_global->evict_kept_blocks_count);
+	buf += ksprintf(buf, "superblocks %d\n", dbt_global->superblocks_count);
+	buf += ksprintf(buf, "inline_caches %d\n", dbt->inline_caches_count);
+	buf += ksprintf(buf, "inline_cache_entries %d\n", dbt_global->inline_cache_entries_count);
+	buf += ksprintf(buf, "megamorphic_sites %d\n", dbt_global->megamorphic_sites_count);
+	buf += ksprintf(buf, "sieve_trims %d\n", dbt_global->sieve_trims_count);
+	buf += ksprintf(buf, "sieve_entries %d\n", 1 << dbt->sieve_bits);
+	buf += ksprintf(buf, "sieve_grows %d\n", dbt_global->sieve_grows_count);
+	buf += ksprintf(buf, "sieve_max_chain %d\n", dbt_global->sieve_max_chain);
+	/* Number of buckets of the current sieve table by chain length */
+	int chains[DBT_SIEVE_MAX_CHAIN + 1] = { 0 };
+	for (int i = 0; i < (1 << dbt->sieve_bits); i++)
+	{
+		int length = 0;
+		for (uint8_t *current = dbt->sieve_table[i]; current != (void*)&dbt_sieve_fallback && length < DBT_SIEVE_MAX_CHAIN;
+			current = dbt_sieve_next_bucket(current))
+			length++;
+		chains[length]++;
+	}
+	for (int i = 1; i <= DBT_SIEVE_MAX_CHAIN; i++)
+		if (chains[i])
+			buf += ksprintf(buf, "sieve_chain_%d %d\n", i, chains[i]);
+	buf += ksprintf(buf, "return_mispredicts %d\n", dbt_global->return_mispredicts_count);
+	buf += ksprintf(buf, "code_write_faults %d\n", dbt_global->code_write_faults_count);
+	buf += ksprintf(buf, "checked_blocks %d\n", dbt_global->checked_blocks_count);
+	buf += ksprintf(buf, "code_checks %d\n", dbt_global->code_checks_count);
+	buf += ksprintf(buf, "code_check_misses %d\n", dbt_global->code_check_misses_count);
+	buf += ksprintf(buf, "direct_lookups %d\n", dbt_global->direct_lookups_count);
+	buf += ksprintf(buf, "indirect_lookups %d\n", dbt_global->indirect_lookups_count);
+	buf += ksprintf(buf, "gs_folded_modrm %d\n", dbt_global->gs_folded_modrm_count);
+	buf += ksprintf(buf, "gs_folded_moffset %d\n", dbt_global->gs_folded_moffset_count);
+	buf += ksprintf(buf, "gs_generic %d\n", dbt_global->gs_generic_count);
+	buf += ksprintf(buf, "gs_base_changes %d\n", dbt_global->gs_base_changes_count);
+	buf += ksprintf(buf, "translated_source_bytes %llu\n", dbt_global->translated_source_bytes);
+	buf += ksprintf(buf, "translated_code_bytes %llu\n", dbt_global->translated_code_bytes);
+	buf += ksprintf(buf, "translate_cycles %llu\n", dbt_global->translate_cycles);
+	for (int i = 0; i < DBT_HANDLER_TYPES; i++)
+	{
+		if (!dbt_global->handler_instructions_count[i])
+			continue;
+		buf += ksprintf(buf, "%s_instructions %d\n", get_handler_type_name(i), dbt_global->handler_instructions_count[i]);
+		buf += ksprintf(buf, "%s_code_bytes %llu\n", get_handler_type_name(i), dbt_global->handler_code_bytes[i]);
+	}
+	buf += ksprintf(buf, "code_caches %d\n", dbt_global->caches_count);
+	buf += ksprintf(buf, "code_caches_committed %d\n", committed_caches);
+	buf += ksprintf(buf, "code_cache_users %d\n", dbt->users);
+	buf += ksprintf(buf, "code_cache_used_bytes %d\n", (int)((dbt->out - dbt->code_cache) + (dbt->code_cache + DBT_CACHE_SIZE - dbt->end) - (dbt->hot_end - dbt->hot_out)));
+	buf += ksprintf(buf, "committed_kbytes %d\n", committed_caches * (int)((DBT_CACHE_SIZE + DBT_BLOCKS_TABLE_SIZE) / 1024));
+	dbt_unlock_shared();
+	return buf - original_buf;
+}
+
+#define DBT_INLINE_CACHE_STATS_MAX_SITES	1024 /* Keep the output within a query buffer */
+int dbt_get_inline_cache_stats(char *buf)
+{
+	char *original_buf = buf;
+	dbt_lock_shared();
+	buf += ksprintf(buf, "pc executions misses targets megamorphic\n");
+	int count = dbt->inline_caches_count;
+	if (count > DBT_INLINE_CACHE_STATS_MAX_SITES)
+		count = DBT_INLINE_CACHE_STATS_MAX_SITES;
+	for (int i = 0; i < count; i++)
 	{
-		/* Bad, cached code changed. Flush all code cache for safety. */
-		/* TODO: Take care of signal/thread safety */
-		log_info("DBT block at [%p, %p) changed. Code cache flushed.", pc, pc + len);
-		dbt_flush();
+		struct dbt_inline_cache *ic = &dbt->inline_caches[i];
+		buf += ksprintf(buf, "%p %u %u %d %d\n", ic->pc, ic->executions, ic->misses, ic->entries, ic->megamorphic);
 	}
+	dbt_unlock_shared();
+	return buf - original_buf;
 }
 
 static int hash_block_pc(size_t pc)
@@ -870,55 +1491,133 @@ static struct dbt_block *find_block(size_t pc)
 	return NULL;
 }
 
-static void dbt_gen_sieve_dispatch()
+static struct dbt_block *dbt_translate(struct dbt_data *cache, size_t pc, bool superblock, struct syscall_context *context);
+/* Make room in a full code cache, dbt lock must be held exclusively
+ * Translated code runs without synchronization, so code cache space can only be reused
+ * after the whole cache is retired. Eviction is therefore done by generation: the cache
+ * is retired and the youngest blocks in FIFO order are retranslated into the new cache,
+ * which usually covers the current working set. Older blocks are dropped.
+ * The block at pc is about to be translated by the caller and is skipped.
+ */
+static void dbt_evict(size_t pc)
 {
-	uint8_t *out;
-	out = (uint8_t*)ALIGN_TO(dbt->out, DBT_OUT_ALIGN);
-	dbt->sieve_dispatch_trampoline = out;
-
-	/* The destination address should be pushed on the stack */
-	/* push ecx (1 byte) */
-	gen_byte(&out, 0x51);
-	dbt->return_fallback_trampoline = out;
+	struct dbt_data *old = dbt;
+	/* Keep the retired cache committed while we read its blocks */
+	InterlockedIncrement(&old->users);
+	dbt_retire_cache();
+	int kept = 0;
+	for (int i = old->blocks_count - old->blocks_count / DBT_EVICT_KEEP_DIVISOR; i < old->blocks_count; i++)
+	{
+		struct dbt_block *old_block = &old->blocks[i];
+		if (old_block->invalidated || old_block->pc == pc || find_block(old_block->pc))
+			continue;
+		/* Never let keeping old blocks cause another eviction */
+		if (dbt->end - dbt->out < DBT_CACHE_SIZE / 2)
+			break;
+		/* The code may have been unmapped since */
+		if (!mm_check_read((void *)old_block->pc, old_block->end_pc - old_block->pc))
+			continue;
+		struct dbt_block *block = dbt_translate(dbt, old_block->pc, old_block->superblock, NULL);
+		slist_add(&dbt->block_hash[hash_block_pc(block->pc)], &block->list);
+		kept++;
+	}
+	InterlockedDecrement(&old->users);
+	dbt_global->evictions_count++;
+	dbt_global->evicted_blocks_count += old->blocks_count - old->invalidated_blocks_count - kept;
+	dbt_global->evict_kept_blocks_count += kept;
+	dbt_save_simd_state();
+	log_info("dbt code cache full, %d blocks evicted, %d blocks kept.", old->blocks_count - old->invalidated_blocks_count - kept, kept);
+	dbt_restore_simd_state();
+}
 
-	/* movzx ecx, word ptr [esp+4] (5 bytes) */
-	gen_byte(&out, 0x0F); gen_byte(&out, 0xB7); gen_byte(&out, 0x4C);
+/* Turn the zero extended low word of the pc in ecx into an index of a table of 2^bits entries
+ * A 16-bit lea shifts out the unused high bits without touching eflags, the table is
+ * then accessed with a scale of TABLE_INDEX_SCALE(bits) to make up for the shift. */
+#define TABLE_INDEX_SCALE(bits)		(MODRM_SCALE_4 - (16 - (bits)))
+static void gen_table_index(uint8_t **out, int bits)
+{
+	if (bits < 16)
+	{
+		/* lea cx, word ptr [ecx*(1 << (16 - bits))] (8 bytes) */
+		gen_byte(out, 0x66); gen_byte(out, 0x8D); gen_byte(out, 0x0C);
+		gen_byte(out, ((16 - bits) << 6) | 0x0D);
+		gen_dword(out, 0);
+	}
+}
+
+/* Generate the sieve table lookup shared by the dispatch trampolines
+ * The destination address and original value of ECX should be pushed on the stack */
+static uint8_t *dbt_gen_sieve_dispatch_body()
+{
+	/* Caution: we must ensure that this stub fits in DBT_TRAMPOLINE_ALIGN bytes */
+	dbt->end -= DBT_TRAMPOLINE_ALIGN;
+	uint8_t *out = dbt->end;
+	/* movzx ecx, word ptr [esp+4] (5 bytes) */
+	gen_byte(&out, 0x0F); gen_byte(&out, 0xB7); gen_byte(&out, 0x4C);
 	gen_byte(&out, 0x24); gen_byte(&out, 0x04);
-	/* jmp dword ptr [ecx*4+sieve_table] (7 bytes) */
-	gen_byte(&out, 0xFF); gen_byte(&out, 0x24); gen_byte(&out, 0x8D);
+	/* lea cx, word ptr [ecx*scale] (0 or 8 bytes) */
+	gen_table_index(&out, dbt->sieve_bits);
+	/* jmp dword ptr [ecx*scale+sieve_table] (7 bytes) */
+	gen_byte(&out, 0xFF); gen_byte(&out, 0x24);
+	gen_byte(&out, (TABLE_INDEX_SCALE(dbt->sieve_bits) << 6) | 0x0D);
 	gen_dword(&out, (uint32_t)dbt->sieve_table);
-	/* Total: 13 bytes */
+	/* Total: 20 bytes at most */
+	return dbt->end;
+}
+
+/* Offsets of the jump to the lookup body in the dispatch trampolines */
+#define DBT_SIEVE_DISPATCH_BODY_OFFSET		2
+#define DBT_SIEVE_CALL_DISPATCH_BODY_OFFSET	4
+static void dbt_gen_sieve_dispatch()
+{
+	/* Fill out sieve_table */
+	for (int i = 0; i < (1 << dbt->sieve_bits); i++)
+		dbt->sieve_table[i] = (uint8_t*)&dbt_sieve_fallback;
+	uint8_t *body = dbt_gen_sieve_dispatch_body();
+
+	/* The jump to the body is patched when the sieve table grows, so the trampolines
+	 * are aligned to never cross a cache line */
+	uint8_t *out;
+	out = (uint8_t*)ALIGN_TO(dbt->out, DBT_TRAMPOLINE_ALIGN);
+	dbt->sieve_dispatch_trampoline = out;
+
+	/* The destination address should be pushed on the stack */
+	/* push ecx (1 byte) */
+	gen_byte(&out, 0x51);
+	dbt->return_fallback_trampoline = out;
+
+	/* jmp body (5 bytes) */
+	gen_jmp(&out, body);
+	/* Total: 6 bytes */
 
 	dbt->out = out;
 
-	out = (uint8_t*)ALIGN_TO(dbt->out, DBT_OUT_ALIGN);
+	out = (uint8_t*)ALIGN_TO(dbt->out, DBT_TRAMPOLINE_ALIGN);
 	dbt->sieve_indirect_call_dispatch_trampoline = out;
 
 	/* there is a dummy return address on stack, replace it */
 	/* mov dword ptr [esp], ecx (3 bytes) */
 	gen_byte(&out, 0x89); gen_byte(&out, 0x0C); gen_byte(&out, 0x24);
-	/* movzx ecx, word ptr [esp+4] (5 bytes) */
-	gen_byte(&out, 0x0F); gen_byte(&out, 0xB7); gen_byte(&out, 0x4C);
-	gen_byte(&out, 0x24); gen_byte(&out, 0x04);
-	/* jmp dword ptr [ecx*4+sieve_table] (7 bytes) */
-	gen_byte(&out, 0xFF); gen_byte(&out, 0x24); gen_byte(&out, 0x8D);
-	gen_dword(&out, (uint32_t)dbt->sieve_table);
-	/* Total: 15 bytes */
+	/* jmp body (5 bytes) */
+	gen_jmp(&out, body);
+	/* Total: 8 bytes */
 
 	dbt->out = out;
+}
 
-	/* Fill out sieve_table */
-	for (int i = 0; i < DBT_SIEVE_ENTRIES; i++)
-		dbt->sieve_table[i] = (uint8_t*)&dbt_sieve_fallback;
+static void dbt_sieve_dispatch_set_body(uint8_t *trampoline, int offset, uint8_t *body)
+{
+	uint8_t *body_rel = body - (size_t)(trampoline + offset + sizeof(size_t));
+	InterlockedExchange((volatile LONG *)&trampoline[offset], (LONG)body_rel);
 }
 
-static bool dbt_sieve_dispatch_fixup(struct syscall_context *context)
+static bool dbt_sieve_dispatch_fixup(struct dbt_data *cache, struct syscall_context *context)
 {
 	/* Test sieve_dispatch_trampoline */
-	if (context->eip >= (DWORD)dbt->sieve_dispatch_trampoline &&
-		context->eip < (DWORD)dbt->sieve_dispatch_trampoline + 13)
+	if (context->eip >= (DWORD)cache->sieve_dispatch_trampoline &&
+		context->eip < (DWORD)cache->sieve_dispatch_trampoline + 6)
 	{
-		DWORD offset = context->eip - (DWORD)dbt->sieve_dispatch_trampoline;
+		DWORD offset = context->eip - (DWORD)cache->sieve_dispatch_trampoline;
 		if (offset == 0)
 		{
 			context->eip = *(DWORD *)context->esp;
@@ -933,10 +1632,10 @@ static bool dbt_sieve_dispatch_fixup(struct syscall_context *context)
 		return true;
 	}
 	/* Test sieve_indirect_call_dispatch_trampoline */
-	if (context->eip >= (DWORD)dbt->sieve_indirect_call_dispatch_trampoline &&
-		context->eip < (DWORD)dbt->sieve_indirect_call_dispatch_trampoline + 15)
+	if (context->eip >= (DWORD)cache->sieve_indirect_call_dispatch_trampoline &&
+		context->eip < (DWORD)cache->sieve_indirect_call_dispatch_trampoline + 8)
 	{
-		DWORD offset = context->eip - (DWORD)dbt->sieve_indirect_call_dispatch_trampoline;
+		DWORD offset = context->eip - (DWORD)cache->sieve_indirect_call_dispatch_trampoline;
 		if (offset > 0)
 			context->ecx = *(DWORD *)context->esp;
 		context->eip = *(DWORD *)(context->esp + 4);
@@ -946,14 +1645,31 @@ static bool dbt_sieve_dispatch_fixup(struct syscall_context *context)
 	return false;
 }
 
+static bool dbt_sieve_dispatch_body_fixup(struct syscall_context *context)
+{
+	DWORD t = context->eip & -DBT_TRAMPOLINE_ALIGN;
+	if (*(uint8_t *)t == 0x0F)
+	{
+		context->ecx = *(DWORD *)context->esp;
+		context->eip = *(DWORD *)(context->esp + 4);
+		context->esp += 8;
+		return true;
+	}
+	return false;
+}
+
 /* Trampoline signature
  * SIEVE:   0x8B
+ * SIEVE DISPATCH: 0x0F
  * DIRECT:  0x68
  * CALL:    0x8D
+ * LOOP:    0x9C (0xFF if flags are dead at the target)
+ * INLINE CACHE: 0x51
  */
 /* When the code is inside a trampoline, we can use the first byte of the
  * block to determine the type of that trampoline
  */
+#define DBT_SIEVE_PC_OFFSET				6
 #define DBT_SIEVE_NEXT_BUCKET_OFFSET		13
 static uint8_t *dbt_gen_sieve(size_t original_pc, uint8_t *target)
 {
@@ -985,6 +1701,88 @@ static uint8_t *dbt_gen_sieve(size_t original_pc, uint8_t *target)
 	return dbt->end;
 }
 
+static uint8_t *dbt_sieve_next_bucket(uint8_t *sieve)
+{
+	uint8_t *next_bucket_rel = *(uint8_t**)&sieve[DBT_SIEVE_NEXT_BUCKET_OFFSET];
+	return next_bucket_rel + (size_t)(sieve + DBT_SIEVE_NEXT_BUCKET_OFFSET + sizeof(size_t));
+}
+
+static void dbt_sieve_set_next_bucket(uint8_t *sieve, uint8_t *next_bucket)
+{
+	uint8_t *next_bucket_rel = next_bucket - (size_t)(sieve + DBT_SIEVE_NEXT_BUCKET_OFFSET + sizeof(size_t));
+	/* The sieve stub never crosses a cache line, so this is atomic to other threads */
+	InterlockedExchange((volatile LONG *)&sieve[DBT_SIEVE_NEXT_BUCKET_OFFSET], (LONG)next_bucket_rel);
+}
+
+/* Remove sieve stubs of the given pc from the sieve table
+ * A thread currently inside a removed stub still follows its next bucket pointer */
+static void dbt_unlink_sieve(size_t pc)
+{
+	int hash = SIEVE_HASH(dbt, pc);
+	uint8_t *prev = NULL;
+	uint8_t *current = dbt->sieve_table[hash];
+	while (current != (void*)&dbt_sieve_fallback)
+	{
+		uint8_t *next_bucket = dbt_sieve_next_bucket(current);
+		if (*(size_t *)&current[DBT_SIEVE_PC_OFFSET] == -pc)
+		{
+			if (prev)
+				dbt_sieve_set_next_bucket(prev, next_bucket);
+			else
+				InterlockedExchangePointer((PVOID *)&dbt->sieve_table[hash], next_bucket);
+		}
+		else
+			prev = current;
+		current = next_bucket;
+	}
+}
+
+/* Double the size of the sieve table, dbt lock must be held exclusively
+ * The new table is published by redirecting the dispatch trampolines to a new lookup
+ * body. Threads still inside the old body look up the old table, whose buckets remain
+ * valid: sieve stubs are only relinked to later stubs of the same bucket, and a stub
+ * missing from a bucket just ends up in dbt_sieve_fallback().
+ */
+static void dbt_grow_sieve()
+{
+	int old_bits = dbt->sieve_bits;
+	size_t size = sizeof(uint8_t*) << (old_bits + 1);
+	if (old_bits == DBT_TABLE_MAX_BITS || dbt->end - dbt->out < (ptrdiff_t)(size + DBT_TRAMPOLINE_ALIGN + DBT_BLOCK_MAXSIZE))
+		return;
+	uint8_t **old_table = dbt->sieve_table;
+	uint8_t **new_table = (uint8_t**)ALIGN_TO(dbt->out, DBT_OUT_ALIGN);
+	dbt->out = (uint8_t*)new_table + size;
+	for (int i = 0; i < (2 << old_bits); i++)
+		new_table[i] = (uint8_t*)&dbt_sieve_fallback;
+	for (int i = 0; i < (1 << old_bits); i++)
+	{
+		/* Buckets are at most DBT_SIEVE_MAX_CHAIN long, link them back to front to keep the order */
+		uint8_t *chain[DBT_SIEVE_MAX_CHAIN];
+		int length = 0;
+		for (uint8_t *current = old_table[i]; current != (void*)&dbt_sieve_fallback && length < DBT_SIEVE_MAX_CHAIN;
+			current = dbt_sieve_next_bucket(current))
+			chain[length++] = current;
+		for (int j = length - 1; j >= 0; j--)
+		{
+			size_t pc = -*(size_t *)&chain[j][DBT_SIEVE_PC_OFFSET];
+			int hash = pc & ((2 << old_bits) - 1);
+			dbt_sieve_set_next_bucket(chain[j], new_table[hash]);
+			new_table[hash] = chain[j];
+		}
+	}
+	dbt->sieve_table = new_table;
+	dbt->sieve_bits = old_bits + 1;
+	uint8_t *body = dbt_gen_sieve_dispatch_body();
+	dbt_sieve_dispatch_set_body(dbt->sieve_dispatch_trampoline, DBT_SIEVE_DISPATCH_BODY_OFFSET, body);
+	dbt_sieve_dispatch_set_body(dbt->sieve_indirect_call_dispatch_trampoline, DBT_SIEVE_CALL_DISPATCH_BODY_OFFSET, body);
+	/* Later code caches start with the grown size */
+	if (dbt_global->sieve_bits < dbt->sieve_bits)
+		dbt_global->sieve_bits = dbt->sieve_bits;
+	dbt_global->sieve_grows_count++;
+	if (cmdline_flags->dbt_trace)
+		log_info("dbt: sieve table grown to %d entries.", 1 << dbt->sieve_bits);
+}
+
 static bool dbt_sieve_fixup(struct syscall_context *context)
 {
 	DWORD t = context->eip & -DBT_TRAMPOLINE_ALIGN;
@@ -1009,8 +1807,157 @@ static bool dbt_sieve_fixup(struct syscall_context *context)
 	return false;
 }
 
+#define DBT_INLINE_CACHE_FIRST_OFFSET	17
+/* Generate the dispatch stub of an inline cache for the indirect branch at pc
+ * Returns NULL if no more inline caches are available */
+static uint8_t *dbt_gen_inline_cache(size_t pc)
+{
+	if (cmdline_flags->dbt_trace_all || dbt->inline_caches_count == DBT_INLINE_CACHE_SITES)
+		return NULL;
+	struct dbt_inline_cache *ic = &dbt->inline_caches[dbt->inline_caches_count++];
+	/* The destination address should be pushed on the stack */
+	/* Caution: we must ensure that this stub fits in DBT_TRAMPOLINE_ALIGN bytes */
+	dbt->end -= DBT_TRAMPOLINE_ALIGN;
+	uint8_t *out = dbt->end;
+	ic->pc = pc;
+	ic->head = out;
+	ic->last_entry = NULL;
+	ic->executions = 0;
+	ic->misses = 0;
+	ic->entries = 0;
+	ic->megamorphic = false;
+	/* push ecx (1 byte) */
+	gen_byte(&out, 0x51);
+	/* mov ecx, dword ptr [executions] (6 bytes) */
+	gen_byte(&out, 0x8B); gen_byte(&out, 0x0D);
+	gen_dword(&out, (uint32_t)&ic->executions);
+	/* lea ecx, dword ptr [ecx + 1] (3 bytes) */
+	gen_byte(&out, 0x8D); gen_byte(&out, 0x49); gen_byte(&out, 0x01);
+	/* mov dword ptr [executions], ecx (6 bytes) */
+	gen_byte(&out, 0x89); gen_byte(&out, 0x0D);
+	gen_dword(&out, (uint32_t)&ic->executions);
+	/* jmp first_entry (5 bytes), initially the miss path */
+	gen_jmp(&out, out + 5);
+	/* patch offset: 1+6+3+6+1=17 bytes */
+
+	/* miss: */
+	/* push ic (5 bytes) */
+	gen_byte(&out, 0x68);
+	gen_dword(&out, (uint32_t)ic);
+	/* jmp dbt_inline_cache_miss_internal (5 bytes) */
+	gen_jmp(&out, (void*)dbt_inline_cache_miss_internal);
+	/* Total: 31 bytes */
+
+	return ic->head;
+}
+
+static uint8_t *dbt_inline_cache_first(struct dbt_inline_cache *ic)
+{
+	uint8_t *first_rel = *(uint8_t**)&ic->head[DBT_INLINE_CACHE_FIRST_OFFSET];
+	return first_rel + (size_t)(ic->head + DBT_INLINE_CACHE_FIRST_OFFSET + sizeof(size_t));
+}
+
+static void dbt_inline_cache_set_first(struct dbt_inline_cache *ic, uint8_t *first)
+{
+	uint8_t *first_rel = first - (size_t)(ic->head + DBT_INLINE_CACHE_FIRST_OFFSET + sizeof(size_t));
+	/* The stub never crosses a cache line, so this is atomic to other threads */
+	InterlockedExchange((volatile LONG *)&ic->head[DBT_INLINE_CACHE_FIRST_OFFSET], (LONG)first_rel);
+}
+
+static bool dbt_inline_cache_fixup(struct syscall_context *context)
+{
+	DWORD t = context->eip & -DBT_TRAMPOLINE_ALIGN;
+	if (*(uint8_t *)t == 0x51)
+	{
+		DWORD offset = context->eip - t;
+		if (offset == 0) /* Rollback jumping */
+		{
+			context->eip = *(DWORD *)context->esp;
+			context->esp += 4;
+		}
+		else if (offset <= 21) /* ecx is on the stack, rollback jumping */
+		{
+			context->ecx = *(DWORD *)context->esp;
+			context->eip = *(DWORD *)(context->esp + 4);
+			context->esp += 8;
+		}
+		else if (offset == 26) /* ecx and the inline cache are on the stack */
+		{
+			context->ecx = *(DWORD *)(context->esp + 4);
+			context->eip = *(DWORD *)(context->esp + 8);
+			context->esp += 12;
+		}
+		return true;
+	}
+	return false;
+}
+
+/* Queue a newly discovered direct branch target for the background translation thread
+ * dbt lock must be held exclusively */
+static void dbt_queue_background(size_t pc)
+{
+	int tail = (dbt_global->background_tail + 1) & (DBT_BACKGROUND_QUEUE_SIZE - 1);
+	if (tail == dbt_global->background_head)
+	{
+		/* The thread cannot keep up, the target will be translated on demand */
+		return;
+	}
+	dbt_global->background_queue[dbt_global->background_tail] = pc;
+	dbt_global->background_tail = tail;
+	if (!dbt_global->background_signaled)
+	{
+		dbt_global->background_signaled = true;
+		dbt_save_simd_state();
+		dbt_host_set_event(dbt_global->background_event);
+		dbt_restore_simd_state();
+	}
+}
+
+/* Record a field of a staged block which depends on where it is copied to */
+static void dbt_stage_reloc(uint8_t *field, int type)
+{
+	if (!dbt_staging)
+		return;
+	if (dbt_staging->relocs_count == DBT_STAGING_MAX_RELOCS)
+	{
+		dbt_staging->overflow = true;
+		return;
+	}
+	struct dbt_staging_reloc *reloc = &dbt_staging->relocs[dbt_staging->relocs_count++];
+	reloc->offset = (uint16_t)(field - dbt_staging->buffer);
+	reloc->type = type;
+}
+
+static void dbt_stage_branch(uint8_t *rel, size_t dest)
+{
+	/* Branches inside the block and placeholders of links stay valid when the block is copied */
+	if (dest >= (size_t)dbt_staging->buffer && dest <= (size_t)dbt_staging->buffer + DBT_STAGING_SIZE)
+		return;
+	dbt_stage_reloc(rel, DBT_RELOC_BRANCH);
+}
+
+/* Record a patchable branch of a staged block, its target is created on publish
+ * Returns a placeholder target, the end of the branch instruction */
+static uint8_t *dbt_stage_link(int type, size_t patch_addr, size_t target, size_t segment_pc, size_t source_pc)
+{
+	if (dbt_staging->links_count == DBT_STAGING_MAX_LINKS)
+		dbt_staging->overflow = true;
+	else
+	{
+		struct dbt_staging_link *link = &dbt_staging->links[dbt_staging->links_count++];
+		link->offset = (uint16_t)((uint8_t *)patch_addr - dbt_staging->buffer);
+		link->type = type;
+		link->target = target;
+		link->segment_pc = segment_pc;
+		link->source_pc = source_pc;
+	}
+	return (uint8_t *)patch_addr + 4;
+}
+
 static uint8_t *dbt_get_direct_trampoline(size_t target, size_t patch_addr)
 {
+	if (dbt_staging)
+		return dbt_stage_link(DBT_LINK_DIRECT, patch_addr, target, 0, 0);
 	struct dbt_block *cached_block = find_block(target);
 	if (cached_block)
 		return cached_block->start;
@@ -1028,9 +1975,40 @@ static uint8_t *dbt_get_direct_trampoline(size_t target, size_t patch_addr)
 	/* jmp dbt_find_direct_internal (5 bytes) */
 	gen_jmp(&out, (void*)dbt_find_direct_internal);
 
+	if (dbt_global->background_event)
+		dbt_queue_background(target);
 	return dbt->end;
 }
 
+/* Unlink a block whose source code has changed, dbt lock must be held exclusively
+ * Other threads may be executing the block, so its code is left in place until the
+ * cache is retired. Instead all ways to enter the block are cut off.
+ */
+static void dbt_invalidate_block(struct dbt_block *block)
+{
+	/* Remove from lookup structures, the block stays in cache_tree for context fixup */
+	slist_iterate(&dbt->block_hash[hash_block_pc(block->pc)], prev, cur)
+	{
+		if (cur == &block->list)
+		{
+			slist_remove(prev, cur);
+			break;
+		}
+	}
+	rb_remove(&dbt->tree, &block->tree);
+	dbt_unlink_sieve(block->pc);
+	/* Turn the patchable entry into a jump to a direct trampoline, this redirects all
+	 * direct jumps linked to the block. The trampoline will patch the jump again to the
+	 * retranslated block. The entry is 8-byte aligned and written in one go. */
+	uint8_t *trampoline = dbt_get_direct_trampoline(block->pc, (size_t)block->start + 1);
+	LONGLONG entry = *(LONGLONG *)block->start;
+	entry = (entry & 0xFFFFFF0000000000LL) | 0xE9
+		| ((LONGLONG)(uint32_t)(trampoline - (block->start + DBT_BLOCK_ENTRY_SIZE)) << 8);
+	InterlockedExchange64((volatile LONGLONG *)block->start, entry);
+	block->invalidated = true;
+	dbt->invalidated_blocks_count++;
+}
+
 static bool dbt_direct_trampoline_fixup(struct syscall_context *context)
 {
 	DWORD t = context->eip & -DBT_TRAMPOLINE_ALIGN;
@@ -1048,8 +2026,215 @@ static bool dbt_direct_trampoline_fixup(struct syscall_context *context)
 	return false;
 }
 
-static uint8_t *dbt_get_direct_call_trampoline(size_t target)
+/* Maximum number of instructions scanned by the liveness analyses */
+#define DBT_LIVENESS_LOOKAHEAD		8
+
+/* Effect of an instruction on the arithmetic flags */
+#define FLAGS_UNKNOWN		0 /* May read the flags */
+#define FLAGS_NONE			1 /* Neither reads nor writes the flags */
+#define FLAGS_WRITE			2 /* Overwrites all status flags without reading them */
+static int get_flags_usage(struct instruction_t *ins)
+{
+	if (!ins->escape_0x0f)
+	{
+		uint8_t op = ins->opcode;
+		/* add, or, adc, sbb, and, sub, xor, cmp in all their 0x00-0x3D forms */
+		if (op < 0x40 && (op & 7) < 6)
+			return (op >> 3) == 2 || (op >> 3) == 3? FLAGS_UNKNOWN: FLAGS_WRITE; /* adc, sbb */
+		if (op >= 0x80 && op <= 0x83) /* Immediate group 1 */
+			return ins->r == 2 || ins->r == 3? FLAGS_UNKNOWN: FLAGS_WRITE;
+		if (op == 0x84 || op == 0x85 || op == 0xA8 || op == 0xA9) /* test */
+			return FLAGS_WRITE;
+		if ((op == 0xF6 || op == 0xF7) && (ins->r == 0 || ins->r == 1 || ins->r == 3)) /* test, neg */
+			return FLAGS_WRITE;
+		if ((op >= 0x88 && op <= 0x8D) || (op >= 0xA0 && op <= 0xA3) || (op >= 0xB0 && op <= 0xBF)
+			|| op == 0xC6 || op == 0xC7) /* mov, lea */
+			return FLAGS_NONE;
+		if ((op >= 0x50 && op <= 0x5F) || op == 0x68 || op == 0x6A) /* push, pop */
+			return FLAGS_NONE;
+		if (op == 0x90 || op == 0x98 || op == 0x99) /* nop, cwde, cdq */
+			return FLAGS_NONE;
+	}
+	else if (!ins->escape_byte2)
+	{
+		if (ins->opcode == 0xB6 || ins->opcode == 0xB7 || ins->opcode == 0xBE || ins->opcode == 0xBF) /* movzx, movsx */
+			return FLAGS_NONE;
+		if (ins->opcode == 0x1F) /* nop */
+			return FLAGS_NONE;
+	}
+	return FLAGS_UNKNOWN;
+}
+
+/* Whether the flags are dead at |code|, i.e. overwritten before being read
+ * Only scans up to |end| as the caller knows the code there is readable */
+static bool dbt_flags_dead(uint8_t *code, uint8_t *end)
+{
+	for (int i = 0; i < DBT_LIVENESS_LOOKAHEAD && code < end; i++)
+	{
+		struct instruction_t ins;
+		int decoded = x86_decode(code, &ins);
+		if (decoded < 0)
+			return false;
+		int usage = get_flags_usage(&ins);
+		if (usage == FLAGS_WRITE)
+			return true;
+		if (usage != FLAGS_NONE)
+			return false;
+		code += decoded + ins.imm_bytes;
+	}
+	return false;
+}
+
+/* Get the target of a direct branch for a backward branch (usually a loop)
+ * The trampoline counts executions of the loop head, when it becomes hot a
+ * superblock is formed by dbt_find_superblock()
+ * If the flags are dead at the target, the counter is decremented without saving them.
+ */
+static uint8_t *dbt_get_loop_trampoline(size_t target, size_t patch_addr, bool flags_dead)
+{
+	struct dbt_block *cached_block = find_block(target);
+	if (cached_block && cached_block->superblock)
+		return cached_block->start;
+	if (cmdline_flags->dbt_trace_all || cmdline_flags->dbt_no_superblocks)
+		return dbt_get_direct_trampoline(target, patch_addr);
+
+	/* Caution: we must ensure that this stub fits in DBT_TRAMPOLINE_ALIGN(32) bytes */
+	dbt->end -= DBT_TRAMPOLINE_ALIGN;
+	uint8_t *entry = dbt->end;
+	uint8_t *out = dbt->end;
+	if (flags_dead)
+	{
+		/* dec dword ptr [counter] (6 bytes) */
+		gen_byte(&out, 0xFF); gen_byte(&out, 0x0D);
+		gen_dword(&out, (uint32_t)&dbt->superblock_counters[SUPERBLOCK_COUNTER_HASH(target)]);
+		/* jz hot (2 bytes) */
+		gen_byte(&out, 0x74); gen_byte(&out, 0x05);
+		/* jmp target (5 bytes) */
+		size_t target_patch_addr = (size_t)out + 1;
+		gen_jmp(&out, cached_block? cached_block->start: dbt_get_direct_trampoline(target, target_patch_addr));
+		/* hot: */
+		/* push patch_addr (5 bytes) */
+		gen_byte(&out, 0x68);
+		gen_dword(&out, patch_addr);
+		/* push target (5 bytes) */
+		gen_byte(&out, 0x68);
+		gen_dword(&out, target);
+		/* jmp dbt_find_superblock_internal (5 bytes) */
+		gen_jmp(&out, (void*)dbt_find_superblock_internal);
+		/* Total: 28 bytes */
+		return entry;
+	}
+	/* pushfd (1 byte) */
+	gen_pushfd(&out);
+	/* dec dword ptr [counter] (6 bytes) */
+	gen_byte(&out, 0xFF); gen_byte(&out, 0x0D);
+	gen_dword(&out, (uint32_t)&dbt->superblock_counters[SUPERBLOCK_COUNTER_HASH(target)]);
+	/* jz hot (2 bytes) */
+	gen_byte(&out, 0x74); gen_byte(&out, 0x07);
+	/* popfd (1 byte) */
+	gen_popfd(&out);
+	/* jmp target (5 bytes) */
+	size_t target_patch_addr = (size_t)out + 1;
+	gen_jmp(&out, cached_block? cached_block->start: dbt_get_direct_trampoline(target, target_patch_addr));
+	/* nop (1 byte) */
+	gen_byte(&out, 0x90);
+	/* hot: */
+	/* popfd (1 byte) */
+	gen_popfd(&out);
+	/* push patch_addr (5 bytes) */
+	gen_byte(&out, 0x68);
+	gen_dword(&out, patch_addr);
+	/* push target (5 bytes) */
+	gen_byte(&out, 0x68);
+	gen_dword(&out, target);
+	/* jmp dbt_find_superblock_internal (5 bytes) */
+	gen_jmp(&out, (void*)dbt_find_superblock_internal);
+	/* Total: 32 bytes */
+
+	return entry;
+}
+
+static bool dbt_loop_trampoline_fixup(struct syscall_context *context)
 {
+	DWORD t = context->eip & -DBT_TRAMPOLINE_ALIGN;
+	if (*(uint8_t *)t == 0x9C)
+	{
+		DWORD offset = context->eip - t;
+		/* Finish jumping */
+		if ((offset >= 1 && offset <= 9) || offset == 16) /* Flags are on the stack */
+		{
+			context->eflags = *(DWORD *)context->esp;
+			context->esp += 4;
+		}
+		else if (offset == 22)
+			context->esp += 4;
+		else if (offset == 27)
+			context->esp += 8;
+		context->eip = *(DWORD *)(t + 23);
+		return true;
+	}
+	if (*(uint8_t *)t == 0xFF)
+	{
+		/* Flags are dead at the target, the counter decrement needs no rollback */
+		DWORD offset = context->eip - t;
+		if (offset == 18)
+			context->esp += 4;
+		else if (offset == 23)
+			context->esp += 8;
+		context->eip = *(DWORD *)(t + 19);
+		return true;
+	}
+	return false;
+}
+
+/* Get the target of a direct branch at source_pc
+ * The code from segment_pc to source_pc has just been decoded, a loop target inside
+ * it can be scanned for flags liveness */
+static uint8_t *dbt_get_branch_trampoline(size_t segment_pc, size_t source_pc, size_t target, size_t patch_addr)
+{
+	if (dbt_staging)
+		return dbt_stage_link(DBT_LINK_BRANCH, patch_addr, target, segment_pc, source_pc);
+	if (target <= source_pc)
+	{
+		bool flags_dead = target >= segment_pc && dbt_flags_dead((uint8_t *)target, (uint8_t *)source_pc);
+		return dbt_get_loop_trampoline(target, patch_addr, flags_dead);
+	}
+	return dbt_get_direct_trampoline(target, patch_addr);
+}
+
+/* Whether a patchable direct branch has ever been taken, i.e. linked to a block */
+static bool dbt_branch_linked(uint8_t *patch_addr)
+{
+	uint8_t *target = patch_addr + 4 + *(int32_t *)patch_addr;
+	if (target >= dbt->end && *target == 0x9C) /* Loop trampoline, see its jump to the target */
+		target = target + 15 + *(int32_t *)(target + 11);
+	else if (target >= dbt->end && *target == 0xFF) /* Loop trampoline without flags saving */
+		target = target + 13 + *(int32_t *)(target + 9);
+	return target < dbt->end;
+}
+
+/* Guess the direction of a conditional branch at the end of the superblock segment starting at segment_pc
+ * The exits of a plain block are linked when they are first taken, use them as a hint if available */
+static bool dbt_predict_branch_taken(size_t segment_pc, size_t next_pc, size_t dest)
+{
+	struct dbt_block *block = find_block(segment_pc);
+	if (block && !block->superblock && block->end_pc == next_pc)
+	{
+		/* Layout of HANDLER_JCC: jcc rel32; 3 bytes padding; jmp rel32 */
+		bool taken = dbt_branch_linked(block->end - 12);
+		bool not_taken = dbt_branch_linked(block->end - 4);
+		if (taken != not_taken)
+			return taken;
+	}
+	/* Static prediction: backward branches are taken */
+	return dest < next_pc;
+}
+
+/* patch_addr is the rel32 field of the call, only used when staging */
+static uint8_t *dbt_get_direct_call_trampoline(size_t target, size_t patch_addr)
+{
+	if (dbt_staging)
+		return dbt_stage_link(DBT_LINK_DIRECT_CALL, patch_addr, target, 0, 0);
 	/* TODO: Make this trampoline inlined */
 	dbt->end -= DBT_TRAMPOLINE_ALIGN;
 	uint8_t *entry = dbt->end;
@@ -1057,8 +2242,8 @@ static uint8_t *dbt_get_direct_call_trampoline(size_t target)
 	/* lea esp, dword ptr [esp+4] (4 bytes) */
 	gen_byte(&out, 0x8D); gen_byte(&out, 0x64); gen_byte(&out, 0x24);
 	gen_byte(&out, 0x04);
-	size_t patch_addr = (size_t)out + 1;
-	gen_jmp(&out, dbt_get_direct_trampoline(target, patch_addr));
+	size_t target_patch_addr = (size_t)out + 1;
+	gen_jmp(&out, dbt_get_direct_trampoline(target, target_patch_addr));
 	return entry;
 }
 
@@ -1078,31 +2263,9 @@ static bool dbt_direct_call_trampoline_fixup(struct syscall_context *context)
 	return false;
 }
 
-#define PREFIX_CS		0x2E
-#define PREFIX_SS		0x36
-#define PREFIX_DS		0x3E
-#define PREFIX_ES		0x26
-#define PREFIX_FS		0x64
-#define PREFIX_GS		0x65
-struct instruction_t
-{
-	uint8_t opcode;
-	uint8_t rep_prefix, segment_prefix;
-	bool opsize_prefix;
-	bool lock_prefix;
-	bool escape_0x0f;
-	uint8_t escape_byte2; /* 0x38 or 0x3A */
-	int r;
-	bool has_modrm;
-	struct modrm_rm_t rm;
-	int imm_bytes;
-	const struct instruction_desc *desc;
-};
-
-/* Find and return an unused register in an instruction, which can be used to hold temporary values */
-static int find_unused_register(struct instruction_t *ins)
+/* Calculate registers read or written by an instruction */
+static int get_used_registers(struct instruction_t *ins)
 {
-	/* Calculate used registers in this instruction */
 	int used_regs = 0;
 	used_regs |= get_implicit_register_usage(ins->desc->op1, ins->opcode);
 	used_regs |= get_implicit_register_usage(ins->desc->op2, ins->opcode);
@@ -1123,6 +2286,13 @@ static int find_unused_register(struct instruction_t *ins)
 	}
 	if (ins->rep_prefix)
 		used_regs |= REG_CX;
+	return used_regs;
+}
+
+/* Find and return an unused register in an instruction, which can be used to hold temporary values */
+static int find_unused_register(struct instruction_t *ins)
+{
+	int used_regs = get_used_registers(ins);
 #define TEST_REG(r) do { if ((used_regs & REG_MASK(r)) == 0) return r; } while (0)
 	/* We really don't want to use esp or ebp as a temporary register */
 	TEST_REG(EAX);
@@ -1132,9 +2302,97 @@ static int find_unused_register(struct instruction_t *ins)
 	TEST_REG(ESI);
 	TEST_REG(EDI);
 #undef TEST_REG
-	log_error("find_unused_register: No usable register found. There must be a bug in our implementation.");
-	__debugbreak();
-	return 0;
+	log_error("find_unused_register: No usable register found. There must be a bug in our implementation.");
+	__debugbreak();
+	return 0;
+}
+
+/* Returns the register completely overwritten by an instruction without reading it, or -1 */
+static int get_killed_register(struct instruction_t *ins)
+{
+	if (ins->opsize_prefix || ins->lock_prefix)
+		return -1;
+	if (!ins->escape_0x0f)
+	{
+		if (ins->opcode >= 0xB8 && ins->opcode <= 0xBF) /* mov r32, imm32 */
+			return ins->opcode & 7;
+		if (ins->opcode == 0x8B || ins->opcode == 0x8D) /* mov r32, r/m32; lea r32, m */
+			return ins->r;
+		/* xor r32, r32; sub r32, r32 */
+		if ((ins->opcode == 0x31 || ins->opcode == 0x33 || ins->opcode == 0x29 || ins->opcode == 0x2B)
+			&& modrm_rm_is_r(ins->rm) && ins->rm.base == ins->r)
+			return ins->r;
+	}
+	else if (!ins->escape_byte2 && !ins->rep_prefix)
+	{
+		/* movzx r32, r/m8; movzx r32, r/m16; movsx r32, r/m8; movsx r32, r/m16 */
+		if (ins->opcode == 0xB6 || ins->opcode == 0xB7 || ins->opcode == 0xBE || ins->opcode == 0xBF)
+			return ins->r;
+	}
+	return -1;
+}
+
+/* Scan forward from |code| in the same basic block and return the mask of registers
+ * which are overwritten before being read. The contents of such registers at |code|
+ * are never observed, they can be used as temporary registers without saving.
+ * The scan stops at anything other than a normal instruction, or a normal instruction
+ * whose register usage is not described by the instruction table.
+ * Only depends on the source code so it gives the same result in replay. */
+static int dbt_find_dead_registers(uint8_t *code)
+{
+	int decided = REG_MASK(ESP), dead = 0;
+	for (int i = 0; i < DBT_LIVENESS_LOOKAHEAD; i++)
+	{
+		struct instruction_t ins;
+		int decoded = x86_decode(code, &ins);
+		if (decoded < 0)
+			break;
+		int handler_type = ins.desc->handler_type;
+		if ((handler_type & HANDLER_NORMAL) != HANDLER_NORMAL)
+			break;
+		/* Instructions like cdq have implicit operands not listed in the table */
+		if (handler_type == HANDLER_NORMAL && ins.desc->op1 == __ && ins.desc->op2 == __ && ins.desc->op3 == __)
+			break;
+		int reads = get_used_registers(&ins);
+		int killed = get_killed_register(&ins);
+		if (killed != -1)
+		{
+			reads &= ~REG_MASK(killed);
+			/* mov eax, [eax] reads the register before overwriting it */
+			if (ins.has_modrm && (ins.rm.base == killed || ins.rm.index == killed))
+				reads |= REG_MASK(killed);
+		}
+		decided |= reads;
+		if (killed != -1 && !(decided & REG_MASK(killed)))
+		{
+			dead |= REG_MASK(killed);
+			decided |= REG_MASK(killed);
+		}
+		if ((decided & 0xFF) == 0xFF)
+			break;
+		code += decoded + ins.imm_bytes;
+	}
+	return dead;
+}
+
+/* Find a temporary register for an instruction, |next_code| is the address of the next instruction
+ * Prefers a register which is dead after the instruction, in which case |dead| is set to true
+ * and the register does not need to be saved and restored through the scratch slot. */
+static int find_temp_register(struct instruction_t *ins, uint8_t *next_code, bool *dead)
+{
+	int dead_regs = dbt_find_dead_registers(next_code) & ~get_used_registers(ins);
+	*dead = true;
+#define TEST_REG(r) do { if (dead_regs & REG_MASK(r)) return r; } while (0)
+	/* We really don't want to use esp or ebp as a temporary register */
+	TEST_REG(EAX);
+	TEST_REG(ECX);
+	TEST_REG(EDX);
+	TEST_REG(EBX);
+	TEST_REG(ESI);
+	TEST_REG(EDI);
+#undef TEST_REG
+	*dead = false;
+	return find_unused_register(ins);
 }
 
 /* Set register in context structure to specified value */
@@ -1184,6 +2442,8 @@ static bool dbt_gen_push_gs_rm(uint8_t **out, int temp_reg, struct modrm_rm_t rm
 		context->eip = current_ip;
 		return true;
 	}
+	if (!context)
+		DBT_TRANSLATE_STAT(gs_generic_count)++;
 	/* mov fs:[scratch], temp_reg */
 	gen_fs_prefix(out);
 	gen_mov_rm_r_32(out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
@@ -1200,7 +2460,7 @@ static bool dbt_gen_push_gs_rm(uint8_t **out, int temp_reg, struct modrm_rm_t rm
 	if (context && context->eip <= (DWORD)*out)
 	{
 		context->eip = current_ip;
-		set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+		set_context_register(context, temp_reg, dbt_host_read_tls(dbt_global->tls_scratch_offset));
 		return true;
 	}
 
@@ -1215,7 +2475,7 @@ static bool dbt_gen_push_gs_rm(uint8_t **out, int temp_reg, struct modrm_rm_t rm
 	if (context && context->eip <= (DWORD)*out)
 	{
 		context->eip = current_ip;
-		set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+		set_context_register(context, temp_reg, dbt_host_read_tls(dbt_global->tls_scratch_offset));
 		context->esp += 4;
 		return true;
 	}
@@ -1223,6 +2483,73 @@ static bool dbt_gen_push_gs_rm(uint8_t **out, int temp_reg, struct modrm_rm_t rm
 	return false;
 }
 
+/* Size of the code following the return address store in dbt_gen_fast_syscall():
+ * push ecx; push edx; push ebx (3), call (5), lea esp, [esp+4] (4), pop edx; pop ecx (2),
+ * jmp fs:[return_addr] (7) */
+#define DBT_FAST_SYSCALL_TAIL_SIZE	21
+
+/* Call a register only system call handler in place
+ * The continuation goes through fs:[return_addr] so a signal which arrives while the
+ * handler is running is delivered the same way as on the generic syscall path. */
+static bool dbt_gen_fast_syscall(uint8_t **out, void *handler, size_t next_pc, DWORD current_ip, struct syscall_context *context)
+{
+	/* mov fs:[eip], next_pc */
+	gen_fs_prefix(out);
+	gen_mov_rm_imm32(out, modrm_rm_disp(dbt_global->tls_eip_offset), next_pc);
+	/* mov fs:[return_addr], continuation */
+	gen_fs_prefix(out);
+	gen_mov_rm_imm32(out, modrm_rm_disp(dbt_global->tls_return_addr_offset), (size_t)*out + 10 + DBT_FAST_SYSCALL_TAIL_SIZE);
+	dbt_stage_reloc(*out - 4, DBT_RELOC_SELF);
+	/* Save registers clobbered by the handler, ebx is the only argument */
+	uint8_t *push_start = *out;
+	gen_push_rm(out, modrm_rm_reg(ECX));
+	gen_push_rm(out, modrm_rm_reg(EDX));
+	gen_push_rm(out, modrm_rm_reg(EBX));
+	if (context && context->eip <= (DWORD)*out)
+	{
+		/* The system call is not yet executed, rollback */
+		if (context->eip > (DWORD)push_start)
+			context->esp += 4 * (context->eip - (DWORD)push_start);
+		context->eip = current_ip;
+		return true;
+	}
+	gen_call(out, handler);
+	uint8_t *return_start = *out;
+	/* lea esp, [esp+4] */
+	gen_lea(out, ESP, modrm_rm_mreg(ESP, 4));
+	uint8_t *pop_start = *out;
+	gen_pop_rm(out, modrm_rm_reg(EDX));
+	gen_pop_rm(out, modrm_rm_reg(ECX));
+	if (context && context->eip <= (DWORD)*out)
+	{
+		/* The system call is already executed, commit */
+		DWORD *stack = (DWORD *)context->esp;
+		if (context->eip == (DWORD)return_start)
+		{
+			context->edx = stack[1];
+			context->ecx = stack[2];
+			context->esp += 12;
+		}
+		else if (context->eip == (DWORD)pop_start)
+		{
+			context->edx = stack[0];
+			context->ecx = stack[1];
+			context->esp += 8;
+		}
+		else if (context->eip == (DWORD)pop_start + 1)
+		{
+			context->ecx = stack[0];
+			context->esp += 4;
+		}
+		context->eip = next_pc;
+		return true;
+	}
+	/* jmp fs:[return_addr] */
+	gen_fs_prefix(out);
+	gen_jmp_rm(out, modrm_rm_disp(dbt_global->tls_return_addr_offset));
+	return false;
+}
+
 static bool dbt_gen_call_postamble(uint8_t **out, size_t source_pc, struct syscall_context *context)
 {
 	/* stack: addr */
@@ -1230,7 +2557,7 @@ static bool dbt_gen_call_postamble(uint8_t **out, size_t source_pc, struct sysca
 	gen_mov_r_rm_32(out, ECX, modrm_rm_mreg(ESP, 4));
 	gen_lea(out, ECX, modrm_rm_mreg(ECX, -source_pc));
 	gen_jecxz_rel(out, 5);
-	gen_jmp(out, (void*)dbt_sieve_fallback);
+	gen_jmp(out, (void*)dbt_return_fallback);
 	if (context && context->eip <= (DWORD)*out)
 	{
 		context->eip = *(DWORD *)(context->esp + 4);
@@ -1251,7 +2578,99 @@ static bool dbt_gen_call_postamble(uint8_t **out, size_t source_pc, struct sysca
 	return false;
 }
 
-static bool dbt_gen_ret_trampoline(uint8_t **out, struct syscall_context *context)
+/* Push the return address of a call onto the shadow stack
+ * The translated return address is left to the caller to fill in *target, as it depends
+ * on the code following this. On context fixup, ECX is restored and true is returned.
+ * The caller then rolls back the whole call instruction.
+ */
+static bool dbt_gen_shadow_stack_push(uint8_t **out, size_t return_pc, uint32_t **target, struct syscall_context *context)
+{
+	uint8_t *start = *out;
+	gen_push_rm(out, modrm_rm_reg(ECX));
+	gen_fs_prefix(out);
+	gen_mov_r_rm_32(out, ECX, modrm_rm_disp(dbt_global->tls_shadow_stack_offset));
+	/* lea cx, [ecx + 8] */
+	gen_byte(out, 0x66);
+	gen_lea(out, ECX, modrm_rm_mreg(ECX, sizeof(struct dbt_shadow_entry)));
+	gen_mov_rm_imm32(out, modrm_rm_mreg(ECX, offsetof(struct dbt_shadow_entry, pc)), return_pc);
+	gen_mov_rm_imm32(out, modrm_rm_mreg(ECX, offsetof(struct dbt_shadow_entry, target)), 0);
+	*target = (uint32_t *)(*out - 4);
+	gen_fs_prefix(out);
+	gen_mov_rm_r_32(out, modrm_rm_disp(dbt_global->tls_shadow_stack_offset), ECX);
+	gen_pop_rm(out, modrm_rm_reg(ECX));
+	if (context && context->eip < (DWORD)*out)
+	{
+		/* The entry may have been pushed already, a duplicated entry only costs a mispredict */
+		if (context->eip > (DWORD)start)
+		{
+			context->ecx = *(DWORD *)context->esp;
+			context->esp += 4;
+		}
+		return true;
+	}
+	return false;
+}
+
+/* Write protect guest code of a block, which may enter the kernel and clobber SIMD state */
+static void dbt_protect_code(size_t start, size_t end)
+{
+	dbt_save_simd_state();
+	mm_protect_code(start, end);
+	dbt_restore_simd_state();
+}
+
+/* FNV-1a hash of guest code in [start, end) */
+static uint32_t dbt_hash_code(size_t start, size_t end)
+{
+	uint32_t hash = 0x811C9DC5U;
+	for (const uint8_t *p = (const uint8_t *)start; p < (const uint8_t *)end; p++)
+		hash = (hash ^ *p) * 0x01000193U;
+	return hash;
+}
+
+/* Emit the guest code check of a checked block
+ * Returns true if the context is inside the check, in which case it is rolled back to the block entry
+ */
+static bool dbt_gen_code_check(uint8_t **out, struct dbt_block *block, struct syscall_context *context)
+{
+	uint8_t *start = *out;
+	gen_push_imm32(out, (uint32_t)block);
+	gen_call(out, (void *)&dbt_check_code_internal);
+	if (context && context->eip >= (DWORD)start && context->eip < (DWORD)*out)
+	{
+		if (context->eip > (DWORD)start)
+			context->esp += 4;
+		return true;
+	}
+	return false;
+}
+
+/* Emit the execution counter of a block in profiling mode
+ * Returns true if the context is inside the counter, in which case it is rolled back to the block entry
+ */
+static bool dbt_gen_block_counter(uint8_t **out, struct dbt_block *block, struct syscall_context *context)
+{
+	uint8_t *start = *out;
+	gen_push_rm(out, modrm_rm_reg(ECX));
+	gen_mov_r_rm_32(out, ECX, modrm_rm_disp((int32_t)&block->executions));
+	dbt_stage_reloc(*out - 4, DBT_RELOC_BLOCK);
+	gen_lea(out, ECX, modrm_rm_mreg(ECX, 1));
+	gen_mov_rm_r_32(out, modrm_rm_disp((int32_t)&block->executions), ECX);
+	dbt_stage_reloc(*out - 4, DBT_RELOC_BLOCK);
+	gen_pop_rm(out, modrm_rm_reg(ECX));
+	if (context && context->eip >= (DWORD)start && context->eip < (DWORD)*out)
+	{
+		if (context->eip > (DWORD)start)
+		{
+			context->ecx = *(DWORD *)context->esp;
+			context->esp += 4;
+		}
+		return true;
+	}
+	return false;
+}
+
+static bool dbt_gen_ret_trampoline(struct dbt_data *cache, uint8_t **out, struct syscall_context *context)
 {
 	if (context && context->eip == (DWORD)*out)
 	{
@@ -1259,17 +2678,27 @@ static bool dbt_gen_ret_trampoline(uint8_t **out, struct syscall_context *contex
 		context->esp += 4;
 		return true;
 	}
+	/* Pop the shadow stack and return to the predicted target, the call postamble there
+	 * checks the guest return address */
 	gen_push_rm(out, modrm_rm_reg(ECX));
-	gen_movzx_r32_rm16(out, ECX, modrm_rm_mreg(ESP, 4));
+	gen_fs_prefix(out);
+	gen_mov_r_rm_32(out, ECX, modrm_rm_disp(dbt_global->tls_shadow_stack_offset));
 	if (context && context->eip <= (DWORD)*out)
 	{
+		context->ecx = *(DWORD *)context->esp;
 		context->eip = *(DWORD *)(context->esp + 4);
 		context->esp += 8;
 		return true;
 	}
-	gen_push_rm(out, modrm_rm_mscale(-1, ECX, MODRM_SCALE_4, (int32_t)dbt->return_cache));
+	gen_push_rm(out, modrm_rm_mreg(ECX, offsetof(struct dbt_shadow_entry, target)));
+	/* lea cx, [ecx - 8] */
+	gen_byte(out, 0x66);
+	gen_lea(out, ECX, modrm_rm_mreg(ECX, -(int32_t)sizeof(struct dbt_shadow_entry)));
+	gen_fs_prefix(out);
+	gen_mov_rm_r_32(out, modrm_rm_disp(dbt_global->tls_shadow_stack_offset), ECX);
 	if (context && context->eip <= (DWORD)*out)
 	{
+		context->ecx = *(DWORD *)(context->esp + 4);
 		context->eip = *(DWORD *)(context->esp + 8);
 		context->esp += 12;
 		return true;
@@ -1289,6 +2718,29 @@ static void dbt_log_opcode(struct instruction_t *ins)
 	log_info("segment: 0x%02x", ins->segment_prefix);
 }
 
+static void dbt_count_instruction(int handler_type, int code_bytes)
+{
+	DBT_TRANSLATE_STAT(handler_instructions_count[handler_type])++;
+	DBT_TRANSLATE_STAT(handler_code_bytes[handler_type]) += code_bytes;
+}
+
+static void dbt_log_decode_error(struct instruction_t *ins, int error)
+{
+	switch (error)
+	{
+	case X86_DECODE_UNKNOWN: log_error("Unknown opcode."); break;
+	case X86_DECODE_INVALID: log_error("Invalid opcode."); break;
+	case X86_DECODE_UNSUPPORTED: log_error("Unsupported opcode."); break;
+	case X86_DECODE_BAD_PREFIX:
+		if (ins->opcode == PREFIX_FS)
+			log_error("FS segment override not supported.");
+		else
+			log_error("Address size prefix not supported.");
+		return;
+	}
+	dbt_log_opcode(ins);
+}
+
 /* CAUTION
  * We do not save x87/MMX/SSE/AVX states across a translation request
  * Thus we have to ensure these get unchanged during the translation
@@ -1299,21 +2751,29 @@ static void dbt_log_opcode(struct instruction_t *ins)
 /* If context is given, dbt_translate() ignores pc and fix up context to user context
  * Otherwise, it translates a new basic block at pc and returns NULL
  * Caller ensures EIP is inside dbt code cache
+ * If superblock is true, direct branches are followed and laid out as fall-through
+ * instead of ending the block. Loop back edges to pc stay inside the superblock.
  */
-static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *context)
+static struct dbt_block *dbt_translate(struct dbt_data *cache, size_t pc, bool superblock, struct syscall_context *context)
 {
     uint8_t handler_type;
 	struct dbt_block *block;
 	if (context)
 	{
-		if (dbt_sieve_dispatch_fixup(context))
+		if (dbt_sieve_dispatch_fixup(cache, context))
 			return NULL;
-		if (context->eip >= (DWORD)dbt->end)
+		if (context->eip >= (DWORD)cache->end)
 		{
 			if (dbt_sieve_fixup(context))
 				return NULL;
+			if (dbt_sieve_dispatch_body_fixup(context))
+				return NULL;
 			if (dbt_direct_trampoline_fixup(context))
 				return NULL;
+			if (dbt_loop_trampoline_fixup(context))
+				return NULL;
+			if (dbt_inline_cache_fixup(context))
+				return NULL;
 			if (dbt_direct_call_trampoline_fixup(context))
 				return NULL;
 			log_error("Address %p: Unknown trampoline type.", pc);
@@ -1322,7 +2782,7 @@ static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *contex
 		/* Not in a trampoline */
 		struct dbt_block probe;
 		probe.start = (uint8_t *)context->eip;
-		struct rb_node *node = rb_upper_bound(&dbt->cache_tree, &probe.cache_tree, cache_tree_cmp);
+		struct rb_node *node = rb_upper_bound(&cache->cache_tree, &probe.cache_tree, cache_tree_cmp);
 		if (node == NULL)
 		{
 			log_error("Address %p: Block not found.", pc);
@@ -1331,6 +2791,20 @@ static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *contex
 		block = rb_entry(node, struct dbt_block, cache_tree);
 		pc = block->pc;
 	}
+	else if (dbt_staging)
+	{
+		/* Background translation, the block is published by dbt_publish_staged_block() */
+		block = &dbt_staging->block;
+		block->pc = pc;
+		block->invalidated = false;
+		block->superblock = false;
+		block->superblock_branches = 0;
+		block->executions = 0;
+		block->space_exhausted_out = NULL;
+		block->checked = false;
+		block->hot = false;
+		block->start = dbt_staging->buffer;
+	}
 	else
 	{
 		block = alloc_block();
@@ -1339,29 +2813,99 @@ static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *contex
 			if (cmdline_flags->dbt_trace)
 			{
 				dbt_save_simd_state();
-				log_debug("dbt cache is full, flushing code cache... (current pc = %p)", pc);
+				log_debug("dbt cache is full, evicting code cache... (current pc = %p)", pc);
 				dbt_restore_simd_state();
 			}
-			dbt_flush();
+			dbt_evict(pc);
+			cache = dbt;
 			block = alloc_block(); /* We won't fail again */
 		}
+		dbt_global->translated_blocks_count++;
 		block->pc = pc;
-		block->start = (uint8_t *)ALIGN_TO(dbt->out, DBT_OUT_ALIGN);
-		rb_add(&dbt->tree, &block->tree, tree_cmp);
-		rb_add(&dbt->cache_tree, &block->cache_tree, cache_tree_cmp);
+		block->invalidated = false;
+		block->superblock = superblock;
+		block->superblock_branches = 0;
+		block->executions = 0;
+		block->space_exhausted_out = NULL;
+		/* Code on pages which are rewritten often is checked on entry, such blocks are
+		 * not worth chaining into superblocks */
+		block->checked = mm_is_code_volatile(pc);
+		if (block->checked)
+		{
+			block->superblock = false;
+			dbt_global->checked_blocks_count++;
+		}
+		else
+			dbt_protect_code(pc, pc + 1);
+		/* Superblocks are formed from hot loops, lay them out in the hot region while it has room */
+		block->hot = block->superblock && cache->hot_end - (uint8_t *)ALIGN_TO(cache->hot_out, DBT_OUT_ALIGN) >= DBT_BLOCK_MAXSIZE;
+		if (block->hot)
+			block->start = (uint8_t *)ALIGN_TO(cache->hot_out, DBT_OUT_ALIGN);
+		else
+			block->start = (uint8_t *)ALIGN_TO(cache->out, DBT_OUT_ALIGN);
+		rb_add(&cache->tree, &block->tree, tree_cmp);
+		rb_add(&cache->cache_tree, &block->cache_tree, cache_tree_cmp);
 	}
 	
 	if (cmdline_flags->dbt_trace)
 	{
 		dbt_save_simd_state();
-		log_debug("dbt_translate: id: %d, pc: %p, translated pc: %p, end: %p", dbt->blocks_count, block->pc, block->start, dbt->end);
+		log_debug("dbt_translate: id: %d, pc: %p, translated pc: %p, end: %p", cache->blocks_count, block->pc, block->start, cache->end);
 		dbt_restore_simd_state();
 	}
 
+	uint64_t start_cycles = context? 0: __rdtsc();
 	uint8_t *code = (uint8_t *)pc;
 	uint8_t *out = block->start;
+	/* End of the region the block is generated in */
+	uint8_t *limit = dbt_staging? dbt_staging->buffer + DBT_STAGING_SIZE: block->hot? cache->hot_end: cache->end;
+	/* Code size accounting of the last translated instruction, -1 if none */
+	int last_handler_type = -1;
+	uint8_t *last_out = out;
+	/* Superblock states, the layout only depends on the source code and superblock_branches
+	 * so the same code is generated in replay */
+	superblock = block->superblock;
+	int segments = 0;
+	size_t segment_pc = pc;
+	/* Value of eax if it is a known constant */
+	bool eax_known = false, syscall_eax_known = false;
+	uint32_t eax_value = 0;
+	/* Dead register holding the gs base from a previous instruction, -1 if none */
+	int gs_temp_reg = -1;
+	size_t end_pc = pc;
+	/* Patchable entry, overwritten by dbt_invalidate_block(), must not be rewritten in replay */
+	if (context)
+	{
+		if (context->eip == (DWORD)out)
+		{
+			context->eip = pc;
+			return block;
+		}
+		out += DBT_BLOCK_ENTRY_SIZE;
+	}
+	else
+	{
+		/* nop dword ptr [eax+eax*1+0] (5 bytes) */
+		gen_byte(&out, 0x0F); gen_byte(&out, 0x1F); gen_byte(&out, 0x44);
+		gen_byte(&out, 0x00); gen_byte(&out, 0x00);
+	}
+	if (block->checked && dbt_gen_code_check(&out, block, context))
+	{
+		context->eip = pc;
+		return block;
+	}
+	if (cmdline_flags->dbt_profile_dir[0] && dbt_gen_block_counter(&out, block, context))
+	{
+		context->eip = pc;
+		return block;
+	}
 	for (;;)
 	{
+		if (last_handler_type != -1)
+		{
+			dbt_count_instruction(last_handler_type, out - last_out);
+			last_handler_type = -1;
+		}
 		DWORD current_ip = (DWORD)code;
 		if (context && context->eip == (DWORD)out)
 		{
@@ -1369,179 +2913,73 @@ static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *contex
 			context->eip = current_ip;
 			goto end_block;
 		}
-		if (dbt->end - out < DBT_BLOCK_MAXSIZE)
+		/* Trampolines of hot blocks are still allocated from the end of the cold region
+		 * The free space changes after the block is built, replay must stop where the block did */
+		if (context? out == block->space_exhausted_out:
+			(limit - out < DBT_BLOCK_MAXSIZE || (!dbt_staging && cache->end - cache->out < DBT_BLOCK_MAXSIZE)))
 		{
 			/* No enough space for code generation, emit a temporary trampoline and give up */
-			size_t patch_addr = (size_t)out + 1;
-			gen_jmp(&out, dbt_get_direct_trampoline((size_t)code, patch_addr));
-			goto end_block;
-		}
-		struct instruction_t ins;
-		ins.rep_prefix = 0;
-		ins.segment_prefix = 0;
-		ins.opsize_prefix = false;
-		ins.lock_prefix = false;
-		/* Handle prefixes. According to x86 doc, they can appear in any order */
-		for (;;)
-		{
-			ins.opcode = parse_byte(&code);
-			/* TODO: Can we migrate this switch to a table driven approach? */
-			/* TODO: Detect invalid multiple segment prefixes */
-			switch (ins.opcode)
-			{
-			case 0xF0: /* LOCK */
-				ins.lock_prefix = true;
-				break;
-
-			case 0xF2: /* REPNE/REPNZ */
-				ins.rep_prefix = 0xF2;
-				break;
-
-			case 0xF3: /* REP/REPE/REPZ */
-				ins.rep_prefix = 0xF3;
-				break;
-
-			case 0x2E: /* CS segment override*/
-				ins.segment_prefix = 0x2E;
-				break;
-
-			case 0x36: /* SS segment override */
-				ins.segment_prefix = 0x36;
-				break;
-
-			case 0x3E: /* DS segment override */
-				ins.segment_prefix = 0x3E;
-				break;
-
-			case 0x26: /* ES segment override */
-				ins.segment_prefix = 0x26;
-				break;
-
-			case 0x64: /* FS segment override */
-				log_error("FS segment override not supported.");
-				__debugbreak();
-				break;
-
-			case 0x65: /* GS segment override */
-				ins.segment_prefix = 0x65;
-				break;
-
-			case 0x66: /* Operand size prefix */
-				ins.opsize_prefix = true;
-				break;
-
-			case 0x67: /* Address size prefix */
-				log_error("Address size prefix not supported.");
-				__debugbreak();
-				break;
-
-			default:
-				goto done_prefix;
-			}
-		}
-
-done_prefix:
-
-		/* Extract instruction descriptor */
-		ins.escape_0x0f = false;
-		ins.escape_byte2 = 0;
-
-		if (ins.opcode == 0x0F)
-		{
-			ins.escape_0x0f = true;
-			ins.opcode = parse_byte(&code);
-			if (ins.opcode == 0x38)
+			block->space_exhausted_out = out;
+			gen_patchable_align(&out, 1);
+			if (context && context->eip <= (DWORD)out)
 			{
-				ins.escape_byte2 = 0x38;
-				ins.opcode = parse_byte(&code);
-				ins.desc = &three_byte_inst_0x38[ins.opcode];
+				context->eip = current_ip;
+				goto end_block;
 			}
-			else if (ins.opcode == 0x3A)
+			if (context)
+				out += 5;
+			else
 			{
-				ins.escape_byte2 = 0x3A;
-				ins.opcode = parse_byte(&code);
-				ins.desc = &three_byte_inst_0x3A[ins.opcode];
+				size_t patch_addr = (size_t)out + 1;
+				gen_jmp(&out, dbt_get_direct_trampoline((size_t)code, patch_addr));
 			}
-			else
-				ins.desc = &two_byte_inst[ins.opcode];
+			goto end_block;
 		}
-		else
-			ins.desc = &one_byte_inst[ins.opcode];
-
-		/* Follow extension tables */
-		ins.has_modrm = false;
-		while (ins.desc->type <= INST_TYPE_MAX)
+		struct instruction_t ins;
+		int decoded;
+		if ((decoded = x86_decode(code, &ins)) < 0)
 		{
-			switch (ins.desc->type)
-			{
-			case INST_TYPE_UNKNOWN: log_error("Unknown opcode."); dbt_log_opcode(&ins); __debugbreak(); break;
-			case INST_TYPE_INVALID: log_error("Invalid opcode."); dbt_log_opcode(&ins); __debugbreak(); break;
-			case INST_TYPE_UNSUPPORTED: log_error("Unsupported opcode."); dbt_log_opcode(&ins); __debugbreak(); break;
-
-			case INST_TYPE_MANDATORY:
-			{
-				if (!ins.escape_0x0f)
-				{
-					log_error("Invalid opcode.");
-					__debugbreak();
-				}
-				if (ins.opsize_prefix)
-					ins.desc = &ins.desc->extension_table[MANDATORY_0x66];
-				else if (ins.rep_prefix == 0xF3)
-					ins.desc = &ins.desc->extension_table[MANDATORY_0xF3];
-				else if (ins.rep_prefix == 0xF2)
-					ins.desc = &ins.desc->extension_table[MANDATORY_0xF2];
-				else
-					ins.desc = &ins.desc->extension_table[MANDATORY_NONE];
-				break;
-			}
-
-			case INST_TYPE_EXTENSION:
-			{
-				if (!ins.has_modrm)
-				{
-					parse_modrm(&code, &ins.r, &ins.rm);
-					ins.has_modrm = true;
-				}
-				ins.desc = &ins.desc->extension_table[ins.r];
-				break;
-			}
-
-			case INST_TYPE_MODRM_MOD:
-			{
-				if (!ins.has_modrm)
-				{
-					parse_modrm(&code, &ins.r, &ins.rm);
-					ins.has_modrm = true;
-				}
-				if (modrm_rm_is_r(ins.rm))
-					ins.desc = &ins.desc->extension_table[MODRM_MOD_R];
-				else
-					ins.desc = &ins.desc->extension_table[MODRM_MOD_M];
-				break;
-			}
-			}
+			dbt_log_decode_error(&ins, decoded);
+			__debugbreak();
 		}
+		code += decoded;
 
-		/* ins.desc now points to the correct instruction description */
-		if (!ins.has_modrm)
+		if (cache->gs_base && ins.segment_prefix == PREFIX_GS && ins.has_modrm && modrm_rm_is_m(ins.rm)
+			&& !(!ins.escape_0x0f && ins.opcode == 0x8D)) /* LEA */
 		{
-			/* Do we need modrm? */
-			if (FROM_MODRM(ins.desc->op1) || FROM_MODRM(ins.desc->op2) || FROM_MODRM(ins.desc->op3))
-			{
-				parse_modrm(&code, &ins.r, &ins.rm);
-				ins.has_modrm = true;
-			}
+			/* All threads share the gs base of this cache, fold it into the displacement
+			 * so the access becomes a plain memory access */
+			ins.rm.disp += (int32_t)cache->gs_base;
+			ins.segment_prefix = 0;
+			if (!context)
+				DBT_TRANSLATE_STAT(gs_folded_modrm_count)++;
 		}
 
-		/* Calculate number of immediate bytes */
-		ins.imm_bytes = get_imm_bytes(ins.desc->op1, ins.opsize_prefix, false)
-			+ get_imm_bytes(ins.desc->op2, ins.opsize_prefix, false)
-			+ get_imm_bytes(ins.desc->op3, ins.opsize_prefix, false);
+		/* Track a constant syscall number in eax, only instructions which obviously
+		 * do not write eax are allowed between mov eax, imm32 and int 0x80
+		 * The syscall returns its result in eax, so it is unknown after int 0x80 */
+		syscall_eax_known = eax_known;
+		if (!ins.escape_0x0f && !ins.opsize_prefix && ins.opcode == 0xB8) /* mov eax, imm32 */
+		{
+			eax_known = true;
+			eax_value = *(uint32_t *)code;
+		}
+		else if (ins.escape_0x0f || ins.opsize_prefix || ins.segment_prefix
+			|| !((ins.opcode >= 0xB9 && ins.opcode <= 0xBF) /* mov r32, imm32 */
+				|| (ins.opcode == 0x8B && ins.r != EAX))) /* mov r32, r/m32 */
+			eax_known = false;
 
 		handler_type = ins.desc->handler_type;
 		if ((handler_type & HANDLER_NORMAL) == HANDLER_NORMAL)
 			handler_type = HANDLER_NORMAL;
+		/* The register stays dead until an instruction uses it */
+		if (gs_temp_reg != -1 && (handler_type != HANDLER_NORMAL || (get_used_registers(&ins) & REG_MASK(gs_temp_reg))))
+			gs_temp_reg = -1;
+		if (!context)
+		{
+			last_handler_type = handler_type;
+			last_out = out;
+		}
 
 		/* Translate instruction */
 		switch (handler_type)
@@ -1569,25 +3007,54 @@ done_prefix:
 				&& !(!ins.escape_0x0f && ins.opcode == 0x8D)) /* LEA */
 			{
 				/* Instruction with effective gs segment override */
-				int temp_reg = find_unused_register(&ins);
-				/* mov fs:[scratch], temp_reg */
-				gen_fs_prefix(&out);
-				gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
-
-				/* mov temp_reg, fs:[gs_addr] */
-				gen_fs_prefix(&out);
-				gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_gs_addr_offset));
-				if (ins.rm.base != -1)
+				if (!context)
+					DBT_TRANSLATE_STAT(gs_generic_count)++;
+				int temp_reg;
+				bool temp_dead;
+				if (gs_temp_reg != -1)
+				{
+					/* A dead register already holds the gs base */
+					temp_reg = gs_temp_reg;
+					temp_dead = true;
+				}
+				else
+				{
+					temp_reg = find_temp_register(&ins, code + ins.imm_bytes, &temp_dead);
+					if (!temp_dead)
+					{
+						/* mov fs:[scratch], temp_reg */
+						gen_fs_prefix(&out);
+						gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
+					}
+
+					/* mov temp_reg, fs:[gs_addr] */
+					gen_fs_prefix(&out);
+					gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_gs_addr_offset));
+				}
+				if (ins.rm.base != -1 && (ins.rm.index != -1 || ins.rm.base == ESP))
 				{
 					/* lea temp_reg, [temp_reg + rm.base] */
 					gen_lea(&out, temp_reg, modrm_rm_mscale(temp_reg, ins.rm.base, 0, 0));
+					ins.rm.base = temp_reg;
+					gs_temp_reg = -1;
+				}
+				else
+				{
+					/* Use the original base as index so temp_reg keeps the gs base */
+					if (ins.rm.base != -1)
+					{
+						ins.rm.index = ins.rm.base;
+						ins.rm.scale = 0;
+					}
+					ins.rm.base = temp_reg;
+					if (temp_dead)
+						gs_temp_reg = temp_reg;
 				}
-				/* Replace rm.base with temp_reg */
-				ins.rm.base = temp_reg;
 				if (context && context->eip <= (DWORD)out)
 				{
 					/* The instruction is not yet executed, rollback */
-					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+					if (!temp_dead)
+						set_context_register(context, temp_reg, dbt_host_read_tls(dbt_global->tls_scratch_offset));
 					context->eip = current_ip;
 					goto end_block;
 				}
@@ -1597,14 +3064,18 @@ done_prefix:
 				if (context && context->eip == (DWORD)out)
 				{
 					/* The instruction is already executed, commit */
-					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+					if (!temp_dead)
+						set_context_register(context, temp_reg, dbt_host_read_tls(dbt_global->tls_scratch_offset));
 					context->eip = (DWORD)code;
 					goto end_block;
 				}
 
-				/* mov temp_reg, fs:[scratch] */
-				gen_fs_prefix(&out);
-				gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
+				if (!temp_dead)
+				{
+					/* mov temp_reg, fs:[scratch] */
+					gen_fs_prefix(&out);
+					gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
+				}
 			}
 			else /* If nothing special, directly copy instruction */
 				dbt_copy_instruction(&out, &code, &ins);
@@ -1622,20 +3093,40 @@ done_prefix:
 
 		case HANDLER_MOV_MOFFSET:
 		{
+			if (ins.segment_prefix == PREFIX_GS && cache->gs_base)
+			{
+				/* Fold the gs base into the offset */
+				if (ins.lock_prefix)
+					gen_byte(&out, 0xF0);
+				if (ins.opsize_prefix)
+					gen_byte(&out, 0x66);
+				gen_byte(&out, ins.opcode);
+				gen_dword(&out, parse_moffset(&code, ins.imm_bytes) + cache->gs_base);
+				if (!context)
+					DBT_TRANSLATE_STAT(gs_folded_moffset_count)++;
+				break;
+			}
 			if (ins.segment_prefix == PREFIX_GS)
 			{
+				if (!context)
+					DBT_TRANSLATE_STAT(gs_generic_count)++;
 				/* mov moffs with effective gs segment override */
-				int temp_reg = find_unused_register(&ins);
-				/* mov fs:[scratch], temp_reg */
-				gen_fs_prefix(&out);
-				gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
+				bool temp_dead;
+				int temp_reg = find_temp_register(&ins, code + ins.imm_bytes, &temp_dead);
+				if (!temp_dead)
+				{
+					/* mov fs:[scratch], temp_reg */
+					gen_fs_prefix(&out);
+					gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
+				}
 
 				/* mov temp_reg, fs:[gs_addr] */
 				gen_fs_prefix(&out);
 				gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_gs_addr_offset));
 				if (context && context->eip <= (DWORD)out)
 				{
-					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+					if (!temp_dead)
+						set_context_register(context, temp_reg, dbt_host_read_tls(dbt_global->tls_scratch_offset));
 					context->eip = current_ip;
 					goto end_block;
 				}
@@ -1657,14 +3148,18 @@ done_prefix:
 				gen_modrm_sib(&out, 0, modrm_rm_mreg(temp_reg, disp));
 				if (context && context->eip == (DWORD)out)
 				{
-					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+					if (!temp_dead)
+						set_context_register(context, temp_reg, dbt_host_read_tls(dbt_global->tls_scratch_offset));
 					context->eip = (DWORD)code;
 					goto end_block;
 				}
 
-				/* mov temp_reg, fs:[scratch] */
-				gen_fs_prefix(&out);
-				gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
+				if (!temp_dead)
+				{
+					/* mov temp_reg, fs:[scratch] */
+					gen_fs_prefix(&out);
+					gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
+				}
 				break;
 			}
 
@@ -1678,21 +3173,24 @@ done_prefix:
 			int32_t rel = parse_rel(&code, ins.imm_bytes);
 			size_t dest = (size_t)code + rel;
 			gen_push_imm32(&out, (size_t)code);
-			gen_mov_rm_imm32(&out, modrm_rm_disp((int32_t)&dbt->return_cache[RETURN_CACHE_HASH((size_t)code)]), 0);
-			if (cmdline_flags->dbt_trace_all) /* Do not do any optimizations */
-				*(size_t*)(out - 4) = (size_t)dbt->return_fallback_trampoline;
-			else
-				*(size_t*)(out - 4) = (size_t)out + 5;
-			if (context && context->eip <= (DWORD)out)
+			uint32_t *shadow_target;
+			if (dbt_gen_shadow_stack_push(&out, (size_t)code, &shadow_target, context))
 			{
 				context->esp += 4;
 				context->eip = current_ip;
 				goto end_block;
 			}
+			if (cmdline_flags->dbt_trace_all) /* Do not do any optimizations */
+				*shadow_target = (size_t)cache->return_fallback_trampoline;
+			else
+			{
+				*shadow_target = (size_t)out + 5;
+				dbt_stage_reloc((uint8_t *)shadow_target, DBT_RELOC_SELF);
+			}
 			if (context)
 				out += 5;
 			else
-				gen_call(&out, dbt_get_direct_call_trampoline(dest));
+				gen_call(&out, dbt_get_direct_call_trampoline(dest, (size_t)out + 1));
 			if (dbt_gen_call_postamble(&out, (size_t)code, context))
 				goto end_block;
 			break;
@@ -1723,22 +3221,37 @@ done_prefix:
 			}
 			else
 			{
-				if (ins.segment_prefix && ins.segment_prefix != PREFIX_GS)
-					gen_byte(&out, ins.segment_prefix);
-				gen_push_rm(&out, ins.rm);
+				if (ins.segment_prefix && ins.segment_prefix != PREFIX_GS)
+					gen_byte(&out, ins.segment_prefix);
+				gen_push_rm(&out, ins.rm);
+			}
+			uint32_t *shadow_target;
+			if (dbt_gen_shadow_stack_push(&out, (size_t)code, &shadow_target, context))
+			{
+				context->esp += 8;
+				context->eip = current_ip;
+				goto end_block;
+			}
+			if (cmdline_flags->dbt_trace_all) /* Do not do any optimizations */
+				*shadow_target = (size_t)cache->return_fallback_trampoline;
+			else
+			{
+				*shadow_target = (size_t)out + 5;
+				dbt_stage_reloc((uint8_t *)shadow_target, DBT_RELOC_SELF);
 			}
-			gen_mov_rm_imm32(&out, modrm_rm_disp((int32_t)&dbt->return_cache[RETURN_CACHE_HASH((size_t)code)]), 0);
-			if (cmdline_flags->dbt_trace_all) /* Do not do any optimizations */
-				*(size_t*)(out - 4) = (size_t)dbt->return_fallback_trampoline;
+			if (context)
+				out += 5;
+			else if (dbt_staging)
+				gen_jmp(&out, dbt_stage_link(DBT_LINK_CALL_INDIRECT, (size_t)out + 1, current_ip, 0, 0));
 			else
-				*(size_t*)(out - 4) = (size_t)out + 5;
-			if (context && context->eip <= (DWORD)out)
 			{
-				context->esp += 8;
-				context->eip = current_ip;
-				goto end_block;
+				/* The inline cache expects the same stack layout as the sieve, so no dummy return address is needed */
+				uint8_t *inline_cache = dbt_gen_inline_cache(current_ip);
+				if (inline_cache)
+					gen_jmp(&out, inline_cache);
+				else
+					gen_call(&out, cache->sieve_indirect_call_dispatch_trampoline);
 			}
-			gen_call(&out, dbt->sieve_indirect_call_dispatch_trampoline);
 			if (dbt_gen_call_postamble(&out, (size_t)code, context))
 				goto end_block;
 			break;
@@ -1746,7 +3259,7 @@ done_prefix:
 
 		case HANDLER_RET:
 		{
-			dbt_gen_ret_trampoline(&out, context);
+			dbt_gen_ret_trampoline(cache, &out, context);
 			goto end_block;
 		}
 
@@ -1765,7 +3278,7 @@ done_prefix:
 			}
 			/* lea esp, [esp - 4 + count] */
 			gen_lea(&out, 4, rm);
-			dbt_gen_ret_trampoline(&out, context);
+			dbt_gen_ret_trampoline(cache, &out, context);
 			goto end_block;
 		}
 
@@ -1773,12 +3286,34 @@ done_prefix:
 		{
 			int32_t rel = parse_rel(&code, ins.imm_bytes);
 			size_t dest = (size_t)code + rel;
+			if (superblock && dest == pc)
+			{
+				/* Loop back edge, jump to superblock entry */
+				gen_jmp(&out, block->start);
+				goto end_block;
+			}
+			if (superblock && segments < DBT_SUPERBLOCK_MAX_SEGMENTS && dest > pc && dest < pc + DBT_SUPERBLOCK_MAX_SPAN)
+			{
+				/* Continue translation at jump target */
+				if ((size_t)code > end_pc)
+					end_pc = (size_t)code;
+				segments++;
+				segment_pc = dest;
+				code = (uint8_t *)dest;
+				break;
+			}
+			gen_patchable_align(&out, 1);
+			if (context && context->eip <= (DWORD)out)
+			{
+				context->eip = current_ip;
+				goto end_block;
+			}
 			if (context)
 				out += 5;
 			else
 			{
 				size_t patch_addr = (size_t)out + 1;
-				gen_jmp(&out, dbt_get_direct_trampoline(dest, patch_addr));
+				gen_jmp(&out, dbt_get_branch_trampoline(segment_pc, current_ip, dest, patch_addr));
 			}
 			goto end_block;
 		}
@@ -1804,7 +3339,13 @@ done_prefix:
 				context->esp += 4;
 				goto end_block;
 			}
-			gen_jmp(&out, dbt->sieve_dispatch_trampoline);
+			if (dbt_staging)
+				gen_jmp(&out, dbt_stage_link(DBT_LINK_JMP_INDIRECT, (size_t)out + 1, current_ip, 0, 0));
+			else if (!context)
+			{
+				uint8_t *inline_cache = dbt_gen_inline_cache(current_ip);
+				gen_jmp(&out, inline_cache? inline_cache: cache->sieve_dispatch_trampoline);
+			}
 			goto end_block;
 		}
 
@@ -1814,15 +3355,61 @@ done_prefix:
 			int32_t rel = parse_rel(&code, ins.imm_bytes);
 			size_t dest0 = (size_t)code + rel; /* Branch taken */
 			size_t dest1 = (size_t)code; /* Branch not taken */
+			if (superblock && dest0 == pc)
+			{
+				/* Loop back edge, jump to superblock entry and continue with loop exit */
+				gen_jcc(&out, cond, (size_t)block->start);
+				segment_pc = dest1;
+				break;
+			}
+			if (superblock && segments < DBT_SUPERBLOCK_MAX_SEGMENTS)
+			{
+				/* Lay out the predicted direction as fall-through */
+				bool taken;
+				if (context)
+					taken = (block->superblock_branches >> segments) & 1;
+				else
+				{
+					taken = dest0 > pc && dest0 < pc + DBT_SUPERBLOCK_MAX_SPAN
+						&& dbt_predict_branch_taken(segment_pc, dest1, dest0);
+					if (taken)
+						block->superblock_branches |= 1 << segments;
+				}
+				size_t exit_pc = taken? dest1: dest0;
+				size_t next_pc = taken? dest0: dest1;
+				gen_patchable_align(&out, 2);
+				if (context && context->eip <= (DWORD)out)
+				{
+					context->eip = current_ip;
+					goto end_block;
+				}
+				if (context)
+					out += 6;
+				else
+				{
+					size_t patch_addr = (size_t)out + 2;
+					/* Inverting the lowest bit of the condition code inverts the condition */
+					gen_jcc(&out, taken? cond ^ 1: cond, (size_t)dbt_get_branch_trampoline(segment_pc, current_ip, exit_pc, patch_addr));
+				}
+				if ((size_t)code > end_pc)
+					end_pc = (size_t)code;
+				segments++;
+				segment_pc = next_pc;
+				code = (uint8_t *)next_pc;
+				break;
+			}
+			gen_patchable_align(&out, 2);
 			if (context)
 				out += 6;
 			else
 			{
 				size_t patch_addr0 = (size_t)out + 2;
-				gen_jcc(&out, cond, (size_t)dbt_get_direct_trampoline(dest0, patch_addr0));
+				gen_jcc(&out, cond, (size_t)dbt_get_branch_trampoline(segment_pc, current_ip, dest0, patch_addr0));
 			}
-			if (context && context->eip == (DWORD)out)
+			gen_patchable_align(&out, 1);
+			if (context && context->eip <= (DWORD)out)
 			{
+				/* Jcc has no side effects, just rollback */
 				context->eip = current_ip;
 				goto end_block;
 			}
@@ -1842,24 +3429,34 @@ done_prefix:
 			size_t dest0 = (size_t)code + rel; /* Branch taken */
 			size_t dest1 = (size_t)code; /* Branch not taken */
 			/* LOOP, LOOPE, LOOPNE, JCXZ, JECXZ, JRCXZ */
+			/* Align so that both rel32 fields are 4-byte aligned */
+			gen_patchable_align(&out, 5);
 			/* op $+2 */
 			gen_byte(&out, ins.opcode);
 			gen_byte(&out, 2); /* sizeof(jmp rel8) */
-			/* jmp $+5 */
+			/* jmp $+8 */
 			gen_byte(&out, 0xEB);
-			gen_byte(&out, 5); /* sizeof(jmp rel32) */
+			gen_byte(&out, 8); /* sizeof(jmp rel32) + 3 bytes padding */
 			if (context)
 				out += 5;
 			else
 			{
 				size_t patch_addr0 = (size_t)out + 1;
-				gen_jmp(&out, dbt_get_direct_trampoline(dest0, patch_addr0));
+				gen_jmp(&out, dbt_get_branch_trampoline(segment_pc, current_ip, dest0, patch_addr0));
 			}
 			if (context && context->eip <= (DWORD)out)
 			{
 				context->eip = current_ip;
 				goto end_block;
 			}
+			/* Padding, never executed */
+			gen_patchable_align(&out, 1);
+			if (context && context->eip == (DWORD)out)
+			{
+				/* The branch is not taken */
+				context->eip = (DWORD)code;
+				goto end_block;
+			}
 			if (context)
 				out += 5;
 			else
@@ -1878,6 +3475,13 @@ done_prefix:
 				log_error("INT 0x%x not supported.", id);
 				__debugbreak();
 			}
+			void *fast_handler = syscall_eax_known? get_fast_syscall_handler(eax_value): NULL;
+			if (fast_handler)
+			{
+				if (dbt_gen_fast_syscall(&out, fast_handler, (size_t)code, current_ip, context))
+					goto end_block;
+				break;
+			}
 			gen_push_imm32(&out, (size_t)code);
 			if (context && context->eip == (DWORD)out)
 			{
@@ -1896,10 +3500,21 @@ done_prefix:
 				log_error("mov from segment selectors other than GS not supported.");
 				__debugbreak();
 			}
-			int temp_reg = find_unused_register(&ins);
-			/* mov fs:[scratch], temp_reg */
-			gen_fs_prefix(&out);
-			gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
+			if (modrm_rm_is_r(ins.rm) && !ins.opsize_prefix)
+			{
+				/* mov |rm|, fs:[gs] */
+				gen_fs_prefix(&out);
+				gen_mov_r_rm_32(&out, ins.rm.base, modrm_rm_disp(dbt_global->tls_gs_offset));
+				break;
+			}
+			bool temp_dead;
+			int temp_reg = find_temp_register(&ins, code, &temp_dead);
+			if (!temp_dead)
+			{
+				/* mov fs:[scratch], temp_reg */
+				gen_fs_prefix(&out);
+				gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
+			}
 
 			/* mov temp_reg, fs:[gs] */
 			gen_fs_prefix(&out);
@@ -1908,7 +3523,8 @@ done_prefix:
 			{
 				/* The instruction is not yet executed, rollback */
 				context->eip = current_ip;
-				set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+				if (!temp_dead)
+					set_context_register(context, temp_reg, dbt_host_read_tls(dbt_global->tls_scratch_offset));
 				goto end_block;
 			}
 
@@ -1918,13 +3534,17 @@ done_prefix:
 			{
 				/* The instruction is already executed, commit */
 				context->eip = (DWORD)code;
-				set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+				if (!temp_dead)
+					set_context_register(context, temp_reg, dbt_host_read_tls(dbt_global->tls_scratch_offset));
 				goto end_block;
 			}
 
-			/* mov temp_reg, fs:[scratch] */
-			gen_fs_prefix(&out);
-			gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
+			if (!temp_dead)
+			{
+				/* mov temp_reg, fs:[scratch] */
+				gen_fs_prefix(&out);
+				gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
+			}
 			break;
 		}
 
@@ -1977,7 +3597,31 @@ done_prefix:
 			/* mov temp_reg, fs:[scratch] */
 			gen_fs_prefix(&out);
 			gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
-			break;
+
+			/* The gs base may have changed, code translated for the old base must not be
+			 * executed. Leave the block through dbt_find_direct() which checks the base.
+			 * The patch address is not in any code cache so the jump is never linked. */
+			if (context && context->eip == (DWORD)out)
+			{
+				context->eip = (DWORD)code;
+				goto end_block;
+			}
+			gen_push_imm32(&out, 0);
+			if (context && context->eip == (DWORD)out)
+			{
+				context->esp += 4;
+				context->eip = (DWORD)code;
+				goto end_block;
+			}
+			gen_push_imm32(&out, (size_t)code);
+			if (context && context->eip == (DWORD)out)
+			{
+				context->esp += 8;
+				context->eip = (DWORD)code;
+				goto end_block;
+			}
+			gen_jmp(&out, (void*)dbt_find_direct_internal);
+			goto end_block;
 		}
 
 		case HANDLER_CPUID:
@@ -1993,142 +3637,610 @@ done_prefix:
 		break;
 	}
 	if (!context)
-		dbt->out = out;
+	{
+		if (last_handler_type != -1)
+			dbt_count_instruction(last_handler_type, out - last_out);
+		block->end_pc = (size_t)code > end_pc? (size_t)code: end_pc;
+		block->end = out;
+		if (dbt_staging)
+		{
+			dbt_staging->code_hash = dbt_hash_code(block->pc, block->end_pc);
+			dbt_staging->translate_cycles = __rdtsc() - start_cycles;
+			return block;
+		}
+		if (block->hot)
+			cache->hot_out = out;
+		else
+			cache->out = out;
+		if (block->end_pc - block->pc > cache->max_block_span)
+			cache->max_block_span = block->end_pc - block->pc;
+		if (block->checked)
+			block->code_hash = dbt_hash_code(block->pc, block->end_pc);
+		else
+			dbt_protect_code(block->pc, block->end_pc);
+		dbt_global->translated_source_bytes += block->end_pc - block->pc;
+		dbt_global->translated_code_bytes += block->end - block->start;
+		dbt_global->translate_cycles += __rdtsc() - start_cycles;
+	}
 	return block;
 }
 
-static uint8_t *dbt_find(size_t pc)
+/* Check whether the basic block at pc can be translated without faulting
+ * A guessed branch target may be data or not mapped at all. The guest thread would
+ * never get there, but the translator stops the process on undecodable code. */
+static bool dbt_block_decodable(size_t pc)
 {
-	int bucket = hash_block_pc(pc);
-	slist_iterate(&dbt->block_hash[bucket], prev, cur)
+	uint8_t *code = (uint8_t *)pc;
+	for (int i = 0; i < DBT_BACKGROUND_MAX_INSTRUCTIONS; i++)
 	{
-		struct dbt_block *block = slist_entry(cur, struct dbt_block, list);
-		if (block->pc == pc)
+		/* 15 bytes is the maximum length of an instruction */
+		if (!mm_check_read(code, 15))
+			return false;
+		struct instruction_t ins;
+		int decoded = x86_decode(code, &ins);
+		if (decoded < 0)
+			return false;
+		switch (ins.desc->handler_type)
 		{
-			if (cmdline_flags->dbt_trace_all)
-			{
-				dbt_save_simd_state();
-				log_debug("dbt_find: block pc: %p, translated pc: %p, end: %p", block->pc, block->start, dbt->end);
-				dbt_restore_simd_state();
-			}
-			return block->start;
+		case HANDLER_INT:
+			return code[decoded] == 0x80;
+
+		case HANDLER_MOV_FROM_SEG:
+		case HANDLER_MOV_TO_SEG:
+			if (ins.r != 5) /* GS */
+				return false;
+			break;
+
+		case HANDLER_PRIVILEGED:
+		case HANDLER_CALL_DIRECT:
+		case HANDLER_CALL_INDIRECT:
+		case HANDLER_RET:
+		case HANDLER_RETN:
+		case HANDLER_JMP_DIRECT:
+		case HANDLER_JMP_INDIRECT:
+		case HANDLER_JCC:
+		case HANDLER_JCC_REL8:
+			/* End of basic block */
+			return true;
 		}
+		code += x86_decode_length(code);
 	}
+	return false;
+}
+
+/* Whether a queued direct branch target is worth translating, dbt lock must be held */
+static bool dbt_background_wanted(size_t pc)
+{
+	/* Do not let speculative translations fill up the code cache, leave room for the application */
+	if (dbt->end - dbt->out < DBT_CACHE_SIZE / 2 || dbt->blocks_count >= MAX_DBT_BLOCKS / 2)
+		return false;
+	/* The guest thread may have got there first */
+	return !find_block(pc);
+}
+
+/* Look up a translated block, dbt lock must be held */
+static uint8_t *dbt_lookup(size_t pc)
+{
+	struct dbt_block *block = find_block(pc);
+	if (block && cmdline_flags->dbt_trace_all)
+	{
+		dbt_save_simd_state();
+		log_debug("dbt_find: block pc: %p, translated pc: %p, end: %p", block->pc, block->start, dbt->end);
+		dbt_restore_simd_state();
+	}
+	return block? block->start: NULL;
+}
+
+/* Translate the blocks recorded in the persistent translation cache in the page of a
+ * newly translated block, dbt lock must be held exclusively */
+static void dbt_translate_recorded(size_t pc)
+{
+	size_t pcs[DBT_PERSIST_BATCH_SIZE];
+	int count = dbt_persist_take_blocks(pc, pcs, DBT_PERSIST_BATCH_SIZE);
+	for (int i = 0; i < count; i++)
+	{
+		if (dbt_global->background_event)
+			dbt_queue_background(pcs[i]);
+		else if (dbt_background_wanted(pcs[i]) && !mm_is_code_volatile(pcs[i]) && dbt_block_decodable(pcs[i]))
+		{
+			/* The code cache is at most half full, the translation does not flush it */
+			struct dbt_block *block = dbt_translate(dbt, pcs[i], false, NULL);
+			slist_add(&dbt->block_hash[hash_block_pc(pcs[i])], &block->list);
+		}
+	}
+}
+
+/* Look up or translate a block, dbt lock must be held exclusively */
+static uint8_t *dbt_find(size_t pc)
+{
+	dbt_handle_code_changed(true);
+	uint8_t *start = dbt_lookup(pc);
+	if (start)
+		return start;
 
 	/* Block not found, translate it now */
-	struct dbt_block *block = dbt_translate(pc, NULL);
-	slist_add(&dbt->block_hash[bucket], &block->list);
+	struct dbt_block *block = dbt_translate(dbt, pc, false, NULL);
+	/* The block is fully generated, publish it */
+	slist_add(&dbt->block_hash[hash_block_pc(pc)], &block->list);
+	dbt_translate_recorded(pc);
 	return block->start;
 }
 
+/* Translate a queued direct branch target into the staging buffer, without holding the dbt lock
+ * The cache is kept from being reclaimed by the caller. Returns false if the target is not translated. */
+static bool dbt_stage_block(struct dbt_staging *staging, struct dbt_data *cache, size_t pc)
+{
+	if (mm_is_code_volatile(pc) || !dbt_block_decodable(pc))
+		return false;
+	staging->cache = cache;
+	staging->overflow = false;
+	staging->relocs_count = 0;
+	staging->links_count = 0;
+	staging->gs_folded_modrm_count = 0;
+	staging->gs_folded_moffset_count = 0;
+	staging->gs_generic_count = 0;
+	memset(staging->handler_instructions_count, 0, sizeof(staging->handler_instructions_count));
+	memset(staging->handler_code_bytes, 0, sizeof(staging->handler_code_bytes));
+	dbt_staging = staging;
+	dbt_translate(cache, pc, false, NULL);
+	dbt_staging = NULL;
+	return !staging->overflow;
+}
+
+/* Create the target of a patchable branch of a staged block */
+static uint8_t *dbt_resolve_staged_link(struct dbt_staging_link *link, uint8_t *patch_addr)
+{
+	switch (link->type)
+	{
+	case DBT_LINK_DIRECT:
+		return dbt_get_direct_trampoline(link->target, (size_t)patch_addr);
+
+	case DBT_LINK_BRANCH:
+		return dbt_get_branch_trampoline(link->segment_pc, link->source_pc, link->target, (size_t)patch_addr);
+
+	case DBT_LINK_DIRECT_CALL:
+		return dbt_get_direct_call_trampoline(link->target, (size_t)patch_addr);
+
+	case DBT_LINK_JMP_INDIRECT:
+	{
+		uint8_t *inline_cache = dbt_gen_inline_cache(link->target);
+		return inline_cache? inline_cache: dbt->sieve_dispatch_trampoline;
+	}
+
+	default: /* DBT_LINK_CALL_INDIRECT */
+	{
+		uint8_t *inline_cache = dbt_gen_inline_cache(link->target);
+		if (inline_cache)
+			return inline_cache;
+		/* The sieve expects a dummy return address, see HANDLER_CALL_INDIRECT */
+		patch_addr[-1] = 0xE8; /* call rel32 */
+		return dbt->sieve_indirect_call_dispatch_trampoline;
+	}
+	}
+}
+
+/* Copy a staged block into the code cache, dbt lock must be held exclusively
+ * The block is dropped if the code cache or the guest code has changed since it was translated */
+static void dbt_publish_staged_block(struct dbt_staging *staging)
+{
+	struct dbt_block *staged = &staging->block;
+	dbt_handle_code_changed(true);
+	if (dbt != staging->cache || !dbt_background_wanted(staged->pc))
+		return;
+	/* From now on writes to the guest code are caught, check it is still what was translated */
+	dbt_protect_code(staged->pc, staged->end_pc);
+	if (dbt_hash_code(staged->pc, staged->end_pc) != staging->code_hash)
+		return;
+	struct dbt_block *block = alloc_block();
+	*block = *staged;
+	block->start = (uint8_t *)ALIGN_TO(dbt->out, DBT_OUT_ALIGN);
+	block->end = block->start + (staged->end - staged->start);
+	if (staged->space_exhausted_out)
+		block->space_exhausted_out = block->start + (staged->space_exhausted_out - staged->start);
+	memcpy(block->start, staged->start, staged->end - staged->start);
+	/* Both the buffer and the block are DBT_OUT_ALIGN aligned, so are the patchable branches */
+	size_t delta = block->start - staged->start;
+	for (int i = 0; i < staging->relocs_count; i++)
+	{
+		uint8_t *field = block->start + staging->relocs[i].offset;
+		switch (staging->relocs[i].type)
+		{
+		case DBT_RELOC_BRANCH: *(uint32_t *)field -= (uint32_t)delta; break;
+		case DBT_RELOC_SELF: *(uint32_t *)field += (uint32_t)delta; break;
+		case DBT_RELOC_BLOCK: *(uint32_t *)field += (uint32_t)((uint8_t *)block - (uint8_t *)staged); break;
+		}
+	}
+	for (int i = 0; i < staging->links_count; i++)
+	{
+		uint8_t *patch_addr = block->start + staging->links[i].offset;
+		uint8_t *target = dbt_resolve_staged_link(&staging->links[i], patch_addr);
+		*(int32_t *)patch_addr = (int32_t)(target - (patch_addr + 4));
+	}
+	dbt->out = block->end;
+	if (block->end_pc - block->pc > dbt->max_block_span)
+		dbt->max_block_span = block->end_pc - block->pc;
+	rb_add(&dbt->tree, &block->tree, tree_cmp);
+	rb_add(&dbt->cache_tree, &block->cache_tree, cache_tree_cmp);
+	slist_add(&dbt->block_hash[hash_block_pc(block->pc)], &block->list);
+	/* The trampoline of the target still jumps to dbt_find_direct() which then only needs to patch the branch */
+	dbt_global->translated_blocks_count++;
+	dbt_global->gs_folded_modrm_count += staging->gs_folded_modrm_count;
+	dbt_global->gs_folded_moffset_count += staging->gs_folded_moffset_count;
+	dbt_global->gs_generic_count += staging->gs_generic_count;
+	for (int i = 0; i < DBT_HANDLER_TYPES; i++)
+	{
+		dbt_global->handler_instructions_count[i] += staging->handler_instructions_count[i];
+		dbt_global->handler_code_bytes[i] += staging->handler_code_bytes[i];
+	}
+	dbt_global->translated_source_bytes += block->end_pc - block->pc;
+	dbt_global->translated_code_bytes += block->end - block->start;
+	dbt_global->translate_cycles += staging->translate_cycles;
+}
+
+static void dbt_background_thread()
+{
+	struct dbt_staging *staging = &dbt_background_staging;
+	for (;;)
+	{
+		dbt_host_wait_event(dbt_global->background_event);
+		bool more;
+		do
+		{
+			/* The lock is only taken to pop the queue and to publish the block, guest threads
+			 * are not held up while the block is translated */
+			struct dbt_data *cache = NULL;
+			size_t pc = 0;
+			dbt_lock_exclusive();
+			dbt_global->background_signaled = false;
+			more = dbt_global->background_head != dbt_global->background_tail;
+			if (more)
+			{
+				pc = dbt_global->background_queue[dbt_global->background_head];
+				dbt_global->background_head = (dbt_global->background_head + 1) & (DBT_BACKGROUND_QUEUE_SIZE - 1);
+				if (dbt_background_wanted(pc))
+				{
+					/* A cache with users is never reclaimed, if it is still current on publish
+					 * it has not been retired meanwhile */
+					cache = dbt;
+					InterlockedIncrement(&cache->users);
+				}
+			}
+			dbt_unlock_exclusive();
+			if (cache)
+			{
+				bool staged = dbt_stage_block(staging, cache, pc);
+				dbt_lock_exclusive();
+				if (staged)
+					dbt_publish_staged_block(staging);
+				InterlockedDecrement(&cache->users);
+				dbt_unlock_exclusive();
+			}
+		} while (more);
+	}
+}
+
+int dbt_get_translated_blocks(size_t low, size_t high, size_t *pcs, int max_count)
+{
+	dbt_lock_shared();
+	struct dbt_block probe;
+	probe.pc = low;
+	int count = 0;
+	for (struct rb_node *node = rb_lower_bound(&dbt->tree, &probe.tree, tree_cmp); node && count < max_count; node = rb_next(node))
+	{
+		struct dbt_block *block = rb_entry(node, struct dbt_block, tree);
+		if (block->pc >= high)
+			break;
+		pcs[count++] = block->pc;
+	}
+	dbt_unlock_shared();
+	return count;
+}
+
+int dbt_translate_block(size_t pc)
+{
+	if (!dbt_block_decodable(pc))
+		return -1;
+	dbt_lock_exclusive();
+	dbt_find(pc);
+	struct dbt_block *block = find_block(pc);
+	int size = block? (int)(block->end - block->start): 0;
+	dbt_unlock_exclusive();
+	return size;
+}
+
 EXTERN_C void dbt_find_next(size_t pc);
 void dbt_find_next(size_t pc)
 {
-	dbt_set_return_addr(pc, (size_t)dbt_find(pc));
+	InterlockedIncrement(&dbt_global->indirect_lookups_count);
+	/* Fast path: the block is already translated, only a shared lock is needed */
+	dbt_lock_shared();
+	uint8_t *target;
+	if (!dbt_global->code_changed_pending && (target = dbt_lookup(pc)))
+	{
+		dbt_enter();
+		dbt_set_return_addr(pc, (size_t)target);
+		dbt_unlock_shared();
+		return;
+	}
+	dbt_unlock_shared();
+
+	dbt_lock_exclusive();
+	target = dbt_find(pc);
+	dbt_enter();
+	dbt_set_return_addr(pc, (size_t)target);
+	dbt_unlock_exclusive();
 }
 
 EXTERN_C void dbt_find_next_sieve(size_t pc);
 void dbt_find_next_sieve(size_t pc)
 {
+	dbt_lock_exclusive();
+	InterlockedIncrement(&dbt_global->indirect_lookups_count);
 	uint8_t *target = dbt_find(pc);
+	dbt_enter();
 	if (cmdline_flags->dbt_trace_all)
 	{
 		/* Do not do any optimizations */
 		dbt_set_return_addr(pc, (size_t)target);
+		dbt_unlock_exclusive();
 		return;
 	}
 	uint8_t *sieve = dbt_gen_sieve(pc, target);
-	/* Patch sieve table */
-	int hash = SIEVE_HASH(pc);
-	if (dbt->sieve_table[hash] == (void*)&dbt_sieve_fallback)
-		dbt->sieve_table[hash] = sieve;
-	else
+	/* Patch sieve table, the most recently resolved target is checked first */
+	int hash = SIEVE_HASH(dbt, pc);
+	dbt_sieve_set_next_bucket(sieve, dbt->sieve_table[hash]);
+	InterlockedExchangePointer((PVOID *)&dbt->sieve_table[hash], sieve);
+	/* Keep the bucket short, trimmed targets come back through dbt_sieve_fallback() when used again */
+	uint8_t *current = sieve;
+	int length;
+	for (length = 1;; length++)
 	{
-		uint8_t *current = dbt->sieve_table[hash];
-		for (;;)
+		uint8_t *next_bucket = dbt_sieve_next_bucket(current);
+		if (next_bucket == (void*)&dbt_sieve_fallback)
+			break;
+		if (length == DBT_SIEVE_MAX_CHAIN)
 		{
-			uint8_t *next_bucket_rel = *(uint8_t**)&current[DBT_SIEVE_NEXT_BUCKET_OFFSET];
-			uint8_t *next_bucket = next_bucket_rel + (size_t)(current + DBT_SIEVE_NEXT_BUCKET_OFFSET + sizeof(size_t));
-			if (next_bucket == (void*)&dbt_sieve_fallback)
-				break;
-			current = next_bucket;
+			dbt_sieve_set_next_bucket(current, (uint8_t*)&dbt_sieve_fallback);
+			dbt_global->sieve_trims_count++;
+			break;
+		}
+		current = next_bucket;
+	}
+	if (length > dbt_global->sieve_max_chain)
+		dbt_global->sieve_max_chain = length;
+	/* Too many targets collide, spread them over a larger table */
+	if (length >= DBT_SIEVE_GROW_CHAIN && !cmdline_flags->dbt_table_bits)
+		dbt_grow_sieve();
+	dbt_set_return_addr(pc, (size_t)target);
+	dbt_unlock_exclusive();
+}
+
+/* Called when a return does not go to the address predicted by the shadow stack */
+EXTERN_C void dbt_find_next_return(size_t pc);
+void dbt_find_next_return(size_t pc)
+{
+	InterlockedIncrement(&dbt_global->return_mispredicts_count);
+	/* The mispredicted entry is already popped. The return may skip frames (longjmp,
+	 * exception unwinding), in which case we unwind the shadow stack to the matching
+	 * entry. Otherwise the return was not paired with a call, e.g. a signal handler
+	 * returning to the restorer, so the popped entry is put back. */
+	size_t top = dbt_host_read_tls(dbt_global->tls_shadow_stack_offset);
+	size_t base = top & -DBT_SHADOW_STACK_SIZE;
+	size_t offset = top + sizeof(struct dbt_shadow_entry);
+	size_t new_top = base | (offset & (DBT_SHADOW_STACK_SIZE - 1));
+	for (int i = 0; i < DBT_SHADOW_STACK_RESYNC_DEPTH; i++)
+	{
+		struct dbt_shadow_entry *entry = (struct dbt_shadow_entry *)(base | (offset & (DBT_SHADOW_STACK_SIZE - 1)));
+		if (entry->pc == pc)
+		{
+			new_top = base | ((offset - sizeof(struct dbt_shadow_entry)) & (DBT_SHADOW_STACK_SIZE - 1));
+			break;
+		}
+		offset -= sizeof(struct dbt_shadow_entry);
+	}
+	dbt_host_write_tls(dbt_global->tls_shadow_stack_offset, (DWORD)new_top);
+	dbt_find_next_sieve(pc);
+}
+
+EXTERN_C void dbt_inline_cache_miss(size_t pc, struct dbt_inline_cache *ic);
+void dbt_inline_cache_miss(size_t pc, struct dbt_inline_cache *ic)
+{
+	dbt_lock_exclusive();
+	InterlockedIncrement(&dbt_global->indirect_lookups_count);
+	uint8_t *target = dbt_find(pc);
+	dbt_enter();
+	/* If the cache is flushed in between, the inline cache belongs to a retired cache, leave it alone */
+	if (ic >= dbt->inline_caches && ic < dbt->inline_caches + dbt->inline_caches_count)
+	{
+		ic->misses++;
+		/* Another thread may have added the same target in between */
+		bool found = false;
+		uint8_t *entry = dbt_inline_cache_first(ic);
+		for (int i = 0; i < ic->entries; i++)
+		{
+			if (*(size_t *)&entry[DBT_SIEVE_PC_OFFSET] == -pc)
+				found = true;
+			entry = dbt_sieve_next_bucket(entry);
+		}
+		if (!found && ic->entries < DBT_INLINE_CACHE_ENTRIES && dbt->end - dbt->out >= DBT_BLOCK_MAXSIZE)
+		{
+			entry = dbt_gen_sieve(pc, target);
+			dbt_sieve_set_next_bucket(entry, dbt_inline_cache_first(ic));
+			dbt_inline_cache_set_first(ic, entry);
+			if (!ic->last_entry)
+				ic->last_entry = entry;
+			ic->entries++;
+			dbt_global->inline_cache_entries_count++;
+		}
+		else if (!found && ic->entries == DBT_INLINE_CACHE_ENTRIES && !ic->megamorphic)
+		{
+			/* Too many targets, look up further targets in the sieve table */
+			dbt_sieve_set_next_bucket(ic->last_entry, dbt->return_fallback_trampoline);
+			ic->megamorphic = true;
+			dbt_global->megamorphic_sites_count++;
 		}
-		uint8_t *next_bucket_rel = sieve - (size_t)(current + DBT_SIEVE_NEXT_BUCKET_OFFSET + sizeof(size_t));
-		*(uint8_t**)&current[DBT_SIEVE_NEXT_BUCKET_OFFSET] = next_bucket_rel;
 	}
 	dbt_set_return_addr(pc, (size_t)target);
+	dbt_unlock_exclusive();
 }
 
 EXTERN_C void dbt_find_direct(size_t pc, size_t patch_addr);
 void dbt_find_direct(size_t pc, size_t patch_addr)
 {
 	/* Translate or generate the block */
-	dbt_flushed = false;
+	dbt_lock_exclusive();
+	InterlockedIncrement(&dbt_global->direct_lookups_count);
+	dbt_check_gs_base();
 	size_t block_start = (size_t)dbt_find(pc);
-	if (!dbt_flushed && !cmdline_flags->dbt_trace_all)
+	dbt_enter();
+	/* If the cache is flushed in between, the patch site is in a retired cache, leave it alone */
+	if (dbt_in_cache(dbt, patch_addr) && !cmdline_flags->dbt_trace_all)
 	{
 		/* Patch the jmp/call address so we don't need to repeat work again */
-		*(size_t*)patch_addr = (intptr_t)(block_start - (patch_addr + 4)); /* Relative address */
+		/* Patch sites never cross a cache line, other threads see either the old or the new target */
+		InterlockedExchange((volatile LONG *)patch_addr, (LONG)(block_start - (patch_addr + 4))); /* Relative address */
 	}
 	dbt_set_return_addr(pc, block_start);
+	dbt_unlock_exclusive();
+}
+
+/* Translate a superblock starting at a hot loop head, dbt lock must be held exclusively */
+static struct dbt_block *dbt_build_superblock(size_t pc)
+{
+	struct dbt_block *superblock = dbt_translate(dbt, pc, true, NULL);
+	/* Replace the plain block, direct jumps linked to it are redirected through its entry */
+	struct dbt_block *block = find_block(pc);
+	if (block)
+		dbt_invalidate_block(block);
+	slist_add(&dbt->block_hash[hash_block_pc(pc)], &superblock->list);
+	dbt_global->superblocks_count++;
+	if (cmdline_flags->dbt_trace)
+	{
+		dbt_save_simd_state();
+		log_debug("dbt: superblock formed at pc %p, translated pc: %p, size: %d", pc, superblock->start, superblock->end - superblock->start);
+		dbt_restore_simd_state();
+	}
+	return superblock;
+}
+
+EXTERN_C void dbt_check_code(struct dbt_block *block, size_t return_addr);
+void dbt_check_code(struct dbt_block *block, size_t return_addr)
+{
+	InterlockedIncrement(&dbt_global->code_checks_count);
+	if (dbt_hash_code(block->pc, block->end_pc) == block->code_hash)
+	{
+		/* The guest code is intact, continue with the block */
+		dbt_set_return_addr(block->pc, return_addr);
+		return;
+	}
+	/* The guest code has changed since translation, retranslate it */
+	InterlockedIncrement(&dbt_global->code_check_misses_count);
+	dbt_code_changed(block->pc, block->end_pc - block->pc);
+	dbt_lock_exclusive();
+	uint8_t *target = dbt_find(block->pc);
+	dbt_enter();
+	dbt_set_return_addr(block->pc, (size_t)target);
+	dbt_unlock_exclusive();
+}
+
+EXTERN_C void dbt_find_superblock(size_t pc, size_t patch_addr);
+void dbt_find_superblock(size_t pc, size_t patch_addr)
+{
+	dbt_lock_exclusive();
+	InterlockedIncrement(&dbt_global->direct_lookups_count);
+	dbt_handle_code_changed(true);
+	dbt->superblock_counters[SUPERBLOCK_COUNTER_HASH(pc)] = DBT_SUPERBLOCK_THRESHOLD;
+	struct dbt_block *block = find_block(pc);
+	/* Checked blocks are never turned into superblocks */
+	if (!block || (!block->superblock && !block->checked))
+		block = dbt_build_superblock(pc);
+	dbt_enter();
+	/* Link the loop branch directly to the superblock, this stops counting */
+	if (dbt_in_cache(dbt, patch_addr))
+		InterlockedExchange((volatile LONG *)patch_addr, (LONG)((size_t)block->start - (patch_addr + 4)));
+	dbt_set_return_addr(pc, (size_t)block->start);
+	dbt_unlock_exclusive();
 }
 
 void __declspec(noreturn) dbt_run(size_t pc, size_t sp)
 {
+	dbt_lock_exclusive();
 	size_t entrypoint = (size_t)dbt_find(pc);
-	log_info("dbt: Calling into application code generated at %p, (original: pc: %p, sp: %p)", entrypoint, pc, sp);
+	dbt_enter();
 	dbt_set_return_addr(pc, entrypoint);
-	((void(*)(size_t sp))dbt->run_trampoline)(sp);
+	void *run_trampoline = dbt->run_trampoline;
+	dbt_unlock_exclusive();
+	log_info("dbt: Calling into application code generated at %p, (original: pc: %p, sp: %p)", entrypoint, pc, sp);
+	((void(*)(size_t sp))run_trampoline)(sp);
 }
 
 void __declspec(noreturn) dbt_restore_fork_context(struct syscall_context *ctx)
 {
 	log_info("dbt: Restoring fork context, (original: pc: %p, sp: %p)", ctx->eip, ctx->esp);
-	((void(*)(struct syscall_context *ctx))dbt->restore_fork_trampoline)(ctx);
+	dbt_lock_shared();
+	dbt_enter();
+	void *restore_fork_trampoline = dbt->restore_fork_trampoline;
+	dbt_unlock_shared();
+	((void(*)(struct syscall_context *ctx))restore_fork_trampoline)(ctx);
 }
 
 int dbt_get_gs()
 {
-	return __readfsdword(dbt_global->tls_gs_offset);
+	return dbt_host_read_tls(dbt_global->tls_gs_offset);
 }
 
 void dbt_update_tls(int gs)
 {
-	DWORD gs_addr = __readfsdword(tls_user_entry_to_offset(gs >> 3));
-	__writefsdword(dbt_global->tls_gs_offset, gs);
-	__writefsdword(dbt_global->tls_gs_addr_offset, gs_addr);
+	DWORD gs_addr = dbt_host_read_tls(tls_user_entry_to_offset(gs >> 3));
+	dbt_host_write_tls(dbt_global->tls_gs_offset, gs);
+	dbt_host_write_tls(dbt_global->tls_gs_addr_offset, gs_addr);
+	dbt_lock_exclusive();
+	dbt_check_gs_base();
+	dbt_unlock_exclusive();
 }
 
 void dbt_deliver_signal(HANDLE thread, CONTEXT *context)
 {
-	THREAD_BASIC_INFORMATION info;
-	NtQueryInformationThread(thread, ThreadBasicInformation, &info, sizeof(info), NULL);
-	struct dbt_data *dbt = *(struct dbt_data **)((uint8_t*)info.TebBaseAddress + dbt_global->tls_dbt_offset);
+	size_t tls_base = dbt_host_thread_tls_base(thread);
+	struct dbt_thread_data *thread_data = *(struct dbt_thread_data **)(tls_base + dbt_global->tls_dbt_offset);
 	/* Are we inside code cache? */
-	if (context->Eip >= (DWORD)dbt->internal_trampoline_end && context->Eip < (DWORD)dbt->code_cache + DBT_CACHE_SIZE)
+	/* The target thread is suspended and may hold the dbt lock, so we must not take it here */
+	struct dbt_data *cache = dbt_find_cache(context->Eip);
+	if (cache)
 	{
-		dbt->signal_need_fixup = true;
-		*(DWORD *)((uint8_t*)info.TebBaseAddress + dbt_global->tls_eip_offset) = context->Eip;
-		context->Eip = (DWORD)dbt->signal_trampoline;
+		thread_data->signal_cache = cache;
+		thread_data->signal_need_fixup = true;
+		*(DWORD *)(tls_base + dbt_global->tls_eip_offset) = context->Eip;
+		context->Eip = (DWORD)cache->signal_trampoline;
 	}
 	else
 	{
-		dbt->signal_need_fixup = false;
-		dbt->signal_pending = true;
-		*(DWORD *)((uint8_t*)info.TebBaseAddress + dbt_global->tls_return_addr_offset) = (DWORD)dbt->signal_trampoline;
+		cache = thread_data->cache? thread_data->cache: dbt;
+		thread_data->signal_need_fixup = false;
+		thread_data->signal_pending = true;
+		*(DWORD *)(tls_base + dbt_global->tls_return_addr_offset) = (DWORD)cache->signal_trampoline;
 	}
 }
 
 static void dbt_setup_signal_handler(struct syscall_context *context)
 {
-	dbt->signal_pending = false;
+	dbt_thread.signal_pending = false;
 	/* Fix up context if needed */
-	if (dbt->signal_need_fixup)
-		dbt_translate(0, context);
+	if (dbt_thread.signal_need_fixup)
+	{
+		/* The signal cache is either current or retired and pinned by us */
+		dbt_lock_shared();
+		dbt_translate(dbt_thread.signal_cache, 0, false, context);
+		dbt_unlock_shared();
+	}
 	signal_setup_handler(context);
 }
 
 void __declspec(noreturn) dbt_sigreturn(struct sigcontext *context)
 {
-	((void(*)(struct sigcontext *context))dbt->sigreturn_trampoline)(context);
+	dbt_lock_shared();
+	dbt_enter();
+	void *sigreturn_trampoline = dbt->sigreturn_trampoline;
+	dbt_unlock_shared();
+	((void(*)(struct sigcontext *context))sigreturn_trampoline)(context);
 }
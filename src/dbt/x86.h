@@ -22,6 +22,7 @@
 #include <common/signal.h>
 #include <common/sigcontext.h>
 
+#include <stdbool.h>
 #include <stdint.h>
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
@@ -45,6 +46,7 @@ struct syscall_context
 };
 
 void dbt_init_thread();
+void dbt_exit_thread();
 void dbt_init();
 void dbt_reset();
 void dbt_shutdown();
@@ -61,6 +63,28 @@ void dbt_update_tls(int gs);
 /* Called when an executable code region changes, determines whether we need to flush code cache */
 void dbt_code_changed(size_t pc, size_t len);
 
+/* Called by the page fault handler when the guest writes to a write protected code page,
+ * translations of the range are invalidated immediately */
+void dbt_code_written(size_t pc, size_t len);
+
+/* Translate the block at pc if it is not translated yet, returns the size of its translated code
+ * or -1 if the block cannot be translated. Used by the host side tools to measure the code generator */
+int dbt_translate_block(size_t pc);
+
+/* Get sorted guest addresses of translated blocks in [low, high), returns number of blocks */
+int dbt_get_translated_blocks(size_t low, size_t high, size_t *pcs, int max_count);
+
+/* Record the currently executing block and call stack of every thread in the profiler */
+void dbt_sample_threads();
+
+/* Hand execution counters of all translated blocks to the profiler */
+void dbt_collect_block_executions();
+
+/* Print code cache statistics to buf, for /proc/[pid]/dbt_stats */
+int dbt_get_stats(char *buf);
+/* Print per site inline cache statistics to buf, for /proc/[pid]/dbt_inline_caches */
+int dbt_get_inline_cache_stats(char *buf);
+
 /* Deliver the signal to the main thread's context
  * This function can only called from the signal thread */
 void dbt_deliver_signal(HANDLE thread, CONTEXT *context);
@@ -0,0 +1,305 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dbt/x86_decoder.h>
+
+/* Prefix byte classes */
+#define PREFIX_CLASS_NONE		0 /* Not a prefix, start of opcode */
+#define PREFIX_CLASS_LOCK		1
+#define PREFIX_CLASS_REP		2 /* REP/REPE/REPNE */
+#define PREFIX_CLASS_SEGMENT	3 /* Segment override */
+#define PREFIX_CLASS_OPSIZE		4 /* Operand size */
+#define PREFIX_CLASS_BAD		5 /* FS segment override and address size, not supported */
+
+#define N	PREFIX_CLASS_NONE
+#define L	PREFIX_CLASS_LOCK
+#define R	PREFIX_CLASS_REP
+#define S	PREFIX_CLASS_SEGMENT
+#define O	PREFIX_CLASS_OPSIZE
+#define B	PREFIX_CLASS_BAD
+static const uint8_t prefix_class[256] =
+{
+	/*        0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F */
+	/* 0 */   N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* 1 */   N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* 2 */   N, N, N, N, N, N, S, N, N, N, N, N, N, N, S, N,
+	/* 3 */   N, N, N, N, N, N, S, N, N, N, N, N, N, N, S, N,
+	/* 4 */   N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* 5 */   N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* 6 */   N, N, N, N, B, S, O, B, N, N, N, N, N, N, N, N,
+	/* 7 */   N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* 8 */   N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* 9 */   N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* A */   N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* B */   N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* C */   N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* D */   N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* E */   N, N, N, N, N, N, N, N, N, N, N, N, N, N, N, N,
+	/* F */   L, N, R, R, N, N, N, N, N, N, N, N, N, N, N, N,
+};
+#undef N
+#undef L
+#undef R
+#undef S
+#undef O
+#undef B
+
+/* Precomputed properties of opcodes whose descriptor can be used directly,
+ * i.e. which does not need mandatory prefix or ModR/M based extension lookup */
+#define OPCODE_TERMINAL		0x01
+#define OPCODE_MODRM		0x02 /* Followed by ModR/M byte */
+struct opcode_class
+{
+	uint8_t flags;
+	uint8_t imm_bytes[2]; /* Immediate bytes without and with operand size prefix */
+};
+
+static struct opcode_class one_byte_class[256];
+static struct opcode_class two_byte_class[256];
+
+static bool desc_has_modrm(const struct instruction_desc *desc)
+{
+	return FROM_MODRM(desc->op1) || FROM_MODRM(desc->op2) || FROM_MODRM(desc->op3);
+}
+
+static int desc_imm_bytes(const struct instruction_desc *desc, bool opsize_prefix)
+{
+	return get_imm_bytes(desc->op1, opsize_prefix, false)
+		+ get_imm_bytes(desc->op2, opsize_prefix, false)
+		+ get_imm_bytes(desc->op3, opsize_prefix, false);
+}
+
+static void build_opcode_class(struct opcode_class *cls, const struct instruction_desc *table)
+{
+	for (int i = 0; i < 256; i++)
+	{
+		const struct instruction_desc *desc = &table[i];
+		if (desc->type <= INST_TYPE_MAX)
+		{
+			cls[i].flags = 0;
+			continue;
+		}
+		cls[i].flags = OPCODE_TERMINAL;
+		if (desc_has_modrm(desc))
+			cls[i].flags |= OPCODE_MODRM;
+		cls[i].imm_bytes[0] = desc_imm_bytes(desc, false);
+		cls[i].imm_bytes[1] = desc_imm_bytes(desc, true);
+	}
+}
+
+void x86_decoder_init()
+{
+	build_opcode_class(one_byte_class, one_byte_inst);
+	build_opcode_class(two_byte_class, two_byte_inst);
+}
+
+void parse_modrm(uint8_t **code, int *r, struct modrm_rm_t *rm)
+{
+	uint8_t modrm = parse_byte(code);
+	*r = GET_MODRM_R(modrm);
+	int mod = GET_MODRM_MOD(modrm);
+	if (mod == 3)
+	{
+		rm->flags = MODRM_PURE_REGISTER;
+		rm->base = GET_MODRM_RM(modrm);
+		rm->index = -1;
+		return;
+	}
+	rm->flags = 0;
+	int modrm_rm = GET_MODRM_RM(modrm);
+	if (modrm_rm == 4)
+	{
+		/* ModR/M with SIB byte */
+		int sib = parse_byte(code);
+		rm->scale = GET_SIB_SCALE(sib);
+		if ((rm->index = GET_SIB_INDEX(sib)) == 4)
+			rm->index = -1;
+		if ((rm->base = GET_SIB_BASE(sib)) == 5 && mod == 0)
+		{
+			rm->base = -1;
+			mod = 2; /* For use later to correctly extract disp32 */
+		}
+	}
+	else
+	{
+		/* ModR/M without SIB byte */
+		rm->index = -1;
+		rm->scale = 0;
+		if (mod == 0 && modrm_rm == 5) /* disp32 */
+		{
+			rm->base = -1;
+			rm->disp = (int32_t)parse_dword(code);
+			return;
+		}
+		rm->base = modrm_rm;
+	}
+	/* Displacement */
+	if (mod == 1) /* disp8 */
+		rm->disp = (int8_t)parse_byte(code);
+	else if (mod == 2) /* disp32 */
+		rm->disp = (int32_t)parse_dword(code);
+	else /* no disp */
+		rm->disp = 0;
+}
+
+int x86_decode(uint8_t *code, struct instruction_t *ins)
+{
+	uint8_t *start = code;
+	const struct opcode_class *cls = NULL;
+	ins->rep_prefix = 0;
+	ins->segment_prefix = 0;
+	ins->opsize_prefix = false;
+	ins->lock_prefix = false;
+	ins->escape_0x0f = false;
+	ins->escape_byte2 = 0;
+	ins->has_modrm = false;
+	/* Handle prefixes. According to x86 doc, they can appear in any order */
+	/* TODO: Detect invalid multiple segment prefixes */
+	for (;;)
+	{
+		ins->opcode = parse_byte(&code);
+		switch (prefix_class[ins->opcode])
+		{
+		case PREFIX_CLASS_NONE: goto done_prefix;
+		case PREFIX_CLASS_LOCK: ins->lock_prefix = true; break;
+		case PREFIX_CLASS_REP: ins->rep_prefix = ins->opcode; break;
+		case PREFIX_CLASS_SEGMENT: ins->segment_prefix = ins->opcode; break;
+		case PREFIX_CLASS_OPSIZE: ins->opsize_prefix = true; break;
+		default: return X86_DECODE_BAD_PREFIX;
+		}
+	}
+
+done_prefix:
+	/* Extract instruction descriptor */
+	if (ins->opcode == 0x0F)
+	{
+		ins->escape_0x0f = true;
+		ins->opcode = parse_byte(&code);
+		if (ins->opcode == 0x38)
+		{
+			ins->escape_byte2 = 0x38;
+			ins->opcode = parse_byte(&code);
+			ins->desc = &three_byte_inst_0x38[ins->opcode];
+		}
+		else if (ins->opcode == 0x3A)
+		{
+			ins->escape_byte2 = 0x3A;
+			ins->opcode = parse_byte(&code);
+			ins->desc = &three_byte_inst_0x3A[ins->opcode];
+		}
+		else
+		{
+			ins->desc = &two_byte_inst[ins->opcode];
+			cls = &two_byte_class[ins->opcode];
+		}
+	}
+	else
+	{
+		ins->desc = &one_byte_inst[ins->opcode];
+		cls = &one_byte_class[ins->opcode];
+	}
+
+	/* Fast path: most opcodes map directly to their descriptor */
+	if (cls && (cls->flags & OPCODE_TERMINAL))
+	{
+		if (cls->flags & OPCODE_MODRM)
+		{
+			parse_modrm(&code, &ins->r, &ins->rm);
+			ins->has_modrm = true;
+		}
+		ins->imm_bytes = cls->imm_bytes[ins->opsize_prefix];
+		return code - start;
+	}
+
+	/* Follow extension tables */
+	while (ins->desc->type <= INST_TYPE_MAX)
+	{
+		switch (ins->desc->type)
+		{
+		case INST_TYPE_MANDATORY:
+		{
+			if (!ins->escape_0x0f)
+				return X86_DECODE_INVALID;
+			if (ins->opsize_prefix)
+				ins->desc = &ins->desc->extension_table[MANDATORY_0x66];
+			else if (ins->rep_prefix == 0xF3)
+				ins->desc = &ins->desc->extension_table[MANDATORY_0xF3];
+			else if (ins->rep_prefix == 0xF2)
+				ins->desc = &ins->desc->extension_table[MANDATORY_0xF2];
+			else
+				ins->desc = &ins->desc->extension_table[MANDATORY_NONE];
+			break;
+		}
+
+		case INST_TYPE_EXTENSION:
+		{
+			if (!ins->has_modrm)
+			{
+				parse_modrm(&code, &ins->r, &ins->rm);
+				ins->has_modrm = true;
+			}
+			ins->desc = &ins->desc->extension_table[ins->r];
+			break;
+		}
+
+		case INST_TYPE_MODRM_MOD:
+		{
+			if (!ins->has_modrm)
+			{
+				parse_modrm(&code, &ins->r, &ins->rm);
+				ins->has_modrm = true;
+			}
+			if (modrm_rm_is_r(ins->rm))
+				ins->desc = &ins->desc->extension_table[MODRM_MOD_R];
+			else
+				ins->desc = &ins->desc->extension_table[MODRM_MOD_M];
+			break;
+		}
+
+		case INST_TYPE_INVALID: return X86_DECODE_INVALID;
+		case INST_TYPE_UNSUPPORTED: return X86_DECODE_UNSUPPORTED;
+		default: return X86_DECODE_UNKNOWN;
+		}
+	}
+
+	/* ins->desc now points to the correct instruction description */
+	if (!ins->has_modrm && desc_has_modrm(ins->desc))
+	{
+		parse_modrm(&code, &ins->r, &ins->rm);
+		ins->has_modrm = true;
+	}
+	ins->imm_bytes = desc_imm_bytes(ins->desc, ins->opsize_prefix);
+	return code - start;
+}
+
+int x86_decode_length(uint8_t *code)
+{
+	struct instruction_t ins;
+	int len = x86_decode(code, &ins);
+	if (len < 0)
+		return len;
+	/* x87 escape opcodes always have a ModR/M byte, which is not described in the table */
+	if (ins.desc->handler_type == HANDLER_X87 && !ins.has_modrm)
+	{
+		uint8_t *modrm = code + len;
+		parse_modrm(&modrm, &ins.r, &ins.rm);
+		len = modrm - code;
+	}
+	return len + ins.imm_bytes;
+}
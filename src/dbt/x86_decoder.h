@@ -0,0 +1,146 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <dbt/x86_inst.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* x86 instruction decoder
+ * Only depends on the instruction tables in x86_inst_table.c, so it can be
+ * built and exercised on any host.
+ */
+
+#define GET_MODRM_MOD(c)	(((c) >> 6) & 7)
+#define GET_MODRM_R(c)		(((c) >> 3) & 7)
+#define GET_MODRM_RM(c)		((c) & 7)
+#define GET_MODRM_CODE(c)	GET_MODRM_R(c)
+
+#define GET_SIB_SCALE(s)	((s) >> 6)
+#define GET_SIB_INDEX(s)	(((s) >> 3) & 7)
+#define GET_SIB_BASE(s)		((s) & 7)
+
+#define PREFIX_CS		0x2E
+#define PREFIX_SS		0x36
+#define PREFIX_DS		0x3E
+#define PREFIX_ES		0x26
+#define PREFIX_FS		0x64
+#define PREFIX_GS		0x65
+
+/* ModR/M flags */
+#define MODRM_PURE_REGISTER	1
+
+struct modrm_rm_t
+{
+	int base, index, scale, flags;
+	int32_t disp;
+};
+
+struct instruction_t
+{
+	uint8_t opcode;
+	uint8_t rep_prefix, segment_prefix;
+	bool opsize_prefix;
+	bool lock_prefix;
+	bool escape_0x0f;
+	uint8_t escape_byte2; /* 0x38 or 0x3A */
+	int r;
+	bool has_modrm;
+	struct modrm_rm_t rm;
+	int imm_bytes;
+	const struct instruction_desc *desc;
+};
+
+/* Decoding errors */
+#define X86_DECODE_UNKNOWN			-1 /* Unknown opcode */
+#define X86_DECODE_INVALID			-2 /* Invalid opcode */
+#define X86_DECODE_UNSUPPORTED		-3 /* Unsupported opcode */
+#define X86_DECODE_BAD_PREFIX		-4 /* Unsupported prefix, ins->opcode is the prefix byte */
+
+static inline int modrm_rm_is_r(struct modrm_rm_t rm)
+{
+	return rm.flags & MODRM_PURE_REGISTER;
+}
+
+static inline int modrm_rm_is_m(struct modrm_rm_t rm)
+{
+	return (rm.flags & MODRM_PURE_REGISTER) == 0;
+}
+
+static inline uint8_t parse_byte(uint8_t **code)
+{
+	return *(*code)++;
+}
+
+static inline uint16_t parse_word(uint8_t **code)
+{
+	uint16_t v = *(uint16_t*)*code;
+	*code += 2;
+	return v;
+}
+
+static inline uint32_t parse_dword(uint8_t **code)
+{
+	uint32_t v = *(uint32_t*)*code;
+	*code += 4;
+	return v;
+}
+
+static inline uint64_t parse_qword(uint8_t **code)
+{
+	uint64_t v = *(uint64_t*)*code;
+	*code += 8;
+	return v;
+}
+
+static inline int32_t parse_rel(uint8_t **code, int rel_bytes)
+{
+	if (rel_bytes == 1)
+		return (int8_t)parse_byte(code);
+	else if (rel_bytes == 2)
+		return (int16_t)parse_word(code);
+	else
+		return (int32_t)parse_dword(code);
+}
+
+static inline uint32_t parse_moffset(uint8_t **code, int imm_bytes)
+{
+	if (imm_bytes == 1)
+		return parse_byte(code);
+	else if (imm_bytes == 2)
+		return parse_word(code);
+	else
+		return parse_dword(code);
+}
+
+void parse_modrm(uint8_t **code, int *r, struct modrm_rm_t *rm);
+
+/* Build the opcode classification tables, must be called before decoding */
+void x86_decoder_init();
+
+/* Decode prefixes, opcode and ModR/M of the instruction at code
+ * Returns the number of bytes consumed, immediates (ins->imm_bytes) are left
+ * to the caller. On failure a negative X86_DECODE_* error is returned.
+ */
+int x86_decode(uint8_t *code, struct instruction_t *ins);
+
+/* Returns the total length of the instruction at code, or a negative X86_DECODE_* error */
+int x86_decode_length(uint8_t *code);
@@ -0,0 +1,159 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Host services used by the translator
+ * Locks, code cache memory, the kernel TLS slots addressed through fs:[] and the background
+ * translation thread. On Windows these map directly to the Windows API. The host side tools
+ * build the translator on Linux to measure the code generator, there tools/dbt_host implements
+ * them on POSIX with a mock thread environment block in place of the fs segment.
+ */
+
+#define DBT_HOST_EXECUTE		1 /* Memory holds generated code */
+#define DBT_HOST_TOP_DOWN		2 /* Allocate at the highest possible address */
+
+#ifdef _WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <ntdll.h>
+#include <intrin.h>
+
+#ifdef __clang__
+#define __writefsdword my_writefsdword
+static __forceinline void __writefsdword(unsigned long offset, unsigned long value)
+{
+	__asm__ __volatile__(
+		"movl %0, %%fs:%1"
+		:
+		: "r"(value), "m"(*(uint32_t*)offset)
+		);
+}
+#endif
+
+typedef SRWLOCK dbt_host_lock;
+typedef HANDLE dbt_host_event;
+
+static __forceinline void dbt_host_lock_init(dbt_host_lock *lock) { InitializeSRWLock(lock); }
+static __forceinline bool dbt_host_try_lock_shared(dbt_host_lock *lock) { return TryAcquireSRWLockShared(lock) != 0; }
+static __forceinline void dbt_host_lock_shared(dbt_host_lock *lock) { AcquireSRWLockShared(lock); }
+static __forceinline void dbt_host_unlock_shared(dbt_host_lock *lock) { ReleaseSRWLockShared(lock); }
+static __forceinline bool dbt_host_try_lock_exclusive(dbt_host_lock *lock) { return TryAcquireSRWLockExclusive(lock) != 0; }
+static __forceinline void dbt_host_lock_exclusive(dbt_host_lock *lock) { AcquireSRWLockExclusive(lock); }
+static __forceinline void dbt_host_unlock_exclusive(dbt_host_lock *lock) { ReleaseSRWLockExclusive(lock); }
+
+static __forceinline DWORD dbt_host_protection(int flags)
+{
+	return (flags & DBT_HOST_EXECUTE)? PAGE_EXECUTE_READWRITE: PAGE_READWRITE;
+}
+
+/* Reserve and commit memory, returns NULL on failure */
+static __forceinline void *dbt_host_alloc(size_t size, int flags)
+{
+	return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | ((flags & DBT_HOST_TOP_DOWN)? MEM_TOP_DOWN: 0), dbt_host_protection(flags));
+}
+
+/* Commit decommitted memory again, its content is zero */
+static __forceinline bool dbt_host_commit(void *addr, size_t size, int flags)
+{
+	return VirtualAlloc(addr, size, MEM_COMMIT, dbt_host_protection(flags)) != NULL;
+}
+
+/* Release the physical memory but keep the address range reserved */
+static __forceinline void dbt_host_decommit(void *addr, size_t size)
+{
+	VirtualFree(addr, size, MEM_DECOMMIT);
+}
+
+static __forceinline void dbt_host_free(void *addr, size_t size)
+{
+	VirtualFree(addr, 0, MEM_RELEASE);
+}
+
+/* Kernel TLS slots, offset is returned by tls_kernel_entry_to_offset() */
+static __forceinline uint32_t dbt_host_read_tls(int offset) { return __readfsdword(offset); }
+static __forceinline void dbt_host_write_tls(int offset, uint32_t value) { __writefsdword(offset, value); }
+/* Linear address of the thread environment block, TLS slots are at the same offsets in it */
+static __forceinline size_t dbt_host_tls_base() { return __readfsdword(0x18); }
+static __forceinline size_t dbt_host_thread_tls_base(HANDLE thread)
+{
+	THREAD_BASIC_INFORMATION info;
+	NtQueryInformationThread(thread, ThreadBasicInformation, &info, sizeof(info), NULL);
+	return (size_t)info.TebBaseAddress;
+}
+
+static __forceinline dbt_host_event dbt_host_create_event() { return CreateEventW(NULL, FALSE, FALSE, NULL); }
+static __forceinline void dbt_host_set_event(dbt_host_event event) { SetEvent(event); }
+static __forceinline void dbt_host_wait_event(dbt_host_event event) { WaitForSingleObject(event, INFINITE); }
+
+static DWORD WINAPI dbt_host_thread_entry(LPVOID parameter)
+{
+	((void (*)())parameter)();
+	return 0;
+}
+
+/* Start a thread which only uses otherwise idle cores, returns 0 or the error code */
+static int dbt_host_start_idle_thread(void (*proc)())
+{
+	HANDLE thread = CreateThread(NULL, 0, dbt_host_thread_entry, (LPVOID)proc, 0, NULL);
+	if (!thread)
+		return GetLastError();
+	SetThreadPriority(thread, THREAD_PRIORITY_BELOW_NORMAL);
+	CloseHandle(thread);
+	return 0;
+}
+
+#else
+
+#include <pthread.h>
+
+typedef pthread_rwlock_t dbt_host_lock;
+typedef struct dbt_host_event_data *dbt_host_event;
+
+void dbt_host_lock_init(dbt_host_lock *lock);
+bool dbt_host_try_lock_shared(dbt_host_lock *lock);
+void dbt_host_lock_shared(dbt_host_lock *lock);
+void dbt_host_unlock_shared(dbt_host_lock *lock);
+bool dbt_host_try_lock_exclusive(dbt_host_lock *lock);
+void dbt_host_lock_exclusive(dbt_host_lock *lock);
+void dbt_host_unlock_exclusive(dbt_host_lock *lock);
+
+/* Generated code embeds 32-bit addresses, all memory is allocated in the low 2GB */
+void *dbt_host_alloc(size_t size, int flags);
+bool dbt_host_commit(void *addr, size_t size, int flags);
+void dbt_host_decommit(void *addr, size_t size);
+void dbt_host_free(void *addr, size_t size);
+
+uint32_t dbt_host_read_tls(int offset);
+void dbt_host_write_tls(int offset, uint32_t value);
+size_t dbt_host_tls_base();
+size_t dbt_host_thread_tls_base(void *thread);
+
+dbt_host_event dbt_host_create_event();
+void dbt_host_set_event(dbt_host_event event);
+void dbt_host_wait_event(dbt_host_event event);
+
+int dbt_host_start_idle_thread(void (*proc)());
+
+#endif
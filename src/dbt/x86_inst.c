@@ -33,6 +33,22 @@ int get_imm_bytes(uint8_t op, bool opsize_prefix_present, bool addrsize_prefix_p
 		return 0;
 }
 
+static const char *handler_type_names[] =
+{
+	"privileged", "mov_moffset", "call_direct", "call_indirect", "ret", "retn",
+	"jmp_direct", "jmp_indirect", "jcc", "jcc_rel8", "int", "mov_from_seg", "mov_to_seg",
+	"cpuid", "x87",
+};
+
+const char *get_handler_type_name(uint8_t handler_type)
+{
+	if ((handler_type & HANDLER_NORMAL) == HANDLER_NORMAL)
+		return "normal";
+	if (handler_type < sizeof(handler_type_names) / sizeof(handler_type_names[0]))
+		return handler_type_names[handler_type];
+	return "unknown";
+}
+
 /* Keep in sync with implicit register / memory definitions in x86_inst.h */
 const uint8_t implicit_register_usage[16] =
 {
@@ -61,7 +77,7 @@ uint8_t get_implicit_register_usage(uint8_t op, uint8_t opcode)
 		if (op < 16)
 			return implicit_register_usage[op];
 		else /* OP_Rxx */
-			return REG_MASK(op & 8);
+			return REG_MASK(opcode & 7);
 	}
 	return 0;
 }
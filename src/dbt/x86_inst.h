@@ -17,6 +17,8 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#pragma once
+
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -297,4 +299,6 @@ extern const struct instruction_desc three_byte_inst_0x38[256];
 extern const struct instruction_desc three_byte_inst_0x3A[256];
 
 int get_imm_bytes(uint8_t op, bool opsize_prefix_present, bool addrsize_prefix_present);
+/* Short name of a handler type for statistics, any HANDLER_NORMAL value is "normal" */
+const char *get_handler_type_name(uint8_t handler_type);
 uint8_t get_implicit_register_usage(uint8_t op, uint8_t opcode);
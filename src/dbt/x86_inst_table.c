@@ -413,7 +413,7 @@ const struct instruction_desc one_byte_inst[256] =
 	/* 0xC0 */ NORMAL("[GRP2]", RM8, IMM8, __)
 	/* 0xC1 */ NORMAL("[GRP2]", RM16_32_64, IMM8, __)
 	/* 0xC2 */ SPECIAL("retn", IMM16, __, __, HANDLER_RETN)
-	/* 0xC3 */ SPECIAL("ret", IMM16, __, __, HANDLER_RET)
+	/* 0xC3 */ SPECIAL("ret", __, __, __, HANDLER_RET)
 #ifdef _WIN64
 	/* 0xC4: INVALID */ INVALID()
 	/* 0xC5: INVALID */ INVALID()
@@ -46,6 +46,29 @@ dbt_find_direct_internal PROC ; pc, patch_addr
 	jmp dword ptr [dbt_return_trampoline]
 dbt_find_direct_internal ENDP
 
+EXTERN dbt_find_superblock:NEAR
+dbt_find_superblock_internal PROC ; pc, patch_addr
+	; save context
+	push eax
+	push ecx
+	push edx
+	pushfd
+	; copy pc and patch_addr
+	mov ecx, [esp+20]
+	mov edx, [esp+16]
+	push ecx
+	push edx
+	call dbt_find_superblock
+	lea esp, [esp+8]
+	; restore context
+	popfd
+	pop edx
+	pop ecx
+	pop eax
+	lea esp, [esp+8] ; we have two extra argument garbage at the stack
+	jmp dword ptr [dbt_return_trampoline]
+dbt_find_superblock_internal ENDP
+
 EXTERN dbt_find_next:NEAR
 dbt_find_indirect_internal PROC
 	; save context
@@ -86,6 +109,73 @@ dbt_sieve_fallback PROC
 	jmp dword ptr [dbt_return_trampoline]
 dbt_sieve_fallback ENDP
 
+EXTERN dbt_find_next_return:NEAR
+dbt_return_fallback PROC
+	; stack: address
+	; stack: ecx
+	push eax
+	push edx
+	pushfd
+	mov ecx, [esp+4*4] ; original address
+	push ecx
+	call dbt_find_next_return
+	lea esp, [esp+4]
+	; restore context
+	popfd
+	pop edx
+	pop eax
+	pop ecx
+	lea esp, [esp+4]
+	jmp dword ptr [dbt_return_trampoline]
+dbt_return_fallback ENDP
+
+EXTERN dbt_inline_cache_miss:NEAR
+dbt_inline_cache_miss_internal PROC
+	; stack: address
+	; stack: ecx
+	; stack: inline cache
+	push eax
+	push edx
+	pushfd
+	mov ecx, [esp+4*3] ; inline cache
+	mov edx, [esp+4*5] ; original address
+	push ecx
+	push edx
+	call dbt_inline_cache_miss
+	lea esp, [esp+8]
+	; restore context
+	popfd
+	pop edx
+	pop eax
+	lea esp, [esp+4] ; inline cache
+	pop ecx
+	lea esp, [esp+4]
+	jmp dword ptr [dbt_return_trampoline]
+dbt_inline_cache_miss_internal ENDP
+
+EXTERN dbt_check_code:NEAR
+dbt_check_code_internal PROC
+	; stack: return address
+	; stack: block
+	push eax
+	push ecx
+	push edx
+	pushfd
+	mov ecx, [esp+4*4] ; return address
+	mov edx, [esp+4*5] ; block
+	push ecx
+	push edx
+	call dbt_check_code
+	lea esp, [esp+8]
+	; restore context
+	popfd
+	pop edx
+	pop ecx
+	pop eax
+	lea esp, [esp+8] ; return address and block
+	jmp dword ptr [dbt_return_trampoline]
+dbt_check_code_internal ENDP
+
 ; TODO: Return through return trampoline
 EXTERN dbt_cpuid:NEAR
 dbt_cpuid_internal PROC
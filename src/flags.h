@@ -23,6 +23,10 @@
 
 #define MAX_SESSION_ID_LEN	8
 #define DEFAULT_SESSION_ID	"default"
+#define MAX_DBT_CACHE_DIR_LEN	256
+#define MAX_DBT_PROFILE_DIR_LEN	256
+#define DBT_TABLE_MIN_BITS		14 /* Range of log2 entries of the dbt sieve table */
+#define DBT_TABLE_MAX_BITS		16
 
 struct _flags
 {
@@ -30,6 +34,11 @@ struct _flags
 	/* DBT flags */
 	bool dbt_trace;
 	bool dbt_trace_all;
+	bool dbt_no_superblocks;
+	bool dbt_background; /* Translate direct branch targets on a background thread */
+	int dbt_table_bits; /* Pinned size of the dbt sieve table, 0 to size it adaptively */
+	char dbt_cache_dir[MAX_DBT_CACHE_DIR_LEN];
+	char dbt_profile_dir[MAX_DBT_PROFILE_DIR_LEN]; /* Where to write profiles of translated code, empty to disable */
 };
 
 extern struct _flags *cmdline_flags;
@@ -66,6 +66,10 @@ struct file_ops
 	int (*getdents)(struct file *f, void *dirent, size_t count, getdents_callback *fill_callback);
 	int (*ioctl)(struct file *f, unsigned int cmd, unsigned long arg);
 	int (*statfs)(struct file *f, struct statfs64 *buf);
+	/* Memory mapping
+	 * Returns a read-only executable section of the file content which mm maps views of,
+	 * or NULL if the file can not be mapped directly. The handle is owned by the file. */
+	HANDLE (*get_section)(struct file *f);
 	/* Socket functions */
 	int (*bind)(struct file *f, const struct sockaddr *addr, int addrlen);
 	int (*connect)(struct file *f, const struct sockaddr *addr, size_t addrlen);
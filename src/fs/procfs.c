@@ -38,6 +38,27 @@ static int proc_maps_gettext(int tag, char *buf)
 
 static struct virtualfs_text_desc proc_maps_desc = VIRTUALFS_TEXT(proc_maps_gettext);
 
+static int proc_dbt_stats_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_DBT_STATS, buf);
+}
+
+static struct virtualfs_text_desc proc_dbt_stats_desc = VIRTUALFS_TEXT(proc_dbt_stats_gettext);
+
+static int proc_dbt_inline_caches_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_DBT_INLINE_CACHES, buf);
+}
+
+static struct virtualfs_text_desc proc_dbt_inline_caches_desc = VIRTUALFS_TEXT(proc_dbt_inline_caches_gettext);
+
+static int proc_mm_stats_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_MM_STATS, buf);
+}
+
+static struct virtualfs_text_desc proc_mm_stats_desc = VIRTUALFS_TEXT(proc_mm_stats_gettext);
+
 static int mounts_gettext(int tag, char *buf)
 {
 	return ksprintf(buf, "none / ntfs\n");
@@ -56,7 +77,10 @@ struct virtualfs_directory_desc proc_pid_desc =
 {
 	.type = VIRTUALFS_TYPE_DIRECTORY,
 	.entries = {
+		VIRTUALFS_ENTRY("dbt_inline_caches", proc_dbt_inline_caches_desc)
+		VIRTUALFS_ENTRY("dbt_stats", proc_dbt_stats_desc)
 		VIRTUALFS_ENTRY("maps", proc_maps_desc)
+		VIRTUALFS_ENTRY("mm_stats", proc_mm_stats_desc)
 		VIRTUALFS_ENTRY("mounts", proc_mounts_desc)
 		VIRTUALFS_ENTRY("stat", proc_stat_desc)
 		VIRTUALFS_ENTRY_END()
@@ -26,6 +26,7 @@
 #include <datetime.h>
 #include <heap.h>
 #include <log.h>
+#include <shared.h>
 #include <str.h>
 
 #include <ntdll.h>
@@ -44,6 +45,7 @@ struct winfs_file
 	struct file base_file;
 	HANDLE handle;
 	HANDLE fp_mutex; /* Mutex for guarding file pointer */
+	HANDLE section; /* Section for mmap(), created on first use */
 	int restart_scan; /* for getdents() */
 	int mp_key; /* Mount point key */
 	char drive_letter; /* DOS drive letter where this file resides in */
@@ -159,8 +161,9 @@ static PSID get_user_sid()
 
 /* Move a file handle to recycle bin
  * The pathname must be a valid NT file name generated using filename_to_nt_pathname()
+ * If recycled_pathname is not NULL, the new NT file name is appended to it
  */
-static NTSTATUS move_to_recycle_bin(HANDLE handle, WCHAR *pathname)
+static NTSTATUS move_to_recycle_bin(HANDLE handle, WCHAR *pathname, UNICODE_STRING *recycled_pathname)
 {
 	IO_STATUS_BLOCK status_block;
 	NTSTATUS status;
@@ -226,9 +229,121 @@ static NTSTATUS move_to_recycle_bin(HANDLE handle, WCHAR *pathname)
 		log_error("NtSetInformationFile(FileRenameInformation) failed, status: %x", status);
 		return status;
 	}
+	if (recycled_pathname)
+		RtlAppendUnicodeStringToString(recycled_pathname, &rename);
 	return STATUS_SUCCESS;
 }
 
+/* Deferred deletion of unlinked files with mapped views
+ * Setting the delete disposition of a file fails with STATUS_CANNOT_DELETE while a view of it is
+ * mapped (see winfs_get_section()) instead of being delayed to the last handle closing.
+ * winfs_unlink() moves such a file to the recycle bin and records it here, and
+ * winfs_delete_unmapped_files() retries the deletion when views could have gone away: after
+ * munmap() or execve() of any process, after a child process is reaped, and on startup.
+ * The table is in the session wide shared area because the views may belong to any process.
+ */
+#define MAX_DEFERRED_DELETES		32
+
+#define DEFERRED_DELETE_FREE		0
+#define DEFERRED_DELETE_LOCKED		1 /* Being filled or deleted by some process */
+#define DEFERRED_DELETE_PENDING		2
+
+struct deferred_delete
+{
+	volatile LONG state;
+	USHORT pathname_len; /* In bytes */
+	WCHAR pathname[MAX_PATH];
+};
+
+struct winfs_shared_data
+{
+	volatile LONG pending_count;
+	struct deferred_delete deferred_deletes[MAX_DEFERRED_DELETES];
+};
+
+static struct winfs_shared_data *winfs_shared;
+
+void winfs_shared_init()
+{
+	winfs_shared = (struct winfs_shared_data *)shared_alloc(sizeof(struct winfs_shared_data));
+}
+
+static bool defer_delete(const UNICODE_STRING *pathname)
+{
+	if (pathname->Length > sizeof(winfs_shared->deferred_deletes[0].pathname))
+		return false;
+	for (int i = 0; i < MAX_DEFERRED_DELETES; i++)
+	{
+		struct deferred_delete *d = &winfs_shared->deferred_deletes[i];
+		if (InterlockedCompareExchange(&d->state, DEFERRED_DELETE_LOCKED, DEFERRED_DELETE_FREE) == DEFERRED_DELETE_FREE)
+		{
+			memcpy(d->pathname, pathname->Buffer, pathname->Length);
+			d->pathname_len = pathname->Length;
+			InterlockedExchange(&d->state, DEFERRED_DELETE_PENDING);
+			InterlockedIncrement(&winfs_shared->pending_count);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Returns false if the file still cannot be deleted */
+static bool delete_recycled_file(UNICODE_STRING *pathname)
+{
+	OBJECT_ATTRIBUTES attr;
+	attr.Length = sizeof(OBJECT_ATTRIBUTES);
+	attr.RootDirectory = NULL;
+	attr.ObjectName = pathname;
+	attr.Attributes = 0;
+	attr.SecurityDescriptor = NULL;
+	attr.SecurityQualityOfService = NULL;
+	IO_STATUS_BLOCK status_block;
+	NTSTATUS status;
+	HANDLE handle;
+	status = NtOpenFile(&handle, DELETE, &attr, &status_block, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		FILE_NON_DIRECTORY_FILE | FILE_OPEN_FOR_BACKUP_INTENT);
+	if (status == STATUS_SHARING_VIOLATION)
+		return false;
+	if (!NT_SUCCESS(status))
+	{
+		/* Someone else emptied the recycle bin */
+		log_info("NtOpenFile() failed, status: %x", status);
+		return true;
+	}
+	FILE_DISPOSITION_INFORMATION info;
+	info.DeleteFile = TRUE;
+	status = NtSetInformationFile(handle, &status_block, &info, sizeof(info), FileDispositionInformation);
+	NtClose(handle);
+	if (status == STATUS_CANNOT_DELETE)
+		return false;
+	if (!NT_SUCCESS(status))
+		log_warning("NtSetInformationFile(FileDispositionInformation) failed, status: %x", status);
+	return true;
+}
+
+void winfs_delete_unmapped_files()
+{
+	/* mm calls this before vfs is initialized */
+	if (!winfs_shared || !winfs_shared->pending_count)
+		return;
+	for (int i = 0; i < MAX_DEFERRED_DELETES; i++)
+	{
+		struct deferred_delete *d = &winfs_shared->deferred_deletes[i];
+		if (InterlockedCompareExchange(&d->state, DEFERRED_DELETE_LOCKED, DEFERRED_DELETE_PENDING) != DEFERRED_DELETE_PENDING)
+			continue;
+		UNICODE_STRING pathname;
+		RtlInitCountedUnicodeString(&pathname, d->pathname, d->pathname_len);
+		if (delete_recycled_file(&pathname))
+		{
+			log_info("Deleted recycled file %.*S", (int)(d->pathname_len / sizeof(WCHAR)), d->pathname);
+			InterlockedExchange(&d->state, DEFERRED_DELETE_FREE);
+			InterlockedDecrement(&winfs_shared->pending_count);
+		}
+		else
+			InterlockedExchange(&d->state, DEFERRED_DELETE_PENDING);
+	}
+}
+
 /* Return value:
  * < 0: errno
  * = 0: Not a special file of the specified header
@@ -434,6 +549,8 @@ static int winfs_close(struct file *f)
 {
 	struct winfs_file *winfile = (struct winfs_file *)f;
 	NtClose(winfile->handle);
+	if (winfile->section)
+		NtClose(winfile->section);
 	CloseHandle(winfile->fp_mutex);
 	kfree(winfile, sizeof(struct winfs_file));
 	return 0;
@@ -707,6 +824,11 @@ static int winfs_truncate(struct file *f, loff_t length)
 	NTSTATUS status;
 	status = NtSetInformationFile(winfile->handle, &status_block, &info, sizeof(info), FileEndOfFileInformation);
 	ReleaseSRWLockShared(&f->rw_lock);
+	if (status == STATUS_USER_MAPPED_FILE)
+	{
+		log_warning("Cannot truncate a file mapped by winfs_get_section().");
+		return -L_ETXTBSY;
+	}
 	if (!NT_SUCCESS(status))
 	{
 		log_warning("NtSetInformationFile(FileEndOfFileInformation) failed, status: %x", status);
@@ -987,6 +1109,51 @@ out:
 	return r;
 }
 
+static HANDLE winfs_get_section(struct file *f)
+{
+	struct winfs_file *winfile = (struct winfs_file *)f;
+	/* Windows does not allow truncating a file with a section, which Linux programs expect to work
+	 * on files they write. Only files opened read-only are mapped, such as executables and libraries.
+	 * Other descriptors still cannot truncate the file while views of it are mapped */
+	if (f->flags & (O_WRONLY | O_RDWR))
+		return NULL;
+	if (winfile->section)
+		return winfile->section;
+	/* Mapping views as executable requires execute access which the file is not opened with
+	 * The section keeps the file referenced, the reopened handle is not needed afterwards */
+	HANDLE handle = ReOpenFile(winfile->handle, GENERIC_READ | GENERIC_EXECUTE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		log_warning("ReOpenFile() for execute access failed, error code: %d", GetLastError());
+		return NULL;
+	}
+	OBJECT_ATTRIBUTES attr;
+	attr.Length = sizeof(OBJECT_ATTRIBUTES);
+	attr.RootDirectory = NULL;
+	attr.ObjectName = NULL;
+	attr.Attributes = OBJ_INHERIT;
+	attr.SecurityDescriptor = NULL;
+	attr.SecurityQualityOfService = NULL;
+	HANDLE section;
+	NTSTATUS status = NtCreateSection(&section, SECTION_MAP_READ | SECTION_MAP_EXECUTE | SECTION_QUERY, &attr, NULL, PAGE_EXECUTE_READ, SEC_COMMIT, handle);
+	NtClose(handle);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("NtCreateSection() failed, status: %x", status);
+		return NULL;
+	}
+	/* Another thread may have created the section meanwhile, keep the first one
+	 * No lock is taken as this is called from page faults which may happen while the file is locked */
+	HANDLE old = InterlockedCompareExchangePointer(&winfile->section, section, NULL);
+	if (old)
+	{
+		NtClose(section);
+		return old;
+	}
+	return section;
+}
+
 static struct file_ops winfs_ops = 
 {
 	.close = winfs_close,
@@ -1003,6 +1170,7 @@ static struct file_ops winfs_ops =
 	.utimens = winfs_utimens,
 	.getdents = winfs_getdents,
 	.statfs = winfs_statfs,
+	.get_section = winfs_get_section,
 };
 
 static int winfs_symlink(struct mount_point *mp, const char *target, const char *linkpath)
@@ -1106,6 +1274,9 @@ static int winfs_unlink(struct mount_point *mp, const char *pathname)
 	NTSTATUS status;
 	HANDLE handle;
 	status = NtOpenFile(&handle, DELETE, &attr, &status_block, FILE_SHARE_DELETE, FILE_NON_DIRECTORY_FILE | FILE_OPEN_FOR_BACKUP_INTENT);
+	WCHAR recycledpath[512];
+	UNICODE_STRING recycled;
+	RtlInitEmptyUnicodeString(&recycled, recycledpath, sizeof(recycledpath));
 	if (!NT_SUCCESS(status))
 	{
 		if (status != STATUS_SHARING_VIOLATION)
@@ -1125,17 +1296,37 @@ static int winfs_unlink(struct mount_point *mp, const char *pathname)
 			log_warning("NtOpenFile() failed, status: %x", status);
 			return -L_EBUSY;
 		}
-		status = move_to_recycle_bin(handle, wpathname);
+		status = move_to_recycle_bin(handle, wpathname, &recycled);
 		if (!NT_SUCCESS(status))
+		{
+			NtClose(handle);
 			return -L_EBUSY;
+		}
 	}
 	/* Set disposition flag */
 	FILE_DISPOSITION_INFORMATION info;
 	info.DeleteFile = TRUE;
 	status = NtSetInformationFile(handle, &status_block, &info, sizeof(info), FileDispositionInformation);
+	if (status == STATUS_CANNOT_DELETE)
+	{
+		/* A file with mapped views cannot be deleted but can be renamed, it is gone from its
+		 * directory as on Linux and is deleted after the last view is unmapped */
+		if (!recycled.Length && !NT_SUCCESS(move_to_recycle_bin(handle, wpathname, &recycled)))
+		{
+			NtClose(handle);
+			return -L_EBUSY;
+		}
+		NtClose(handle);
+		if (!defer_delete(&recycled))
+			log_warning("Too many deferred deletions, %.*S is left in the recycle bin.", (int)(recycled.Length / sizeof(WCHAR)), recycled.Buffer);
+		/* The views may have been unmapped in the meantime */
+		winfs_delete_unmapped_files();
+		return 0;
+	}
 	if (!NT_SUCCESS(status))
 	{
 		log_warning("NtSetInformation(FileDispositionInformation) failed, status: %x", status);
+		NtClose(handle);
 		return -L_EBUSY;
 	}
 	NtClose(handle);
@@ -1368,6 +1559,12 @@ static int winfs_open(struct mount_point *mp, const char *pathname, int flags, i
 		info.EndOfFile.QuadPart = 0;
 		IO_STATUS_BLOCK status_block;
 		NTSTATUS status = NtSetInformationFile(handle, &status_block, &info, sizeof(info), FileEndOfFileInformation);
+		if (status == STATUS_USER_MAPPED_FILE)
+		{
+			log_warning("Cannot truncate a file mapped by winfs_get_section().");
+			NtClose(handle);
+			return -L_ETXTBSY;
+		}
 		if (!NT_SUCCESS(status))
 			log_error("NtSetInformationFile() failed, status: %x", status);
 	}
@@ -1387,6 +1584,7 @@ static int winfs_open(struct mount_point *mp, const char *pathname, int flags, i
 		struct winfs_file *file = (struct winfs_file *)kmalloc(sizeof(struct winfs_file));
 		file_init(&file->base_file, &winfs_ops, flags);
 		file->handle = handle;
+		file->section = NULL;
         file->is_text = is_text;
 		SECURITY_ATTRIBUTES attr;
 		attr.nLength = sizeof(SECURITY_ATTRIBUTES);
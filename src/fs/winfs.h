@@ -22,6 +22,8 @@
 #include <fs/file.h>
 
 struct file_system *winfs_alloc();
+void winfs_shared_init();
+void winfs_delete_unmapped_files();
 int winfs_is_winfile(struct file *f);
 int winfs_read_special_file(struct file *f, const char *header, int headerlen, char *buf, int buflen);
 int winfs_write_special_file(struct file *f, const char *header, int headerlen, char *buf, int buflen);
@@ -54,6 +54,12 @@ static __forceinline void rb_left_rotate(struct rb_tree *tree, struct rb_node *n
 		rb_set_parent(p->right, p);
 	n->left = p;
 	rb_set_parent(p, n);
+	if (tree->augment)
+	{
+		/* p is a child of n now */
+		tree->augment(p);
+		tree->augment(n);
+	}
 }
 
 static __forceinline void rb_right_rotate(struct rb_tree *tree, struct rb_node *n)
@@ -81,6 +87,25 @@ static __forceinline void rb_right_rotate(struct rb_tree *tree, struct rb_node *
 		rb_set_parent(p->left, p);
 	n->right = p;
 	rb_set_parent(p, n);
+	if (tree->augment)
+	{
+		/* p is a child of n now */
+		tree->augment(p);
+		tree->augment(n);
+	}
+}
+
+/* Recompute augmented data from node up to the root */
+static void rb_propagate(struct rb_tree *tree, struct rb_node *node)
+{
+	for (; node; node = rb_parent(node))
+		tree->augment(node);
+}
+
+void rb_update_augmented(struct rb_tree *tree, struct rb_node *node)
+{
+	if (tree->augment)
+		rb_propagate(tree, node);
 }
 
 static void rb_exchange(struct rb_tree *tree, struct rb_node *victim, struct rb_node *replacement)
@@ -215,6 +240,8 @@ void rb_add(struct rb_tree *tree, struct rb_node *node, rb_cmp *cmp)
 	{
 		tree->root = node;
 		rb_set_parent_and_color(node, NULL, RB_BLACK);
+		if (tree->augment)
+			tree->augment(node);
 		return;
 	}
 
@@ -243,6 +270,9 @@ void rb_add(struct rb_tree *tree, struct rb_node *node, rb_cmp *cmp)
 			cur = cur->right;
 		}
 	}
+	/* Ancestors of the new node are made up to date before rotations */
+	if (tree->augment)
+		rb_propagate(tree, node);
 	rb_add_fixup(tree, node);
 }
 
@@ -417,6 +447,10 @@ void rb_remove(struct rb_tree *tree, struct rb_node *node)
 		else
 			p->right = n;
 	}
+	/* Rotations in the fixup keep p a descendant of every node whose subtree lost the node,
+	 * including the successor which took its place */
+	if (tree->augment)
+		rb_propagate(tree, p);
 }
 
 struct rb_node *rb_find(struct rb_tree *tree, const struct rb_node *value, rb_cmp *cmp)
@@ -11,13 +11,20 @@ struct rb_node
 #define rb_entry(node, type, member) \
 	container_of(node, type, member)
 
+typedef int rb_cmp(const struct rb_node *left, const struct rb_node *right);
+
+/* Recompute the augmented data of a node from the node itself and its children
+ * It is called whenever the subtree of a node changes, augmented data of the children is
+ * always up to date when it is called.
+ */
+typedef void rb_augment(struct rb_node *node);
+
 struct rb_tree
 {
 	struct rb_node *root;
+	rb_augment *augment;
 };
 
-typedef int rb_cmp(const struct rb_node *left, const struct rb_node *right);
-
 /* Test if the tree is empty */
 #define rb_empty(tree)	((tree)->root == NULL)
 
@@ -25,6 +32,14 @@ typedef int rb_cmp(const struct rb_node *left, const struct rb_node *right);
 #define rb_init(tree)	\
 	do { \
 		(tree)->root = NULL; \
+		(tree)->augment = NULL; \
+	} while (0)
+
+/* Initialize a tree whose nodes are augmented with data about their subtrees */
+#define rb_init_augmented(tree, augment_func)	\
+	do { \
+		(tree)->root = NULL; \
+		(tree)->augment = (augment_func); \
 	} while (0)
 
 /* Add a node to a tree */
@@ -33,6 +48,9 @@ void rb_add(struct rb_tree *tree, struct rb_node *node, rb_cmp *cmp);
 /* Remove a node from a tree, the data in it is lost */
 void rb_remove(struct rb_tree *tree, struct rb_node *node);
 
+/* Recompute augmented data of a node and its ancestors after the node is changed in place */
+void rb_update_augmented(struct rb_tree *tree, struct rb_node *node);
+
 /* Find a node in tree which is equal to value */
 struct rb_node *rb_find(struct rb_tree *tree, const struct rb_node *value, rb_cmp *cmp);
 
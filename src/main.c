@@ -25,6 +25,7 @@
 #include <syscall/process.h>
 #include <syscall/sig.h>
 #include <syscall/tls.h>
+#include <syscall/vdso.h>
 #include <syscall/vfs.h>
 #include <syscall/syscall.h>
 #include <flags.h>
@@ -78,6 +79,12 @@ static void print_help()
 	kprintf("                    are completely isolated. <id> can be any alphanumeric string\n");
 	kprintf("                    not longer than 7 characters. The ID \"default\" is used by\n");
 	kprintf("                    default.\n");
+	kprintf("  --dbt-cache <dir> Keep a persistent translation cache in <dir>, which speeds up\n");
+	kprintf("                    startup of frequently used executables and libraries. <dir>\n");
+	kprintf("                    is relative to the root directory and must already exist.\n");
+	kprintf("  --dbt-background  Translate newly discovered branch targets ahead of time on a\n");
+	kprintf("                    background thread, which reduces startup time of large\n");
+	kprintf("                    executables on multi-core machines.\n");
 	kprintf("\n");
 	kprintf("Misc options:\n");
 	kprintf("  --help, -h        Print this help message.\n");
@@ -88,6 +95,16 @@ static void print_help()
     kprintf("  --trace           Enable verbose logging.\n");
 	kprintf("  --dbt-trace       Trace dbt basic block generation.\n");
 	kprintf("  --dbt-trace-all   Full trace of dbt execution. (massive performance drop)\n");
+	kprintf("  --dbt-no-superblocks\n");
+	kprintf("                    Do not form superblocks from hot loops.\n");
+	kprintf("  --dbt-table-bits <n>\n");
+	kprintf("                    Fix the dbt sieve table to 2^<n> entries, <n> must be\n");
+	kprintf("                    between 14 and 16. By default the table starts small and\n");
+	kprintf("                    grows as indirect branch targets collide.\n");
+	kprintf("  --dbt-profile <dir>\n");
+	kprintf("                    Sample translated code and write a flat profile and folded\n");
+	kprintf("                    call stacks of each process to <dir> at exit. <dir> is\n");
+	kprintf("                    relative to the root directory and must already exist.\n");
 }
 
 /*
@@ -106,6 +123,7 @@ static void init_subsystems()
 	process_init();
 	tls_init();
 	vfs_init();
+	vdso_init();
 	dbt_init();
 }
 
@@ -216,6 +234,44 @@ int main()
 				process_exit(1, 0);
 			}
 		}
+		else if (!strcmp(argv[i], "--dbt-cache"))
+		{
+			if (++i < argc)
+			{
+				if (strlen(argv[i]) >= MAX_DBT_CACHE_DIR_LEN)
+				{
+					init_subsystems();
+					kprintf("--dbt-cache: Directory name too long.\n");
+					process_exit(1, 0);
+				}
+				strcpy(cmdline_flags->dbt_cache_dir, argv[i]);
+			}
+			else
+			{
+				init_subsystems();
+				kprintf("--dbt-cache: No directory given.\n");
+				process_exit(1, 0);
+			}
+		}
+		else if (!strcmp(argv[i], "--dbt-profile"))
+		{
+			if (++i < argc)
+			{
+				if (strlen(argv[i]) >= MAX_DBT_PROFILE_DIR_LEN)
+				{
+					init_subsystems();
+					kprintf("--dbt-profile: Directory name too long.\n");
+					process_exit(1, 0);
+				}
+				strcpy(cmdline_flags->dbt_profile_dir, argv[i]);
+			}
+			else
+			{
+				init_subsystems();
+				kprintf("--dbt-profile: No directory given.\n");
+				process_exit(1, 0);
+			}
+		}
 		else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
 		{
 			init_subsystems();
@@ -238,11 +294,27 @@ int main()
 			logger_attached = 1;
 		else if (!strcmp(argv[i], "--dbt-trace"))
 			cmdline_flags->dbt_trace = true;
+		else if (!strcmp(argv[i], "--dbt-background"))
+			cmdline_flags->dbt_background = true;
 		else if (!strcmp(argv[i], "--dbt-trace-all"))
 		{
 			cmdline_flags->dbt_trace = true;
 			cmdline_flags->dbt_trace_all = true;
 		}
+		else if (!strcmp(argv[i], "--dbt-no-superblocks"))
+			cmdline_flags->dbt_no_superblocks = true;
+		else if (!strcmp(argv[i], "--dbt-table-bits"))
+		{
+			int bits;
+			if (++i < argc && katoi(argv[i], &bits) && bits >= DBT_TABLE_MIN_BITS && bits <= DBT_TABLE_MAX_BITS)
+				cmdline_flags->dbt_table_bits = bits;
+			else
+			{
+				init_subsystems();
+				kprintf("--dbt-table-bits: Expected a number between %d and %d.\n", DBT_TABLE_MIN_BITS, DBT_TABLE_MAX_BITS);
+				process_exit(1, 0);
+			}
+		}
 		else if (argv[i][0] == '-')
 		{
 			init_subsystems();
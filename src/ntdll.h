@@ -20,6 +20,8 @@ typedef LONG NTSTATUS;
 #define STATUS_ACCESS_DENIED			0xC0000022
 #define STATUS_OBJECT_NAME_COLLISION	0xC0000035
 #define STATUS_SHARING_VIOLATION		0xC0000043
+#define STATUS_CANNOT_DELETE			0xC0000121
+#define STATUS_USER_MAPPED_FILE			0xC0000243
 
 #ifndef NT_SUCCESS
 #define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
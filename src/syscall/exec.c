@@ -21,6 +21,8 @@
 #include <common/auxvec.h>
 #include <common/errno.h>
 #include <common/fcntl.h>
+#include <dbt/persist.h>
+#include <dbt/profile.h>
 #include <dbt/x86.h>
 #include <fs/winfs.h>
 #include <syscall/exec.h>
@@ -29,6 +31,7 @@
 #include <syscall/sig.h>
 #include <syscall/syscall.h>
 #include <syscall/tls.h>
+#include <syscall/vdso.h>
 #include <syscall/vfs.h>
 #include <log.h>
 #include <heap.h>
@@ -48,9 +51,11 @@
 #ifdef _WIN64
 #define Elf_Ehdr Elf64_Ehdr
 #define Elf_Phdr Elf64_Phdr
+#define Elf_Dyn Elf64_Dyn
 #else
 #define Elf_Ehdr Elf32_Ehdr
 #define Elf_Phdr Elf32_Phdr
+#define Elf_Dyn Elf32_Dyn
 #endif
 
 struct elf_header
@@ -105,6 +110,9 @@ static void run(struct binfmt *binary, int argc, char *argv[], int env_size, cha
 	else
 		AUX_VEC(AT_ENTRY, executable->eh.e_entry);
 	AUX_VEC(AT_BASE, (binary->has_interpreter ? (void*)(interpreter->load_base - interpreter->low) : NULL));
+	void *vdso = vdso_map();
+	if (vdso)
+		AUX_VEC(AT_SYSINFO_EHDR, vdso);
 
 	/* environment variables */
 	PTR(NULL);
@@ -212,6 +220,7 @@ static int load_elf(struct file *f, struct binfmt *binary)
 
 	/* Map executable segments */
 	/* TODO: Directly use mmap() */
+	size_t image_base = elf->load_base;
 	int load_base_set = 0;
 	for (int i = 0; i < elf->eh.e_phnum; i++)
 	{
@@ -253,6 +262,14 @@ static int load_elf(struct file *f, struct binfmt *binary)
 		}
 	}
 
+	/* Register the image in the persistent translation cache
+	 * Recorded blocks are only translated when their page is first executed, by then the
+	 * dynamic linker has applied text relocations */
+	dbt_persist_load_module(f, image_base, elf->low, elf->high);
+
+	/* Function symbols for the profiler */
+	dbt_profile_load_module(f, image_base);
+
 	/* Load interpreter if present */
 	for (int i = 0; i < elf->eh.e_phnum; i++)
 	{
@@ -418,6 +435,8 @@ extern char *startup;
 
 static void execve_initialize_routine()
 {
+	dbt_persist_save();
+	dbt_profile_save();
 	signal_reset();
 	vfs_reset();
 	mm_reset();
@@ -28,6 +28,7 @@
 #include <syscall/syscall.h>
 #include <syscall/tls.h>
 #include <syscall/sig.h>
+#include <syscall/vdso.h>
 #include <syscall/vfs.h>
 #include <syscall/exec.h>
 #include <flags.h>
@@ -72,6 +73,7 @@ __declspec(noreturn) static void fork_child()
 	process_afterfork_child(fork->stack_base, fork->pid);
 	tls_afterfork_child();
 	vfs_afterfork_child();
+	vdso_afterfork_child();
 	dbt_init();
 	if (fork->ctid)
 		*(pid_t *)fork->ctid = fork->pid;
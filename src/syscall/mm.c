@@ -18,7 +18,9 @@
  */
 
 #include <common/errno.h>
+#include <dbt/persist.h>
 #include <dbt/x86.h>
+#include <fs/winfs.h>
 #include <lib/rbtree.h>
 #include <lib/slist.h>
 #include <syscall/mm.h>
@@ -34,6 +36,7 @@
 #include <Windows.h>
 #include <Psapi.h>
 #include <ntdll.h>
+#include <intrin.h>
 
 #ifndef min
 #define min(a,b) ((a) < (b) ? (a) : (b))
@@ -59,9 +62,12 @@
  *     MAP_FIXED with MAP_SHARED or MAP_PRIVATE on non 64kB aligned address.
  */
 
-/* Hard limits */
-/* Maximum number of mmap()-ed areas */
-#define MAX_MMAP_COUNT 2048 /*1024*/
+/* Number of map entries embedded in mm_data, more are allocated in slabs when they run out */
+#define MAP_ENTRY_INITIAL_COUNT 2048
+/* Size of a map entry slab */
+#define MAP_ENTRY_SLAB_SIZE BLOCK_SIZE
+/* Number of free map entries kept before an operation starts, no operation takes more */
+#define MAP_ENTRY_RESERVE 64
 
 #ifdef _WIN64
 
@@ -126,6 +132,12 @@ struct map_entry
 			int prot, flags;
 			struct file *f;
 			off_t offset_pages;
+			/* Read-ahead state of demand paged file mappings */
+			size_t readahead_page; /* Page where a sequential access faults next */
+			size_t readahead_pages; /* Current read-ahead window */
+			/* Augmented data of the subtree, see map_entry_augment() */
+			size_t subtree_start_page, subtree_end_page; /* Pages occupied by all entries of the subtree */
+			size_t subtree_gap; /* Largest number of free pages between entries of the subtree */
 		};
 	};
 };
@@ -142,6 +154,41 @@ static int map_entry_cmp(const struct rb_node *l, const struct rb_node *r)
 		return 1;
 }
 
+/* Last page occupied by the entry, block aligned entries always occupy entire blocks */
+static __forceinline size_t map_entry_last_page(const struct map_entry *e)
+{
+	if (BLOCK_ALIGNED(e->flags))
+		return GET_LAST_PAGE_OF_BLOCK(GET_BLOCK_OF_PAGE(e->end_page));
+	return e->end_page;
+}
+
+/* Number of free pages in between end_page and start_page */
+static __forceinline size_t free_pages_between(size_t end_page, size_t start_page)
+{
+	return start_page > end_page + 1? start_page - end_page - 1: 0;
+}
+
+static void map_entry_augment(struct rb_node *node)
+{
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	e->subtree_start_page = e->start_page;
+	e->subtree_end_page = map_entry_last_page(e);
+	e->subtree_gap = 0;
+	if (node->left)
+	{
+		struct map_entry *left = rb_entry(node->left, struct map_entry, tree);
+		e->subtree_start_page = left->subtree_start_page;
+		e->subtree_gap = max(left->subtree_gap, free_pages_between(left->subtree_end_page, e->start_page));
+	}
+	if (node->right)
+	{
+		struct map_entry *right = rb_entry(node->right, struct map_entry, tree);
+		e->subtree_end_page = right->subtree_end_page;
+		e->subtree_gap = max(e->subtree_gap, right->subtree_gap);
+		e->subtree_gap = max(e->subtree_gap, free_pages_between(map_entry_last_page(e), right->subtree_start_page));
+	}
+}
+
 struct mm_munmap_list_entry
 {
 	void *addr;
@@ -149,6 +196,16 @@ struct mm_munmap_list_entry
 	struct mm_munmap_list_entry *next;
 };
 
+/* Demand paging of private file mappings
+ * When a block of a private file mapping is allocated its file content is not read.
+ * The pages are marked pending and left inaccessible instead, the first access to a
+ * page faults and reads it from the file along with a read-ahead window which grows
+ * on sequential faults. The pending table is committed in chunks.
+ */
+#define FILE_PAGE_CHUNK_SIZE		BLOCK_SIZE
+#define FILE_PAGE_CHUNK_COUNT		(BLOCK_COUNT * PAGES_PER_BLOCK / FILE_PAGE_CHUNK_SIZE)
+#define FILE_READAHEAD_MAX_PAGES	PAGES_PER_BLOCK /* Maximum read-ahead window */
+
 struct mm_data
 {
 	/* RW lock for multi-threading protection */
@@ -169,23 +226,143 @@ struct mm_data
 	/* Information for all existing mappings */
 	struct rb_tree entry_tree;
 	struct slist entry_free_list;
-	struct map_entry entries[MAX_MMAP_COUNT];
+	int entry_free_count;
+	int entry_slab_count;
+	struct map_entry entries[MAP_ENTRY_INITIAL_COUNT];
 
 	/* Section handle count for each table */
 	uint16_t section_table_handle_count[SECTION_TABLE_COUNT];
+
+	/* Committed chunks of the pending file page table */
+	bool file_page_chunk[FILE_PAGE_CHUNK_COUNT];
 } _mm;
 static struct mm_data *const mm = &_mm;
 static HANDLE *mm_section_handle;
+/* File offset in pages of each file view block, committed along with the section handle tables
+ * The map entries covering a block may change after its view is mapped */
+static size_t *mm_file_block_offset;
+/* Pending file page table, inherited by a fork child as the sections are */
+static uint8_t *mm_file_page_pending;
+
+/* Demand paging statistics, not part of mm_data so a fork child starts from zero */
+struct mm_stats
+{
+	int file_page_faults;
+	int file_pages_deferred;
+	int file_pages_loaded;
+	int file_readahead_pages;
+	int file_blocks_mapped;
+	int file_blocks_copied;
+	uint64_t file_page_in_cycles;
+	uint64_t file_page_in_max_cycles;
+};
+static struct mm_stats mm_stats;
+
+/* Self-modifying code detection
+ * Guest pages dbt has translated code from are write protected. A write fault on such a page
+ * gives write access back and lets dbt invalidate the translations of the page. Pages which
+ * are written too often are left writable, their translations check the guest code on entry.
+ * The state table is not part of mm_data as a fork child starts with an empty code cache.
+ */
+#define CODE_PAGE_PROTECTED			0x80 /* Write protected for dbt */
+#define CODE_PAGE_WRITES_MASK		0x7F /* Number of write faults, saturated */
+#define CODE_PAGE_VOLATILE_WRITES	4 /* Number of write faults after which the page is no longer protected */
+#define CODE_PAGE_CHUNK_SIZE		BLOCK_SIZE /* The state table is committed in chunks */
+#define CODE_PAGE_CHUNK_COUNT		(BLOCK_COUNT * PAGES_PER_BLOCK / CODE_PAGE_CHUNK_SIZE)
+static uint8_t *mm_code_page_state;
+static bool mm_code_page_chunk[CODE_PAGE_CHUNK_COUNT];
+
+static __forceinline uint8_t get_code_page_state(size_t page)
+{
+	if (mm_code_page_chunk[page / CODE_PAGE_CHUNK_SIZE])
+		return mm_code_page_state[page];
+	else
+		return 0;
+}
+
+static __forceinline bool is_code_page_protected(size_t page)
+{
+	return (get_code_page_state(page) & CODE_PAGE_PROTECTED) != 0;
+}
+
+static __forceinline uint8_t *code_page_state(size_t page)
+{
+	size_t chunk = page / CODE_PAGE_CHUNK_SIZE;
+	if (!mm_code_page_chunk[chunk])
+	{
+		VirtualAlloc(&mm_code_page_state[chunk * CODE_PAGE_CHUNK_SIZE], CODE_PAGE_CHUNK_SIZE, MEM_COMMIT, PAGE_READWRITE);
+		mm_code_page_chunk[chunk] = true;
+	}
+	return &mm_code_page_state[page];
+}
+
+static void clear_code_pages(size_t start_page, size_t end_page)
+{
+	for (size_t page = start_page; page <= end_page; page++)
+		if (get_code_page_state(page))
+			mm_code_page_state[page] = 0;
+}
+
+static __forceinline bool is_file_page_pending(size_t page)
+{
+	return mm->file_page_chunk[page / FILE_PAGE_CHUNK_SIZE] && mm_file_page_pending[page];
+}
+
+static void set_file_pages_pending(size_t start_page, size_t end_page)
+{
+	for (size_t page = start_page; page <= end_page; page++)
+	{
+		size_t chunk = page / FILE_PAGE_CHUNK_SIZE;
+		if (!mm->file_page_chunk[chunk])
+		{
+			VirtualAlloc(&mm_file_page_pending[chunk * FILE_PAGE_CHUNK_SIZE], FILE_PAGE_CHUNK_SIZE, MEM_COMMIT, PAGE_READWRITE);
+			mm->file_page_chunk[chunk] = true;
+		}
+		mm_file_page_pending[page] = 1;
+	}
+}
+
+static void clear_file_pages(size_t start_page, size_t end_page)
+{
+	for (size_t page = start_page; page <= end_page; page++)
+		if (is_file_page_pending(page))
+			mm_file_page_pending[page] = 0;
+}
+
+static bool has_pending_file_pages(size_t start_page, size_t end_page)
+{
+	for (size_t page = start_page; page <= end_page; page++)
+		if (is_file_page_pending(page))
+			return true;
+	return false;
+}
+
+/* Zero-copy file mappings
+ * A block entirely covered by a private file mapping whose file offset is block aligned is
+ * mapped as a read-only view of the file section instead of an anonymous copy. Its pages
+ * come from the file cache and are shared by all processes mapping the file. On the first
+ * write the view is replaced by an anonymous copy, see duplicate_section().
+ * Such blocks are marked by tagging the low bit of their handle in the section handle table,
+ * which is never set in kernel handles. The tag is copied to a fork child with the table.
+ * The file offset of the view is kept in mm_file_block_offset.
+ */
+#define SECTION_HANDLE_FILE		1
 
 static __forceinline HANDLE get_section_handle(size_t i)
 {
 	size_t t = GET_SECTION_TABLE(i);
 	if (mm->section_table_handle_count[t])
-		return mm_section_handle[i];
+		return (HANDLE)((size_t)mm_section_handle[i] & ~(size_t)SECTION_HANDLE_FILE);
 	else
 		return NULL;
 }
 
+static __forceinline bool is_file_block(size_t i)
+{
+	size_t t = GET_SECTION_TABLE(i);
+	return mm->section_table_handle_count[t] && ((size_t)mm_section_handle[i] & SECTION_HANDLE_FILE);
+}
+
 static __forceinline void add_section_handle(size_t i, HANDLE handle)
 {
 	size_t t = GET_SECTION_TABLE(i);
@@ -194,6 +371,7 @@ static __forceinline void add_section_handle(size_t i, HANDLE handle)
 	else
 	{
 		VirtualAlloc(&mm_section_handle[t * SECTION_HANDLE_PER_TABLE], BLOCK_SIZE, MEM_COMMIT, PAGE_READWRITE);
+		VirtualAlloc(&mm_file_block_offset[t * SECTION_HANDLE_PER_TABLE], BLOCK_SIZE, MEM_COMMIT, PAGE_READWRITE);
 		mm_section_handle[i] = handle;
 	}
 }
@@ -214,7 +392,10 @@ static __forceinline void remove_section_handle(size_t i)
 	mm_section_handle[i] = NULL;
 	size_t t = GET_SECTION_TABLE(i);
 	if (--mm->section_table_handle_count[t] == 0)
+	{
 		VirtualFree(&mm_section_handle[t * SECTION_HANDLE_PER_TABLE], BLOCK_SIZE, MEM_DECOMMIT);
+		VirtualFree(&mm_file_block_offset[t * SECTION_HANDLE_PER_TABLE], BLOCK_SIZE, MEM_DECOMMIT);
+	}
 }
 
 static void munmap_list_add(void *addr, size_t length)
@@ -247,12 +428,14 @@ static struct map_entry *new_map_entry()
 	}
 	struct map_entry *entry = slist_next_entry(&mm->entry_free_list, struct map_entry, free_list);
 	slist_remove(&mm->entry_free_list, &entry->free_list);
+	mm->entry_free_count--;
 	return entry;
 }
 
 static void free_map_entry(struct map_entry *entry)
 {
 	slist_add(&mm->entry_free_list, &entry->free_list);
+	mm->entry_free_count++;
 }
 
 static struct rb_node *start_node(size_t start_page)
@@ -289,12 +472,17 @@ static void split_map_entry(struct map_entry *e, size_t last_page_of_first_entry
 	}
 	ne->prot = e->prot;
 	ne->flags = e->flags;
+	ne->readahead_page = 0;
+	ne->readahead_pages = 0;
 	e->end_page = last_page_of_first_entry;
+	rb_update_augmented(&mm->entry_tree, &e->tree);
 	rb_add(&mm->entry_tree, &ne->tree, map_entry_cmp);
 }
 
 static void free_map_entry_blocks(struct map_entry *e)
 {
+	clear_code_pages(e->start_page, e->end_page);
+	clear_file_pages(e->start_page, e->end_page);
 	if (e->flags & INTERNAL_MAP_VIRTUALALLOC)
 	{
 		VirtualFree(GET_PAGE_ADDRESS(e->start_page), 0, MEM_RELEASE);
@@ -349,13 +537,18 @@ void mm_init()
 	/* Initialize munmap_list */
 	mm->munmap_list = NULL;
 	/* Initialize mapping info freelist */
-	rb_init(&mm->entry_tree);
+	rb_init_augmented(&mm->entry_tree, map_entry_augment);
 	slist_init(&mm->entry_free_list);
-	for (size_t i = 0; i + 1 < MAX_MMAP_COUNT; i++)
-		slist_add(&mm->entry_free_list, &mm->entries[i].free_list);
+	mm->entry_free_count = 0;
+	mm->entry_slab_count = 0;
+	for (size_t i = 0; i + 1 < MAP_ENTRY_INITIAL_COUNT; i++)
+		free_map_entry(&mm->entries[i]);
 	mm->brk = 0;
 	/* Initialize section handle table */
 	mm_section_handle = (HANDLE*)VirtualAlloc(NULL, BLOCK_COUNT * sizeof(HANDLE), MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	mm_file_block_offset = (size_t*)VirtualAlloc(NULL, BLOCK_COUNT * sizeof(size_t), MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	mm_code_page_state = (uint8_t *)VirtualAlloc(NULL, BLOCK_COUNT * PAGES_PER_BLOCK, MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	mm_file_page_pending = (uint8_t *)VirtualAlloc(NULL, BLOCK_COUNT * PAGES_PER_BLOCK, MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
 	/* Initialize static alloc */
 	mm->static_alloc_begin = mm_mmap(NULL, MM_STATIC_ALLOC_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS,
 		INTERNAL_MAP_TOPDOWN | INTERNAL_MAP_NORESET | INTERNAL_MAP_VIRTUALALLOC, NULL, 0);
@@ -392,6 +585,8 @@ void mm_reset()
 		}
 		last_block = end_block;
 
+		clear_code_pages(e->start_page, e->end_page);
+		clear_file_pages(e->start_page, e->end_page);
 		if (e->f)
 			vfs_release(e->f);
 		free_map_entry(e);
@@ -400,6 +595,7 @@ void mm_reset()
 		cur = next;
 	}
 	mm->brk = 0;
+	winfs_delete_unmapped_files();
 }
 
 void mm_shutdown()
@@ -416,6 +612,7 @@ void mm_shutdown()
 		}
 	}
 	VirtualFree(mm_section_handle, 0, MEM_RELEASE);
+	VirtualFree(mm_file_block_offset, 0, MEM_RELEASE);
 }
 
 void *mm_static_alloc(size_t size)
@@ -442,53 +639,100 @@ void mm_update_brk(void *brk)
 #endif
 }
 
+/* Free page searching
+ * Entries are visited in address order as a linear scan would, but subtrees whose gaps between
+ * entries are all smaller than the requested size are skipped as a whole using the augmented
+ * data of the VAD tree, which makes a search O(log n) instead of O(n).
+ * *last is the first page not occupied by the entries visited so far.
+ */
+static size_t find_free_pages_in(struct rb_node *node, size_t count, bool block_align, size_t *last)
+{
+	if (node == NULL || *last >= GET_PAGE(ADDRESS_ALLOCATION_HIGH))
+		return 0;
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	/* The whole subtree is below the current position */
+	if (e->subtree_end_page < *last)
+		return 0;
+	/* The gap before the first entry of the subtree */
+	if (e->subtree_start_page >= *last && e->subtree_start_page - *last >= count)
+		return *last;
+	if (e->subtree_gap < count)
+	{
+		*last = e->subtree_end_page + 1;
+		if (block_align)
+			*last = (*last + PAGES_PER_BLOCK - 1) & -PAGES_PER_BLOCK;
+		return 0;
+	}
+	size_t r = find_free_pages_in(node->left, count, block_align, last);
+	if (r)
+		return r;
+	if (e->start_page >= *last && e->start_page - *last >= count)
+		return *last;
+	else if (map_entry_last_page(e) >= *last)
+	{
+		*last = map_entry_last_page(e) + 1;
+		/* Make sure not collide with block aligned entries */
+		if (block_align)
+			*last = (*last + PAGES_PER_BLOCK - 1) & -PAGES_PER_BLOCK;
+	}
+	return find_free_pages_in(node->right, count, block_align, last);
+}
+
 /* Find 'count' consecutive free pages, return 0 if not found */
 static size_t find_free_pages(size_t count, bool block_align)
 {
 	size_t last = GET_PAGE(ADDRESS_ALLOCATION_LOW);
-	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
-	{
-		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
-		if (e->start_page >= last && e->start_page - last >= count)
-			return last;
-		else if (e->end_page >= last)
-		{
-			last = e->end_page + 1;
-			/* Make sure not collide with block aligned entries */
-			if (block_align || BLOCK_ALIGNED(e->flags))
-				last = (last + PAGES_PER_BLOCK - 1) & -PAGES_PER_BLOCK;
-		}
-		if (last >= GET_PAGE(ADDRESS_ALLOCATION_HIGH))
-			return 0;
-	}
+	size_t r = find_free_pages_in(mm->entry_tree.root, count, block_align, &last);
+	if (r)
+		return r;
 	if (GET_PAGE(ADDRESS_ALLOCATION_HIGH) > last && GET_PAGE(ADDRESS_ALLOCATION_HIGH) - last >= count)
 		return last;
 	else
 		return 0;
 }
 
+/* Mirrored find_free_pages_in(), entries are visited from the highest address
+ * *last is the lowest page occupied by the entries visited so far.
+ */
+static size_t find_free_pages_topdown_in(struct rb_node *node, size_t count, bool block_align, size_t *last)
+{
+	if (node == NULL || *last <= GET_PAGE(ADDRESS_ALLOCATION_LOW))
+		return 0;
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	/* The whole subtree is above the current position */
+	if (e->subtree_start_page >= *last)
+		return 0;
+	/* The gap after the last entry of the subtree */
+	if (e->subtree_end_page < *last && e->subtree_end_page + count < *last)
+		return *last - count;
+	if (e->subtree_gap < count)
+	{
+		*last = e->subtree_start_page;
+		if (block_align)
+			*last &= -PAGES_PER_BLOCK;
+		return 0;
+	}
+	size_t r = find_free_pages_topdown_in(node->right, count, block_align, last);
+	if (r)
+		return r;
+	if (map_entry_last_page(e) < *last && map_entry_last_page(e) + count < *last)
+		return *last - count;
+	else if (e->start_page < *last)
+	{
+		*last = e->start_page;
+		if (block_align)
+			*last &= -PAGES_PER_BLOCK;
+	}
+	return find_free_pages_topdown_in(node->left, count, block_align, last);
+}
+
 /* Find 'count' consecutive free pages at the highest possible address with, return 0 if not found */
 static size_t find_free_pages_topdown(size_t count, bool block_align)
 {
 	size_t last = GET_PAGE(ADDRESS_ALLOCATION_HIGH);
-	for (struct rb_node *cur = rb_last(&mm->entry_tree); cur; cur = rb_prev(cur))
-	{
-		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
-		size_t end_page = e->end_page;
-		/* MAP_SHARED entries always occupy entire blocks */
-		if (e->flags & INTERNAL_MAP_SHARED)
-			end_page = (end_page & -PAGES_PER_BLOCK) + (PAGES_PER_BLOCK - 1);
-		if (e->end_page < last && e->end_page + count < last)
-			return last - count;
-		else if (e->start_page < last)
-		{
-			last = e->start_page;
-			if (block_align)
-				last &= -PAGES_PER_BLOCK;
-		}
-		if (last <= GET_PAGE(ADDRESS_ALLOCATION_LOW))
-			return 0;
-	}
+	size_t r = find_free_pages_topdown_in(mm->entry_tree.root, count, block_align, &last);
+	if (r)
+		return r;
 	if (GET_PAGE(ADDRESS_ALLOCATION_LOW) < last && GET_PAGE(ADDRESS_ALLOCATION_LOW) + count < last)
 		return last - count;
 	else
@@ -569,6 +813,23 @@ void mm_dump_memory_mappings()
 	ReleaseSRWLockShared(&mm->rw_lock);
 }
 
+int mm_get_stats(char *buf)
+{
+	char *original_buf = buf;
+	AcquireSRWLockShared(&mm->rw_lock);
+	buf += ksprintf(buf, "file_page_faults %d\n", mm_stats.file_page_faults);
+	buf += ksprintf(buf, "file_pages_deferred %d\n", mm_stats.file_pages_deferred);
+	buf += ksprintf(buf, "file_pages_loaded %d\n", mm_stats.file_pages_loaded);
+	buf += ksprintf(buf, "file_readahead_pages %d\n", mm_stats.file_readahead_pages);
+	buf += ksprintf(buf, "file_blocks_mapped %d\n", mm_stats.file_blocks_mapped);
+	buf += ksprintf(buf, "file_blocks_copied %d\n", mm_stats.file_blocks_copied);
+	buf += ksprintf(buf, "file_page_in_cycles %llu\n", mm_stats.file_page_in_cycles);
+	buf += ksprintf(buf, "file_page_in_avg_cycles %llu\n", mm_stats.file_page_faults? mm_stats.file_page_in_cycles / mm_stats.file_page_faults: 0ULL);
+	buf += ksprintf(buf, "file_page_in_max_cycles %llu\n", mm_stats.file_page_in_max_cycles);
+	ReleaseSRWLockShared(&mm->rw_lock);
+	return buf - original_buf;
+}
+
 int mm_get_maps(char *buf)
 {
 	int r = 0;
@@ -622,9 +883,23 @@ static void map_entry_range(struct map_entry *e, size_t start_page, size_t end_p
 		RtlZeroMemory(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE);
 }
 
+/* Whether the file content of the entry can be loaded on demand */
+static __forceinline bool can_defer_map_entry(struct map_entry *e)
+{
+	return e->f && !(e->flags & (INTERNAL_MAP_SHARED | INTERNAL_MAP_VIRTUALALLOC));
+}
+
+/* Mark the pages pending instead of reading them, they are loaded by handle_file_page_fault() */
+static void defer_map_entry_range(struct map_entry *e, size_t start_page, size_t end_page)
+{
+	set_file_pages_pending(start_page, end_page);
+	DWORD oldProtect;
+	VirtualProtect(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE, PAGE_NOACCESS, &oldProtect);
+	mm_stats.file_pages_deferred += (int)(end_page - start_page + 1);
+}
+
 static int mm_change_protection(HANDLE process, size_t start_page, size_t end_page, int prot)
 {
-	DWORD protection = prot_linux2win(prot);
 	size_t start_block = GET_BLOCK_OF_PAGE(start_page);
 	size_t end_block = GET_BLOCK_OF_PAGE(end_page);
 	for (size_t i = start_block; i <= end_block; i++)
@@ -632,20 +907,35 @@ static int mm_change_protection(HANDLE process, size_t start_page, size_t end_pa
 		HANDLE handle = get_section_handle(i);
 		if (handle)
 		{
+			/* File views are read only */
+			DWORD protection = prot_linux2win(is_file_block(i)? prot & ~PROT_WRITE: prot);
 			size_t range_start = max(GET_FIRST_PAGE_OF_BLOCK(i), start_page);
 			size_t range_end = min(GET_LAST_PAGE_OF_BLOCK(i), end_page);
-			DWORD old_protection;
-			PVOID addr = GET_PAGE_ADDRESS(range_start);
-			SIZE_T size = PAGE_SIZE * (range_end - range_start + 1);
-			NTSTATUS status;
-			status = NtProtectVirtualMemory(process, &addr, &size, protection, &old_protection);
-			if (status == STATUS_CONFLICTING_ADDRESSES) /* The block is not yet mapped */
-				log_info("NtProtectVirtualMemory(0x%p, 0x%p) failed: block %p not yet mapped, silently ignore.", addr, size, i);
-			else if (!NT_SUCCESS(status))
+			/* Pages not yet loaded from file stay inaccessible */
+			while (range_start <= range_end)
 			{
-				log_error("NtProtectVirtualMemory(0x%p, 0x%p) failed, status: %p", addr, size, status);
-				mm_dump_windows_memory_mappings(process);
-				return 0;
+				if (is_file_page_pending(range_start))
+				{
+					range_start++;
+					continue;
+				}
+				size_t run_end = range_start;
+				while (run_end < range_end && !is_file_page_pending(run_end + 1))
+					run_end++;
+				DWORD old_protection;
+				PVOID addr = GET_PAGE_ADDRESS(range_start);
+				SIZE_T size = PAGE_SIZE * (run_end - range_start + 1);
+				NTSTATUS status;
+				status = NtProtectVirtualMemory(process, &addr, &size, protection, &old_protection);
+				if (status == STATUS_CONFLICTING_ADDRESSES) /* The block is not yet mapped */
+					log_info("NtProtectVirtualMemory(0x%p, 0x%p) failed: block %p not yet mapped, silently ignore.", addr, size, i);
+				else if (!NT_SUCCESS(status))
+				{
+					log_error("NtProtectVirtualMemory(0x%p, 0x%p) failed, status: %p", addr, size, status);
+					mm_dump_windows_memory_mappings(process);
+					return 0;
+				}
+				range_start = run_end + 1;
 			}
 		}
 	}
@@ -709,6 +999,23 @@ static int allocate_block(size_t i)
 	return 1;
 }
 
+/* Map the section of a block at *addr, anonymous sections are mapped read-write-execute,
+ * file views read-execute at the file offset of the block */
+static NTSTATUS map_block_view(size_t block, PVOID *addr)
+{
+	HANDLE section = get_section_handle(block);
+	SIZE_T size = BLOCK_SIZE;
+	if (is_file_block(block))
+	{
+		LARGE_INTEGER offset;
+		offset.QuadPart = (loff_t)mm_file_block_offset[block] * PAGE_SIZE;
+		return NtMapViewOfSection(section, NtCurrentProcess(), addr, 0, BLOCK_SIZE,
+			&offset, &size, ViewUnmap, 0, PAGE_EXECUTE_READ);
+	}
+	return NtMapViewOfSection(section, NtCurrentProcess(), addr, 0, BLOCK_SIZE,
+		NULL, &size, ViewUnmap, 0, PAGE_EXECUTE_READWRITE);
+}
+
 /* Duplicate the section at given block. */
 static int duplicate_section(size_t block)
 {
@@ -743,8 +1050,9 @@ static int duplicate_section(size_t block)
 	}
 
 	HANDLE source = get_section_handle(block);
-	status = NtMapViewOfSection(source, NtCurrentProcess(), &remapped_addr, 0, BLOCK_SIZE,
-		NULL, &view_size, ViewUnmap, 0, PAGE_READWRITE);
+	if (is_file_block(block))
+		mm_stats.file_blocks_copied++;
+	status = map_block_view(block, &remapped_addr);
 	if (!NT_SUCCESS(status))
 	{
 		log_error("NtMapViewOfSection() failed, status: %x", status);
@@ -785,7 +1093,8 @@ static int take_block_ownership(size_t block)
 		log_error("NtQueryObject() on block %p failed, status: 0x%x.", block, status);
 		return 0;
 	}
-	if (info.HandleCount == 1)
+	/* A file view is never written to, it is always replaced by an anonymous copy */
+	if (info.HandleCount == 1 && !is_file_block(block))
 	{
 		log_info("We're the only owner.");
 		return 1;
@@ -809,8 +1118,45 @@ static int take_block_ownership(size_t block)
  * prot flags are mixed or the current prot flag is unknown.
  */
 #define INITIAL_PROT_UNKNOWN	-1
+/* Change protection of pages in [start_page, end_page], write protected code pages stay write protected
+ * and pending file pages stay inaccessible */
+static bool protect_pages(size_t start_page, size_t end_page, int prot)
+{
+	size_t page = start_page;
+	while (page <= end_page)
+	{
+		bool code = is_code_page_protected(page);
+		bool pending = is_file_page_pending(page);
+		size_t last_page = page;
+		while (last_page < end_page && is_code_page_protected(last_page + 1) == code
+			&& is_file_page_pending(last_page + 1) == pending)
+			last_page++;
+		DWORD protection = pending? PAGE_NOACCESS: prot_linux2win(code? prot & ~PROT_WRITE: prot);
+		DWORD oldProtect;
+		if (!VirtualProtect(GET_PAGE_ADDRESS(page), PAGE_SIZE * (last_page - page + 1), protection, &oldProtect))
+		{
+			log_error("VirtualProtect(0x%p, 0x%p) failed, error code: %d.", GET_PAGE_ADDRESS(page),
+				PAGE_SIZE * (last_page - page + 1), GetLastError());
+			return false;
+		}
+		page = last_page + 1;
+	}
+	return true;
+}
+
+static bool has_protected_code_pages(size_t start_page, size_t end_page)
+{
+	for (size_t page = start_page; page <= end_page; page++)
+		if (is_code_page_protected(page))
+			return true;
+	return false;
+}
+
 static bool load_block_protection(size_t block, int prot_mask, int initial_prot)
 {
+	/* File views are read only */
+	if (is_file_block(block))
+		prot_mask &= ~PROT_WRITE;
 	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(block);
 	size_t end_page = GET_LAST_PAGE_OF_BLOCK(block);
 	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
@@ -824,16 +1170,13 @@ static bool load_block_protection(size_t block, int prot_mask, int initial_prot)
 			size_t range_end = min(end_page, e->end_page);
 			if (range_start > range_end)
 				continue;
-			DWORD oldProtect;
 			int prot = (e->prot & prot_mask);
-			if (initial_prot == INITIAL_PROT_UNKNOWN || prot != initial_prot)
+			if (initial_prot == INITIAL_PROT_UNKNOWN || prot != initial_prot
+				|| ((prot & PROT_WRITE) && has_protected_code_pages(range_start, range_end))
+				|| has_pending_file_pages(range_start, range_end))
 			{
-				if (!VirtualProtect(GET_PAGE_ADDRESS(range_start), PAGE_SIZE * (range_end - range_start + 1), prot_linux2win(prot), &oldProtect))
-				{
-					log_error("VirtualProtect(0x%p, 0x%p) failed, error code: %d.", GET_PAGE_ADDRESS(range_start),
-						PAGE_SIZE * (range_end - range_start + 1), GetLastError());
+				if (!protect_pages(range_start, range_end, prot))
 					return false;
-				}
 			}
 		}
 	}
@@ -843,15 +1186,13 @@ static bool load_block_protection(size_t block, int prot_mask, int initial_prot)
 /* Load the detached block if not yet loaded, returns true if a detached block is loaded */
 static bool load_detached_block(size_t block)
 {
-	HANDLE section = get_section_handle(block);
 	PVOID addr = GET_BLOCK_ADDRESS(block);
-	SIZE_T size = BLOCK_SIZE;
-	NTSTATUS status = NtMapViewOfSection(section, NtCurrentProcess(), &addr, 0, BLOCK_SIZE,
-		NULL, &size, ViewUnmap, 0, PAGE_EXECUTE_READWRITE);
+	NTSTATUS status = map_block_view(block, &addr);
 	if (NT_SUCCESS(status))
 	{
 		/* Load content of the block and disable write permission */
-		if (load_block_protection(block, PROT_READ | PROT_EXEC, PROT_READ | PROT_WRITE | PROT_EXEC))
+		int initial_prot = is_file_block(block)? PROT_READ | PROT_EXEC: PROT_READ | PROT_WRITE | PROT_EXEC;
+		if (load_block_protection(block, PROT_READ | PROT_EXEC, initial_prot))
 		{
 			log_info("Detached block 0x%p successfully loaded.", block);
 			return true;
@@ -861,6 +1202,24 @@ static bool load_detached_block(size_t block)
 	return false;
 }
 
+/* Take ownership of a block, map it if it is detached and load its protection flags */
+static bool own_block(size_t block)
+{
+	if (!take_block_ownership(block))
+		return false;
+
+	/* Make sure it is mapped */
+	PVOID base_addr = GET_BLOCK_ADDRESS(block);
+	NTSTATUS status = map_block_view(block, &base_addr);
+	int initial_prot = INITIAL_PROT_UNKNOWN;
+	if (NT_SUCCESS(status))
+		initial_prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+
+	/* We're the only owner of the section now, change page protection flags */
+	load_block_protection(block, PROT_READ | PROT_WRITE | PROT_EXEC, initial_prot);
+	return true;
+}
+
 static int handle_cow_page_fault(void *addr)
 {
 	struct map_entry *entry = find_map_entry(addr);
@@ -875,29 +1234,113 @@ static int handle_cow_page_fault(void *addr)
 		return 0;
 	}
 	size_t block = GET_BLOCK(addr);
-
-	if (!take_block_ownership(block))
+	if (!own_block(block))
 		return 0;
 
-	/* Make sure it is mapped */
-	PVOID base_addr = GET_BLOCK_ADDRESS(block);
-	HANDLE section = get_section_handle(block);
-	SIZE_T size = BLOCK_SIZE;
-	NTSTATUS status;
-	status = NtMapViewOfSection(section, NtCurrentProcess(), &base_addr, 0, size,
-		NULL, &size, ViewUnmap, 0, PAGE_EXECUTE_READWRITE);
-	int initial_prot = INITIAL_PROT_UNKNOWN;
-	if (NT_SUCCESS(status))
-		initial_prot = PROT_READ | PROT_WRITE | PROT_EXEC;
-
-	/* We're the only owner of the section now, change page protection flags */
-	load_block_protection(block, PROT_READ | PROT_WRITE | PROT_EXEC, initial_prot);
-
 	/* TODO: Mark unmapped pages as PAGE_NOACCESS */
 	log_info("CoW section %p successfully duplicated.", block);
 	return 1;
 }
 
+/* Read pending pages in [start_page, end_page] of a file mapping, they must be in one block */
+static bool load_file_pages(struct map_entry *e, size_t start_page, size_t end_page)
+{
+	/* Loading writes to the section, it must not be shared with a forked process */
+	if (!own_block(GET_BLOCK_OF_PAGE(start_page)))
+		return false;
+	DWORD oldProtect;
+	VirtualProtect(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE, PAGE_READWRITE, &oldProtect);
+	map_entry_range(e, start_page, end_page);
+	clear_file_pages(start_page, end_page);
+	mm_stats.file_pages_loaded += (int)(end_page - start_page + 1);
+	return protect_pages(start_page, end_page, e->prot);
+}
+
+/* Access to a pending page of a private file mapping */
+static int handle_file_page_fault(void *addr)
+{
+	uint64_t start_cycles = __rdtsc();
+	size_t page = GET_PAGE(addr);
+	struct map_entry *e = find_map_entry(addr);
+	if (e == NULL || !e->f)
+	{
+		log_warning("Pending page %p has no file mapping.", page);
+		clear_file_pages(page, page);
+		return 0;
+	}
+	/* Double the read-ahead window on sequential faults, fall back to the faulting page otherwise */
+	if (page == e->readahead_page)
+		e->readahead_pages = min(e->readahead_pages * 2, FILE_READAHEAD_MAX_PAGES);
+	else
+		e->readahead_pages = 1;
+	size_t last_page = min(min(e->end_page, GET_LAST_PAGE_OF_BLOCK(GET_BLOCK_OF_PAGE(page))), page + e->readahead_pages - 1);
+	size_t end_page = page;
+	while (end_page < last_page && is_file_page_pending(end_page + 1))
+		end_page++;
+	e->readahead_page = end_page + 1;
+	if (!load_file_pages(e, page, end_page))
+		return 0;
+	uint64_t cycles = __rdtsc() - start_cycles;
+	mm_stats.file_page_faults++;
+	mm_stats.file_readahead_pages += (int)(end_page - page);
+	mm_stats.file_page_in_cycles += cycles;
+	if (cycles > mm_stats.file_page_in_max_cycles)
+		mm_stats.file_page_in_max_cycles = cycles;
+	return 1;
+}
+
+/* Write to a page which dbt has translated code from */
+static int handle_code_page_fault(void *addr)
+{
+	struct map_entry *entry = find_map_entry(addr);
+	if (entry && (entry->prot & PROT_WRITE))
+	{
+		uint8_t *state = code_page_state(GET_PAGE(addr));
+		*state &= ~CODE_PAGE_PROTECTED;
+		if ((*state & CODE_PAGE_WRITES_MASK) < CODE_PAGE_WRITES_MASK)
+			(*state)++;
+	}
+	/* Give write access back, the same as a CoW fault */
+	return handle_cow_page_fault(addr);
+}
+
+/* Map an unallocated block as a view of the file section if it is eligible, see SECTION_HANDLE_FILE */
+static bool map_file_block(size_t block)
+{
+	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(block);
+	size_t end_page = GET_LAST_PAGE_OF_BLOCK(block);
+	struct map_entry *e = find_map_entry(GET_BLOCK_ADDRESS(block));
+	if (!e || e->end_page < end_page || !can_defer_map_entry(e) || !e->f->op_vtable->get_section)
+		return false;
+	if ((e->offset_pages + (start_page - e->start_page)) % PAGES_PER_BLOCK)
+		return false;
+	HANDLE file_section = e->f->op_vtable->get_section(e->f);
+	if (!file_section)
+		return false;
+	/* Every block holds its own handle so it can be closed on its own */
+	HANDLE handle;
+	if (!DuplicateHandle(GetCurrentProcess(), file_section, GetCurrentProcess(), &handle, 0, TRUE, DUPLICATE_SAME_ACCESS))
+	{
+		log_error("DuplicateHandle() failed, error code: %d", GetLastError());
+		return false;
+	}
+	add_section_handle(block, (HANDLE)((size_t)handle | SECTION_HANDLE_FILE));
+	mm_file_block_offset[block] = e->offset_pages + (start_page - e->start_page);
+	PVOID addr = GET_BLOCK_ADDRESS(block);
+	NTSTATUS status = map_block_view(block, &addr);
+	if (!NT_SUCCESS(status))
+	{
+		/* The block is beyond the end of the section, fall back to copying */
+		log_info("Mapping file view of block 0x%p failed, status: %x", block, status);
+		remove_section_handle(block);
+		NtClose(handle);
+		return false;
+	}
+	protect_pages(start_page, end_page, e->prot & ~PROT_WRITE);
+	mm_stats.file_blocks_mapped++;
+	return true;
+}
+
 static int handle_on_demand_page_fault(size_t block)
 {
 	size_t page = GET_FIRST_PAGE_OF_BLOCK(block);
@@ -905,6 +1348,11 @@ static int handle_on_demand_page_fault(size_t block)
 	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(block);
 	size_t end_page = GET_LAST_PAGE_OF_BLOCK(block);
 	int found = 0;
+	if (map_file_block(block))
+	{
+		log_info("On demand block 0x%p mapped from file.", block);
+		return 1;
+	}
 	allocate_block(block);
 	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
 	{
@@ -919,6 +1367,11 @@ static int handle_on_demand_page_fault(size_t block)
 				continue;
 			if (page >= range_start && page <= range_end)
 				found = 1;
+			if (can_defer_map_entry(e))
+			{
+				defer_map_entry_range(e, range_start, range_end);
+				continue;
+			}
 			map_entry_range(e, range_start, range_end);
 			if (e->prot != (PROT_READ | PROT_WRITE | PROT_EXEC))
 			{
@@ -945,20 +1398,34 @@ int mm_handle_page_fault(void *addr, bool is_write)
 	}
 	AcquireSRWLockExclusive(&mm->rw_lock);
 	int r;
+	bool code_written = false;
 	size_t block = GET_BLOCK(addr);
 	HANDLE section = get_section_handle(block);
 	if (!section)
 	{
 		/* Page not loaded, load it now */
 		r = handle_on_demand_page_fault(block);
+		if (r && is_file_page_pending(GET_PAGE(addr)))
+			r = handle_file_page_fault(addr);
 	}
 	else
 	{
-		if (!is_write)
+		if (is_file_page_pending(GET_PAGE(addr)))
+		{
+			/* File content not loaded yet */
+			r = handle_file_page_fault(addr);
+		}
+		else if (!is_write)
 		{
 			/* A detached block */
 			r = load_detached_block(block);
 		}
+		else if (is_code_page_protected(GET_PAGE(addr)))
+		{
+			/* Self-modifying code */
+			r = handle_code_page_fault(addr);
+			code_written = (r != 0);
+		}
 		else
 		{
 			/* CoW triggered, this function will automatically map the section if not yet */
@@ -966,9 +1433,47 @@ int mm_handle_page_fault(void *addr, bool is_write)
 		}
 	}
 	ReleaseSRWLockExclusive(&mm->rw_lock);
+	/* dbt may be waiting for mm lock, only notify it after releasing the lock */
+	if (code_written)
+		dbt_code_written((size_t)GET_PAGE_ADDRESS(GET_PAGE(addr)), PAGE_SIZE);
 	return r;
 }
 
+void mm_protect_code(size_t start, size_t end)
+{
+	size_t start_page = GET_PAGE(start);
+	size_t end_page = GET_PAGE(end - 1);
+	/* Fast path: all pages are already protected */
+	size_t page = start_page;
+	while (page <= end_page && is_code_page_protected(page))
+		page++;
+	if (page > end_page)
+		return;
+	AcquireSRWLockExclusive(&mm->rw_lock);
+	for (; page <= end_page; page++)
+	{
+		if (is_code_page_protected(page))
+			continue;
+		struct map_entry *e = find_map_entry(GET_PAGE_ADDRESS(page));
+		if (!e || (e->flags & INTERNAL_MAP_VIRTUALALLOC))
+			continue;
+		/* Read only pages are marked as well, in case they are made writable later */
+		*code_page_state(page) |= CODE_PAGE_PROTECTED;
+		/* A pending file page gets its protection when it is loaded */
+		if ((e->prot & PROT_WRITE) && !is_file_page_pending(page))
+		{
+			DWORD oldProtect;
+			VirtualProtect(GET_PAGE_ADDRESS(page), PAGE_SIZE, prot_linux2win(e->prot & ~PROT_WRITE), &oldProtect);
+		}
+	}
+	ReleaseSRWLockExclusive(&mm->rw_lock);
+}
+
+bool mm_is_code_volatile(size_t addr)
+{
+	return (get_code_page_state(GET_PAGE(addr)) & CODE_PAGE_WRITES_MASK) >= CODE_PAGE_VOLATILE_WRITES;
+}
+
 int mm_fork(HANDLE process)
 {
 	AcquireSRWLockShared(&mm->rw_lock);
@@ -988,6 +1493,13 @@ int mm_fork(HANDLE process)
 		log_error("mm_fork(): Copy section handle master table failed, status: %x", status);
 		return 0;
 	}
+	size_t *forked_file_block_offset = (size_t*)VirtualAllocEx(process, NULL, BLOCK_COUNT * sizeof(size_t), MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	status = NtWriteVirtualMemory(process, &mm_file_block_offset, &forked_file_block_offset, sizeof(size_t *), NULL);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("mm_fork(): Copy file block offset master table failed, status: %x", status);
+		return 0;
+	}
 	for (size_t i = 0; i < SECTION_TABLE_COUNT; i++)
 		if (mm->section_table_handle_count[i])
 		{
@@ -1003,6 +1515,41 @@ int mm_fork(HANDLE process)
 				log_error("mm_fork(): Write section table 0x%p failed, status: %x", status);
 				return 0;
 			}
+			if (!VirtualAllocEx(process, &forked_file_block_offset[j], BLOCK_SIZE, MEM_COMMIT, PAGE_READWRITE))
+			{
+				log_error("mm_fork(): Allocate file block offset table 0x%p failed, error code: %d", i, GetLastError());
+				return 0;
+			}
+			status = NtWriteVirtualMemory(process, &forked_file_block_offset[j], &mm_file_block_offset[j], BLOCK_SIZE, NULL);
+			if (!NT_SUCCESS(status))
+			{
+				log_error("mm_fork(): Write file block offset table 0x%p failed, status: %x", i, status);
+				return 0;
+			}
+		}
+	/* Copy pending file page table, the child loads pending pages from its own sections */
+	uint8_t *forked_file_page_pending = (uint8_t*)VirtualAllocEx(process, NULL, BLOCK_COUNT * PAGES_PER_BLOCK, MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	status = NtWriteVirtualMemory(process, &mm_file_page_pending, &forked_file_page_pending, sizeof(uint8_t *), NULL);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("mm_fork(): Copy pending file page table failed, status: %x", status);
+		return 0;
+	}
+	for (size_t i = 0; i < FILE_PAGE_CHUNK_COUNT; i++)
+		if (mm->file_page_chunk[i])
+		{
+			size_t j = i * FILE_PAGE_CHUNK_SIZE;
+			if (!VirtualAllocEx(process, &forked_file_page_pending[j], FILE_PAGE_CHUNK_SIZE, MEM_COMMIT, PAGE_READWRITE))
+			{
+				log_error("mm_fork(): Allocate pending file page chunk 0x%p failed, error code: %d", i, GetLastError());
+				return 0;
+			}
+			status = NtWriteVirtualMemory(process, &forked_file_page_pending[j], &mm_file_page_pending[j], FILE_PAGE_CHUNK_SIZE, NULL);
+			if (!NT_SUCCESS(status))
+			{
+				log_error("mm_fork(): Write pending file page chunk 0x%p failed, status: %x", i, status);
+				return 0;
+			}
 		}
 	/* Section mapping plus protection change is very time consuming
 	 * It takes about 8 msec for 50-60 sections (3-4M) on my machine.
@@ -1106,6 +1653,7 @@ void mm_afterfork_parent()
 void mm_afterfork_child()
 {
 	InitializeSRWLock(&mm->rw_lock);
+	mm_code_page_state = (uint8_t *)VirtualAlloc(NULL, BLOCK_COUNT * PAGES_PER_BLOCK, MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
 	mm->static_alloc_begin = (uint8_t *)mm->static_alloc_end - MM_STATIC_ALLOC_SIZE;
 }
 
@@ -1234,6 +1782,8 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 	entry->f = f;
 	entry->offset_pages = offset_pages;
 	entry->prot = prot;
+	entry->readahead_page = 0;
+	entry->readahead_pages = 0;
 	if (f)
 		vfs_ref(f);
 	entry->flags = 0;
@@ -1241,6 +1791,8 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		entry->flags |= INTERNAL_MAP_NORESET;
 	if (internal_flags & INTERNAL_MAP_VIRTUALALLOC)
 		entry->flags |= INTERNAL_MAP_VIRTUALALLOC;
+	if (internal_flags & INTERNAL_MAP_SHARED)
+		entry->flags |= INTERNAL_MAP_SHARED;
 
 	/* Add the new entry to VAD tree */
 	rb_add(&mm->entry_tree, &entry->tree, map_entry_cmp);
@@ -1273,11 +1825,16 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		/* Set up content */
 		size_t last_page = GET_LAST_PAGE_OF_BLOCK(start_block);
 		last_page = min(last_page, end_page);
-		DWORD oldProtect;
-		VirtualProtect(GET_PAGE_ADDRESS(start_page), (last_page - start_page + 1) * PAGE_SIZE, prot_linux2win(prot | PROT_WRITE), &oldProtect);
-		map_entry_range(entry, start_page, last_page);
-		if ((prot & PROT_WRITE) == 0)
-			VirtualProtect(GET_PAGE_ADDRESS(start_page), (last_page - start_page + 1) * PAGE_SIZE, prot_linux2win(prot), &oldProtect);
+		if (can_defer_map_entry(entry) && !(flags & MAP_POPULATE))
+			defer_map_entry_range(entry, start_page, last_page);
+		else
+		{
+			DWORD oldProtect;
+			VirtualProtect(GET_PAGE_ADDRESS(start_page), (last_page - start_page + 1) * PAGE_SIZE, prot_linux2win(prot | PROT_WRITE), &oldProtect);
+			map_entry_range(entry, start_page, last_page);
+			if ((prot & PROT_WRITE) == 0)
+				VirtualProtect(GET_PAGE_ADDRESS(start_page), (last_page - start_page + 1) * PAGE_SIZE, prot_linux2win(prot), &oldProtect);
+		}
 		start_block++;
 	}
 	if (end_block >= start_block && (section = get_section_handle(end_block)) != NULL)
@@ -1291,18 +1848,27 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		load_detached_block(end_block);
 		/* Set up content */
 		size_t first_page = GET_FIRST_PAGE_OF_BLOCK(end_block);
-		DWORD oldProtect;
-		VirtualProtect(GET_PAGE_ADDRESS(first_page), (end_page - first_page + 1) * PAGE_SIZE, prot_linux2win(prot | PROT_WRITE), &oldProtect);
-		map_entry_range(entry, first_page, end_page);
-		if ((prot & PROT_WRITE) == 0)
-			VirtualProtect(GET_PAGE_ADDRESS(first_page), (end_page - first_page + 1) * PAGE_SIZE, prot_linux2win(prot), &oldProtect);
+		if (can_defer_map_entry(entry) && !(flags & MAP_POPULATE))
+			defer_map_entry_range(entry, first_page, end_page);
+		else
+		{
+			DWORD oldProtect;
+			VirtualProtect(GET_PAGE_ADDRESS(first_page), (end_page - first_page + 1) * PAGE_SIZE, prot_linux2win(prot | PROT_WRITE), &oldProtect);
+			map_entry_range(entry, first_page, end_page);
+			if ((prot & PROT_WRITE) == 0)
+				VirtualProtect(GET_PAGE_ADDRESS(first_page), (end_page - first_page + 1) * PAGE_SIZE, prot_linux2win(prot), &oldProtect);
+		}
 		end_block--;
 	}
 	if ((flags & MAP_POPULATE) && start_block < end_block)
 	{
 		for (size_t i = start_block; i <= end_block; i++)
+		{
+			if (map_file_block(i))
+				continue;
 			allocate_block(i);
-		map_entry_range(entry, GET_FIRST_PAGE_OF_BLOCK(start_block), GET_LAST_PAGE_OF_BLOCK(end_block));
+			map_entry_range(entry, GET_FIRST_PAGE_OF_BLOCK(i), GET_LAST_PAGE_OF_BLOCK(i));
+		}
 		mm_change_protection(NtCurrentProcess(), GET_FIRST_PAGE_OF_BLOCK(start_block), GET_LAST_PAGE_OF_BLOCK(end_block), prot);
 	}
 	log_info("Allocated memory: [%p, %p)", addr, (size_t)addr + length);
@@ -1395,9 +1961,36 @@ static int munmap_internal(void *addr, size_t length)
 	return 0;
 }
 
+/* Map entry slabs
+ * When the entries embedded in mm_data run out, more are allocated in slabs of VirtualAlloc()-ed
+ * memory like heap buckets. mm_fork() copies them to the child at the same address as any other
+ * VirtualAlloc()-ed memory region, so the links between entries in mm_data stay valid there.
+ * Slabs are never freed and survive execve(), their entries are reused through the free list.
+ * The free list is refilled when an operation starts instead of when it runs out, as allocating
+ * a slab in the middle of an operation could take pages the operation is working on.
+ */
+static void reserve_map_entries()
+{
+	if (mm->entry_free_count >= MAP_ENTRY_RESERVE)
+		return;
+	/* The slab itself takes one of the remaining entries */
+	struct map_entry *slab = (struct map_entry *)mmap_internal(NULL, MAP_ENTRY_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+		INTERNAL_MAP_TOPDOWN | INTERNAL_MAP_NORESET | INTERNAL_MAP_VIRTUALALLOC, NULL, 0);
+	if ((intptr_t)slab < 0)
+	{
+		log_error("Allocating map entry slab failed.");
+		return;
+	}
+	for (size_t i = 0; i < MAP_ENTRY_SLAB_SIZE / sizeof(struct map_entry); i++)
+		free_map_entry(&slab[i]);
+	mm->entry_slab_count++;
+	log_info("Map entry slab %d allocated at %p.", mm->entry_slab_count, slab);
+}
+
 void *mm_mmap(void *addr, size_t length, int prot, int flags, int internal_flags, struct file *f, off_t offset_pages)
 {
 	AcquireSRWLockExclusive(&mm->rw_lock);
+	reserve_map_entries();
 	void *r = mmap_internal(addr, length, prot, flags, internal_flags, f, offset_pages);
 	ReleaseSRWLockExclusive(&mm->rw_lock);
 	return r;
@@ -1418,8 +2011,10 @@ int mm_munmap(void *addr, size_t length)
 	}
 
 	AcquireSRWLockExclusive(&mm->rw_lock);
+	reserve_map_entries();
 	munmap_internal_unsafe(addr, length);
 	ReleaseSRWLockExclusive(&mm->rw_lock);
+	winfs_delete_unmapped_files();
 	return 0;
 }
 
@@ -1432,6 +2027,8 @@ DEFINE_SYSCALL6(mmap, void *, addr, size_t, length, int, prot, int, flags, int,
 		return -L_EINVAL;
 	struct file *f = vfs_get(fd);
 	intptr_t r = (intptr_t)mm_mmap(addr, length, prot, flags, 0, f, offset / PAGE_SIZE);
+	if (f && (prot & PROT_EXEC) && r >= 0) /* Shared libraries loaded by the dynamic linker */
+		dbt_persist_load_module(f, r - offset, offset, offset + length);
 	if (f)
 		vfs_release(f);
 	return r;
@@ -1458,6 +2055,8 @@ DEFINE_SYSCALL6(mmap2, void *, addr, size_t, length, int, prot, int, flags, int,
 	log_info("mmap2(%p, %p, %x, %x, %d, %p)", addr, length, prot, flags, fd, offset);
 	struct file *f = vfs_get(fd);
 	intptr_t r = (intptr_t)mm_mmap(addr, length, prot, flags, 0, f, offset);
+	if (f && (prot & PROT_EXEC) && r >= 0)
+		dbt_persist_load_module(f, r - offset * PAGE_SIZE, offset * PAGE_SIZE, offset * PAGE_SIZE + length);
 	if (f)
 		vfs_release(f);
 	return r;
@@ -1475,6 +2074,7 @@ DEFINE_SYSCALL3(mprotect, void *, addr, size_t, length, int, prot)
 	log_info("mprotect(%p, %p, %x)", addr, length, prot);
 	int r = 0;
 	AcquireSRWLockExclusive(&mm->rw_lock);
+	reserve_map_entries();
 	if (!IS_ALIGNED(addr, PAGE_SIZE))
 	{
 		r = -L_EINVAL;
@@ -1592,13 +2192,29 @@ static int mm_populate_internal(const void *addr, size_t len)
 				{
 					/* Load it if it is detached block */
 					load_detached_block(i);
+					/* Read file pages which are not loaded yet */
+					size_t first_page = max(range_start, GET_FIRST_PAGE_OF_BLOCK(i));
+					size_t last_page = min(range_end, GET_LAST_PAGE_OF_BLOCK(i));
+					for (size_t page = first_page; page <= last_page; page++)
+					{
+						if (!is_file_page_pending(page))
+							continue;
+						size_t pending_end = page;
+						while (pending_end < last_page && is_file_page_pending(pending_end + 1))
+							pending_end++;
+						if (!load_file_pages(e, page, pending_end))
+							return -L_ENOMEM;
+						page = pending_end;
+					}
 					continue;
 				}
 				else
 				{
+					num_blocks++;
+					if (map_file_block(i))
+						continue;
 					if (!allocate_block(i))
 						return -L_ENOMEM;
-					num_blocks++;
 					size_t first_page = max(range_start, GET_FIRST_PAGE_OF_BLOCK(i));
 					size_t last_page = min(range_end, GET_LAST_PAGE_OF_BLOCK(i));
 					map_entry_range(e, first_page, last_page);
@@ -1670,11 +2286,302 @@ DEFINE_SYSCALL2(munlock, const void *, addr, size_t, len)
 	return 0;
 }
 
+/* mremap() support
+ * A mapping is grown in place when the pages following it are free. Otherwise it is moved to a
+ * destination at the same offset within a block as the source, so that blocks entirely covered
+ * by the moved range are moved by re-pointing their section handles and remapping the views.
+ * Only the partial blocks at both ends have their content copied.
+ */
+
+/* Grow the entry in place to end at end_page, returns false if the following pages are not free */
+static bool mremap_grow(struct map_entry *e, size_t end_page)
+{
+	size_t start_page = e->end_page + 1;
+	/* Block aligned entries can only be extended by entire blocks */
+	if (BLOCK_ALIGNED(e->flags) && GET_PAGE_IN_BLOCK(start_page))
+		return false;
+	int flags = MAP_FIXED | ((e->flags & INTERNAL_MAP_SHARED)? MAP_SHARED: MAP_PRIVATE);
+	if (!e->f)
+		flags |= MAP_ANONYMOUS;
+	void *addr = mmap_internal(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE, e->prot, flags,
+		INTERNAL_MAP_NOOVERWRITE | (e->flags & INTERNAL_MAP_NORESET), e->f, e->offset_pages + (start_page - e->start_page));
+	if (addr != GET_PAGE_ADDRESS(start_page))
+		return false;
+	/* Merge the new entry into the original one */
+	struct map_entry *tail = find_map_entry(addr);
+	e->end_page = tail->end_page;
+	rb_remove(&mm->entry_tree, &tail->tree);
+	rb_update_augmented(&mm->entry_tree, &e->tree);
+	if (tail->f)
+		vfs_release(tail->f);
+	free_map_entry(tail);
+	return true;
+}
+
+/* Move the section of src_block to dst_block, both must be entirely covered by the moved range */
+static void mremap_move_block(size_t src_block, size_t dst_block)
+{
+	/* Not loaded yet, the destination block will be loaded on demand */
+	if (!get_section_handle(src_block))
+		return;
+	/* Keep the SECTION_HANDLE_FILE tag */
+	HANDLE handle = mm_section_handle[src_block];
+	/* The section handle may not be currrently mapped, let it silently fail here */
+	NtUnmapViewOfSection(NtCurrentProcess(), GET_BLOCK_ADDRESS(src_block));
+	size_t file_offset = mm_file_block_offset[src_block];
+	remove_section_handle(src_block);
+	add_section_handle(dst_block, handle);
+	mm_file_block_offset[dst_block] = file_offset;
+	for (size_t i = 0; i < PAGES_PER_BLOCK; i++)
+		if (is_file_page_pending(GET_FIRST_PAGE_OF_BLOCK(src_block) + i))
+			set_file_pages_pending(GET_FIRST_PAGE_OF_BLOCK(dst_block) + i, GET_FIRST_PAGE_OF_BLOCK(dst_block) + i);
+	/* Map it as a detached block, the section may still be shared with a forked process */
+	load_detached_block(dst_block);
+}
+
+/* Whether a page of the moved range has content of its own, other pages have the initial content of the entry */
+static __forceinline bool mremap_has_content(size_t page)
+{
+	return get_section_handle(GET_BLOCK_OF_PAGE(page)) && !is_file_page_pending(page);
+}
+
+/* Set up pages [start_page, end_page] of the moved entry e in a block which cannot be moved as a whole
+ * Pages up to moved_end_page correspond to the source range starting at src_start_page, the others
+ * are newly grown pages.
+ */
+static bool mremap_copy_block(struct map_entry *e, size_t block, size_t start_page, size_t end_page,
+	size_t moved_end_page, size_t src_start_page)
+{
+	size_t copy_end_page = min(end_page, moved_end_page);
+	bool has_content = false;
+	for (size_t page = start_page; page <= copy_end_page; page++)
+		if (mremap_has_content(page - e->start_page + src_start_page))
+			has_content = true;
+	bool loaded = get_section_handle(block) != NULL;
+	if (!loaded)
+	{
+		/* Nothing to copy, the block is loaded on demand */
+		if (!has_content)
+			return true;
+		/* Set up the block for all entries in it */
+		handle_on_demand_page_fault(block);
+		if (!get_section_handle(block))
+			return false;
+	}
+	if (!own_block(block))
+		return false;
+	size_t page = start_page;
+	while (page <= end_page)
+	{
+		size_t src_page = page - e->start_page + src_start_page;
+		bool copy = page <= copy_end_page && mremap_has_content(src_page);
+		size_t last_page = page;
+		/* A run must not cross source blocks, each of them is a separate view */
+		while (last_page < end_page && GET_BLOCK_OF_PAGE(src_page + (last_page + 1 - page)) == GET_BLOCK_OF_PAGE(src_page)
+			&& (last_page + 1 <= copy_end_page && mremap_has_content(src_page + (last_page + 1 - page))) == copy)
+			last_page++;
+		size_t size = (last_page - page + 1) * PAGE_SIZE;
+		DWORD oldProtect;
+		if (copy)
+		{
+			/* The source pages are unmapped afterwards, their protection does not matter */
+			load_detached_block(GET_BLOCK_OF_PAGE(src_page));
+			VirtualProtect(GET_PAGE_ADDRESS(src_page), size, PAGE_READONLY, &oldProtect);
+			clear_file_pages(page, last_page);
+			VirtualProtect(GET_PAGE_ADDRESS(page), size, PAGE_READWRITE, &oldProtect);
+			RtlCopyMemory(GET_PAGE_ADDRESS(page), GET_PAGE_ADDRESS(src_page), size);
+		}
+		else if (loaded)
+		{
+			/* Set up content, it is already done by handle_on_demand_page_fault() for a newly loaded block */
+			if (can_defer_map_entry(e))
+				defer_map_entry_range(e, page, last_page);
+			else
+			{
+				VirtualProtect(GET_PAGE_ADDRESS(page), size, PAGE_READWRITE, &oldProtect);
+				map_entry_range(e, page, last_page);
+			}
+		}
+		page = last_page + 1;
+	}
+	return protect_pages(start_page, end_page, e->prot);
+}
+
+/* Set up the initial content of pages [start_page, end_page] of entry e in a moved block */
+static bool mremap_init_pages(struct map_entry *e, size_t start_page, size_t end_page)
+{
+	if (can_defer_map_entry(e))
+		defer_map_entry_range(e, start_page, end_page);
+	else
+	{
+		DWORD oldProtect;
+		VirtualProtect(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE, PAGE_READWRITE, &oldProtect);
+		map_entry_range(e, start_page, end_page);
+	}
+	return protect_pages(start_page, end_page, e->prot);
+}
+
+/* Move src_pages pages of entry e starting at src_start_page to dst_pages pages at dst_start_page
+ * The destination pages must be free, dst_start_page is 0 if any free pages can be used
+ */
+static void *mremap_move(struct map_entry *e, size_t src_start_page, size_t src_pages, size_t dst_start_page, size_t dst_pages)
+{
+	if (!dst_start_page)
+	{
+		size_t offset = GET_PAGE_IN_BLOCK(src_start_page);
+		dst_start_page = find_free_pages(dst_pages + offset, true);
+		if (!dst_start_page)
+		{
+			log_error("Cannot find free pages.");
+			return (void*)-L_ENOMEM;
+		}
+		dst_start_page += offset;
+	}
+	size_t dst_end_page = dst_start_page + dst_pages - 1;
+	size_t moved_end_page = dst_start_page + min(src_pages, dst_pages) - 1;
+	/* The section of a block aligned entry is shared, it must always be moved as a whole, never copied
+	 * The last block of the entry is moved with the pages after the end of the entry */
+	size_t whole_end_page = moved_end_page;
+	if (BLOCK_ALIGNED(e->flags))
+	{
+		size_t src_end_page = src_start_page + src_pages - 1;
+		if (GET_PAGE_IN_BLOCK(src_start_page) || GET_PAGE_IN_BLOCK(dst_start_page)
+			|| (src_end_page != e->end_page && GET_PAGE_IN_BLOCK(src_end_page + 1)))
+		{
+			log_error("Moving part of a block of a shared mapping is not supported.");
+			return (void*)-L_EINVAL;
+		}
+		if (src_end_page == e->end_page)
+			whole_end_page = dst_start_page + (map_entry_last_page(e) - src_start_page);
+	}
+
+	/* Create the destination entry */
+	struct map_entry *entry = new_map_entry();
+	if (!entry)
+		return (void*)-L_ENOMEM;
+	entry->start_page = dst_start_page;
+	entry->end_page = dst_end_page;
+	entry->f = e->f;
+	entry->offset_pages = e->offset_pages + (src_start_page - e->start_page);
+	entry->prot = e->prot;
+	entry->flags = e->flags;
+	entry->readahead_page = 0;
+	entry->readahead_pages = 0;
+	if (entry->f)
+		vfs_ref(entry->f);
+	rb_add(&mm->entry_tree, &entry->tree, map_entry_cmp);
+
+	bool congruent = GET_PAGE_IN_BLOCK(dst_start_page) == GET_PAGE_IN_BLOCK(src_start_page);
+	for (size_t block = GET_BLOCK_OF_PAGE(dst_start_page); block <= GET_BLOCK_OF_PAGE(dst_end_page); block++)
+	{
+		size_t start_page = max(dst_start_page, GET_FIRST_PAGE_OF_BLOCK(block));
+		size_t end_page = min(dst_end_page, GET_LAST_PAGE_OF_BLOCK(block));
+		if (congruent && start_page == GET_FIRST_PAGE_OF_BLOCK(block) && GET_LAST_PAGE_OF_BLOCK(block) <= whole_end_page)
+		{
+			mremap_move_block(GET_BLOCK_OF_PAGE(start_page - dst_start_page + src_start_page), block);
+			/* Grown pages in the last moved block of a block aligned entry get the initial content of the entry */
+			if (end_page > moved_end_page && get_section_handle(block) && !mremap_init_pages(entry, moved_end_page + 1, end_page))
+			{
+				log_error("Setting up moved block 0x%p failed.", block);
+				return (void*)-L_ENOMEM;
+			}
+		}
+		else if (!mremap_copy_block(entry, block, start_page, end_page, moved_end_page, src_start_page))
+		{
+			log_error("Setting up moved block 0x%p failed.", block);
+			return (void*)-L_ENOMEM;
+		}
+	}
+	munmap_internal(GET_PAGE_ADDRESS(src_start_page), src_pages * PAGE_SIZE);
+	log_info("Moved memory: [%p, %p) -> [%p, %p)", GET_PAGE_ADDRESS(src_start_page), GET_PAGE_ADDRESS(src_start_page + src_pages),
+		GET_PAGE_ADDRESS(dst_start_page), GET_PAGE_ADDRESS(dst_end_page + 1));
+	return GET_PAGE_ADDRESS(dst_start_page);
+}
+
 DEFINE_SYSCALL5(mremap, void *, old_address, size_t, old_size, size_t, new_size, int, flags, void *, new_address)
 {
 	log_info("mremap(old_address=%p, old_size=%p, new_size=%p, flags=%x, new_address=%p)", old_address, old_size, new_size, flags, new_address);
-	log_warning("mremap() not implemented.");
-	return -L_ENOSYS;
+	if ((flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED)) || ((flags & MREMAP_FIXED) && !(flags & MREMAP_MAYMOVE)) || new_size == 0)
+		return -L_EINVAL;
+	if (old_size == 0)
+	{
+		log_warning("mremap() with zero old_size is not supported.");
+		return -L_EINVAL;
+	}
+	if (munmap_internal_check(old_address, &old_size))
+		return -L_EINVAL;
+	new_size = ALIGN_TO_PAGE(new_size);
+	if (flags & MREMAP_FIXED)
+	{
+		if (munmap_internal_check(new_address, &new_size))
+			return -L_EINVAL;
+		/* The ranges must not overlap */
+		if ((size_t)new_address < (size_t)old_address + old_size && (size_t)old_address < (size_t)new_address + new_size)
+			return -L_EINVAL;
+	}
+	intptr_t r;
+	AcquireSRWLockExclusive(&mm->rw_lock);
+	reserve_map_entries();
+	size_t start_page = GET_PAGE(old_address);
+	size_t end_page = GET_PAGE((size_t)old_address + old_size - 1);
+	struct map_entry *e = find_map_entry(old_address);
+	if (!e || e->end_page < end_page)
+	{
+		r = -L_EFAULT;
+		goto out;
+	}
+	if (e->flags & INTERNAL_MAP_VIRTUALALLOC)
+	{
+		log_warning("mremap() on VirtualAlloc() memory regions is not supported.");
+		r = -L_EINVAL;
+		goto out;
+	}
+	if ((flags & MREMAP_FIXED) && BLOCK_ALIGNED(e->flags) && !IS_ALIGNED(new_address, BLOCK_SIZE))
+	{
+		log_error("Non-64kB aligned MREMAP_FIXED address for a MAP_SHARED memory region is unsupported.");
+		r = -L_EINVAL;
+		goto out;
+	}
+	if (new_size < old_size)
+	{
+		/* Shrink, the remaining part is moved if MREMAP_FIXED is given */
+		munmap_internal((char*)old_address + new_size, old_size - new_size);
+		old_size = new_size;
+		end_page = GET_PAGE((size_t)old_address + old_size - 1);
+	}
+	if (flags & MREMAP_FIXED)
+	{
+		/* The destination may be inside the source entry, which changes or frees it */
+		munmap_internal(new_address, new_size);
+		e = find_map_entry(old_address);
+		if (!e || e->end_page < end_page)
+		{
+			r = -L_EFAULT;
+			goto out;
+		}
+		r = (intptr_t)mremap_move(e, start_page, GET_PAGE(old_size), GET_PAGE(new_address), GET_PAGE(new_size));
+		goto out;
+	}
+	if (new_size == old_size)
+	{
+		r = (intptr_t)old_address;
+		goto out;
+	}
+	/* Grow in place if the range is at the end of the entry and the following pages are free */
+	if (end_page == e->end_page && mremap_grow(e, GET_PAGE((size_t)old_address + new_size - 1)))
+	{
+		r = (intptr_t)old_address;
+		goto out;
+	}
+	if (!(flags & MREMAP_MAYMOVE))
+	{
+		r = -L_ENOMEM;
+		goto out;
+	}
+	r = (intptr_t)mremap_move(e, start_page, GET_PAGE(old_size), 0, GET_PAGE(new_size));
+out:
+	ReleaseSRWLockExclusive(&mm->rw_lock);
+	return r;
 }
 
 DEFINE_SYSCALL3(madvise, void *, addr, size_t, length, int, advise)
@@ -1692,6 +2599,7 @@ DEFINE_SYSCALL1(brk, void *, addr)
 	log_info("brk(%p)", addr);
 	log_info("Last brk: %p", mm->brk);
 	AcquireSRWLockExclusive(&mm->rw_lock);
+	reserve_map_entries();
 	size_t brk = ALIGN_TO_PAGE(mm->brk);
 	addr = (void*)ALIGN_TO_PAGE(addr);
 	if (addr != 0 && addr < mm->brk)
@@ -68,6 +68,8 @@ void mm_dump_stack_trace(PCONTEXT context);
 void mm_dump_windows_memory_mappings(HANDLE process);
 void mm_dump_memory_mappings();
 int mm_get_maps(char *buf);
+/* Print demand paging statistics to buf, for /proc/[pid]/mm_stats */
+int mm_get_stats(char *buf);
 
 /* Check if the memory region is compatible with desired access */
 EXTERN_C int mm_check_read(const void *addr, size_t size);
@@ -75,6 +77,14 @@ EXTERN_C int mm_check_read_string(const char *addr);
 EXTERN_C int mm_check_write(void *addr, size_t size);
 
 int mm_handle_page_fault(void *addr, bool is_write);
+
+/* Write protect guest pages in [start, end) which dbt has translated code from
+ * A write to these pages invalidates the translations via dbt_code_written() */
+void mm_protect_code(size_t start, size_t end);
+/* Whether the page containing addr is rewritten so often that its translations
+ * should check the guest code on entry instead of write protecting it */
+bool mm_is_code_volatile(size_t addr);
+
 int mm_fork(HANDLE process);
 void mm_afterfork_parent();
 void mm_afterfork_child();
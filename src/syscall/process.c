@@ -23,7 +23,11 @@
 #include <common/resource.h>
 #include <common/sysinfo.h>
 #include <common/wait.h>
+#include <dbt/persist.h>
+#include <dbt/profile.h>
+#include <dbt/x86.h>
 #include <fs/virtual.h>
+#include <fs/winfs.h>
 #include <syscall/futex.h>
 #include <syscall/mm.h>
 #include <syscall/process.h>
@@ -414,6 +418,8 @@ static pid_t process_wait(pid_t pid, int *status, int options, struct rusage *ru
 			*status = W_EXITCODE(exit_code, 0);
 	}
 	CloseHandle(proc->hProcess);
+	/* Views of files unlinked while the child mapped them are gone now */
+	winfs_delete_unmapped_files();
 	return pid;
 }
 
@@ -440,6 +446,8 @@ DEFINE_SYSCALL4(wait4, pid_t, pid, int *, status, int, options, struct rusage *,
 __declspec(noreturn) void process_exit(int exit_code, int exit_signal)
 {
 	/* TODO: Gracefully shutdown subsystems, but take care of race conditions */
+	dbt_persist_save();
+	dbt_profile_save();
 	process_lock_shared();
 	pid_t pid = process->pid;
 	process_shared->processes[pid].exit_code = exit_code;
@@ -452,6 +460,7 @@ __declspec(noreturn) void process_exit(int exit_code, int exit_signal)
 __declspec(noreturn) void thread_exit(int exit_code, int exit_signal)
 {
 	signal_exit_thread(current_thread);
+	dbt_exit_thread();
 	if (current_thread->clear_tid)
 	{
 		if (mm_check_write(current_thread->clear_tid, sizeof(pid_t)))
@@ -693,6 +702,15 @@ int process_query(int query_type, char *buf)
 	case PROCESS_QUERY_MAPS:
 		return mm_get_maps(buf);
 
+	case PROCESS_QUERY_DBT_STATS:
+		return dbt_get_stats(buf);
+
+	case PROCESS_QUERY_DBT_INLINE_CACHES:
+		return dbt_get_inline_cache_stats(buf);
+
+	case PROCESS_QUERY_MM_STATS:
+		return mm_get_stats(buf);
+
 	default:
 		return 0;
 	}
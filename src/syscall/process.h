@@ -52,6 +52,9 @@ enum
 {
 	PROCESS_QUERY_STAT,		/* /proc/[pid]/stat */
 	PROCESS_QUERY_MAPS,		/* /proc/[pid]/maps */
+	PROCESS_QUERY_DBT_STATS,	/* /proc/[pid]/dbt_stats */
+	PROCESS_QUERY_DBT_INLINE_CACHES,	/* /proc/[pid]/dbt_inline_caches */
+	PROCESS_QUERY_MM_STATS,	/* /proc/[pid]/mm_stats */
 };
 int process_query(int query_type, char *buf);
 int process_query_pid(pid_t pid, int query_type, char *buf);
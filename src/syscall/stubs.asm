@@ -138,4 +138,214 @@ signal_restorer PROC
 	int 080h
 signal_restorer ENDP
 
+; vDSO functions, exported by the image built in vdso.c
+; These are translated by dbt before run and must only use guest visible state
+; Offsets into struct vdso_data, which must match vdso.h
+VDSO_SEQ			EQU 0
+VDSO_MODE			EQU 4
+VDSO_TSC			EQU 8
+VDSO_MULT			EQU 16
+VDSO_REALTIME		EQU 20
+VDSO_MONOTONIC		EQU 28
+
+EXTERN vdso_data: DWORD
+
+; Read a clock, ecx is the offset of its base time in vdso_data
+; On success returns seconds in eax and nanoseconds in edx and clears the carry flag
+; Sets the carry flag if the time must be read by a system call
+vdso_read_time PROC
+	push ebx
+	push esi
+	push edi
+	; vdso_data points into the shared area
+	mov edi, vdso_data
+RETRY:
+	mov esi, [edi + VDSO_SEQ]
+	test esi, 1
+	jnz RETRY
+	cmp DWORD PTR [edi + VDSO_MODE], 0
+	je FAIL
+	rdtsc
+	sub eax, [edi + VDSO_TSC]
+	sbb edx, [edi + VDSO_TSC + 4]
+	; the update thread is late, or the TSC went backwards
+	jnz FAIL
+	; eax = elapsed TSC ticks
+	mul DWORD PTR [edi + VDSO_MULT]
+	; edx = elapsed nanoseconds
+	mov eax, edx
+	xor edx, edx
+	add eax, [edi + ecx + 4]
+	adc edx, 0
+	mov ebx, 1000000000
+	div ebx
+	add eax, [edi + ecx]
+	cmp esi, [edi + VDSO_SEQ]
+	jne RETRY
+	pop edi
+	pop esi
+	pop ebx
+	clc
+	ret
+
+FAIL:
+	pop edi
+	pop esi
+	pop ebx
+	stc
+	ret
+vdso_read_time ENDP
+
+; Get the offset of the base time of clock eax in ecx, sets the carry flag if not supported
+vdso_clock_base PROC
+	mov ecx, VDSO_REALTIME
+	cmp eax, 0 ; CLOCK_REALTIME
+	je SUCC
+	cmp eax, 5 ; CLOCK_REALTIME_COARSE
+	je SUCC
+	mov ecx, VDSO_MONOTONIC
+	cmp eax, 1 ; CLOCK_MONOTONIC
+	je SUCC
+	cmp eax, 4 ; CLOCK_MONOTONIC_RAW
+	je SUCC
+	cmp eax, 6 ; CLOCK_MONOTONIC_COARSE
+	je SUCC
+	stc
+	ret
+
+SUCC:
+	clc
+	ret
+vdso_clock_base ENDP
+
+vdso_clock_gettime PROC ; clk_id, tp
+	mov eax, [esp + 4]
+	call vdso_clock_base
+	jc FALLBACK
+	call vdso_read_time
+	jc FALLBACK
+	mov ecx, [esp + 8]
+	mov [ecx], eax
+	mov [ecx + 4], edx
+	xor eax, eax
+	ret
+
+FALLBACK:
+	push ebx
+	mov eax, 265 ; clock_gettime
+	mov ebx, [esp + 8]
+	mov ecx, [esp + 12]
+	int 080h
+	pop ebx
+	ret
+vdso_clock_gettime ENDP
+
+vdso_clock_gettime64 PROC ; clk_id, tp
+	mov eax, [esp + 4]
+	call vdso_clock_base
+	jc FALLBACK
+	call vdso_read_time
+	jc FALLBACK
+	mov ecx, [esp + 8]
+	mov [ecx], eax
+	mov dword ptr [ecx + 4], 0
+	mov [ecx + 8], edx
+	mov dword ptr [ecx + 12], 0
+	xor eax, eax
+	ret
+
+FALLBACK:
+	; clock_gettime64 is not implemented, use clock_gettime and widen the result
+	push ebx
+	sub esp, 8
+	mov eax, 265 ; clock_gettime
+	mov ebx, [esp + 16]
+	mov ecx, esp
+	int 080h
+	test eax, eax
+	jnz DONE
+	mov ecx, [esp + 20]
+	mov edx, [esp]
+	mov [ecx], edx
+	mov dword ptr [ecx + 4], 0
+	mov edx, [esp + 4]
+	mov [ecx + 8], edx
+	mov dword ptr [ecx + 12], 0
+DONE:
+	add esp, 8
+	pop ebx
+	ret
+vdso_clock_gettime64 ENDP
+
+vdso_gettimeofday PROC ; tv, tz
+	mov ecx, VDSO_REALTIME
+	call vdso_read_time
+	jc FALLBACK
+	push ebx
+	mov ebx, [esp + 8]
+	test ebx, ebx
+	jz TZ
+	mov [ebx], eax
+	mov eax, edx
+	xor edx, edx
+	mov ecx, 1000
+	div ecx
+	mov [ebx + 4], eax
+TZ:
+	mov ebx, [esp + 12]
+	test ebx, ebx
+	jz DONE
+	mov dword ptr [ebx], 0
+	mov dword ptr [ebx + 4], 0
+DONE:
+	pop ebx
+	xor eax, eax
+	ret
+
+FALLBACK:
+	push ebx
+	mov eax, 78 ; gettimeofday
+	mov ebx, [esp + 8]
+	mov ecx, [esp + 12]
+	int 080h
+	pop ebx
+	ret
+vdso_gettimeofday ENDP
+
+vdso_time PROC ; t
+	mov ecx, VDSO_REALTIME
+	call vdso_read_time
+	jc FALLBACK
+	mov ecx, [esp + 4]
+	test ecx, ecx
+	jz DONE
+	mov [ecx], eax
+DONE:
+	ret
+
+FALLBACK:
+	push ebx
+	mov eax, 13 ; time
+	mov ebx, [esp + 8]
+	int 080h
+	pop ebx
+	ret
+vdso_time ENDP
+
+; Same as the getcpu system call, which always reports cpu 0 and node 0
+vdso_getcpu PROC ; cpu, node, tcache
+	mov ecx, [esp + 4]
+	test ecx, ecx
+	jz NODE
+	mov dword ptr [ecx], 0
+NODE:
+	mov ecx, [esp + 8]
+	test ecx, ecx
+	jz DONE
+	mov dword ptr [ecx], 0
+DONE:
+	xor eax, eax
+	ret
+vdso_getcpu ENDP
+
 END
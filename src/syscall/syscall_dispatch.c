@@ -69,6 +69,35 @@ void sys_unimplemented_imp(intptr_t id)
 	process_exit(1, 0);
 }
 
+#ifndef _WIN64
+/* System calls which only read their register arguments and never need the syscall
+ * context, translated code calls them in place without going through syscall_handler */
+static const int fast_syscalls[] =
+{
+	20, /* getpid */
+	24, /* getuid */
+	47, /* getgid */
+	49, /* geteuid */
+	50, /* getegid */
+	60, /* umask */
+	64, /* getppid */
+	158, /* sched_yield */
+	199, /* getuid32 */
+	200, /* getgid32 */
+	201, /* geteuid32 */
+	202, /* getegid32 */
+	224, /* gettid */
+};
+
+void *get_fast_syscall_handler(uint32_t id)
+{
+	for (int i = 0; i < sizeof(fast_syscalls) / sizeof(fast_syscalls[0]); i++)
+		if (fast_syscalls[i] == id)
+			return syscall_table[id];
+	return NULL;
+}
+#endif
+
 void dispatch_syscall(PCONTEXT context)
 {
 #ifdef _WIN64
@@ -19,7 +19,13 @@
 
 #pragma once
 
+#include <stdint.h>
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 
 void dispatch_syscall(PCONTEXT context);
+#ifndef _WIN64
+/* Returns the handler of system call |id| if it only takes register arguments (at most ebx),
+ * or NULL if it must go through the generic syscall handler */
+void *get_fast_syscall_handler(uint32_t id);
+#endif
@@ -95,7 +95,7 @@ DEFINE_SYSCALL2(clock_gettime, int, clk_id, struct linux_timespec *, tp)
 		LARGE_INTEGER freq, counter;
 		QueryPerformanceFrequency(&freq);
 		QueryPerformanceCounter(&counter);
-		uint64_t ns = (double)counter.QuadPart / (double)freq.QuadPart * NANOSECONDS_PER_SECOND;
+		uint64_t ns = performance_counter_to_nsec(&counter, &freq);
 		tp->tv_sec = ns / NANOSECONDS_PER_SECOND;
 		tp->tv_nsec = ns % NANOSECONDS_PER_SECOND;
 		return 0;
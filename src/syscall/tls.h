@@ -36,6 +36,7 @@ enum
 	TLS_ENTRY_KERNEL_ESP,
 	TLS_ENTRY_ESP,
 	TLS_ENTRY_EIP,
+	TLS_ENTRY_SHADOW_STACK,
 
 	TLS_KERNEL_ENTRY_COUNT
 };
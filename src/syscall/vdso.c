@@ -0,0 +1,308 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <binfmt/elf.h>
+#include <common/mman.h>
+#include <dbt/cpuid.h>
+#include <syscall/mm.h>
+#include <syscall/vdso.h>
+#include <datetime.h>
+#include <log.h>
+#include <ntdll.h>
+#include <shared.h>
+#include <win7compat.h>
+
+#include <stddef.h>
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <intrin.h>
+
+#define VDSO_CALIBRATE_INTERVAL		50 /* Milliseconds before the first calibration */
+#define VDSO_UPDATE_INTERVAL		500 /* Milliseconds between recalibrations */
+#define VDSO_SAMPLE_RETRIES			16
+#define VDSO_SAMPLE_MAX_CYCLES		20000 /* A slower sample was interrupted and is discarded */
+#define VDSO_STRTAB_SIZE			256
+
+struct vdso_data *vdso_data;
+
+/* Exported functions, in stubs.asm */
+EXTERN_C void vdso_clock_gettime();
+EXTERN_C void vdso_clock_gettime64();
+EXTERN_C void vdso_gettimeofday();
+EXTERN_C void vdso_time();
+EXTERN_C void vdso_getcpu();
+
+struct vdso_symbol
+{
+	const char *name;
+	void (*func)();
+};
+
+static const struct vdso_symbol vdso_symbols[] =
+{
+	{ "__vdso_clock_gettime", vdso_clock_gettime },
+	{ "__vdso_clock_gettime64", vdso_clock_gettime64 },
+	{ "__vdso_gettimeofday", vdso_gettimeofday },
+	{ "__vdso_time", vdso_time },
+	{ "__vdso_getcpu", vdso_getcpu },
+};
+#define VDSO_SYMBOLS_COUNT	(sizeof(vdso_symbols) / sizeof(vdso_symbols[0]))
+
+/* In memory layout of the vDSO image, it is described by a single PT_LOAD segment
+ * at virtual address 0. The exported functions are outside of the image, their
+ * symbol values are relative to the image base and wrap around. */
+struct vdso_image
+{
+	Elf32_Ehdr eh;
+	Elf32_Phdr ph[2];
+	Elf32_Dyn dyn[7];
+	/* nbucket, nchain, a single bucket, chain */
+	Elf32_Word hash[3 + 1 + VDSO_SYMBOLS_COUNT];
+	Elf32_Sym sym[1 + VDSO_SYMBOLS_COUNT];
+	char strtab[VDSO_STRTAB_SIZE];
+};
+
+static LARGE_INTEGER vdso_freq;
+
+/* Read the TSC together with the monotonic and real time, retry if the thread was
+ * interrupted in between so the TSC value matches the other two */
+static bool vdso_sample(uint64_t *tsc, uint64_t *monotonic, FILETIME *realtime)
+{
+	for (int i = 0; i < VDSO_SAMPLE_RETRIES; i++)
+	{
+		uint64_t start = __rdtsc();
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		win7compat_GetSystemTimePreciseAsFileTime(realtime);
+		uint64_t end = __rdtsc();
+		if (end - start < VDSO_SAMPLE_MAX_CYCLES)
+		{
+			*tsc = start + (end - start) / 2;
+			*monotonic = performance_counter_to_nsec(&counter, &vdso_freq);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void vdso_update(uint64_t tsc, uint64_t monotonic, const FILETIME *realtime, uint32_t mult)
+{
+	/* Seqlock write side, the guest retries reads which overlap an update */
+	InterlockedIncrement(&vdso_data->seq);
+	vdso_data->mode = mult? VDSO_MODE_TSC: VDSO_MODE_NONE;
+	vdso_data->tsc = tsc;
+	vdso_data->mult = mult;
+	vdso_data->realtime.sec = (uint32_t)filetime_to_unix_sec(realtime);
+	vdso_data->realtime.nsec = (uint32_t)filetime_to_unix_nsec(realtime);
+	vdso_data->monotonic.sec = (uint32_t)(monotonic / NANOSECONDS_PER_SECOND);
+	vdso_data->monotonic.nsec = (uint32_t)(monotonic % NANOSECONDS_PER_SECOND);
+	InterlockedIncrement(&vdso_data->seq);
+}
+
+static DWORD WINAPI vdso_update_thread(LPVOID parameter)
+{
+	/* Only the owner of the mutex updates the time data, it is released when the owning
+	 * process exits and the thread of another process takes over */
+	HANDLE update_mutex = (HANDLE)parameter;
+	WaitForSingleObject(update_mutex, INFINITE);
+	log_info("vdso: This process now updates the time data.");
+	for (;;)
+	{
+		uint64_t tsc, monotonic;
+		FILETIME realtime;
+		if (vdso_sample(&tsc, &monotonic, &realtime))
+		{
+			/* Calibrate the TSC against the performance counter over the last interval,
+			 * which may have been measured by the previous updating process */
+			uint64_t last_tsc = vdso_data->calibration_tsc, last_monotonic = vdso_data->calibration_monotonic;
+			uint32_t mult = 0;
+			if (last_tsc && tsc > last_tsc && monotonic - last_monotonic < 0x100000000ULL)
+			{
+				uint64_t m = ((monotonic - last_monotonic) << 32) / (tsc - last_tsc);
+				if (m < 0x100000000ULL) /* The guest code cannot handle a TSC slower than 1GHz */
+					mult = (uint32_t)m;
+			}
+			vdso_data->calibration_tsc = tsc;
+			vdso_data->calibration_monotonic = monotonic;
+			/* The guest may have extrapolated past the measured time with the previous
+			 * parameters, monotonic time must not go backwards */
+			if (vdso_data->mode == VDSO_MODE_TSC && tsc - vdso_data->tsc < 0x100000000ULL)
+			{
+				uint64_t extrapolated = (uint64_t)vdso_data->monotonic.sec * NANOSECONDS_PER_SECOND + vdso_data->monotonic.nsec
+					+ (((tsc - vdso_data->tsc) * vdso_data->mult) >> 32);
+				if (monotonic < extrapolated)
+					monotonic = extrapolated;
+			}
+			vdso_update(tsc, monotonic, &realtime, mult);
+		}
+		Sleep(vdso_data->mode == VDSO_MODE_TSC? VDSO_UPDATE_INTERVAL: VDSO_CALIBRATE_INTERVAL);
+	}
+	return 0;
+}
+
+static void vdso_start_update_thread()
+{
+	/* Zero initialized by the first process, VDSO_MODE_NONE until the first update */
+	vdso_data = (struct vdso_data *)shared_alloc(sizeof(struct vdso_data));
+#ifndef _WIN64
+	/* Without an invariant TSC the exported functions always use system calls */
+	if (!dbt_host_has_invariant_tsc())
+	{
+		log_info("vdso: No invariant TSC, time functions fall back to system calls.");
+		return;
+	}
+	QueryPerformanceFrequency(&vdso_freq);
+	UNICODE_STRING name;
+	RtlInitUnicodeString(&name, L"vdso_update_mutex");
+	OBJECT_ATTRIBUTES oa;
+	InitializeObjectAttributes(&oa, &name, OBJ_OPENIF, shared_get_object_directory(), NULL);
+	HANDLE update_mutex;
+	NTSTATUS status = NtCreateMutant(&update_mutex, MUTANT_ALL_ACCESS, &oa, FALSE);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("vdso: NtCreateMutant() failed, status: %x.", status);
+		return;
+	}
+	HANDLE thread = CreateThread(NULL, 0, vdso_update_thread, update_mutex, 0, NULL);
+	if (!thread)
+	{
+		log_error("vdso: Time update thread creation failed, error code: %d.", GetLastError());
+		NtClose(update_mutex);
+		return;
+	}
+	/* Late updates make the guest fall back to system calls */
+	SetThreadPriority(thread, THREAD_PRIORITY_TIME_CRITICAL);
+	CloseHandle(thread);
+#endif
+}
+
+void vdso_init()
+{
+	vdso_start_update_thread();
+}
+
+void vdso_afterfork_child()
+{
+	/* Threads are not inherited, the vDSO image itself is copied with the address space
+	 * The time data is allocated again at the same place of the shared area */
+	vdso_start_update_thread();
+}
+
+void *vdso_map()
+{
+#ifdef _WIN64
+	return NULL;
+#else
+	struct vdso_image *image = (struct vdso_image *)mm_mmap(NULL, sizeof(struct vdso_image), PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_ANONYMOUS | MAP_PRIVATE, INTERNAL_MAP_TOPDOWN, NULL, 0);
+	if ((uintptr_t)image >= (uintptr_t)-PAGE_SIZE)
+	{
+		log_error("vdso: Mapping vDSO image failed, error %d.", (intptr_t)image);
+		return NULL;
+	}
+	memset(image, 0, sizeof(struct vdso_image));
+	size_t base = (size_t)image;
+
+	/* String and symbol tables */
+	char *strtab = image->strtab;
+	int strsz = 1;
+	int soname = strsz;
+	strcpy(strtab + strsz, "linux-gate.so.1");
+	strsz += sizeof("linux-gate.so.1");
+	for (int i = 0; i < VDSO_SYMBOLS_COUNT; i++)
+	{
+		Elf32_Sym *sym = &image->sym[i + 1];
+		sym->st_name = strsz;
+		sym->st_value = (Elf32_Addr)((size_t)vdso_symbols[i].func - base);
+		sym->st_size = 0;
+		sym->st_info = (STB_GLOBAL << 4) | STT_FUNC;
+		sym->st_other = 0;
+		sym->st_shndx = 1; /* Any defined section */
+		strcpy(strtab + strsz, vdso_symbols[i].name);
+		strsz += strlen(vdso_symbols[i].name) + 1;
+	}
+
+	/* Hash table with one bucket, all symbols are chained in reverse order */
+	Elf32_Word *hash = image->hash;
+	hash[0] = 1;
+	hash[1] = 1 + VDSO_SYMBOLS_COUNT;
+	hash[2] = VDSO_SYMBOLS_COUNT;
+	Elf32_Word *chain = &hash[3];
+	chain[0] = 0;
+	for (int i = 1; i <= VDSO_SYMBOLS_COUNT; i++)
+		chain[i] = i - 1;
+
+	/* Dynamic section, addresses are relative to the image base */
+	Elf32_Dyn *dyn = image->dyn;
+	dyn[0].d_tag = DT_HASH;
+	dyn[0].d_un.d_ptr = offsetof(struct vdso_image, hash);
+	dyn[1].d_tag = DT_STRTAB;
+	dyn[1].d_un.d_ptr = offsetof(struct vdso_image, strtab);
+	dyn[2].d_tag = DT_SYMTAB;
+	dyn[2].d_un.d_ptr = offsetof(struct vdso_image, sym);
+	dyn[3].d_tag = DT_STRSZ;
+	dyn[3].d_un.d_val = strsz;
+	dyn[4].d_tag = DT_SYMENT;
+	dyn[4].d_un.d_val = sizeof(Elf32_Sym);
+	dyn[5].d_tag = DT_SONAME;
+	dyn[5].d_un.d_val = soname;
+	dyn[6].d_tag = DT_NULL;
+	dyn[6].d_un.d_val = 0;
+
+	/* Program headers */
+	image->ph[0].p_type = PT_LOAD;
+	image->ph[0].p_offset = 0;
+	image->ph[0].p_vaddr = 0;
+	image->ph[0].p_paddr = 0;
+	image->ph[0].p_filesz = sizeof(struct vdso_image);
+	image->ph[0].p_memsz = sizeof(struct vdso_image);
+	image->ph[0].p_flags = PF_R | PF_X;
+	image->ph[0].p_align = PAGE_SIZE;
+	image->ph[1].p_type = PT_DYNAMIC;
+	image->ph[1].p_offset = offsetof(struct vdso_image, dyn);
+	image->ph[1].p_vaddr = offsetof(struct vdso_image, dyn);
+	image->ph[1].p_paddr = offsetof(struct vdso_image, dyn);
+	image->ph[1].p_filesz = sizeof(image->dyn);
+	image->ph[1].p_memsz = sizeof(image->dyn);
+	image->ph[1].p_flags = PF_R;
+	image->ph[1].p_align = 4;
+
+	/* ELF header */
+	Elf32_Ehdr *eh = &image->eh;
+	memcpy(eh->e_ident, ELFMAG, SELFMAG);
+	eh->e_ident[EI_CLASS] = ELFCLASS32;
+	eh->e_ident[EI_DATA] = ELFDATA2LSB;
+	eh->e_ident[EI_VERSION] = EV_CURRENT;
+	eh->e_ident[EI_OSABI] = ELFOSABI_NONE;
+	eh->e_type = ET_DYN;
+	eh->e_machine = EM_386;
+	eh->e_version = EV_CURRENT;
+	eh->e_entry = 0;
+	eh->e_phoff = offsetof(struct vdso_image, ph);
+	eh->e_shoff = 0;
+	eh->e_flags = 0;
+	eh->e_ehsize = sizeof(Elf32_Ehdr);
+	eh->e_phentsize = sizeof(Elf32_Phdr);
+	eh->e_phnum = 2;
+	eh->e_shentsize = 0;
+	eh->e_shnum = 0;
+	eh->e_shstrndx = 0;
+	return image;
+#endif
+}
@@ -0,0 +1,65 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <common/types.h>
+
+#include <stdint.h>
+
+/* Virtual dynamic shared object
+ * A minimal ELF image exporting __vdso_clock_gettime() and friends is mapped into
+ * every image and advertised by AT_SYSINFO_EHDR. The exported functions live in
+ * stubs.asm and run as translated guest code. They extrapolate the time from the TSC
+ * and the time bases in vdso_data, which is in the session wide shared area.
+ * A single process of the session recalibrates it periodically on a helper thread,
+ * the helper threads of other processes wait to take over when it exits.
+ * When the TSC cannot be used they fall back to the regular system calls.
+ */
+
+#define VDSO_MODE_NONE		0 /* Time must be read by system calls */
+#define VDSO_MODE_TSC		1 /* Time is extrapolated from the TSC */
+
+struct vdso_timespec
+{
+	uint32_t sec;
+	uint32_t nsec;
+};
+
+/* Time data read by the guest code in stubs.asm, which hardcodes the layout */
+struct vdso_data
+{
+	volatile long seq; /* Odd while an update is in progress */
+	uint32_t mode;
+	uint64_t tsc; /* TSC at the time of last update */
+	uint32_t mult; /* Nanoseconds per TSC tick, 0.32 fixed point */
+	struct vdso_timespec realtime; /* CLOCK_REALTIME at the time of last update */
+	struct vdso_timespec monotonic; /* CLOCK_MONOTONIC at the time of last update */
+	/* Not read by the guest, calibration point of the updating process */
+	uint64_t calibration_tsc;
+	uint64_t calibration_monotonic;
+};
+
+EXTERN_C struct vdso_data *vdso_data;
+
+void vdso_init();
+void vdso_afterfork_child();
+
+/* Map the vDSO image for a new executable, returns its address or NULL */
+void *vdso_map();
@@ -292,6 +292,7 @@ void vfs_init()
 	vfs->fs[FS_SYSFS] = sysfs_alloc();
 	/* Create vfs shared area */
 	vfs_shared = (struct vfs_shared_data*)shared_alloc(sizeof(struct vfs_shared_data));
+	winfs_shared_init();
 	/* Create vfs mutexex */
 	UNICODE_STRING name;
 	RtlInitUnicodeString(&name, L"vfs_mount_write_mutex");
@@ -315,6 +316,8 @@ void vfs_init()
 	}
 	vfs->umask = S_IWGRP | S_IWOTH;
 	socket_init();
+	/* Files unlinked while mapped by processes which have exited since */
+	winfs_delete_unmapped_files();
 	log_info("vfs subsystem initialized.");
 }
 
@@ -392,6 +395,7 @@ void vfs_afterfork_child()
 {
 	vfs = (struct vfs_data*)mm_static_alloc(sizeof(struct vfs_data));
 	vfs_shared = (struct vfs_shared_data*)shared_alloc(sizeof(struct vfs_shared_data));
+	winfs_shared_init();
 	InitializeSRWLock(&vfs->rw_lock);
 	console_afterfork();
 
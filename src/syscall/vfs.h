@@ -48,3 +48,7 @@ void vfs_ref(struct file *f);
 void vfs_release(struct file *f);
 void vfs_get_root_mountpoint(struct mount_point *mp);
 bool vfs_get_mountpoint(int key, struct mount_point *mp);
+
+/* For subsystems which keep files of their own */
+EXTERN_C intptr_t sys_rename(const char *oldpath, const char *newpath);
+EXTERN_C intptr_t sys_unlink(const char *pathname);
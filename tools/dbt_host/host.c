@@ -0,0 +1,184 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* POSIX implementation of the host services of the translator, see src/dbt/x86_host.h
+ * The fs segment of a Windows thread points to its thread environment block, which holds
+ * the TLS slots at fixed offsets. Here every thread gets a mock block instead. */
+
+#include <common/types.h> /* Its clock_t replaces the one of the C library */
+#include <dbt/x86_host.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define MOCK_TEB_SIZE		0x1000
+#define MOCK_TEB_SELF		0x18 /* NT_TIB.Self */
+
+struct dbt_host_event_data
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool signaled;
+};
+
+static __thread uint8_t *mock_teb;
+
+void dbt_host_lock_init(dbt_host_lock *lock)
+{
+	pthread_rwlock_init(lock, NULL);
+}
+
+bool dbt_host_try_lock_shared(dbt_host_lock *lock)
+{
+	return pthread_rwlock_tryrdlock(lock) == 0;
+}
+
+void dbt_host_lock_shared(dbt_host_lock *lock)
+{
+	pthread_rwlock_rdlock(lock);
+}
+
+void dbt_host_unlock_shared(dbt_host_lock *lock)
+{
+	pthread_rwlock_unlock(lock);
+}
+
+bool dbt_host_try_lock_exclusive(dbt_host_lock *lock)
+{
+	return pthread_rwlock_trywrlock(lock) == 0;
+}
+
+void dbt_host_lock_exclusive(dbt_host_lock *lock)
+{
+	pthread_rwlock_wrlock(lock);
+}
+
+void dbt_host_unlock_exclusive(dbt_host_lock *lock)
+{
+	pthread_rwlock_unlock(lock);
+}
+
+static int get_protection(int flags)
+{
+	return (flags & DBT_HOST_EXECUTE)? PROT_READ | PROT_WRITE | PROT_EXEC: PROT_READ | PROT_WRITE;
+}
+
+void *dbt_host_alloc(size_t size, int flags)
+{
+	void *addr = mmap(NULL, size, get_protection(flags), MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	return addr == MAP_FAILED? NULL: addr;
+}
+
+bool dbt_host_commit(void *addr, size_t size, int flags)
+{
+	return mprotect(addr, size, get_protection(flags)) == 0;
+}
+
+void dbt_host_decommit(void *addr, size_t size)
+{
+	/* Private anonymous pages read back as zero after MADV_DONTNEED, like recommitted pages */
+	madvise(addr, size, MADV_DONTNEED);
+	mprotect(addr, size, PROT_NONE);
+}
+
+void dbt_host_free(void *addr, size_t size)
+{
+	munmap(addr, size);
+}
+
+static uint8_t *get_mock_teb()
+{
+	if (!mock_teb)
+	{
+		mock_teb = (uint8_t *)dbt_host_alloc(MOCK_TEB_SIZE, 0);
+		if (!mock_teb)
+		{
+			fprintf(stderr, "Cannot allocate the mock thread environment block.\n");
+			abort();
+		}
+		*(uint32_t *)(mock_teb + MOCK_TEB_SELF) = (uint32_t)(size_t)mock_teb;
+	}
+	return mock_teb;
+}
+
+uint32_t dbt_host_read_tls(int offset)
+{
+	return *(uint32_t *)(get_mock_teb() + offset);
+}
+
+void dbt_host_write_tls(int offset, uint32_t value)
+{
+	*(uint32_t *)(get_mock_teb() + offset) = value;
+}
+
+size_t dbt_host_tls_base()
+{
+	return (size_t)get_mock_teb();
+}
+
+size_t dbt_host_thread_tls_base(void *thread)
+{
+	/* Signals are never delivered to the threads of the host side tools */
+	(void)thread;
+	abort();
+}
+
+dbt_host_event dbt_host_create_event()
+{
+	dbt_host_event event = (dbt_host_event)malloc(sizeof(struct dbt_host_event_data));
+	pthread_mutex_init(&event->mutex, NULL);
+	pthread_cond_init(&event->cond, NULL);
+	event->signaled = false;
+	return event;
+}
+
+void dbt_host_set_event(dbt_host_event event)
+{
+	pthread_mutex_lock(&event->mutex);
+	event->signaled = true;
+	pthread_cond_signal(&event->cond);
+	pthread_mutex_unlock(&event->mutex);
+}
+
+void dbt_host_wait_event(dbt_host_event event)
+{
+	/* Auto reset event, a waiting thread consumes the signal */
+	pthread_mutex_lock(&event->mutex);
+	while (!event->signaled)
+		pthread_cond_wait(&event->cond, &event->mutex);
+	event->signaled = false;
+	pthread_mutex_unlock(&event->mutex);
+}
+
+static void *thread_entry(void *parameter)
+{
+	void (*proc)() = (void (*)())parameter;
+	proc();
+	return NULL;
+}
+
+int dbt_host_start_idle_thread(void (*proc)())
+{
+	pthread_t thread;
+	int error = pthread_create(&thread, NULL, thread_entry, (void *)proc);
+	if (!error)
+		pthread_detach(thread);
+	return error;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+/* struct timeval comes from the C library */
+#include <sys/time.h>
@@ -0,0 +1,77 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* The part of the Windows API the translator headers refer to, for building it on Linux
+ * Only what src/dbt/x86.c and the headers it includes need. The host services the
+ * translator actually calls are in src/dbt/x86_host.h, the Windows functions declared
+ * here are only reached on paths the host side tools never take and fail in mock.c.
+ */
+
+#include <stdint.h>
+
+#define __declspec(...)				__dbt_host_declspec_##__VA_ARGS__
+#define __dbt_host_declspec_thread		__thread
+#define __dbt_host_declspec_align(n)	__attribute__((aligned(n)))
+#define __dbt_host_declspec_noreturn	__attribute__((noreturn))
+#define __debugbreak()				__builtin_trap()
+#define WINAPI
+
+#define FALSE			0
+#define TRUE			1
+#define MAX_PATH		260
+
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef int64_t LONGLONG;
+typedef uint16_t WCHAR;
+typedef void *PVOID, *LPVOID, *HANDLE;
+typedef struct { void *Ptr; } SRWLOCK;
+
+#define CONTEXT_CONTROL			0x00010001
+#define DUPLICATE_SAME_ACCESS	0x00000002
+
+/* i386 thread context */
+typedef struct _CONTEXT
+{
+	DWORD ContextFlags;
+	DWORD Edi, Esi, Ebx, Edx, Ecx, Eax;
+	DWORD Ebp, Eip, SegCs, EFlags, Esp, SegSs;
+} CONTEXT, *PCONTEXT;
+
+/* Statement expressions, the result is often unused */
+#define InterlockedIncrement(p)				({ __sync_add_and_fetch((p), 1); })
+#define InterlockedDecrement(p)				({ __sync_sub_and_fetch((p), 1); })
+#define InterlockedExchange(p, v)			({ __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST); })
+#define InterlockedExchange64(p, v)			({ __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST); })
+#define InterlockedExchangePointer(p, v)	({ __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST); })
+#define InterlockedCompareExchange(p, v, c)	({ __sync_val_compare_and_swap((p), (c), (v)); })
+
+HANDLE GetCurrentProcess();
+HANDLE GetCurrentThread();
+BOOL DuplicateHandle(HANDLE source_process, HANDLE source, HANDLE target_process, HANDLE *target, DWORD access, BOOL inherit, DWORD options);
+BOOL CloseHandle(HANDLE handle);
+DWORD SuspendThread(HANDLE thread);
+DWORD ResumeThread(HANDLE thread);
+BOOL GetThreadContext(HANDLE thread, CONTEXT *context);
+void InitializeSRWLock(SRWLOCK *lock);
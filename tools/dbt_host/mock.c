@@ -0,0 +1,208 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The rest of flinux as far as the translator sees it, for the host side tools
+ * Translated code is only generated and measured, never run. The entry points into
+ * the runtime (asm stubs, the syscall and signal handlers) are never called, only their
+ * addresses are embedded in generated code. The flinux subsystems are replaced by
+ * their disabled behavior: no persistent cache, no profiler, no code volatility and
+ * every system call goes through the generic handler.
+ */
+
+#include <common/types.h>
+#include <dbt/cpuid.h>
+#include <flags.h>
+#include <log.h>
+#include <str.h>
+#include <syscall/mm.h>
+#include <syscall/syscall_dispatch.h>
+#include <syscall/tls.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define MOCK_TLS_SLOTS		0xE10 /* TEB.TlsSlots */
+
+struct syscall_context;
+
+static struct _flags flags;
+struct _flags *cmdline_flags = &flags;
+int logger_attached = 0; /* Only errors are printed */
+
+static void unreachable(const char *name)
+{
+	fprintf(stderr, "%s() is not available in the host side tools.\n", name);
+	abort();
+}
+
+/* Runtime entry points, only their addresses are used */
+#define MOCK_ENTRY(name) EXTERN_C void name() { unreachable(#name); }
+MOCK_ENTRY(dbt_find_direct_internal)
+MOCK_ENTRY(dbt_find_superblock_internal)
+MOCK_ENTRY(dbt_find_indirect_internal)
+MOCK_ENTRY(dbt_sieve_fallback)
+MOCK_ENTRY(dbt_return_fallback)
+MOCK_ENTRY(dbt_inline_cache_miss_internal)
+MOCK_ENTRY(dbt_check_code_internal)
+MOCK_ENTRY(dbt_cpuid_internal)
+MOCK_ENTRY(syscall_handler)
+
+void signal_setup_handler(struct syscall_context *context)
+{
+	unreachable("signal_setup_handler");
+}
+
+void *get_fast_syscall_handler(uint32_t id)
+{
+	return NULL;
+}
+
+bool dbt_host_has_xsaveopt()
+{
+	return false;
+}
+
+int tls_kernel_entry_to_offset(int entry)
+{
+	return MOCK_TLS_SLOTS + entry * sizeof(uint32_t);
+}
+
+int tls_user_entry_to_offset(int entry)
+{
+	return MOCK_TLS_SLOTS + (TLS_KERNEL_ENTRY_COUNT + entry) * sizeof(uint32_t);
+}
+
+EXTERN_C int mm_check_read(const void *addr, size_t size)
+{
+	/* The guest image is mapped readable, mincore() fails if a page is not mapped */
+	size_t start = (size_t)addr & -(size_t)PAGE_SIZE;
+	size_t end = ((size_t)addr + size + PAGE_SIZE - 1) & -(size_t)PAGE_SIZE;
+	unsigned char resident;
+	for (; start < end; start += PAGE_SIZE)
+		if (mincore((void *)start, PAGE_SIZE, &resident) < 0)
+			return 0;
+	return 1;
+}
+
+void mm_protect_code(size_t start, size_t end)
+{
+}
+
+bool mm_is_code_volatile(size_t addr)
+{
+	return false;
+}
+
+void dbt_persist_init()
+{
+}
+
+int dbt_persist_take_blocks(size_t pc, size_t *pcs, int max_count)
+{
+	return 0;
+}
+
+void dbt_profile_init()
+{
+}
+
+void dbt_profile_add_sample(const size_t *frames, int depth)
+{
+}
+
+void dbt_profile_add_executions(size_t pc, uint32_t executions)
+{
+}
+
+int ksprintf(char *buffer, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int r = vsprintf(buffer, format, args);
+	va_end(args);
+	return r;
+}
+
+void log_debug_internal(const char *format, ...)
+{
+}
+
+void log_info_internal(const char *format, ...)
+{
+}
+
+void log_warning_internal(const char *format, ...)
+{
+}
+
+void log_error_internal(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+HANDLE GetCurrentProcess()
+{
+	return NULL;
+}
+
+HANDLE GetCurrentThread()
+{
+	return NULL;
+}
+
+BOOL DuplicateHandle(HANDLE source_process, HANDLE source, HANDLE target_process, HANDLE *target, DWORD access, BOOL inherit, DWORD options)
+{
+	unreachable("DuplicateHandle");
+	return FALSE;
+}
+
+BOOL CloseHandle(HANDLE handle)
+{
+	unreachable("CloseHandle");
+	return FALSE;
+}
+
+DWORD SuspendThread(HANDLE thread)
+{
+	unreachable("SuspendThread");
+	return 0;
+}
+
+DWORD ResumeThread(HANDLE thread)
+{
+	unreachable("ResumeThread");
+	return 0;
+}
+
+BOOL GetThreadContext(HANDLE thread, CONTEXT *context)
+{
+	unreachable("GetThreadContext");
+	return FALSE;
+}
+
+void InitializeSRWLock(SRWLOCK *lock)
+{
+	unreachable("InitializeSRWLock");
+}
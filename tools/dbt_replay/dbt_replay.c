@@ -0,0 +1,480 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host side replay benchmark of the DBT decoder and code generator
+ * Walks the blocks of recorded guest code pages the way dbt_translate() does and reports
+ * blocks/s, instructions/s and the decoding cost per opcode class. On x86 hosts the blocks
+ * are then translated by the real code generator (see tools/dbt_host), which adds the
+ * translation speed, the host code bytes per instruction and the expansion per opcode class.
+ *
+ * Usage: dbt_replay [-n iterations] image [block_offsets]
+ * image is an i386 ELF file, its executable segments are the code pages. They are mapped
+ * at their guest addresses, position independent images at IMAGE_DYN_BASE.
+ * block_offsets is the file written for the image by flinux --dbt-cache, it lists the
+ * blocks translated in real runs. Without it the blocks are found by a linear sweep.
+ */
+
+#ifdef HAVE_TRANSLATOR
+#include <dbt/x86.h>
+#endif
+#include <dbt/x86_decoder.h>
+#include <dbt/x86_inst.h>
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define HAVE_CYCLES		1
+#endif
+
+#define CODE_PADDING		16 /* Longer than any instruction, decoding never reads past a region */
+#define MAX_REGIONS			16
+#define IMAGE_DYN_BASE		0x20000000
+#define HOST_PAGE_SIZE		4096
+#define STATS_BUFFER_SIZE	65536
+#define HANDLER_CLASSES		(HANDLER_NORMAL + 1)
+
+/* See struct dbt_persist_header in src/dbt/persist.c */
+#define DBT_PERSIST_MAGIC	0x54424446
+#define DBT_PERSIST_VERSION	1
+
+struct dbt_persist_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t mtime_nsec;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct region
+{
+	uint32_t vaddr, size;
+	uint8_t *code;
+};
+
+struct block
+{
+	const struct region *region;
+	uint32_t offset;
+};
+
+struct class_stats
+{
+	uint64_t instructions;
+	uint64_t bytes;
+	uint64_t cycles;
+};
+
+static struct region regions[MAX_REGIONS];
+static int regions_count;
+static struct block *blocks;
+static int blocks_count, blocks_capacity;
+
+static void *read_file(const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+	{
+		fprintf(stderr, "Cannot open %s.\n", path);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	void *data = malloc(*size + 1);
+	if (fread(data, 1, *size, f) != *size)
+	{
+		fprintf(stderr, "Cannot read %s.\n", path);
+		exit(1);
+	}
+	fclose(f);
+	((char *)data)[*size] = 0;
+	return data;
+}
+
+static void load_image(const char *path)
+{
+	size_t size;
+	uint8_t *image = (uint8_t *)read_file(path, &size);
+	Elf32_Ehdr *eh = (Elf32_Ehdr *)image;
+	if (size < sizeof(Elf32_Ehdr) || memcmp(eh->e_ident, ELFMAG, SELFMAG) || eh->e_ident[EI_CLASS] != ELFCLASS32
+		|| eh->e_machine != EM_386 || eh->e_phoff + (size_t)eh->e_phnum * sizeof(Elf32_Phdr) > size)
+	{
+		fprintf(stderr, "%s is not an i386 ELF file.\n", path);
+		exit(1);
+	}
+	Elf32_Phdr *ph = (Elf32_Phdr *)(image + eh->e_phoff);
+	for (int i = 0; i < eh->e_phnum && regions_count < MAX_REGIONS; i++)
+	{
+		if (ph[i].p_type != PT_LOAD || !(ph[i].p_flags & PF_X) || ph[i].p_offset + (size_t)ph[i].p_filesz > size)
+			continue;
+		struct region *region = &regions[regions_count++];
+		region->vaddr = ph[i].p_vaddr;
+		region->size = ph[i].p_filesz;
+		/* Generated code refers to guest addresses, the translator reads the code where it runs */
+		size_t addr = (eh->e_type == ET_DYN? IMAGE_DYN_BASE: 0) + region->vaddr;
+		size_t start = addr & -HOST_PAGE_SIZE;
+		size_t end = (addr + region->size + CODE_PADDING + HOST_PAGE_SIZE - 1) & -HOST_PAGE_SIZE;
+		void *mapped = mmap((void *)start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+		if (mapped != (void *)start)
+		{
+			fprintf(stderr, "Cannot map the code segment at 0x%zx.\n", addr);
+			exit(1);
+		}
+		region->code = (uint8_t *)addr;
+		memcpy(region->code, image + ph[i].p_offset, region->size);
+	}
+	free(image);
+	if (!regions_count)
+	{
+		fprintf(stderr, "%s has no executable segments.\n", path);
+		exit(1);
+	}
+}
+
+static void add_block(const struct region *region, uint32_t offset)
+{
+	if (blocks_count == blocks_capacity)
+	{
+		blocks_capacity = blocks_capacity? blocks_capacity * 2: 4096;
+		blocks = (struct block *)realloc(blocks, blocks_capacity * sizeof(struct block));
+	}
+	blocks[blocks_count].region = region;
+	blocks[blocks_count].offset = offset;
+	blocks_count++;
+}
+
+/* Whether dbt_translate() ends a plain block after an instruction of this handler type */
+static bool ends_block(uint8_t handler_type)
+{
+	switch (handler_type)
+	{
+	case HANDLER_PRIVILEGED:
+	case HANDLER_CALL_DIRECT:
+	case HANDLER_CALL_INDIRECT:
+	case HANDLER_RET:
+	case HANDLER_RETN:
+	case HANDLER_JMP_DIRECT:
+	case HANDLER_JMP_INDIRECT:
+	case HANDLER_JCC:
+	case HANDLER_JCC_REL8:
+	case HANDLER_INT:
+	case HANDLER_MOV_TO_SEG:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inline uint64_t read_cycles()
+{
+#ifdef HAVE_CYCLES
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+#ifdef HAVE_CYCLES
+/* Cost of the cycle counter reads around an instruction, subtracted from the per class cycles */
+static uint64_t cycles_overhead()
+{
+	uint64_t overhead = UINT64_MAX;
+	for (int i = 0; i < 1000; i++)
+	{
+		uint64_t start = read_cycles();
+		uint64_t cycles = read_cycles() - start;
+		if (cycles < overhead)
+			overhead = cycles;
+	}
+	return overhead;
+}
+#endif
+
+/* Decode a whole instruction, returns its length or a negative X86_DECODE_* error */
+static inline int decode_instruction(uint8_t *code, struct instruction_t *ins)
+{
+	int len = x86_decode(code, ins);
+	if (len < 0)
+		return len;
+	/* As in x86_decode_length(), x87 escape opcodes always have a ModR/M byte */
+	if (ins->desc->handler_type == HANDLER_X87 && !ins->has_modrm)
+	{
+		uint8_t *modrm = code + len;
+		int r;
+		struct modrm_rm_t rm;
+		parse_modrm(&modrm, &r, &rm);
+		len = (int)(modrm - code);
+	}
+	return len + ins->imm_bytes;
+}
+
+static inline int handler_class(const struct instruction_t *ins)
+{
+	uint8_t handler_type = ins->desc->handler_type;
+	return (handler_type & HANDLER_NORMAL) == HANDLER_NORMAL? HANDLER_NORMAL: handler_type;
+}
+
+/* Walk a block, returns the number of instructions, *end is the offset after the block
+ * Per class statistics are collected when classes is not NULL, *error is set if decoding failed */
+static int replay_block(const struct region *region, uint32_t offset, uint32_t *end, struct class_stats *classes, bool *error)
+{
+	int instructions = 0;
+	*error = false;
+	while (offset < region->size)
+	{
+		struct instruction_t ins;
+		uint64_t start_cycles = classes? read_cycles(): 0;
+		int len = decode_instruction(region->code + offset, &ins);
+		if (len < 0 || offset + len > region->size)
+		{
+			*error = true;
+			break;
+		}
+		int cls = handler_class(&ins);
+		if (classes)
+		{
+			classes[cls].cycles += read_cycles() - start_cycles;
+			classes[cls].instructions++;
+			classes[cls].bytes += len;
+		}
+		instructions++;
+		offset += len;
+		if (ends_block(cls))
+			break;
+	}
+	*end = offset;
+	return instructions;
+}
+
+static void sweep_blocks()
+{
+	for (int i = 0; i < regions_count; i++)
+	{
+		uint32_t offset = 0;
+		while (offset < regions[i].size)
+		{
+			uint32_t end;
+			bool error;
+			replay_block(&regions[i], offset, &end, NULL, &error);
+			if (end > offset)
+				add_block(&regions[i], offset);
+			/* Data or padding in the code segment, resynchronize at the next byte */
+			offset = error? end + 1: end;
+		}
+	}
+}
+
+static void load_block_offsets(const char *path)
+{
+	size_t size;
+	uint8_t *data = (uint8_t *)read_file(path, &size);
+	struct dbt_persist_header *header = (struct dbt_persist_header *)data;
+	if (size < sizeof(*header) || header->magic != DBT_PERSIST_MAGIC || header->version != DBT_PERSIST_VERSION
+		|| sizeof(*header) + (size_t)header->count * sizeof(uint32_t) > size)
+	{
+		fprintf(stderr, "%s is not a translation cache file.\n", path);
+		exit(1);
+	}
+	uint32_t *offsets = (uint32_t *)(data + sizeof(*header));
+	int outside = 0;
+	for (uint32_t i = 0; i < header->count; i++)
+	{
+		int j;
+		for (j = 0; j < regions_count; j++)
+			if (offsets[i] >= regions[j].vaddr && offsets[i] < regions[j].vaddr + regions[j].size)
+				break;
+		if (j < regions_count)
+			add_block(&regions[j], offsets[i] - regions[j].vaddr);
+		else
+			outside++;
+	}
+	if (outside)
+		printf("%d recorded blocks are outside the code segments of the image.\n", outside);
+	free(data);
+}
+
+/* Value of a counter in the output of dbt_get_stats(), -1 if it is not present */
+static long long find_stat(const char *stats, const char *name)
+{
+	size_t len = strlen(name);
+	const char *line = stats;
+	while (line)
+	{
+		if (!strncmp(line, name, len) && line[len] == ' ')
+			return atoll(line + len + 1);
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+	return -1;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: dbt_replay [-n iterations] image [block_offsets]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = 10;
+	int i = 1;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2)
+	{
+		if (!strcmp(argv[i], "-n"))
+			iterations = atoi(argv[i + 1]);
+		else
+			usage();
+	}
+	if (i == argc || argc - i > 2 || iterations <= 0)
+		usage();
+
+	x86_decoder_init();
+	load_image(argv[i]);
+	uint64_t code_bytes = 0;
+	for (int j = 0; j < regions_count; j++)
+		code_bytes += regions[j].size;
+	if (i + 1 < argc)
+		load_block_offsets(argv[i + 1]);
+	else
+		sweep_blocks();
+	printf("%s: %d code segments, %llu bytes, %d blocks from %s\n", argv[i], regions_count,
+		(unsigned long long)code_bytes, blocks_count, i + 1 < argc? "the translation cache": "a linear sweep");
+
+	/* Profiling pass, per class counts and cycles */
+#ifdef HAVE_CYCLES
+	uint64_t overhead = cycles_overhead();
+#endif
+	struct class_stats classes[HANDLER_CLASSES];
+	memset(classes, 0, sizeof(classes));
+	uint64_t instructions = 0, guest_bytes = 0;
+	int errors = 0;
+	for (int j = 0; j < blocks_count; j++)
+	{
+		uint32_t end;
+		bool error;
+		instructions += replay_block(blocks[j].region, blocks[j].offset, &end, classes, &error);
+		guest_bytes += end - blocks[j].offset;
+		errors += error;
+	}
+
+	/* Timed passes */
+	uint64_t start = now_ns();
+	uint64_t checksum = 0;
+	for (int k = 0; k < iterations; k++)
+		for (int j = 0; j < blocks_count; j++)
+		{
+			uint32_t end;
+			bool error;
+			checksum += replay_block(blocks[j].region, blocks[j].offset, &end, NULL, &error);
+		}
+	uint64_t ns = now_ns() - start;
+	if (checksum != instructions * iterations)
+		printf("Replay is not deterministic.\n");
+
+	printf("%llu instructions, %llu guest bytes, %d blocks ending in a decoding error\n",
+		(unsigned long long)instructions, (unsigned long long)guest_bytes, errors);
+	double seconds = ns / 1e9;
+	printf("%d iterations in %.2f ms\n", iterations, ns / 1e6);
+	printf("  %-20s %14.0f\n", "blocks/s", seconds? blocks_count * (double)iterations / seconds: 0);
+	printf("  %-20s %14.0f\n", "instructions/s", seconds? instructions * (double)iterations / seconds: 0);
+	printf("  %-20s %14.2f\n", "guest MB/s", seconds? guest_bytes * (double)iterations / seconds / 1e6: 0);
+
+	char *stats = NULL;
+#ifdef HAVE_TRANSLATOR
+	/* Translation pass, each block is translated once by the real code generator */
+	dbt_init();
+	int rejected = 0;
+	start = now_ns();
+	for (int j = 0; j < blocks_count; j++)
+	{
+		uint32_t end;
+		bool error;
+		replay_block(blocks[j].region, blocks[j].offset, &end, NULL, &error);
+		/* The translator stops the process on code it cannot decode */
+		if (error || dbt_translate_block((size_t)blocks[j].region->code + blocks[j].offset) < 0)
+			rejected++;
+	}
+	ns = now_ns() - start;
+	stats = (char *)malloc(STATS_BUFFER_SIZE);
+	dbt_get_stats(stats);
+	long long translated = find_stat(stats, "translated_blocks");
+	long long source = find_stat(stats, "translated_source_bytes");
+	long long code = find_stat(stats, "translated_code_bytes");
+	printf("%lld blocks translated in %.2f ms, %d blocks not translatable\n", translated, ns / 1e6, rejected);
+	printf("  %-20s %14.0f\n", "translated blocks/s", ns? translated / (ns / 1e9): 0);
+	printf("  %-20s %14lld\n", "host bytes", code);
+	if (source > 0)
+		printf("  %-20s %14.2f\n", "expansion", (double)code / source);
+#endif
+
+	printf("%-14s %12s %7s %10s", "class", "instructions", "share", "bytes/ins");
+#ifdef HAVE_CYCLES
+	printf(" %11s", "cycles/ins");
+#endif
+	if (stats)
+		printf(" %14s %10s", "host bytes/ins", "expansion");
+	printf("\n");
+	for (int cls = 0; cls < HANDLER_CLASSES; cls++)
+	{
+		struct class_stats *c = &classes[cls];
+		if (!c->instructions)
+			continue;
+		const char *name = get_handler_type_name(cls);
+		printf("%-14s %12llu %6.2f%% %10.2f", name, (unsigned long long)c->instructions,
+			100.0 * c->instructions / instructions, (double)c->bytes / c->instructions);
+#ifdef HAVE_CYCLES
+		double cycles = (double)c->cycles / c->instructions - overhead;
+		printf(" %11.1f", cycles > 0? cycles: 0);
+#endif
+		if (stats)
+		{
+			char key[64];
+			snprintf(key, sizeof(key), "%s_instructions", name);
+			long long host_instructions = find_stat(stats, key);
+			snprintf(key, sizeof(key), "%s_code_bytes", name);
+			long long host_bytes = find_stat(stats, key);
+			if (host_instructions > 0 && host_bytes >= 0)
+			{
+				double host_per_instruction = (double)host_bytes / host_instructions;
+				printf(" %14.2f %10.2f", host_per_instruction, host_per_instruction * c->instructions / c->bytes);
+			}
+		}
+		printf("\n");
+	}
+	free(stats);
+	return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host side check of x86_decode_length() against objdump
+ * Usage: decode_check [-v] listing...
+ * A listing is the output of objdump -d on i386 code. Every instruction in it is decoded
+ * and its length compared with the one objdump found. Instructions the decoder rejects
+ * (unsupported or invalid for the translator) are counted but are not errors, with -v
+ * they are printed too.
+ * Returns 1 if any length differs.
+ */
+
+#include <dbt/x86_decoder.h>
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_INSTRUCTION		15
+#define CODE_PADDING		16 /* Longer than any instruction, decoding never reads past the buffer */
+
+struct listing_instruction
+{
+	char address[32];
+	char text[128];
+	uint8_t bytes[MAX_INSTRUCTION + CODE_PADDING];
+	int length;
+};
+
+static int instructions_count, mismatches_count, rejected_count;
+static bool verbose;
+
+static void print_bytes(const struct listing_instruction *ins)
+{
+	for (int i = 0; i < ins->length; i++)
+		printf(" %02x", ins->bytes[i]);
+}
+
+static void check_instruction(const char *path, struct listing_instruction *ins)
+{
+	if (ins->length == 0 || strncmp(ins->text, "(bad)", 5) == 0)
+		return;
+	instructions_count++;
+	memset(ins->bytes + ins->length, 0, sizeof(ins->bytes) - ins->length);
+	int length = x86_decode_length(ins->bytes);
+	if (length < 0)
+	{
+		rejected_count++;
+		if (verbose)
+		{
+			printf("%s:%s: rejected (%d):", path, ins->address, length);
+			print_bytes(ins);
+			printf("  %s\n", ins->text);
+		}
+	}
+	else if (length != ins->length)
+	{
+		mismatches_count++;
+		printf("%s:%s: length %d, objdump %d:", path, ins->address, length, ins->length);
+		print_bytes(ins);
+		printf("  %s\n", ins->text);
+	}
+}
+
+/* Parse the hexadecimal bytes field of a listing line, returns false if the line has other content */
+static bool parse_bytes(const char *field, struct listing_instruction *ins)
+{
+	while (*field)
+	{
+		if (isspace((unsigned char)*field))
+		{
+			field++;
+			continue;
+		}
+		if (!isxdigit((unsigned char)field[0]) || !isxdigit((unsigned char)field[1]) || ins->length == MAX_INSTRUCTION)
+			return false;
+		char hex[3] = { field[0], field[1], 0 };
+		ins->bytes[ins->length++] = (uint8_t)strtoul(hex, NULL, 16);
+		field += 2;
+	}
+	return true;
+}
+
+/* Instruction lines look like "  1f:\t8b 44 24 04    \tmov    0x4(%esp),%eax"
+ * Bytes of long instructions continue on following lines without the text field */
+static void check_listing(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+	{
+		printf("Cannot open %s.\n", path);
+		exit(1);
+	}
+	char line[1024];
+	struct listing_instruction ins;
+	ins.length = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\r\n")] = 0;
+		char *address = line;
+		while (*address == ' ')
+			address++;
+		char *colon = strchr(address, ':');
+		if (!colon || colon == address || colon[1] != '\t' || strspn(address, "0123456789abcdef") != (size_t)(colon - address))
+		{
+			check_instruction(path, &ins);
+			ins.length = 0;
+			continue;
+		}
+		*colon = 0;
+		char *field = colon + 2;
+		char *text = strchr(field, '\t');
+		if (text)
+		{
+			check_instruction(path, &ins);
+			ins.length = 0;
+			*text++ = 0;
+			snprintf(ins.address, sizeof(ins.address), "%.31s", address);
+			snprintf(ins.text, sizeof(ins.text), "%.127s", text);
+		}
+		else if (ins.length == 0)
+			continue;
+		if (!parse_bytes(field, &ins))
+		{
+			printf("%s:%s: bad listing line.\n", path, address);
+			exit(1);
+		}
+	}
+	check_instruction(path, &ins);
+	fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+	int i = 1;
+	if (i < argc && strcmp(argv[i], "-v") == 0)
+	{
+		verbose = true;
+		i++;
+	}
+	if (i == argc)
+	{
+		printf("Usage: decode_check [-v] listing...\n");
+		return 1;
+	}
+	x86_decoder_init();
+	for (; i < argc; i++)
+		check_listing(argv[i]);
+	printf("%d instructions, %d length mismatches, %d rejected by the decoder.\n",
+		instructions_count, mismatches_count, rejected_count);
+	return mismatches_count? 1: 0;
+}
@@ -0,0 +1,1203 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Guest side benchmarks
+ * Build as a static i386 binary (cmake -DFLBENCH_FLAGS="-m32 -static") and run it under
+ * flinux, the same program runs natively on Linux for reference numbers.
+ *
+ * Usage: flbench [-n scale] [benchmark...]
+ * Without arguments all benchmarks are run.
+ * The startup benchmark runs the program given in the FLBENCH_STARTUP environment variable
+ * with --version, or flbench itself. Each benchmark prints its own results,
+ * followed by the changes of the related counters in /proc/self/dbt_stats and
+ * /proc/self/mm_stats when they exist.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_STATS		256
+#define STATS_BUFFER	65536
+
+struct stats
+{
+	int count;
+	char names[MAX_STATS][64];
+	long long values[MAX_STATS];
+};
+
+struct benchmark
+{
+	const char *name;
+	const char *description;
+	void (*run)(int scale);
+	/* Counters of interest, NULL terminated */
+	const char *const *stats;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *what, double value, const char *unit)
+{
+	printf("  %-32s %14.2f %s\n", what, value, unit);
+}
+
+/* Report |count| operations done in |ns| nanoseconds */
+static void report_rate(const char *what, uint64_t count, uint64_t ns)
+{
+	report(what, ns? (double)count * 1e9 / ns: 0, "ops/s");
+	report(what, count? (double)ns / count: 0, "ns/op");
+}
+
+static void read_stats_file(const char *path, struct stats *stats)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	static char buf[STATS_BUFFER];
+	int len = 0, r;
+	while (len < STATS_BUFFER - 1 && (r = read(fd, buf + len, STATS_BUFFER - 1 - len)) > 0)
+		len += r;
+	close(fd);
+	buf[len] = 0;
+	for (char *line = strtok(buf, "\r\n"); line && stats->count < MAX_STATS; line = strtok(NULL, "\r\n"))
+	{
+		long long value;
+		if (sscanf(line, "%63s %lld", stats->names[stats->count], &value) == 2)
+			stats->values[stats->count++] = value;
+	}
+}
+
+static void read_stats(struct stats *stats)
+{
+	stats->count = 0;
+	read_stats_file("/proc/self/dbt_stats", stats);
+	read_stats_file("/proc/self/mm_stats", stats);
+}
+
+static bool find_stat(const struct stats *stats, const char *name, long long *value)
+{
+	for (int i = 0; i < stats->count; i++)
+		if (!strcmp(stats->names[i], name))
+		{
+			*value = stats->values[i];
+			return true;
+		}
+	return false;
+}
+
+static void print_stats(const struct stats *before, const struct stats *after, const char *const *names)
+{
+	for (; names && *names; names++)
+	{
+		long long old_value, new_value;
+		if (find_stat(before, *names, &old_value) && find_stat(after, *names, &new_value))
+			printf("  %-32s %14lld -> %lld (%+lld)\n", *names, old_value, new_value, new_value - old_value);
+	}
+}
+
+/* Resident memory in KB on Linux, -1 if it is not reported */
+static long resident_kbytes()
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	if (!f)
+		return -1;
+	char line[256];
+	long kbytes = -1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmRSS: %ld", &kbytes) == 1)
+			break;
+	fclose(f);
+	return kbytes;
+}
+
+/* Keeps results alive so the compiler does not remove benchmark loops */
+static volatile uint32_t sink;
+static const char *program_path;
+
+/* threads: many threads running the same code, translation should be shared by all of them */
+
+#define THREADS_COUNT		64
+
+static pthread_barrier_t threads_barrier;
+
+static int compare_int(const void *l, const void *r)
+{
+	return *(const int *)l - *(const int *)r;
+}
+
+/* A mix of libc and local code, similar to a request handler in a thread pool */
+static void *threads_worker(void *arg)
+{
+	intptr_t id = (intptr_t)arg;
+	pthread_barrier_wait(&threads_barrier);
+	int values[256];
+	char text[64];
+	uint32_t sum = 0;
+	for (int round = 0; round < 200; round++)
+	{
+		for (int i = 0; i < 256; i++)
+			values[i] = (int)((i * 2654435761U + round + id) & 0xFFFF);
+		qsort(values, 256, sizeof(int), compare_int);
+		snprintf(text, sizeof(text), "%d:%d:%d", values[0], values[128], values[255]);
+		sum += (uint32_t)strlen(text) + (uint32_t)strtol(text, NULL, 10);
+	}
+	sink += sum;
+	return NULL;
+}
+
+static void bench_threads(int scale)
+{
+	int count = THREADS_COUNT * scale;
+	pthread_t *threads = (pthread_t *)malloc(count * sizeof(pthread_t));
+	long rss_before = resident_kbytes();
+	pthread_barrier_init(&threads_barrier, NULL, count + 1);
+	for (int i = 0; i < count; i++)
+		if (pthread_create(&threads[i], NULL, threads_worker, (void *)(intptr_t)i))
+		{
+			printf("  pthread_create() failed.\n");
+			exit(1);
+		}
+	uint64_t start = now_ns();
+	pthread_barrier_wait(&threads_barrier);
+	for (int i = 0; i < count; i++)
+		pthread_join(threads[i], NULL);
+	uint64_t ns = now_ns() - start;
+	pthread_barrier_destroy(&threads_barrier);
+	free(threads);
+	report("threads", count, "");
+	report("wall time", ns / 1e6, "ms");
+	long rss_after = resident_kbytes();
+	if (rss_before >= 0 && rss_after >= 0)
+		report("resident memory growth", rss_after - rss_before, "KB");
+}
+
+static const char *const threads_stats[] = { "threads", "translated_blocks", "code_caches", "code_caches_committed", "committed_kbytes", NULL };
+
+/* loops: guest loop kernels, run with and without --dbt-no-superblocks to compare trampoline executions */
+
+#define LOOPS_ITERATIONS	20000000
+
+static __attribute__((noinline)) uint32_t loop_counted(uint32_t n)
+{
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < n; i++)
+		sum = sum * 31 + i;
+	return sum;
+}
+
+/* A conditional branch in the loop body, taken every other iteration */
+static __attribute__((noinline)) uint32_t loop_branchy(uint32_t n)
+{
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < n; i++)
+	{
+		if (i & 1)
+			sum += i >> 1;
+		else
+			sum ^= i;
+	}
+	return sum;
+}
+
+static __attribute__((noinline)) uint32_t loop_nested(uint32_t n)
+{
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < n / 64; i++)
+		for (uint32_t j = 0; j < 64; j++)
+			sum = sum * 33 + (i ^ j);
+	return sum;
+}
+
+struct loop_node
+{
+	struct loop_node *next;
+	uint32_t value;
+};
+
+/* Pointer chasing while loop */
+static __attribute__((noinline)) uint32_t loop_list(const struct loop_node *node, uint32_t n)
+{
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < n; i++)
+	{
+		sum += node->value;
+		node = node->next;
+	}
+	return sum;
+}
+
+static void bench_loops(int scale)
+{
+	uint32_t n = LOOPS_ITERATIONS * scale;
+	uint64_t start = now_ns();
+	sink += loop_counted(n);
+	report_rate("counted loop", n, now_ns() - start);
+	start = now_ns();
+	sink += loop_branchy(n);
+	report_rate("branchy loop", n, now_ns() - start);
+	start = now_ns();
+	sink += loop_nested(n);
+	report_rate("nested loop", n / 64 * 64, now_ns() - start);
+	struct loop_node nodes[1024];
+	for (int i = 0; i < 1024; i++)
+	{
+		nodes[i].next = &nodes[(i * 389 + 1) % 1024];
+		nodes[i].value = i;
+	}
+	start = now_ns();
+	sink += loop_list(nodes, n);
+	report_rate("list loop", n, now_ns() - start);
+}
+
+static const char *const loops_stats[] = { "translated_blocks", "superblocks", "direct_lookups", "indirect_lookups", NULL };
+
+/* calls: recursive guest code, return_mispredicts counts the returns which took the fallback path */
+
+static __attribute__((noinline)) uint32_t fib(uint32_t n)
+{
+	return n < 2? n: fib(n - 1) + fib(n - 2);
+}
+
+struct tree_node
+{
+	struct tree_node *left, *right;
+	uint32_t value;
+};
+
+static struct tree_node *tree_build(struct tree_node **pool, int depth)
+{
+	struct tree_node *node = (*pool)++;
+	node->value = depth;
+	node->left = depth? tree_build(pool, depth - 1): NULL;
+	node->right = depth? tree_build(pool, depth - 1): NULL;
+	return node;
+}
+
+static __attribute__((noinline)) uint32_t tree_walk(const struct tree_node *node)
+{
+	if (!node)
+		return 0;
+	return node->value + tree_walk(node->left) + tree_walk(node->right);
+}
+
+/* Deeper than the shadow stack, the outermost returns are predicted from overwritten entries */
+static __attribute__((noinline)) uint32_t recurse_deep(uint32_t depth)
+{
+	if (!depth)
+		return 0;
+	/* Not a linear function of the result, so the compiler cannot turn it into a loop */
+	uint32_t r = recurse_deep(depth - 1);
+	return (r ^ (r >> 1)) + depth;
+}
+
+static jmp_buf calls_jmp_buf;
+static volatile bool calls_longjmp = true;
+
+static __attribute__((noinline)) void unwind(uint32_t depth)
+{
+	if (depth)
+		unwind(depth - 1);
+	else if (calls_longjmp)
+		longjmp(calls_jmp_buf, 1);
+	sink++;
+}
+
+/* Leaves the unwind() frames through longjmp, their returns are never executed */
+static __attribute__((noinline)) void unwind_once()
+{
+	if (!setjmp(calls_jmp_buf))
+		unwind(8);
+}
+
+#define TREE_DEPTH		16
+
+static void bench_calls(int scale)
+{
+	/* fib(n) makes 2 * F(n + 1) - 1 calls, F being the Fibonacci numbers */
+	uint32_t n = 30 + (scale > 1) * 2;
+	uint64_t a = 0, b = 1;
+	for (uint32_t i = 0; i < n + 1; i++)
+	{
+		uint64_t t = a + b;
+		a = b;
+		b = t;
+	}
+	uint64_t fib_calls = 2 * a - 1;
+	uint64_t start = now_ns();
+	sink += fib(n);
+	report_rate("fib calls", fib_calls, now_ns() - start);
+
+	struct tree_node *nodes = (struct tree_node *)malloc(((2 << TREE_DEPTH) - 1) * sizeof(struct tree_node));
+	struct tree_node *pool = nodes;
+	struct tree_node *root = tree_build(&pool, TREE_DEPTH);
+	int walks = 20 * scale;
+	start = now_ns();
+	for (int i = 0; i < walks; i++)
+		sink += tree_walk(root);
+	/* Null children are calls too */
+	report_rate("tree walk calls", (uint64_t)walks * ((4 << TREE_DEPTH) - 1), now_ns() - start);
+	free(nodes);
+
+	int rounds = 100 * scale;
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+		sink += recurse_deep(20000);
+	report_rate("deep recursion calls", (uint64_t)rounds * 20001, now_ns() - start);
+
+	rounds = 100000 * scale;
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+		unwind_once();
+	report_rate("longjmp unwinds", rounds, now_ns() - start);
+}
+
+static const char *const calls_stats[] = { "translated_blocks", "return_mispredicts", "indirect_lookups", NULL };
+
+/* profile: known split of time between functions, to check --dbt-profile reports and its overhead
+ * The samples are all in profile_work, the folded stacks split them between its callers:
+ * profile_hot, profile_warm and profile_cold get about 60%, 30% and 10% */
+
+static __attribute__((noinline)) uint32_t profile_work(uint32_t seed, uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++)
+		seed = seed * 1103515245 + 12345 + (seed >> 16);
+	return seed;
+}
+
+static __attribute__((noinline)) uint32_t profile_hot(uint32_t seed)
+{
+	return profile_work(seed, 6000);
+}
+
+static __attribute__((noinline)) uint32_t profile_warm(uint32_t seed)
+{
+	return profile_work(seed, 3000);
+}
+
+static __attribute__((noinline)) uint32_t profile_cold(uint32_t seed)
+{
+	return profile_work(seed, 1000);
+}
+
+static void bench_profile(int scale)
+{
+	int rounds = 20000 * scale;
+	uint32_t seed = 1;
+	uint64_t start = now_ns();
+	for (int i = 0; i < rounds; i++)
+		seed = profile_cold(profile_warm(profile_hot(seed)));
+	sink += seed;
+	report("run time", (now_ns() - start) / 1e6, "ms");
+	report("expected profile_hot share", 60, "%");
+	report("expected profile_warm share", 30, "%");
+	report("expected profile_cold share", 10, "%");
+}
+
+/* startup: process start latency, compare with and without --dbt-background on a big dynamically linked guest
+ * The child runs in a new process, its counters are not included */
+
+static void bench_startup(int scale)
+{
+	const char *path = getenv("FLBENCH_STARTUP");
+	char *const argv[] = { (char *)(path? path: program_path), path? "--version": "--exit", NULL };
+	int rounds = 20 * scale;
+	uint64_t start = now_ns();
+	for (int i = 0; i < rounds; i++)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			int fd = open("/dev/null", O_WRONLY);
+			dup2(fd, 1);
+			dup2(fd, 2);
+			execv(argv[0], argv);
+			_exit(127);
+		}
+		int status;
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127)
+		{
+			printf("  Running %s failed.\n", argv[0]);
+			return;
+		}
+	}
+	uint64_t ns = now_ns() - start;
+	printf("  %-32s %s\n", "program", argv[0]);
+	report("start to exit time", ns / 1e6 / rounds, "ms");
+}
+
+/* syscall: round trip latency of a system call through the generic path
+ * glibc's syscall() loads the number from memory, so the call site is never a fast syscall */
+
+static void bench_syscall(int scale)
+{
+	int rounds = 1000000 * scale;
+	uint64_t start = now_ns();
+	for (int i = 0; i < rounds; i++)
+		sink += syscall(SYS_getppid);
+	report_rate("getppid round trip", rounds, now_ns() - start);
+	/* Floating point state live across the calls, it must survive the kernel path */
+	double x = 1.0;
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+	{
+		x = x * 1.0000001 + 0.5;
+		sink += syscall(SYS_getppid);
+	}
+	report_rate("getppid round trip with FPU use", rounds, now_ns() - start);
+	sink += (uint32_t)x;
+}
+
+/* tls: thread local variables and errno in hot loops, static binaries address them through gs directly
+ * The second pass runs the loops in several threads, each with its own gs base */
+
+#define TLS_THREADS_COUNT	4
+
+static __thread uint32_t tls_counter;
+static __thread uint32_t tls_values[16];
+
+static __attribute__((noinline)) uint32_t tls_loop(uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++)
+	{
+		tls_counter += i;
+		tls_values[i & 15] ^= tls_counter;
+	}
+	return tls_counter + tls_values[7];
+}
+
+/* strtoul() sets errno on overflow from inside libc */
+static __attribute__((noinline)) uint32_t tls_errno_loop(uint32_t n)
+{
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < n; i++)
+	{
+		errno = 0;
+		sum += (uint32_t)strtoul((i & 1)? "99999999999999999999": "12345", NULL, 10);
+		if (errno == ERANGE)
+			sum++;
+	}
+	return sum;
+}
+
+static void *tls_worker(void *arg)
+{
+	uint32_t n = (uint32_t)(uintptr_t)arg;
+	sink += tls_loop(n) + tls_errno_loop(n / 10);
+	return NULL;
+}
+
+static void bench_tls(int scale)
+{
+	uint32_t n = 10000000 * scale;
+	uint64_t start = now_ns();
+	sink += tls_loop(n);
+	report_rate("thread local variable loop", n, now_ns() - start);
+	start = now_ns();
+	sink += tls_errno_loop(n / 10);
+	report_rate("errno loop", n / 10, now_ns() - start);
+	pthread_t threads[TLS_THREADS_COUNT];
+	start = now_ns();
+	for (int i = 0; i < TLS_THREADS_COUNT; i++)
+		if (pthread_create(&threads[i], NULL, tls_worker, (void *)(uintptr_t)n))
+		{
+			printf("  pthread_create() failed.\n");
+			exit(1);
+		}
+	for (int i = 0; i < TLS_THREADS_COUNT; i++)
+		pthread_join(threads[i], NULL);
+	report_rate("both loops in threads", (uint64_t)(n + n / 10) * TLS_THREADS_COUNT, now_ns() - start);
+}
+
+static const char *const tls_stats[] = { "gs_folded_modrm", "gs_folded_moffset", "gs_generic", "gs_base_changes", NULL };
+
+/* vdso: time functions through libc, which uses the vDSO when it exists, against the system calls */
+
+static void bench_vdso(int scale)
+{
+	int rounds = 2000000 * scale;
+	struct timespec ts;
+	struct timeval tv;
+	uint64_t start = now_ns();
+	for (int i = 0; i < rounds; i++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		sink += ts.tv_nsec;
+	}
+	report_rate("clock_gettime(CLOCK_MONOTONIC)", rounds, now_ns() - start);
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		sink += ts.tv_nsec;
+	}
+	report_rate("clock_gettime(CLOCK_REALTIME)", rounds, now_ns() - start);
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+	{
+		gettimeofday(&tv, NULL);
+		sink += tv.tv_usec;
+	}
+	report_rate("gettimeofday()", rounds, now_ns() - start);
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+		sink += time(NULL);
+	report_rate("time()", rounds, now_ns() - start);
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+		sink += sched_getcpu();
+	report_rate("sched_getcpu()", rounds, now_ns() - start);
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+	{
+		syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+		sink += ts.tv_nsec;
+	}
+	report_rate("clock_gettime system call", rounds, now_ns() - start);
+}
+
+/* syscall_classes: latency of each system call class
+ * An int 0x80 with a constant number in eax takes the fast path for register only system calls,
+ * the same calls through syscall() and the calls which use buffers go through the generic path */
+
+#ifdef __i386__
+static inline long syscall_constant(long id, long arg)
+{
+	long ret;
+	__asm__ volatile ("int $0x80" : "=a"(ret) : "0"(id), "b"(arg) : "memory");
+	return ret;
+}
+#define SYSCALL_CONSTANT(id, arg)	syscall_constant(id, arg)
+#else
+#define SYSCALL_CONSTANT(id, arg)	syscall(id, arg)
+#endif
+
+/* One loop per call, so the number is a constant at each int 0x80 site */
+#define SYSCALL_LOOP(name, id, arg) \
+	static __attribute__((noinline)) void syscall_loop_##name(int rounds) \
+	{ \
+		for (int i = 0; i < rounds; i++) \
+			sink += SYSCALL_CONSTANT(id, arg); \
+	}
+
+SYSCALL_LOOP(getpid, SYS_getpid, 0)
+SYSCALL_LOOP(gettid, SYS_gettid, 0)
+SYSCALL_LOOP(getuid, SYS_getuid, 0)
+SYSCALL_LOOP(sched_yield, SYS_sched_yield, 0)
+SYSCALL_LOOP(umask, SYS_umask, 022)
+
+static const struct
+{
+	const char *name;
+	long id;
+	long arg;
+	void (*loop)(int rounds);
+} syscall_classes[] =
+{
+	{ "getpid", SYS_getpid, 0, syscall_loop_getpid },
+	{ "gettid", SYS_gettid, 0, syscall_loop_gettid },
+	{ "getuid", SYS_getuid, 0, syscall_loop_getuid },
+	{ "sched_yield", SYS_sched_yield, 0, syscall_loop_sched_yield },
+	{ "umask", SYS_umask, 022, syscall_loop_umask },
+};
+
+static void bench_syscall_classes(int scale)
+{
+	int rounds = 1000000 * scale;
+	char name[64];
+	for (int c = 0; c < (int)(sizeof(syscall_classes) / sizeof(syscall_classes[0])); c++)
+	{
+		uint64_t start = now_ns();
+		syscall_classes[c].loop(rounds);
+		snprintf(name, sizeof(name), "%s constant number", syscall_classes[c].name);
+		report(name, (double)(now_ns() - start) / rounds, "ns/op");
+		start = now_ns();
+		for (int i = 0; i < rounds; i++)
+			sink += syscall(syscall_classes[c].id, syscall_classes[c].arg);
+		snprintf(name, sizeof(name), "%s through syscall()", syscall_classes[c].name);
+		report(name, (double)(now_ns() - start) / rounds, "ns/op");
+	}
+	int zero = open("/dev/zero", O_RDONLY);
+	int null = open("/dev/null", O_WRONLY);
+	char byte = 0;
+	uint64_t start = now_ns();
+	for (int i = 0; i < rounds; i++)
+		sink += read(zero, &byte, 1);
+	report("read /dev/zero", (double)(now_ns() - start) / rounds, "ns/op");
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+		sink += write(null, &byte, 1);
+	report("write /dev/null", (double)(now_ns() - start) / rounds, "ns/op");
+	close(zero);
+	close(null);
+	struct stat st;
+	start = now_ns();
+	for (int i = 0; i < rounds / 10; i++)
+	{
+		stat("/", &st);
+		sink += st.st_mode;
+	}
+	report("stat /", (double)(now_ns() - start) / (rounds / 10), "ns/op");
+}
+
+/* libc: hot libc loops, string functions and errno use inside libc reach gs through rewritten accesses */
+
+static void bench_libc(int scale)
+{
+	int rounds = 2000000 * scale;
+	char text[256], copy[256];
+	memset(text, 'x', sizeof(text) - 1);
+	text[sizeof(text) - 1] = 0;
+	uint64_t start = now_ns();
+	for (int i = 0; i < rounds; i++)
+	{
+		text[i & 127] = 'a' + (i & 15);
+		sink += strlen(text + (i & 63));
+	}
+	report_rate("strlen", rounds, now_ns() - start);
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+	{
+		memcpy(copy, text + (i & 63), 128 + (i & 63));
+		sink += copy[i & 127];
+	}
+	report_rate("memcpy", rounds, now_ns() - start);
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+	{
+		snprintf(text, sizeof(text), "%d", i);
+		errno = 0;
+		sink += strtol(text, NULL, 16);
+		sink += errno;
+	}
+	report_rate("snprintf and strtol", rounds, now_ns() - start);
+	start = now_ns();
+	for (int i = 0; i < rounds / 10; i++)
+	{
+		char *p = malloc(64 + (i & 255));
+		p[0] = (char)i;
+		sink += p[0];
+		free(p);
+	}
+	report_rate("malloc and free", rounds / 10, now_ns() - start);
+}
+
+static const char *const libc_stats[] = { "translated_blocks", "gs_folded_modrm", "gs_folded_moffset", "gs_generic", NULL };
+
+/* compare: loops whose bodies end in compares, the flags are dead at each loop head
+ * Short searches called many times keep passing through the loop trampolines */
+
+static __attribute__((noinline)) int compare_linear_search(const uint32_t *values, int count, uint32_t key)
+{
+	for (int i = 0; i < count; i++)
+		if (values[i] >= key)
+			return i;
+	return count;
+}
+
+static __attribute__((noinline)) int compare_binary_search(const uint32_t *values, int count, uint32_t key)
+{
+	int low = 0, high = count;
+	while (low < high)
+	{
+		int mid = (low + high) / 2;
+		if (values[mid] < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static __attribute__((noinline)) int compare_bytes(const uint8_t *l, const uint8_t *r, int count)
+{
+	for (int i = 0; i < count; i++)
+		if (l[i] != r[i])
+			return l[i] - r[i];
+	return 0;
+}
+
+static void bench_compare(int scale)
+{
+	uint32_t values[64];
+	uint8_t left[64], right[64];
+	for (int i = 0; i < 64; i++)
+	{
+		values[i] = i * 37;
+		left[i] = right[i] = (uint8_t)i;
+	}
+	int rounds = 2000000 * scale;
+	uint64_t start = now_ns();
+	for (int i = 0; i < rounds; i++)
+		sink += compare_linear_search(values, 64, (uint32_t)(i & 2047));
+	report_rate("linear search", rounds, now_ns() - start);
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+		sink += compare_binary_search(values, 64, (uint32_t)(i & 2047));
+	report_rate("binary search", rounds, now_ns() - start);
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+	{
+		right[i & 63] ^= 1;
+		sink += compare_bytes(left, right, 64);
+		right[i & 63] ^= 1;
+	}
+	report_rate("byte compare", rounds, now_ns() - start);
+}
+
+static const char *const compare_stats[] = { "translated_blocks", "superblocks", "direct_lookups", NULL };
+
+/* footprint: a hot loop among 1024 cold functions, a large code footprint with a small hot subset
+ * The hot loop rate should not drop when the cold code is translated around it */
+
+#define FOOTPRINT_FUNCTION(id) \
+	static __attribute__((noinline)) uint32_t footprint_##id(uint32_t x) \
+	{ \
+		x = x * (2 * 0x##id + 1) + (x >> 7); \
+		if (x & 1) \
+			x ^= 0x##id; \
+		return x + (x >> 11); \
+	}
+#define FOOTPRINT_POINTER(id)	footprint_##id,
+
+#define FOOTPRINT_16(m, h) \
+	m(h##0) m(h##1) m(h##2) m(h##3) m(h##4) m(h##5) m(h##6) m(h##7) \
+	m(h##8) m(h##9) m(h##a) m(h##b) m(h##c) m(h##d) m(h##e) m(h##f)
+#define FOOTPRINT_256(m, h) \
+	FOOTPRINT_16(m, h##0) FOOTPRINT_16(m, h##1) FOOTPRINT_16(m, h##2) FOOTPRINT_16(m, h##3) \
+	FOOTPRINT_16(m, h##4) FOOTPRINT_16(m, h##5) FOOTPRINT_16(m, h##6) FOOTPRINT_16(m, h##7) \
+	FOOTPRINT_16(m, h##8) FOOTPRINT_16(m, h##9) FOOTPRINT_16(m, h##a) FOOTPRINT_16(m, h##b) \
+	FOOTPRINT_16(m, h##c) FOOTPRINT_16(m, h##d) FOOTPRINT_16(m, h##e) FOOTPRINT_16(m, h##f)
+#define FOOTPRINT_1024(m) \
+	FOOTPRINT_256(m, 0) FOOTPRINT_256(m, 1) FOOTPRINT_256(m, 2) FOOTPRINT_256(m, 3)
+
+FOOTPRINT_1024(FOOTPRINT_FUNCTION)
+
+static uint32_t (*const footprint_functions[])(uint32_t) = { FOOTPRINT_1024(FOOTPRINT_POINTER) };
+
+#define FOOTPRINT_FUNCTIONS_COUNT	(int)(sizeof(footprint_functions) / sizeof(footprint_functions[0]))
+#define FOOTPRINT_HOT_ITERATIONS	2000000
+
+static __attribute__((noinline)) uint32_t footprint_hot(uint32_t n)
+{
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < n; i++)
+	{
+		if ((sum ^ i) & 4)
+			sum = sum * 17 + i;
+		else
+			sum -= i >> 2;
+	}
+	return sum;
+}
+
+static void bench_footprint(int scale)
+{
+	int rounds = 20 * scale;
+	uint64_t first_hot_ns = 0, hot_ns = 0, cold_ns = 0;
+	for (int round = 0; round < rounds; round++)
+	{
+		uint64_t start = now_ns();
+		sink += footprint_hot(FOOTPRINT_HOT_ITERATIONS);
+		uint64_t ns = now_ns() - start;
+		if (round == 0)
+			first_hot_ns = ns;
+		else
+			hot_ns += ns;
+		start = now_ns();
+		for (int i = 0; i < FOOTPRINT_FUNCTIONS_COUNT; i++)
+			sink += footprint_functions[i](sink + i);
+		cold_ns += now_ns() - start;
+	}
+	report("cold functions", FOOTPRINT_FUNCTIONS_COUNT, "");
+	report_rate("hot loop, first round", FOOTPRINT_HOT_ITERATIONS, first_hot_ns);
+	if (rounds > 1)
+		report_rate("hot loop, later rounds", (uint64_t)FOOTPRINT_HOT_ITERATIONS * (rounds - 1), hot_ns);
+	report_rate("cold function calls", (uint64_t)FOOTPRINT_FUNCTIONS_COUNT * rounds, cold_ns);
+}
+
+static const char *const footprint_stats[] = { "translated_blocks", "superblocks", "evictions", "code_cache_used_bytes", NULL };
+
+/* realloc: growing large blocks, glibc serves them with mmap() and grows them with mremap() */
+
+#define REALLOC_STEP		(1024 * 1024)
+#define REALLOC_STEPS		64
+
+static void bench_realloc(int scale)
+{
+	int rounds = 10 * scale;
+	uint64_t start = now_ns();
+	for (int round = 0; round < rounds; round++)
+	{
+		char *p = NULL;
+		for (int i = 1; i <= REALLOC_STEPS; i++)
+		{
+			p = (char *)realloc(p, (size_t)i * REALLOC_STEP);
+			if (!p)
+			{
+				printf("  realloc() failed.\n");
+				exit(1);
+			}
+			/* Touch the new part and one page of the old part */
+			for (size_t off = (size_t)(i - 1) * REALLOC_STEP; off < (size_t)i * REALLOC_STEP; off += 4096)
+				p[off] = (char)off;
+			sink += p[(size_t)(i - 1) * REALLOC_STEP / 2];
+		}
+		free(p);
+	}
+	report_rate("realloc growth step", (uint64_t)REALLOC_STEPS * rounds, now_ns() - start);
+	/* The same growth with mremap() directly, without touching the pages */
+	start = now_ns();
+	for (int round = 0; round < rounds; round++)
+	{
+		void *p = mmap(NULL, REALLOC_STEP, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		for (int i = 2; i <= REALLOC_STEPS && p != MAP_FAILED; i++)
+			p = mremap(p, (size_t)(i - 1) * REALLOC_STEP, (size_t)i * REALLOC_STEP, MREMAP_MAYMOVE);
+		if (p == MAP_FAILED)
+		{
+			printf("  mremap() failed.\n");
+			exit(1);
+		}
+		munmap(p, (size_t)REALLOC_STEPS * REALLOC_STEP);
+	}
+	report_rate("mremap growth step", (uint64_t)(REALLOC_STEPS - 1) * rounds, now_ns() - start);
+}
+
+/* mmap: mmap()/munmap() churn with many live mappings, each mmap() searches for free pages
+ * Mappings alternate their protection so adjacent ones are never merged */
+
+#define MMAP_LIVE_MAPPINGS	10000
+
+static void *mmap_pages(size_t pages, int i)
+{
+	void *p = mmap(NULL, pages * 4096, (i & 1)? PROT_READ: PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		printf("  mmap() failed.\n");
+		exit(1);
+	}
+	return p;
+}
+
+/* Replace random live mappings with new ones of 1 to 4 pages */
+static void mmap_churn(void **maps, size_t *sizes, int live, int rounds)
+{
+	uint32_t seed = 12345;
+	for (int i = 0; i < rounds; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		int victim = (int)((seed >> 8) % (uint32_t)live);
+		munmap(maps[victim], sizes[victim] * 4096);
+		sizes[victim] = 1 + (seed >> 28) % 4;
+		maps[victim] = mmap_pages(sizes[victim], i);
+	}
+}
+
+static void bench_mmap(int scale)
+{
+	int rounds = 20000 * scale;
+	void **maps = (void **)malloc(MMAP_LIVE_MAPPINGS * sizeof(void *));
+	size_t *sizes = (size_t *)malloc(MMAP_LIVE_MAPPINGS * sizeof(size_t));
+	maps[0] = mmap_pages(1, 0);
+	sizes[0] = 1;
+	uint64_t start = now_ns();
+	mmap_churn(maps, sizes, 1, rounds);
+	report_rate("churn with 1 live mapping", rounds, now_ns() - start);
+	start = now_ns();
+	for (int i = 1; i < MMAP_LIVE_MAPPINGS; i++)
+	{
+		sizes[i] = 1 + i % 4;
+		maps[i] = mmap_pages(sizes[i], i);
+	}
+	report_rate("mmap up to 10000 live mappings", MMAP_LIVE_MAPPINGS - 1, now_ns() - start);
+	start = now_ns();
+	mmap_churn(maps, sizes, MMAP_LIVE_MAPPINGS, rounds);
+	report_rate("churn with 10000 live mappings", rounds, now_ns() - start);
+	for (int i = 0; i < MMAP_LIVE_MAPPINGS; i++)
+		munmap(maps[i], sizes[i] * 4096);
+	free(maps);
+	free(sizes);
+}
+
+/* mappings: stress test with 100000 live single page mappings, far beyond the embedded map entries
+ * Writable pages get their index written and are checked before they are unmapped.
+ * Linux limits the number of mappings with vm.max_map_count, the test stops there natively. */
+
+#define MAPPINGS_COUNT		100000
+
+static void bench_mappings(int scale)
+{
+	int count = MAPPINGS_COUNT * scale;
+	void **maps = (void **)malloc(count * sizeof(void *));
+	long rss_before = resident_kbytes();
+	uint64_t start = now_ns();
+	for (int i = 0; i < count; i++)
+	{
+		maps[i] = mmap(NULL, 4096, (i & 1)? PROT_READ: PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (maps[i] == MAP_FAILED)
+		{
+			count = i;
+			break;
+		}
+		if (!(i & 1))
+			*(int *)maps[i] = i;
+	}
+	report_rate("mmap and touch", count, now_ns() - start);
+	report("live mappings", count, "");
+	long rss_after = resident_kbytes();
+	if (rss_before >= 0 && rss_after >= 0)
+		report("resident memory growth", rss_after - rss_before, "KB");
+	start = now_ns();
+	for (int i = 0; i < count; i += 2)
+		mprotect(maps[i], 4096, PROT_READ);
+	report_rate("mprotect", (count + 1) / 2, now_ns() - start);
+	int bad = 0;
+	start = now_ns();
+	for (int i = 0; i < count; i++)
+	{
+		if (!(i & 1) && *(int *)maps[i] != i)
+			bad++;
+		munmap(maps[i], 4096);
+	}
+	report_rate("check and munmap", count, now_ns() - start);
+	free(maps);
+	if (bad)
+	{
+		printf("  %d mappings lost their content.\n", bad);
+		exit(1);
+	}
+}
+
+/* mapped_files: truncate and unlink of files while they are mapped
+ * Under flinux block aligned private mappings of files opened read-only are views of the file
+ * (see winfs_get_section()), which Windows does not allow to truncate or delete. Unlinking or
+ * renaming over a mapped file must work as on Linux, truncating it through another descriptor
+ * fails with ETXTBSY under flinux, which is reported but is not an error.
+ * Mappings of files opened read-write are copies and must behave as on Linux in all cases. */
+
+#define MAPPED_FILE_PAGES	64 /* Four 64KB blocks */
+
+static void mapped_file_fail(const char *what)
+{
+	printf("  %s failed: %s.\n", what, strerror(errno));
+	exit(1);
+}
+
+static void mapped_file_create(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		mapped_file_fail("open()");
+	for (int i = 0; i < MAPPED_FILE_PAGES; i++)
+	{
+		int page[1024];
+		for (int j = 0; j < 1024; j++)
+			page[j] = i * 1024 + j;
+		if (write(fd, page, sizeof(page)) != sizeof(page))
+			mapped_file_fail("write()");
+	}
+	close(fd);
+}
+
+/* Returns the number of integers in the first |pages| pages which do not have their original value */
+static int mapped_file_check(const int *p, int pages)
+{
+	int bad = 0;
+	for (int i = 0; i < pages * 1024; i++)
+		if (p[i] != i)
+			bad++;
+	return bad;
+}
+
+/* Map |path| through a descriptor opened with |flags|, then truncate it to half through another
+ * descriptor, and unlink it or rename another file over it. Returns the count of bad values. */
+static int mapped_file_round(const char *path, const char *other_path, int flags, bool rename_over, int *truncate_busy)
+{
+	size_t size = MAPPED_FILE_PAGES * 4096;
+	mapped_file_create(path);
+	int fd = open(path, flags);
+	if (fd < 0)
+		mapped_file_fail("open()");
+	int *p = (int *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		mapped_file_fail("mmap()");
+	int bad = mapped_file_check(p, MAPPED_FILE_PAGES);
+	int truncate_fd = open(path, O_RDWR);
+	if (truncate_fd < 0)
+		mapped_file_fail("open()");
+	int pages = MAPPED_FILE_PAGES;
+	if (ftruncate(truncate_fd, size / 2) == 0)
+		pages = MAPPED_FILE_PAGES / 2; /* Pages past the end of the file would raise SIGBUS */
+	else if (errno == ETXTBSY && !(flags & O_RDWR))
+		(*truncate_busy)++;
+	else
+		mapped_file_fail("ftruncate()");
+	close(truncate_fd);
+	if (rename_over)
+	{
+		mapped_file_create(other_path);
+		if (rename(other_path, path) < 0)
+			mapped_file_fail("rename()");
+		struct stat st;
+		if (stat(path, &st) < 0)
+			mapped_file_fail("stat()");
+		if (st.st_size != (off_t)size)
+		{
+			printf("  The file renamed over a mapped file has size %lld.\n", (long long)st.st_size);
+			exit(1);
+		}
+		if (unlink(path) < 0)
+			mapped_file_fail("unlink()");
+	}
+	else if (unlink(path) < 0)
+		mapped_file_fail("unlink()");
+	if (access(path, F_OK) == 0 || errno != ENOENT)
+	{
+		printf("  %s still exists after unlink().\n", path);
+		exit(1);
+	}
+	bad += mapped_file_check(p, pages);
+	munmap(p, size);
+	close(fd);
+	return bad;
+}
+
+static void bench_mapped_files(int scale)
+{
+	int rounds = 50 * scale;
+	const char *dir = getenv("TMPDIR");
+	if (!dir)
+		dir = "/tmp";
+	char path[256], other_path[256];
+	snprintf(path, sizeof(path), "%s/flbench_mapped_%d", dir, (int)getpid());
+	snprintf(other_path, sizeof(other_path), "%s/flbench_mapped_%d.new", dir, (int)getpid());
+	int bad = 0, truncate_busy = 0;
+	uint64_t start = now_ns();
+	for (int i = 0; i < rounds; i++)
+		bad += mapped_file_round(path, other_path, O_RDONLY, i & 1, &truncate_busy);
+	report_rate("read-only descriptor round", rounds, now_ns() - start);
+	report("truncate failed with ETXTBSY", truncate_busy, "times");
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+		bad += mapped_file_round(path, other_path, O_RDWR, i & 1, &truncate_busy);
+	report_rate("read-write descriptor round", rounds, now_ns() - start);
+	if (bad)
+	{
+		printf("  %d values changed in mapped files.\n", bad);
+		exit(1);
+	}
+}
+
+static const struct benchmark benchmarks[] =
+{
+	{ "threads", "threads running the same code", bench_threads, threads_stats },
+	{ "loops", "hot loop kernels", bench_loops, loops_stats },
+	{ "calls", "recursive calls and returns", bench_calls, calls_stats },
+	{ "profile", "fixed time split for checking --dbt-profile", bench_profile, NULL },
+	{ "startup", "process start latency", bench_startup, NULL },
+	{ "syscall", "system call round trip", bench_syscall, NULL },
+	{ "syscall_classes", "system call latency by class", bench_syscall_classes, NULL },
+	{ "tls", "thread local storage accesses", bench_tls, tls_stats },
+	{ "vdso", "vDSO time functions", bench_vdso, NULL },
+	{ "libc", "hot libc loops", bench_libc, libc_stats },
+	{ "compare", "compare heavy short loops", bench_compare, compare_stats },
+	{ "footprint", "hot loop in a large code footprint", bench_footprint, footprint_stats },
+	{ "realloc", "large realloc() growth", bench_realloc, NULL },
+	{ "mmap", "mmap() and munmap() churn", bench_mmap, NULL },
+	{ "mappings", "100000 live mappings", bench_mappings, NULL },
+	{ "mapped_files", "truncate and unlink of mapped files", bench_mapped_files, NULL },
+};
+
+#define BENCHMARKS_COUNT	(int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void run_benchmark(const struct benchmark *benchmark, int scale)
+{
+	static struct stats before, after;
+	printf("%s: %s\n", benchmark->name, benchmark->description);
+	fflush(stdout);
+	read_stats(&before);
+	benchmark->run(scale);
+	read_stats(&after);
+	print_stats(&before, &after, benchmark->stats);
+	fflush(stdout);
+}
+
+static void usage()
+{
+	printf("Usage: flbench [-n scale] [benchmark...]\n");
+	printf("Benchmarks:\n");
+	for (int i = 0; i < BENCHMARKS_COUNT; i++)
+		printf("  %-12s %s\n", benchmarks[i].name, benchmarks[i].description);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	/* Child of the startup benchmark */
+	if (argc == 2 && !strcmp(argv[1], "--exit"))
+		return 0;
+	program_path = argv[0];
+	int scale = 1;
+	int first = 1;
+	if (argc >= 3 && !strcmp(argv[1], "-n"))
+	{
+		scale = atoi(argv[2]);
+		if (scale <= 0)
+			usage();
+		first = 3;
+	}
+	if (first == argc)
+	{
+		for (int i = 0; i < BENCHMARKS_COUNT; i++)
+			run_benchmark(&benchmarks[i], scale);
+		return 0;
+	}
+	for (int i = first; i < argc; i++)
+	{
+		int j;
+		for (j = 0; j < BENCHMARKS_COUNT; j++)
+			if (!strcmp(argv[i], benchmarks[j].name))
+				break;
+		if (j == BENCHMARKS_COUNT)
+			usage();
+		run_benchmark(&benchmarks[j], scale);
+	}
+	return 0;
+}